@@ -0,0 +1,327 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Hot-spot alarm.
+//
+// Each frame's NUC output is thresholded into a bitmask, one row at a time,
+// and the set bits are grouped into 8-connected blobs in the same single
+// pass: each run of set bits in a row gets a new label, which is merged
+// (union-find) with every run it touches in the row above.  Area, peak and
+// bounding box are kept at each root and combined on merge, so when the
+// pass ends every root holds its blob's statistics; nothing is revisited.
+// The cost is one compare per pixel plus work per run, and a mostly cold
+// image is mostly empty 64-bit mask words.
+//
+// Blobs smaller than min_area pixels are ignored.  The alarm becomes active
+// when there is a blob at or above t_set, and stays active while there is
+// one at or above t_clear (at most t_set), so noise around the threshold
+// doesn't make it flicker.
+
+#define WORD_BITS 64
+
+struct run {
+	uint32_t x0, x1; // inclusive
+	uint32_t label;
+};
+
+struct blob_acc {
+	uint32_t area;
+	uint32_t x0, y0, x1, y1;
+	uint32_t i_peak;
+	float px_peak;
+};
+
+struct thermapp_alarm {
+	double t_set, t_clear; // celsius
+	size_t min_area;
+	int active;
+
+	size_t w, h;
+	int fliph, flipv;
+	size_t words;          // per row of mask
+	uint64_t *mask;
+	struct run *runs[2];   // this row and the one above, (w+1)/2 each
+	uint32_t *parent;      // per label
+	struct blob_acc *acc;
+	size_t labels_max;
+};
+
+struct thermapp_alarm *
+thermapp_alarm_open(double t_set, double t_clear, size_t min_area)
+{
+	struct thermapp_alarm *alarm = calloc(1, sizeof *alarm);
+	if (!alarm) {
+		perror("calloc");
+		return NULL;
+	}
+	alarm->t_set = t_set;
+	alarm->t_clear = t_clear < t_set ? t_clear : t_set;
+	alarm->min_area = min_area ? min_area : 1;
+	return alarm;
+}
+
+// For a w x h image, displayed with the given flips.
+int
+thermapp_alarm_start(struct thermapp_alarm *alarm, size_t w, size_t h, int fliph, int flipv)
+{
+	alarm->w = w;
+	alarm->h = h;
+	alarm->fliph = fliph;
+	alarm->flipv = flipv;
+	alarm->words = (w + WORD_BITS - 1) / WORD_BITS;
+	alarm->labels_max = (w + 1) / 2 * h;
+	alarm->active = 0;
+
+	free(alarm->mask);
+	free(alarm->runs[0]);
+	free(alarm->runs[1]);
+	free(alarm->parent);
+	free(alarm->acc);
+	// Label storage is sized for a checkerboard, but only touched as far as it's used.
+	alarm->mask = malloc(alarm->words * sizeof *alarm->mask);
+	alarm->runs[0] = malloc((w + 1) / 2 * sizeof *alarm->runs[0]);
+	alarm->runs[1] = malloc((w + 1) / 2 * sizeof *alarm->runs[1]);
+	alarm->parent = malloc(alarm->labels_max * sizeof *alarm->parent);
+	alarm->acc = malloc(alarm->labels_max * sizeof *alarm->acc);
+	if (!alarm->mask || !alarm->runs[0] || !alarm->runs[1] || !alarm->parent || !alarm->acc) {
+		perror("malloc");
+		return 0;
+	}
+	return 1;
+}
+
+// Bit x of the mask is set if px[x] >= thresh.
+static void
+threshold(const float *px, size_t w, float thresh, uint64_t *mask)
+{
+	size_t x = 0;
+	for (size_t i = 0; x < w; ++i) {
+		uint64_t bits = 0;
+		size_t n = w - x < WORD_BITS ? w - x : WORD_BITS;
+		size_t k = 0;
+#ifdef __SSE2__
+		__m128 t = _mm_set1_ps(thresh);
+		for (; k + 4 <= n; k += 4) {
+			bits |= (uint64_t)_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(&px[x + k]), t)) << k;
+		}
+#endif
+		for (; k < n; ++k) {
+			bits |= (uint64_t)(px[x + k] >= thresh) << k;
+		}
+		mask[i] = bits;
+		x += n;
+	}
+}
+
+static uint32_t
+find(uint32_t *parent, uint32_t i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+static void
+merge(struct thermapp_alarm *alarm, uint32_t a, uint32_t b)
+{
+	a = find(alarm->parent, a);
+	b = find(alarm->parent, b);
+	if (a == b) {
+		return;
+	}
+	// The older label stays the root, so roots are found in scan order.
+	if (a > b) {
+		uint32_t tmp = a;
+		a = b;
+		b = tmp;
+	}
+	alarm->parent[b] = a;
+	struct blob_acc *ra = &alarm->acc[a];
+	const struct blob_acc *rb = &alarm->acc[b];
+	ra->area += rb->area;
+	if (ra->x0 > rb->x0) ra->x0 = rb->x0;
+	if (ra->y0 > rb->y0) ra->y0 = rb->y0;
+	if (ra->x1 < rb->x1) ra->x1 = rb->x1;
+	if (ra->y1 < rb->y1) ra->y1 = rb->y1;
+	if (ra->px_peak < rb->px_peak) {
+		ra->px_peak = rb->px_peak;
+		ra->i_peak = rb->i_peak;
+	}
+}
+
+// Runs of set bits in one row of the mask.
+static size_t
+find_runs(const uint64_t *mask, size_t words, size_t w, struct run *runs)
+{
+	size_t n = 0;
+	int in_run = 0;
+	uint32_t x0 = 0;
+	for (size_t i = 0; i < words; ++i) {
+		// Looking for the next 1 outside a run, the next 0 inside one.
+		uint64_t bits = in_run ? ~mask[i] : mask[i];
+		while (bits) {
+			unsigned s = __builtin_ctzll(bits);
+			if (in_run) {
+				runs[n++] = (struct run){ x0, i * WORD_BITS + s - 1, 0 };
+			} else {
+				x0 = i * WORD_BITS + s;
+			}
+			in_run = !in_run;
+			bits = ~bits & (~(uint64_t)0 << s);
+		}
+	}
+	if (in_run) {
+		runs[n++] = (struct run){ x0, w - 1, 0 };
+	}
+	return n;
+}
+
+// Labels every blob of pixels >= thresh; returns the number of labels used.
+static size_t
+label(struct thermapp_alarm *alarm, const float *temp, float thresh)
+{
+	size_t w = alarm->w;
+	size_t labels = 0;
+	size_t above = 0; // runs in the row above
+	for (size_t y = 0; y < alarm->h; ++y) {
+		const float *px = &temp[y * w];
+		struct run *cur = alarm->runs[y & 1];
+		const struct run *prev = alarm->runs[!(y & 1)];
+
+		threshold(px, w, thresh, alarm->mask);
+		size_t runs = find_runs(alarm->mask, alarm->words, w, cur);
+		size_t p = 0;
+		for (size_t r = 0; r < runs; ++r) {
+			uint32_t x0 = cur[r].x0, x1 = cur[r].x1;
+			uint32_t l = labels++;
+			struct blob_acc *acc = &alarm->acc[l];
+			alarm->parent[l] = l;
+			acc->area = x1 - x0 + 1;
+			acc->x0 = x0;
+			acc->x1 = x1;
+			acc->y0 = acc->y1 = y;
+			acc->i_peak = y * w + x0;
+			acc->px_peak = px[x0];
+			for (uint32_t x = x0 + 1; x <= x1; ++x) {
+				if (acc->px_peak < px[x]) {
+					acc->px_peak = px[x];
+					acc->i_peak = y * w + x;
+				}
+			}
+			cur[r].label = l;
+
+			// Runs above that touch this one, diagonals included.
+			while (p < above && prev[p].x1 + 1 < x0) {
+				++p;
+			}
+			for (size_t q = p; q < above && prev[q].x0 <= x1 + 1; ++q) {
+				merge(alarm, l, prev[q].label);
+			}
+		}
+		above = runs;
+	}
+	return labels;
+}
+
+static double
+to_celsius(float px, double refl, double emissivity)
+{
+	return pow((pow(px / 100.0 + 273.15, 4.0) - refl) / emissivity, 0.25) - 273.15;
+}
+
+// Updates the alarm from temp, the NUC output (0.01 C units, before
+// emissivity, in buffer order).
+void
+thermapp_alarm_check(struct thermapp_alarm *alarm, const float *temp, double t_refl, double emissivity, struct thermapp_alarm_result *result)
+{
+	// Inverse of the model in thermapp_img_minmax, so pixels are compared as they are.
+	double refl = (1.0 - emissivity) * pow(t_refl + 273.15, 4.0);
+	double t = alarm->active ? alarm->t_clear : alarm->t_set;
+	float thresh = (pow(emissivity * pow(t + 273.15, 4.0) + refl, 0.25) - 273.15) * 100.0;
+
+	size_t labels = label(alarm, temp, thresh);
+
+	memset(result, 0, sizeof *result);
+	size_t kept = 0;
+	for (uint32_t l = 0; l < labels; ++l) {
+		const struct blob_acc *acc = &alarm->acc[l];
+		if (alarm->parent[l] != l || acc->area < alarm->min_area) {
+			continue;
+		}
+		result->blobs++;
+		result->area += acc->area;
+
+		// Hottest first, keeping ALARM_BLOBS_MAX.
+		size_t i = kept < ALARM_BLOBS_MAX ? kept++ : ALARM_BLOBS_MAX;
+		float t_peak = to_celsius(acc->px_peak, refl, emissivity);
+		while (i && result->blob[i - 1].t_peak < t_peak) {
+			if (i < ALARM_BLOBS_MAX) {
+				result->blob[i] = result->blob[i - 1];
+			}
+			--i;
+		}
+		if (i == ALARM_BLOBS_MAX) {
+			continue;
+		}
+		struct thermapp_alarm_blob *b = &result->blob[i];
+		b->area = acc->area;
+		b->t_peak = t_peak;
+		b->i_peak = acc->i_peak;
+		b->bx0 = acc->x0;
+		b->by0 = acc->y0;
+		b->bx1 = acc->x1;
+		b->by1 = acc->y1;
+	}
+	result->blobs_kept = kept;
+
+	for (size_t i = 0; i < kept; ++i) {
+		struct thermapp_alarm_blob *b = &result->blob[i];
+		b->peak_x = b->i_peak % alarm->w;
+		b->peak_y = b->i_peak / alarm->w;
+		b->x0 = b->bx0;
+		b->x1 = b->bx1;
+		b->y0 = b->by0;
+		b->y1 = b->by1;
+		if (alarm->fliph) {
+			b->peak_x = alarm->w - 1 - b->peak_x;
+			b->x0 = alarm->w - 1 - b->bx1;
+			b->x1 = alarm->w - 1 - b->bx0;
+		}
+		if (alarm->flipv) {
+			b->peak_y = alarm->h - 1 - b->peak_y;
+			b->y0 = alarm->h - 1 - b->by1;
+			b->y1 = alarm->h - 1 - b->by0;
+		}
+	}
+
+	int active = result->blobs > 0;
+	result->changed = active != alarm->active;
+	result->active = alarm->active = active;
+}
+
+void
+thermapp_alarm_close(struct thermapp_alarm *alarm)
+{
+	if (!alarm)
+		return;
+
+	free(alarm->acc);
+	free(alarm->parent);
+	free(alarm->runs[1]);
+	free(alarm->runs[0]);
+	free(alarm->mask);
+	free(alarm);
+}
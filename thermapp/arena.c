@@ -0,0 +1,105 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Working buffers, allocated once.
+//
+// An arena is one anonymous mapping, carved up by thermapp_arena_alloc into
+// ARENA_ALIGN-aligned pieces that live until thermapp_arena_close.  All its
+// pages are faulted in by thermapp_arena_open, so the first frames don't pay
+// for page faults, and with huge pages the per-frame buffers (a few MB) are
+// covered by a handful of TLB entries.  Memory starts zeroed.
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+struct thermapp_arena {
+	unsigned char *base;
+	size_t len;
+	size_t used;
+};
+
+static enum thermapp_arena_pages arena_pages = ARENA_PAGES_THP;
+
+// For arenas opened after this call.
+void
+thermapp_arena_pages(enum thermapp_arena_pages pages)
+{
+	arena_pages = pages;
+}
+
+static size_t
+round_up(size_t n, size_t align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+struct thermapp_arena *
+thermapp_arena_open(size_t len)
+{
+	struct thermapp_arena *arena = calloc(1, sizeof *arena);
+	if (!arena) {
+		perror("calloc");
+		return NULL;
+	}
+
+	void *base = MAP_FAILED;
+	if (arena_pages == ARENA_PAGES_HUGETLB) {
+		// Explicit huge pages must be reserved (vm.nr_hugepages); fall back if not.
+		arena->len = round_up(len, HUGE_PAGE_SIZE);
+		base = mmap(NULL, arena->len, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (base == MAP_FAILED) {
+			perror("mmap MAP_HUGETLB");
+		}
+	}
+	if (base == MAP_FAILED) {
+		arena->len = round_up(len, sysconf(_SC_PAGESIZE));
+		base = mmap(NULL, arena->len, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			perror("mmap");
+			free(arena);
+			return NULL;
+		}
+		// Advice has to come before the pages are faulted in to take effect.
+		if (arena_pages != ARENA_PAGES_SMALL && arena->len >= HUGE_PAGE_SIZE) {
+			madvise(base, arena->len, MADV_HUGEPAGE);
+		}
+		// Prefault.  Writing (not reading) is what allocates a private page.
+		memset(base, 0, arena->len);
+	}
+	arena->base = base;
+	return arena;
+}
+
+// Never fails if the arena was opened with the sum of ARENA_LEN of each allocation;
+// NULL with a message otherwise.
+void *
+thermapp_arena_alloc(struct thermapp_arena *arena, size_t len)
+{
+	size_t start = round_up(arena->used, ARENA_ALIGN);
+	if (start > arena->len || len > arena->len - start) {
+		fprintf(stderr, "arena: %zu of %zu bytes used, %zu more requested\n", arena->used, arena->len, len);
+		return NULL;
+	}
+	arena->used = start + len;
+	return arena->base + start;
+}
+
+void
+thermapp_arena_close(struct thermapp_arena *arena)
+{
+	if (!arena)
+		return;
+
+	munmap(arena->base, arena->len);
+	free(arena);
+}
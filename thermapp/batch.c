@@ -0,0 +1,597 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Offline processing of recordings made with -r.
+//
+// Runs the same image processing as main.c over every frame of a recording,
+// as fast as the machine allows, and writes an image (or a map of
+// temperatures) per frame.
+//
+// Most of the state carried from frame to frame in main.c depends only on
+// the frame headers and arrival times: the filtered temperatures, the
+// transient correction, and the calibration set chosen with hysteresis by
+// thermapp_cal_select.  A first pass replays those over the headers in order
+// (and runs the automatic calibration, if needed, on the first frames), which
+// leaves each frame with everything it needs to be processed on its own.
+// Frames are then handed out to worker threads in order.
+//
+// The one piece of state that depends on pixels is the LUT, which is filtered
+// from frame to frame.  Each worker computes its frame's target LUT in
+// parallel, then takes its turn to blend it into the running LUT, in frame
+// order, and continues with its own copy of the result.  The blend is a small
+// fraction of the work per frame, so the rest scales with the number of
+// threads.
+//
+// Output matches what main.c would have produced live, except that vgsk
+// control has no effect (the recorded frames already carry the VoutC the
+// camera used) and -b is not available.
+
+#include "thermapp.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum batch_format {
+	FORMAT_JPEG, // palette image
+	FORMAT_PPM,  // palette image
+	FORMAT_PGM,  // 16-bit quantized image, like -Y
+	FORMAT_PFM,  // temperature in celsius, float
+};
+
+static const char *const format_ext[] = {
+	[FORMAT_JPEG] = "jpg",
+	[FORMAT_PPM]  = "ppm",
+	[FORMAT_PGM]  = "pgm",
+	[FORMAT_PFM]  = "pfm",
+};
+
+// A frame of the recording, and the sequential state it is processed with.
+struct job {
+	const unsigned char *data; // record contents, not aligned
+	uint32_t magic;
+	uint32_t len;
+	enum thermapp_cal_set set;
+	int transient_enabled;
+	float temp_delta;
+};
+
+struct worker {
+	pthread_t thread;
+	struct batch *batch;
+	struct thermapp_jpeg *jpeg;
+
+	// Working buffers.  Workers come from an arena, and these sizes keep every one aligned.
+	_Alignas(ARENA_ALIGN) union thermapp_frame frame;
+	float uniform[FRAME_PIXELS_MAX];
+	uint16_t quantized[FRAME_PIXELS_MAX];
+	uint32_t rgb[FRAME_PIXELS_MAX];
+	float temp[FRAME_PIXELS_MAX];
+	uint8_t lut[UINT16_MAX+1];
+	struct thermapp_img_scratch scratch;
+};
+
+struct batch {
+	struct job *jobs;
+	size_t jobs_len;
+	atomic_size_t next_job;
+
+	// One copy of the calibration per set in use, since frames on different
+	// sets are processed at the same time.  The copies share the master's
+	// tables and are freed with free(), not thermapp_cal_close.
+	struct thermapp_cal *cal[CAL_SETS + 1];
+
+	enum thermapp_video_mode video_mode;
+	float enhanced_ratio;
+	int fliph, flipv;
+	const uint32_t *palette;
+	enum batch_format format;
+	const char *out_dir;
+
+	// The running LUT, blended in frame order.
+	pthread_mutex_t lut_lock;
+	pthread_cond_t lut_turn;
+	size_t lut_next;
+	uint8_t lut[UINT16_MAX+1];
+
+	atomic_ulong frames_written;
+	atomic_int failed;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+frame_load(const struct job *job, union thermapp_frame *frame)
+{
+	if (job->magic == REC_MAGIC_CODEC) {
+		return thermapp_codec_decode(job->data, job->len, frame);
+	}
+	if (job->len > sizeof *frame) {
+		return 0;
+	}
+	memcpy(frame->bytes, job->data, job->len);
+	return job->len;
+}
+
+// Same model as thermapp_img_minmax, for every pixel, in display orientation.
+static void
+temperatures(const struct thermapp_cal *cal, const float *in, float *out, int fliph, int flipv, double t_refl, double emissivity)
+{
+	double refl = (1.0 - emissivity) * pow(t_refl + 273.15, 4.0);
+	for (size_t y = 0; y < cal->img_h; ++y) {
+		size_t oy = flipv ? cal->img_h - 1 - y : y;
+		for (size_t x = 0; x < cal->img_w; ++x) {
+			size_t ox = fliph ? cal->img_w - 1 - x : x;
+			double k = *in++ / 100.0 + 273.15;
+			double k2 = k * k;
+			out[oy * cal->img_w + ox] = sqrt(sqrt((k2 * k2 - refl) / emissivity)) - 273.15;
+		}
+	}
+}
+
+static int
+write_file(const char *path, const void *head, size_t head_len, const void *data, size_t data_len)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return 0;
+	}
+	int ok = fwrite(head, 1, head_len, f) == head_len
+	      && fwrite(data, 1, data_len, f) == data_len;
+	if (fclose(f) == EOF) {
+		ok = 0;
+	}
+	if (!ok) {
+		perror(path);
+	}
+	return ok;
+}
+
+static int
+write_output(struct batch *batch, struct worker *w, const struct thermapp_cal *cal, size_t index)
+{
+	size_t n = cal->img_w * cal->img_h;
+	char path[4096];
+	snprintf(path, sizeof path, "%s/%06zu.%s", batch->out_dir, index, format_ext[batch->format]);
+	char head[64];
+	int head_len;
+
+	switch (batch->format) {
+	case FORMAT_JPEG: {
+		thermapp_img_palette(cal, w->quantized, w->lut, batch->palette, w->rgb, batch->fliph, batch->flipv);
+		const unsigned char *jpeg;
+		size_t len = thermapp_jpeg_encode(w->jpeg, w->rgb, &jpeg);
+		return write_file(path, NULL, 0, jpeg, len);
+	}
+	case FORMAT_PPM: {
+		thermapp_img_palette(cal, w->quantized, w->lut, batch->palette, w->rgb, batch->fliph, batch->flipv);
+		// Pack in place: byte i of the output never overtakes pixel i/3 of the input.
+		unsigned char *rgb = (unsigned char *)w->rgb;
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t px = w->rgb[i];
+			rgb[3*i+0] = px >> 16;
+			rgb[3*i+1] = px >> 8;
+			rgb[3*i+2] = px;
+		}
+		head_len = snprintf(head, sizeof head, "P6\n%zu %zu\n255\n", cal->img_w, cal->img_h);
+		return write_file(path, head, head_len, rgb, 3 * n);
+	}
+	case FORMAT_PGM: {
+		uint16_t *y16 = (uint16_t *)w->rgb;
+		thermapp_img_y16(cal, w->quantized, y16, batch->fliph, batch->flipv);
+		for (size_t i = 0; i < n; ++i) {
+			y16[i] = htobe16(y16[i]);
+		}
+		head_len = snprintf(head, sizeof head, "P5\n%zu %zu\n65535\n", cal->img_w, cal->img_h);
+		return write_file(path, head, head_len, y16, 2 * n);
+	}
+	case FORMAT_PFM: {
+		// Little-endian (negative scale), rows from the bottom up.
+		float *rows = (float *)w->rgb;
+		for (size_t y = 0; y < cal->img_h; ++y) {
+			memcpy(&rows[y * cal->img_w], &w->temp[(cal->img_h - 1 - y) * cal->img_w], cal->img_w * sizeof *rows);
+		}
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+		head_len = snprintf(head, sizeof head, "Pf\n%zu %zu\n-1.0\n", cal->img_w, cal->img_h);
+#else
+		head_len = snprintf(head, sizeof head, "Pf\n%zu %zu\n1.0\n", cal->img_w, cal->img_h);
+#endif
+		return write_file(path, head, head_len, rows, n * sizeof *rows);
+	}
+	}
+	return 0;
+}
+
+static void *
+worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct batch *batch = w->batch;
+	const double t_refl = 20.0;
+	const double emissivity = 0.95;
+
+	for (;;) {
+		size_t i = atomic_fetch_add_explicit(&batch->next_job, 1, memory_order_relaxed);
+		if (i >= batch->jobs_len) {
+			break;
+		}
+		const struct job *job = &batch->jobs[i];
+		const struct thermapp_cal *cal = batch->cal[job->set];
+
+		if (!frame_load(job, &w->frame)) {
+			fprintf(stderr, "Frame %zu is corrupt\n", i);
+			atomic_store_explicit(&batch->failed, 1, memory_order_relaxed);
+			memset(&w->frame.bytes[HEADER_SIZE], 0, 2 * cal->img_w * cal->img_h);
+		}
+
+		thermapp_img_nuc(cal, &w->frame, w->uniform, job->transient_enabled, job->temp_delta);
+		thermapp_img_bpr(cal, w->uniform);
+		if (batch->format == FORMAT_PFM) {
+			temperatures(cal, w->uniform, w->temp, batch->fliph, batch->flipv, t_refl, emissivity);
+		} else {
+			thermapp_img_quantize(cal, w->uniform, w->quantized);
+			if (batch->video_mode == VIDEO_MODE_ENHANCED) {
+				thermapp_img_hpf(cal, w->quantized, batch->enhanced_ratio, &w->scratch);
+			}
+			thermapp_img_lut_target(cal, w->quantized, w->scratch.target, 0.0f, 0.0f, &w->scratch);
+		}
+
+		// Every frame takes its turn, even a corrupt one, so the ones after it are never stuck.
+		if (batch->format != FORMAT_PFM) {
+			pthread_mutex_lock(&batch->lut_lock);
+			while (batch->lut_next != i) {
+				pthread_cond_wait(&batch->lut_turn, &batch->lut_lock);
+			}
+			thermapp_img_lut_blend(batch->lut, w->scratch.target);
+			memcpy(w->lut, batch->lut, sizeof w->lut);
+			batch->lut_next = i + 1;
+			pthread_cond_broadcast(&batch->lut_turn);
+			pthread_mutex_unlock(&batch->lut_lock);
+		}
+
+		if (write_output(batch, w, cal, i)) {
+			atomic_fetch_add_explicit(&batch->frames_written, 1, memory_order_relaxed);
+		} else {
+			atomic_store_explicit(&batch->failed, 1, memory_order_relaxed);
+		}
+	}
+	return NULL;
+}
+
+// First pass: index the recording and replay the sequential state.
+static struct thermapp_cal *
+plan(struct batch *batch, const unsigned char *data, size_t len, const char *caldir,
+     const char *autocal_dir, double autocal_max_temp_delta, double autocal_max_age)
+{
+	union thermapp_frame *frame = malloc(sizeof *frame);
+	batch->jobs = malloc((len / (sizeof (struct thermapp_rec_header) + HEADER_SIZE) + 1) * sizeof *batch->jobs);
+	if (!frame || !batch->jobs) {
+		perror("malloc");
+		free(frame);
+		return NULL;
+	}
+
+	struct thermapp_cal *cal = NULL;
+	struct thermapp_temp temp = { 0 };
+	int autocal_frame = 0;
+	size_t skipped = 0;
+
+	for (size_t pos = 0; pos < len; ) {
+		// Records are packed, so copy out anything wider than a byte.
+		struct thermapp_rec_header rec;
+		union thermapp_cfg hdr;
+		const union thermapp_cfg *header = &hdr;
+		if (len - pos < sizeof rec) {
+			fprintf(stderr, "Truncated record at offset %zu\n", pos);
+			break;
+		}
+		memcpy(&rec, &data[pos], sizeof rec);
+		if (len - pos - sizeof rec < rec.len
+		 || (rec.magic != REC_MAGIC_FRAME && rec.magic != REC_MAGIC_CODEC)
+		 || rec.len < HEADER_SIZE) {
+			fprintf(stderr, "Bad record at offset %zu, stopping there\n", pos);
+			break;
+		}
+		struct job *job = &batch->jobs[batch->jobs_len];
+		job->data = &data[pos + sizeof rec];
+		job->magic = rec.magic;
+		job->len = rec.len;
+		memcpy(&hdr, job->data, sizeof hdr);
+		pos += sizeof rec + rec.len;
+
+		if (!cal) {
+			cal = thermapp_cal_open(caldir, header);
+			if (!cal) {
+				break;
+			}
+			printf("Serial number: %" PRIu32 "\n", cal->serial_num);
+			if (thermapp_cal_present(cal)) {
+				thermapp_cal_bpr_init(cal);
+			} else if (autocal_dir
+			        && thermapp_cache_autocal_load(cal, autocal_dir, header, autocal_max_temp_delta, autocal_max_age)) {
+				thermapp_cal_bpr_init(cal);
+			} else {
+				autocal_frame = AUTOCAL_FRAMES;
+				printf("No calibration, using the first %d frames for automatic calibration\n", AUTOCAL_FRAMES);
+			}
+			thermapp_temp_reset(&temp, cal, rec.timestamp);
+		}
+
+		thermapp_temp_update(&temp, cal, header, rec.timestamp);
+
+		if (header->data_w != cal->img_w
+		 || header->data_h != cal->img_h
+		 || header->data_offset != HEADER_SIZE) {
+			skipped += 1;
+			continue;
+		}
+
+		if (autocal_frame) {
+			if (!frame_load(job, frame)) {
+				skipped += 1;
+				continue;
+			}
+			autocal_frame -= 1;
+			thermapp_cal_autocal_add(cal, frame);
+			if (autocal_frame) {
+				continue;
+			}
+			thermapp_cal_autocal_finish(cal);
+		}
+
+		thermapp_cal_select(cal, NULL, batch->video_mode, temp.therm);
+		if (!batch->cal[cal->cur_set]) {
+			batch->cal[cal->cur_set] = malloc(sizeof *cal);
+			if (!batch->cal[cal->cur_set]) {
+				perror("malloc");
+				break;
+			}
+			memcpy(batch->cal[cal->cur_set], cal, sizeof *cal);
+		}
+
+		batch->jobs_len += 1;
+		job->set = cal->cur_set;
+		job->transient_enabled = !!temp.transient_steps;
+		job->temp_delta = temp.delta;
+	}
+
+	if (autocal_frame) {
+		fprintf(stderr, "Recording too short for automatic calibration\n");
+		batch->jobs_len = 0;
+	}
+	if (skipped) {
+		printf("Skipped %zu frames\n", skipped);
+	}
+	free(frame);
+	return cal;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ret = EXIT_SUCCESS;
+	struct batch batch = {
+		.video_mode = VIDEO_MODE_THERMOGRAPHY,
+		.enhanced_ratio = 1.25f,
+		.fliph = 1,
+		.format = FORMAT_JPEG,
+		.out_dir = ".",
+	};
+	const char *caldir = NULL;
+	const char *autocal_dir = NULL;
+	double autocal_max_temp_delta = 2.0;
+	double autocal_max_age = 0.0;
+	const char *palette_name = NULL;
+	int quality = 0;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "A:HVa:c:e::f:hj:m:o:p:q:")) != -1) {
+		switch (opt) {
+		case 'A':
+			autocal_max_temp_delta = strtod(optarg, NULL);
+			break;
+		case 'H':
+			batch.fliph = !batch.fliph;
+			break;
+		case 'V':
+			batch.flipv = !batch.flipv;
+			break;
+		case 'a':
+			autocal_dir = optarg;
+			break;
+		case 'c':
+			caldir = optarg;
+			break;
+		case 'e':
+			batch.video_mode = VIDEO_MODE_ENHANCED;
+			if (optarg) {
+				batch.enhanced_ratio = strtof(optarg, NULL);
+				if (batch.enhanced_ratio < 0.25f) {
+					batch.enhanced_ratio = 0.25f;
+				} else if (batch.enhanced_ratio > 5.0f) {
+					batch.enhanced_ratio = 5.0f;
+				}
+			}
+			break;
+		case 'f':
+			for (batch.format = 0; batch.format <= FORMAT_PFM; ++batch.format) {
+				if (strcmp(optarg, format_ext[batch.format]) == 0) {
+					break;
+				}
+			}
+			if (batch.format > FORMAT_PFM) {
+				fprintf(stderr, "unrecognized format %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			printf("Usage: %s [options] recording.rec\n", argv[0]);
+			printf("  -A degrees    Max FPA temperature change to reuse a saved automatic\n");
+			printf("                calibration [default: 2.0]\n");
+			printf("  -H            Flip the image horizontally\n");
+			printf("  -V            Flip the image vertically\n");
+			printf("  -a dir        Reuse a saved automatic calibration from dir\n");
+			printf("  -c dir        Path to the calibration directory\n");
+			printf("  -e[ratio]     Enhanced (\"night vision\") video mode\n");
+			printf("                Enhanced ratio: 0.25 to 5.0 [default: 1.25]\n");
+			printf("  -f format     Output format [default: jpg]:\n");
+			printf("                jpg, ppm   palette image\n");
+			printf("                pgm        16-bit image, as with thermapp -Y\n");
+			printf("                pfm        temperature map, celsius (radiometric)\n");
+			printf("  -h            Show this help message and exit\n");
+			printf("  -j threads    Worker threads [default: one per CPU]\n");
+			printf("  -m minutes    Max age to reuse a saved automatic calibration [default: no limit]\n");
+			printf("  -o dir        Write the frames to dir, numbered from 000000 [default: .]\n");
+			printf("  -p palette    Select the palette: whitehot [default], blackhot, green,\n");
+			printf("                iron, ironbow, vivid, lava, rainbow, psy\n");
+			printf("  -q quality    JPEG quality, 1 to 100\n");
+			return EXIT_SUCCESS;
+		case 'j':
+			threads = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			autocal_max_age = 60.0 * strtod(optarg, NULL);
+			break;
+		case 'o':
+			batch.out_dir = optarg;
+			break;
+		case 'p':
+			palette_name = optarg;
+			break;
+		case 'q':
+			quality = strtol(optarg, NULL, 0);
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "expected one recording, see -h\n");
+		return EXIT_FAILURE;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	uint32_t palette_buf[UINT8_MAX+1];
+	batch.palette = thermapp_palette(palette_name, palette_buf);
+	if (!batch.palette) {
+		fprintf(stderr, "unrecognized palette %s\n", palette_name);
+		return EXIT_FAILURE;
+	}
+
+	const char *path = argv[optind];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	size_t len = st.st_size;
+	if (!len) {
+		fprintf(stderr, "%s: empty\n", path);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	const unsigned char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	madvise((void *)data, len, MADV_SEQUENTIAL);
+
+	uint64_t t0 = now_ns();
+	struct thermapp_cal *cal = plan(&batch, data, len, caldir, autocal_dir, autocal_max_temp_delta, autocal_max_age);
+	uint64_t t1 = now_ns();
+	if (!cal || !batch.jobs_len) {
+		fprintf(stderr, "%s: no frames to process\n", path);
+		ret = EXIT_FAILURE;
+		goto done;
+	}
+
+	if ((size_t)threads > batch.jobs_len) {
+		threads = batch.jobs_len;
+	}
+	struct thermapp_arena *arena = thermapp_arena_open(threads * sizeof (struct worker));
+	if (!arena) {
+		ret = EXIT_FAILURE;
+		goto done;
+	}
+	struct worker *workers = thermapp_arena_alloc(arena, threads * sizeof *workers);
+	pthread_mutex_init(&batch.lut_lock, NULL);
+	pthread_cond_init(&batch.lut_turn, NULL);
+
+	long started = 0;
+	for (; started < threads; ++started) {
+		struct worker *w = &workers[started];
+		w->batch = &batch;
+		if (batch.format == FORMAT_JPEG) {
+			w->jpeg = thermapp_jpeg_open(cal->img_w, cal->img_h, quality);
+			if (!w->jpeg) {
+				break;
+			}
+		}
+		int err = pthread_create(&w->thread, NULL, worker_run, w);
+		if (err) {
+			fprintf(stderr, "%s: %s\n", "pthread_create", strerror(err));
+			if (w->jpeg) {
+				thermapp_jpeg_close(w->jpeg);
+			}
+			break;
+		}
+	}
+	if (!started) {
+		ret = EXIT_FAILURE;
+	}
+	for (long i = 0; i < started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].jpeg) {
+			thermapp_jpeg_close(workers[i].jpeg);
+		}
+	}
+	uint64_t t2 = now_ns();
+	thermapp_arena_close(arena);
+	pthread_cond_destroy(&batch.lut_turn);
+	pthread_mutex_destroy(&batch.lut_lock);
+
+	unsigned long written = atomic_load_explicit(&batch.frames_written, memory_order_relaxed);
+	printf("%lu frames written to %s in %.3f s (%.1f frames/s, %ld threads; first pass %.3f s)\n",
+	       written, batch.out_dir, (t2 - t0) / 1e9, written / ((t2 - t0) / 1e9), started, (t1 - t0) / 1e9);
+	if (atomic_load_explicit(&batch.failed, memory_order_relaxed)) {
+		ret = EXIT_FAILURE;
+	}
+
+done:
+	for (int i = 0; i <= CAL_SETS; ++i) {
+		free(batch.cal[i]);
+	}
+	thermapp_cal_close(cal);
+	free(batch.jobs);
+	munmap((void *)data, len);
+	return ret;
+}
@@ -0,0 +1,435 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Compiled calibration cache.
+//
+// A single file holding everything thermapp_cal_open needs from the factory
+// calibration files, laid out so that it can be mapped and used in place:
+//
+//   struct cache_header
+//   struct cache_entry[entries]
+//   (padding to CACHE_ALIGN)
+//   entry data, each entry padded to CACHE_ALIGN
+//
+// 0.bin and 11{,a,b,c}.bin are small and stored verbatim; they are re-parsed
+// on every load.  All other files are NUC tables and are stored already
+// converted to host-endian (float), so none of the per-pixel conversion done
+// by parse_nuc needs to be repeated.  The cache is host-specific: it is
+// rejected if the byte order or layout version does not match.
+
+#define CACHE_MAGIC   "ThACal\r\n"
+#define CACHE_VERSION 1
+#define CACHE_BOM     0x01020304
+#define CACHE_ALIGN   64
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t bom;
+	uint32_t serial_num;
+	uint32_t entries;
+	uint64_t file_len;
+	uint64_t checksum; // over everything following the header
+	uint32_t valid[CAL_SETS];
+	unsigned char pad[CACHE_ALIGN - 40 - 4*CAL_SETS];
+};
+
+struct cache_entry {
+	uint16_t set;
+	uint16_t id;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t len;
+};
+
+_Static_assert(sizeof (struct cache_header) == CACHE_ALIGN, "cache header size");
+
+static size_t
+align_up(size_t len)
+{
+	return (len + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+}
+
+// 64-bit FNV-1a, one 64-bit word at a time.  Not cryptographic, only meant to
+// catch truncated/corrupted files.  len must be a multiple of 8.
+static uint64_t
+checksum(uint64_t sum, const void *buf, size_t len)
+{
+	const unsigned char *src = buf;
+	for (size_t i = 0; i < len; i += sizeof (uint64_t)) {
+		uint64_t word;
+		memcpy(&word, src + i, sizeof word);
+		sum ^= word;
+		sum *= 0x100000001b3;
+	}
+	return sum;
+}
+#define CHECKSUM_INIT 0xcbf29ce484222325
+
+// Bytes of cal->raw_buf[set][id] that are meaningful after parsing.
+static size_t
+entry_len(const struct thermapp_cal *cal, size_t set, size_t id)
+{
+	if (id == 0 || id == 11) {
+		return cal->raw_len[set][id];
+	}
+	return cal->nuc_w * cal->nuc_h * sizeof (float);
+}
+
+int
+thermapp_cache_load(struct thermapp_cal *cal, const char *path, uint32_t *valid)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof (struct cache_header)) {
+		close(fd);
+		return 0;
+	}
+
+	size_t map_len = st.st_size;
+	unsigned char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 0;
+	}
+
+	const struct cache_header *hdr = (const struct cache_header *)map;
+	const struct cache_entry *ent = (const struct cache_entry *)(hdr + 1);
+	size_t data_start = align_up(sizeof *hdr + hdr->entries * sizeof *ent);
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof hdr->magic) != 0
+	 || hdr->version != CACHE_VERSION
+	 || hdr->bom != CACHE_BOM
+	 || hdr->serial_num != cal->serial_num
+	 || hdr->file_len != map_len
+	 || hdr->entries > CAL_SETS * CAL_FILES
+	 || data_start > map_len
+	 || checksum(CHECKSUM_INIT, map + sizeof *hdr, map_len - sizeof *hdr) != hdr->checksum) {
+		fprintf(stderr, "%s: %s\n", path, "Stale or corrupt calibration cache");
+		goto err;
+	}
+
+	for (size_t i = 0; i < hdr->entries; ++i) {
+		if (ent[i].set >= CAL_SETS
+		 || ent[i].id >= CAL_FILES
+		 || ent[i].offset < data_start
+		 || ent[i].offset % CACHE_ALIGN
+		 || ent[i].len > map_len - ent[i].offset) {
+			fprintf(stderr, "%s: %s\n", path, "Corrupt calibration cache index");
+			goto err;
+		}
+	}
+
+	for (size_t i = 0; i < hdr->entries; ++i) {
+		cal->raw_buf[ent[i].set][ent[i].id] = map + ent[i].offset;
+		cal->raw_len[ent[i].set][ent[i].id] = ent[i].len;
+	}
+	memcpy(valid, hdr->valid, sizeof hdr->valid);
+	cal->cache_map = map;
+	cal->cache_len = map_len;
+	return 1;
+
+err:
+	munmap(map, map_len);
+	return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *ptr = buf;
+	while (len) {
+		ssize_t bytes_written = write(fd, ptr, len);
+		if (bytes_written < 0) {
+			perror("write");
+			return 0;
+		}
+		ptr += bytes_written;
+		len -= bytes_written;
+	}
+	return 1;
+}
+
+int
+thermapp_cache_save(const struct thermapp_cal *cal, const char *path, const char *tmp_path)
+{
+	static const unsigned char zeros[CACHE_ALIGN];
+	struct cache_header hdr;
+	struct cache_entry ent[CAL_SETS * CAL_FILES];
+	size_t entries = 0;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof hdr.magic);
+	hdr.version    = CACHE_VERSION;
+	hdr.bom        = CACHE_BOM;
+	hdr.serial_num = cal->serial_num;
+	memcpy(hdr.valid, cal->valid, sizeof hdr.valid);
+
+	// Index every file that parsed successfully.
+	memset(ent, 0, sizeof ent);
+	for (size_t set = 0; set < CAL_SETS; ++set) {
+		for (size_t id = 0; id < CAL_FILES; ++id) {
+			if (cal->raw_buf[set][id] && cal->valid[set] & (1 << id)) {
+				ent[entries].set = set;
+				ent[entries].id  = id;
+				ent[entries].len = entry_len(cal, set, id);
+				entries += 1;
+			}
+		}
+	}
+	hdr.entries = entries;
+
+	size_t offset = align_up(sizeof hdr + entries * sizeof *ent);
+	for (size_t i = 0; i < entries; ++i) {
+		ent[i].offset = offset;
+		offset += align_up(ent[i].len);
+	}
+	hdr.file_len = offset;
+
+	// Checksum everything after the header, in file order, including padding.
+	size_t index_len = offset = sizeof hdr + entries * sizeof *ent;
+	uint64_t sum = checksum(CHECKSUM_INIT, ent, entries * sizeof *ent);
+	sum = checksum(sum, zeros, align_up(offset) - offset);
+	for (size_t i = 0; i < entries; ++i) {
+		size_t len = ent[i].len;
+		sum = checksum(sum, cal->raw_buf[ent[i].set][ent[i].id], len & ~(size_t)7);
+		if (len & 7) {
+			// Tail of an entry is checksummed as one word, zero-padded.
+			unsigned char tail[8] = { 0 };
+			memcpy(tail, cal->raw_buf[ent[i].set][ent[i].id] + (len & ~(size_t)7), len & 7);
+			sum = checksum(sum, tail, sizeof tail);
+			len = (len + 7) & ~(size_t)7;
+		}
+		sum = checksum(sum, zeros, align_up(len) - len);
+	}
+	hdr.checksum = sum;
+
+	// Write to a temporary file and rename, so that a partially written cache is never used.
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		return 0;
+	}
+
+	int ok = write_all(fd, &hdr, sizeof hdr)
+	      && write_all(fd, ent, entries * sizeof *ent)
+	      && write_all(fd, zeros, align_up(index_len) - index_len);
+	for (size_t i = 0; ok && i < entries; ++i) {
+		size_t len = ent[i].len;
+		ok = write_all(fd, cal->raw_buf[ent[i].set][ent[i].id], len)
+		  && write_all(fd, zeros, align_up(len) - len);
+	}
+
+	if (close(fd) < 0) {
+		perror("close");
+		ok = 0;
+	}
+	if (ok && rename(tmp_path, path) < 0) {
+		perror("rename");
+		ok = 0;
+	}
+	if (!ok) {
+		unlink(tmp_path);
+	}
+	return ok;
+}
+
+// Saved autocal tables.
+//
+//   struct autocal_header
+//   float good[img_h][img_w]
+//   float offset[img_h][img_w]
+//
+// Stored per serial number along with the conditions they were captured at,
+// so they can be reused at the next start if those conditions still hold.
+// Like the calibration cache, the file is host-specific.
+
+#define AUTOCAL_MAGIC   "ThAAut\r\n"
+#define AUTOCAL_VERSION 1
+
+struct autocal_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t bom;
+	uint32_t serial_num;
+	uint16_t img_w;
+	uint16_t img_h;
+	uint16_t VoutC;
+	uint16_t temp_fpa_diode;
+	uint32_t reserved;
+	int64_t time;     // seconds since the epoch
+	double temp_fpa;  // celsius
+	uint64_t checksum; // over the tables
+};
+
+static char *
+autocal_path(const struct thermapp_cal *cal, const char *dir, const char *suffix)
+{
+	const char *format = dir[strlen(dir) - 1] == '/'
+	                   ? "%s%" PRIu32 ".autocal%s"
+	                   : "%s/%" PRIu32 ".autocal%s";
+	int len = snprintf(NULL, 0, format, dir, cal->serial_num, suffix);
+	if (len <= 0) {
+		return NULL;
+	}
+	char *path = malloc(len + 1);
+	if (!path) {
+		perror("malloc");
+		return NULL;
+	}
+	snprintf(path, len + 1, format, dir, cal->serial_num, suffix);
+	return path;
+}
+
+static double
+autocal_temp(const struct thermapp_cal *cal, const union thermapp_cfg *header)
+{
+	return fma(cal->coeffs_fpa_diode[1], header->temp_fpa_diode, cal->coeffs_fpa_diode[0]);
+}
+
+int
+thermapp_cache_autocal_save(const struct thermapp_cal *cal, const char *dir, const union thermapp_cfg *header)
+{
+	struct autocal_header hdr;
+	size_t nuc_start = cal->ofs_y * cal->nuc_w + cal->ofs_x;
+	size_t row_len = cal->img_w * sizeof (float);
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, AUTOCAL_MAGIC, sizeof hdr.magic);
+	hdr.version        = AUTOCAL_VERSION;
+	hdr.bom            = CACHE_BOM;
+	hdr.serial_num     = cal->serial_num;
+	hdr.img_w          = cal->img_w;
+	hdr.img_h          = cal->img_h;
+	hdr.VoutC          = header->VoutC;
+	hdr.temp_fpa_diode = header->temp_fpa_diode;
+	hdr.time           = time(NULL);
+	hdr.temp_fpa       = autocal_temp(cal, header);
+
+	// Gather the image region of both tables into one contiguous block.
+	// 2 tables * rows * (float) is always a multiple of 8 bytes, as checksum requires.
+	size_t tables_len = 2 * cal->img_h * row_len;
+	float *tables = malloc(tables_len);
+	char *path = autocal_path(cal, dir, "");
+	char *tmp_path = autocal_path(cal, dir, ".tmp");
+	int ok = 0;
+	if (!tables) {
+		perror("malloc");
+		goto err;
+	}
+	if (!path || !tmp_path) {
+		goto err;
+	}
+	for (size_t y = 0; y < cal->img_h; ++y) {
+		memcpy(&tables[y * cal->img_w],                &cal->auto_good[nuc_start + y * cal->nuc_w],   row_len);
+		memcpy(&tables[(cal->img_h + y) * cal->img_w], &cal->auto_offset[nuc_start + y * cal->nuc_w], row_len);
+	}
+	hdr.checksum = checksum(CHECKSUM_INIT, tables, tables_len);
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		goto err;
+	}
+	ok = write_all(fd, &hdr, sizeof hdr)
+	  && write_all(fd, tables, tables_len);
+	if (close(fd) < 0) {
+		perror("close");
+		ok = 0;
+	}
+	if (ok && rename(tmp_path, path) < 0) {
+		perror("rename");
+		ok = 0;
+	}
+	if (!ok) {
+		unlink(tmp_path);
+	}
+
+err:
+	free(tmp_path);
+	free(path);
+	free(tables);
+	return ok;
+}
+
+int
+thermapp_cache_autocal_load(struct thermapp_cal *cal, const char *dir, const union thermapp_cfg *header, double max_temp_delta, double max_age)
+{
+	size_t nuc_start = cal->ofs_y * cal->nuc_w + cal->ofs_x;
+	size_t row_len = cal->img_w * sizeof (float);
+	size_t file_len = sizeof (struct autocal_header) + 2 * cal->img_h * row_len;
+	int ok = 0;
+
+	char *path = autocal_path(cal, dir, "");
+	if (!path) {
+		return 0;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		goto err;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != file_len) {
+		close(fd);
+		fprintf(stderr, "%s: %s\n", path, "Size mismatch");
+		goto err;
+	}
+	unsigned char *map = mmap(NULL, file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto err;
+	}
+
+	const struct autocal_header *hdr = (const struct autocal_header *)map;
+	const float *good   = (const float *)(hdr + 1);
+	const float *offset = good + cal->img_w * cal->img_h;
+	double temp_delta = fabs(autocal_temp(cal, header) - hdr->temp_fpa);
+	double age = difftime(time(NULL), (time_t)hdr->time);
+	if (memcmp(hdr->magic, AUTOCAL_MAGIC, sizeof hdr->magic) != 0
+	 || hdr->version != AUTOCAL_VERSION
+	 || hdr->bom != CACHE_BOM
+	 || hdr->serial_num != cal->serial_num
+	 || hdr->img_w != cal->img_w
+	 || hdr->img_h != cal->img_h
+	 || checksum(CHECKSUM_INIT, good, 2 * cal->img_h * row_len) != hdr->checksum) {
+		fprintf(stderr, "%s: %s\n", path, "Stale or corrupt automatic calibration");
+	} else if (hdr->VoutC != header->VoutC) {
+		printf("Saved calibration not reused: VoutC %" PRIu16 " != %" PRIu16 "\n", hdr->VoutC, header->VoutC);
+	} else if (temp_delta > max_temp_delta) {
+		printf("Saved calibration not reused: FPA temperature changed by %.2f C\n", temp_delta);
+	} else if (max_age > 0.0 && age > max_age) {
+		printf("Saved calibration not reused: %.0f minutes old\n", age / 60.0);
+	} else {
+		for (size_t y = 0; y < cal->img_h; ++y) {
+			memcpy(&cal->auto_good[nuc_start + y * cal->nuc_w],   &good[y * cal->img_w],   row_len);
+			memcpy(&cal->auto_offset[nuc_start + y * cal->nuc_w], &offset[y * cal->img_w], row_len);
+		}
+		printf("Reusing %s (FPA temperature changed by %.2f C, %.0f minutes old)\n", path, temp_delta, age / 60.0);
+		ok = 1;
+	}
+	munmap(map, file_len);
+
+err:
+	free(path);
+	return ok;
+}
@@ -5,9 +5,15 @@
 
 #include <endian.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -225,8 +231,21 @@ static const char *leaf_names[CAL_FILES][CAL_SETS] = {
 	{ NULL,     "22a.bin", "22b.bin", "22c.bin", }, // Transient coefficents: 1
 };
 
+#define CACHE_LEAF     "cal.cache"
+#define CACHE_TMP_LEAF "cal.cache.tmp"
+
+// path_buf is either cal->path_buf or a private copy of it, with the same stem.
+static const char *
+set_leaf(const struct thermapp_cal *cal, char *path_buf, const char *leaf_name)
+{
+	char *leaf_ptr = path_buf + (cal->leaf_ptr - cal->path_buf);
+	*leaf_ptr = '\0';
+	strncat(leaf_ptr, leaf_name, cal->leaf_len - 1);
+	return path_buf;
+}
+
 static void
-read_leaf(struct thermapp_cal *cal, size_t set, size_t id)
+read_leaf(struct thermapp_cal *cal, char *path_buf, size_t set, size_t id)
 {
 	int fd = -1;
 	unsigned char *buf = NULL;
@@ -236,13 +255,17 @@ read_leaf(struct thermapp_cal *cal, size_t set, size_t id)
 		return;
 	}
 
-	*cal->leaf_ptr = '\0';
-	strncat(cal->leaf_ptr, leaf_name, cal->leaf_len - 1);
-	printf("Reading %s\n", cal->path_buf);
+	set_leaf(cal, path_buf, leaf_name);
+	if (!cal->quiet) {
+		printf("Reading %s\n", path_buf);
+	}
 
-	fd = open(cal->path_buf, O_RDONLY);
+	fd = open(path_buf, O_RDONLY);
 	if (fd < 0) {
-		perror("open");
+		// Missing sets are expected; the outcome is reported as a whole.
+		if (!cal->quiet || errno != ENOENT) {
+			perror("open");
+		}
 		goto err;
 	}
 
@@ -292,14 +315,121 @@ err:
 		close(fd);
 }
 
-struct thermapp_cal *
-thermapp_cal_open(const char *dir, const union thermapp_cfg *header)
+#define LOAD_WORKERS_MAX 8
+
+struct load_job {
+	struct thermapp_cal *cal;
+	const uint32_t *cached_valid;
+	size_t sets;
+	atomic_size_t next;
+};
+
+struct load_worker {
+	pthread_t thread;
+	struct load_job *job;
+	char *path_buf;
+	uint32_t valid[CAL_SETS];
+};
+
+static void *
+load_worker(void *arg)
+{
+	struct load_worker *worker = arg;
+	struct load_job *job = worker->job;
+	struct thermapp_cal *cal = job->cal;
+
+	// Each (set, id) is claimed by exactly one worker.
+	// Workers write to disjoint raw_buf/raw_len/header elements, and collect validity privately.
+	size_t i;
+	while ((i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < job->sets * CAL_FILES) {
+		size_t set = i / CAL_FILES;
+		size_t id  = i % CAL_FILES;
+		if (id == 0 && set == 0) {
+			// Already handled by the caller.
+			continue;
+		}
+
+		if (!job->cached_valid) {
+			read_leaf(cal, worker->path_buf, set, id);
+		}
+
+		int valid;
+		if (id == 11) {
+			valid = parse_header(cal, set);
+		} else if (job->cached_valid) {
+			valid = job->cached_valid[set] >> id & 1;
+		} else {
+			valid = parse_nuc(cal, set, id);
+		}
+		worker->valid[set] |= !!valid << id;
+	}
+	return NULL;
+}
+
+// Read and parse all files other than 0.bin, spread across up to LOAD_WORKERS_MAX threads.
+// The calling thread is always worker 0; if threads cannot be created it does all the work.
+static void
+load_leaves(struct thermapp_cal *cal, size_t sets, const uint32_t *cached_valid)
+{
+	struct load_job job = {
+		.cal = cal,
+		.cached_valid = cached_valid,
+		.sets = sets,
+	};
+	atomic_init(&job.next, 0);
+
+	// Reading is a mix of I/O and (for ver_format 0) conversion; one thread per CPU is plenty.
+	// Nothing to gain from threads when everything comes from the cache.
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t workers = cached_valid || cpus < 1 ? 1 : (size_t)cpus;
+	if (workers > LOAD_WORKERS_MAX) {
+		workers = LOAD_WORKERS_MAX;
+	}
+
+	struct load_worker worker[LOAD_WORKERS_MAX];
+	memset(worker, 0, sizeof worker);
+	size_t path_len = (cal->leaf_ptr - cal->path_buf) + cal->leaf_len;
+	size_t started = 1;
+	worker[0].job = &job;
+	worker[0].path_buf = cal->path_buf;
+	for (; started < workers; ++started) {
+		worker[started].job = &job;
+		worker[started].path_buf = malloc(path_len);
+		if (!worker[started].path_buf) {
+			break;
+		}
+		memcpy(worker[started].path_buf, cal->path_buf, path_len);
+		int ret = pthread_create(&worker[started].thread, NULL, load_worker, &worker[started]);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+			free(worker[started].path_buf);
+			break;
+		}
+	}
+
+	load_worker(&worker[0]);
+
+	for (size_t i = 0; i < started; ++i) {
+		if (i) {
+			pthread_join(worker[i].thread, NULL);
+			free(worker[i].path_buf);
+		}
+		for (size_t set = 0; set < CAL_SETS; ++set) {
+			cal->valid[set] |= worker[i].valid[set];
+		}
+	}
+}
+
+// quiet: no progress messages, when loading in the background.
+static struct thermapp_cal *
+open_cal(const char *dir, const union thermapp_cfg *header, int quiet)
 {
 	struct thermapp_cal *cal = calloc(1, sizeof *cal);
 	if (!cal) {
 		perror("calloc");
 		return cal;
 	}
+	cal->quiet = quiet;
 
 	cal->serial_num   = header->serial_num_lo
 	                  | header->serial_num_hi << 16;
@@ -317,6 +447,15 @@ thermapp_cal_open(const char *dir, const union thermapp_cfg *header)
 	cal->coeffs_fpa_diode[0] = 0.00652 * -14336;
 	cal->coeffs_fpa_diode[1] = 0.00652;
 
+	// The autocal tables are used directly by the image processing, so they're aligned and prefaulted.
+	cal->auto_arena = thermapp_arena_open(2 * ARENA_LEN(FRAME_PIXELS_MAX * sizeof (float)));
+	if (!cal->auto_arena) {
+		free(cal);
+		return NULL;
+	}
+	cal->auto_good = thermapp_arena_alloc(cal->auto_arena, FRAME_PIXELS_MAX * sizeof *cal->auto_good);
+	cal->auto_offset = thermapp_arena_alloc(cal->auto_arena, FRAME_PIXELS_MAX * sizeof *cal->auto_offset);
+
 	cal->cur_set = CAL_SETS;
 	cal->nuc_good = cal->auto_good;
 	cal->nuc_offset = cal->auto_offset;
@@ -332,7 +471,7 @@ thermapp_cal_open(const char *dir, const union thermapp_cfg *header)
 	const char *format = dir[strlen(dir) - 1] == '/'
 	                   ? "%s%" PRIu32 "/%s"
 	                   : "%s/%" PRIu32 "/%s";
-	const char *longest_leaf = "11a.bin";
+	const char *longest_leaf = CACHE_TMP_LEAF;
 	char *path_buf;
 	int path_len, stem_len;
 	path_len = snprintf(NULL, 0, format, dir, cal->serial_num, longest_leaf);
@@ -354,58 +493,70 @@ thermapp_cal_open(const char *dir, const union thermapp_cfg *header)
 	cal->leaf_ptr = path_buf + stem_len;
 	cal->leaf_len = path_len - stem_len;
 
+	// Prefer the compiled cache, unless 0.bin has been modified since the cache was written.
+	// The cache holds already-parsed NUC tables; 0.bin and 11*.bin are re-parsed from it below.
+	uint32_t cached_valid[CAL_SETS];
+	struct stat st_params, st_cache;
+	int cached = 0;
+	if (stat(set_leaf(cal, cal->path_buf, CACHE_LEAF), &st_cache) == 0
+	 && (stat(set_leaf(cal, cal->path_buf, leaf_names[0][0]), &st_params) != 0
+	  || st_params.st_mtime <= st_cache.st_mtime)) {
+		cached = thermapp_cache_load(cal, set_leaf(cal, cal->path_buf, CACHE_LEAF), cached_valid);
+		if (cached && !cal->quiet) {
+			printf("Reading %s\n", cal->path_buf);
+		}
+	}
+
 	// Attempt to read and parse each leaf file.
 	// Missing/empty/failures result in cal->raw_buf[set][id] == NULL on a per-file basis.
-	for (size_t set = 0; set < CAL_SETS; ++set) {
-		for (size_t id = 0; id < CAL_FILES; ++id) {
-			read_leaf(cal, set, id);
-
-			int valid;
-			if (id == 0 && set == 0) {
-				valid = parse_params(cal);
-
-				// Interpretation of all other files depend on version constants in this first file.
-				// Abort if first file is missing/corrupt.
-				if (!valid) {
-					goto err;
-				}
-
-				// Factory calibration does not support images > FPA size.  Use auto-calibration.
-				if (header->fpa_w < cal->img_w || header->fpa_h < cal->img_h) {
-					goto err;
-				}
-
-				// Ensure the reported FPA size matches the expected NUC table size.
-				// XXX: NUC coefficients may not be valid when image size < FPA size.
-				if (cal->ver_format == 2) {
-					cal->nuc_w = 640;
-					cal->nuc_h = 480;
-				} else {
-					cal->nuc_w = 384;
-					cal->nuc_h = 288;
-				}
-				if (header->fpa_w != cal->nuc_w || header->fpa_h != cal->nuc_h) {
-					goto err;
-				}
-
-				// Image is centered within the NUC table.
-				// If image height/width is odd, image center moves 1/2 px to the S/W of the NUC center.
-				// XXX: May be model-specific or firmware-specific behavior.
-				//      Tested on original ThermApp (HW #4, FW #120).
-				cal->ofs_x = (cal->nuc_w - cal->img_w) / 2;
-				cal->ofs_y = (cal->nuc_h - cal->img_h + 1) / 2;
-			} else if (id == 11) {
-				valid = parse_header(cal, set);
-			} else {
-				valid = parse_nuc(cal, set, id);
-			}
-			cal->valid[set] |= !!valid << id;
-		}
+	// Interpretation of all other files depend on version constants in this first file.
+	// Abort if first file is missing/corrupt.
+	if (!cached) {
+		read_leaf(cal, cal->path_buf, 0, 0);
+	}
+	if (!parse_params(cal)) {
+		goto err;
+	}
 
-		// Only set NV (0) is expected to exist for non-TH devices.
-		// Sets {LO,MED,HI} (1-3) are for TH devices in thermography mode.
-		if (cal->cal_type != 2) {
-			break;
+	// Factory calibration does not support images > FPA size.  Use auto-calibration.
+	if (header->fpa_w < cal->img_w || header->fpa_h < cal->img_h) {
+		goto err;
+	}
+
+	// Ensure the reported FPA size matches the expected NUC table size.
+	// XXX: NUC coefficients may not be valid when image size < FPA size.
+	if (cal->ver_format == 2) {
+		cal->nuc_w = 640;
+		cal->nuc_h = 480;
+	} else {
+		cal->nuc_w = 384;
+		cal->nuc_h = 288;
+	}
+	if (header->fpa_w != cal->nuc_w || header->fpa_h != cal->nuc_h) {
+		goto err;
+	}
+
+	// Image is centered within the NUC table.
+	// If image height/width is odd, image center moves 1/2 px to the S/W of the NUC center.
+	// XXX: May be model-specific or firmware-specific behavior.
+	//      Tested on original ThermApp (HW #4, FW #120).
+	cal->ofs_x = (cal->nuc_w - cal->img_w) / 2;
+	cal->ofs_y = (cal->nuc_h - cal->img_h + 1) / 2;
+	cal->valid[0] |= 1 << 0;
+
+	// Only set NV (0) is expected to exist for non-TH devices.
+	// Sets {LO,MED,HI} (1-3) are for TH devices in thermography mode.
+	// The remaining files are independent of each other, load them in parallel.
+	load_leaves(cal, cal->cal_type == 2 ? CAL_SETS : 1, cached ? cached_valid : NULL);
+
+	// Compile the cache for the next start.  Not fatal if the directory is read-only.
+	if (!cached) {
+		char *tmp_path = strdup(set_leaf(cal, cal->path_buf, CACHE_TMP_LEAF));
+		if (tmp_path) {
+			if (thermapp_cache_save(cal, set_leaf(cal, cal->path_buf, CACHE_LEAF), tmp_path) && !cal->quiet) {
+				printf("Wrote %s\n", cal->path_buf);
+			}
+			free(tmp_path);
 		}
 	}
 
@@ -413,6 +564,114 @@ err:
 	return cal;
 }
 
+struct thermapp_cal *
+thermapp_cal_open(const char *dir, const union thermapp_cfg *header)
+{
+	return open_cal(dir, header, 0);
+}
+
+struct thermapp_cal_loader {
+	pthread_t thread;
+	atomic_int done;
+	char *dir;
+	union thermapp_cfg header;
+	struct thermapp_cal *result;
+};
+
+static void *
+async_open(void *arg)
+{
+	struct thermapp_cal_loader *loader = arg;
+	loader->result = open_cal(loader->dir, &loader->header, 1);
+	atomic_store_explicit(&loader->done, 1, memory_order_release);
+	return NULL;
+}
+
+struct thermapp_cal *
+thermapp_cal_open_async(const char *dir, const union thermapp_cfg *header)
+{
+	// Start with the defaults only, as if no calibration directory was given.
+	// This is usable (with the autocal tables) while the real one loads.
+	struct thermapp_cal *cal = thermapp_cal_open(NULL, header);
+	if (!cal || !dir || !*dir) {
+		return cal;
+	}
+
+	struct thermapp_cal_loader *loader = calloc(1, sizeof *loader);
+	if (!loader) {
+		perror("calloc");
+		goto sync;
+	}
+	loader->dir = strdup(dir);
+	if (!loader->dir) {
+		perror("strdup");
+		goto sync;
+	}
+	loader->header = *header;
+	atomic_init(&loader->done, 0);
+
+	int ret = pthread_create(&loader->thread, NULL, async_open, loader);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+		goto sync;
+	}
+	cal->loader = loader;
+	return cal;
+
+sync:
+	if (loader)
+		free(loader->dir);
+	free(loader);
+	thermapp_cal_close(cal);
+	return thermapp_cal_open(dir, header);
+}
+
+int
+thermapp_cal_loading(const struct thermapp_cal *cal)
+{
+	return cal->loader != NULL;
+}
+
+// Whether a pending load has finished, i.e. thermapp_cal_join would swap now.
+int
+thermapp_cal_loaded(const struct thermapp_cal *cal)
+{
+	return cal->loader && atomic_load_explicit(&cal->loader->done, memory_order_acquire);
+}
+
+struct thermapp_cal *
+thermapp_cal_join(struct thermapp_cal *cal, int wait)
+{
+	struct thermapp_cal_loader *loader = cal->loader;
+	if (!loader
+	 || (!wait && !atomic_load_explicit(&loader->done, memory_order_acquire))) {
+		return cal;
+	}
+
+	pthread_join(loader->thread, NULL);
+	struct thermapp_cal *result = loader->result;
+	free(loader->dir);
+	free(loader);
+	cal->loader = NULL;
+
+	// Swap in the loaded calibration.  It starts out on the autocal set,
+	// same as the placeholder, with the placeholder's autocal tables (e.g.
+	// reused from a saved autocal while loading); the caller's next
+	// thermapp_cal_select switches sets.
+	if (!result) {
+		return cal;
+	}
+	size_t row_len = cal->img_w * sizeof (float);
+	for (size_t y = 0; y < cal->img_h; ++y) {
+		size_t from = (cal->ofs_y + y) * cal->nuc_w + cal->ofs_x;
+		size_t to = (result->ofs_y + y) * result->nuc_w + result->ofs_x;
+		memcpy(&result->auto_good[to], &cal->auto_good[from], row_len);
+		memcpy(&result->auto_offset[to], &cal->auto_offset[from], row_len);
+	}
+	thermapp_cal_close(cal);
+	return result;
+}
+
 static size_t
 first_good_index(const struct thermapp_cal *cal)
 {
@@ -450,6 +709,61 @@ thermapp_cal_bpr_init(struct thermapp_cal *cal)
 	cal->bpr_i = first_good_index(cal);
 }
 
+// Automatic calibration: average AUTOCAL_FRAMES frames of the covered lens
+// into an offset table, and mark pixels far from the mean as bad.
+void
+thermapp_cal_autocal_add(struct thermapp_cal *cal, const union thermapp_frame *frame)
+{
+	const uint16_t *pixels = (const uint16_t *)&frame->bytes[frame->header.data_offset];
+	size_t nuc_start = cal->ofs_y * cal->nuc_w + cal->ofs_x;
+	size_t nuc_row_adj = cal->nuc_w - cal->img_w;
+
+	float *nuc_offset = &cal->auto_offset[nuc_start];
+	for (size_t y = cal->img_h; y; --y) {
+		for (size_t x = cal->img_w; x; --x) {
+			*nuc_offset++ += *pixels++;
+		}
+		nuc_offset += nuc_row_adj;
+	}
+}
+
+void
+thermapp_cal_autocal_finish(struct thermapp_cal *cal)
+{
+	size_t nuc_start = cal->ofs_y * cal->nuc_w + cal->ofs_x;
+	size_t nuc_row_adj = cal->nuc_w - cal->img_w;
+	float *nuc_good, *nuc_offset;
+
+	double meancal = 0.0;
+	nuc_offset = &cal->auto_offset[nuc_start];
+	for (size_t y = cal->img_h; y; --y) {
+		for (size_t x = cal->img_w; x; --x) {
+			*nuc_offset /= -(float)AUTOCAL_FRAMES;
+			meancal += *nuc_offset++;
+		}
+		nuc_offset += nuc_row_adj;
+	}
+	meancal /= cal->img_w * cal->img_h;
+	// record the bad pixels
+	nuc_good   = &cal->auto_good[nuc_start];
+	nuc_offset = &cal->auto_offset[nuc_start];
+	for (size_t y = cal->img_h; y; --y) {
+		for (size_t x = cal->img_w; x; --x) {
+			if (fabs(*nuc_offset - meancal) > 250.0) {
+				long xy[] = { cal->img_w - x, cal->img_h - y };
+				thermapp_log_args(LOG_BAD_PIXEL, NULL, xy, 2);
+			} else {
+				*nuc_good = 1.0f;
+			}
+			nuc_good   += 1;
+			nuc_offset += 1;
+		}
+		nuc_good   += nuc_row_adj;
+		nuc_offset += nuc_row_adj;
+	}
+	thermapp_cal_bpr_init(cal);
+}
+
 #define CAL_VALID_0     0xfff // {0..11}.bin
 #define CAL_VALID_NV    0xffc // {2..11}.bin
 #define CAL_VALID_TH 0x7c08fc // {{2..7},11,{18..22}}{a,b,c}.bin
@@ -503,6 +817,16 @@ select_th(const struct thermapp_cal *cal)
 	}
 }
 
+// Trace span names for switches to each set, CAL_SETS being autocal.
+static const char *const switch_names[CAL_SETS + 1] = {
+	[CAL_SET_NV]  = "cal switch NV",
+	[CAL_SET_LO]  = "cal switch LO",
+	[CAL_SET_MED] = "cal switch MED",
+	[CAL_SET_HI]  = "cal switch HI",
+	[CAL_SETS]    = "cal switch auto",
+};
+
+// dev may be NULL when replaying a recording.
 int
 thermapp_cal_select(struct thermapp_cal *cal, struct thermapp_usb_dev *dev, enum thermapp_video_mode video_mode, float temp_therm)
 {
@@ -528,6 +852,7 @@ thermapp_cal_select(struct thermapp_cal *cal, struct thermapp_usb_dev *dev, enum
 	if (cal->cur_set == set) {
 		return 0;
 	}
+	uint64_t trace_start = thermapp_trace_now();
 
 	if (set < CAL_SETS) {
 		// XXX: Changes to calibration constants take effect before the matching header is sent.
@@ -554,7 +879,9 @@ thermapp_cal_select(struct thermapp_cal *cal, struct thermapp_usb_dev *dev, enum
 
 		// The app sends the entire header, except word 0x0d
 		// which is sometimes left as-is or set to 2500 as done here.
-		if (cal->ver_format == 2) {
+		if (!dev) {
+			// Replaying a recording, there is no camera to update.
+		} else if (cal->ver_format == 2) {
 			uint16_t word_0x0d = 2500;
 			thermapp_usb_cfg_write(dev, &word_0x0d, sizeof (uint16_t) * 0x0d, sizeof (uint16_t));
 		} else if (cal->ver_format == 0) {
@@ -591,13 +918,16 @@ thermapp_cal_select(struct thermapp_cal *cal, struct thermapp_usb_dev *dev, enum
 		cal->dist_param            = NULL;
 
 		// Revert the above header changes to the initial values used during autocal.
-		if (cal->ver_format == 2) {
-			thermapp_usb_cfg_write(dev, &thermapp_initial_cfg.word[0x0d], sizeof (uint16_t) * 0x0d, sizeof (uint16_t));
+		if (dev) {
+			if (cal->ver_format == 2) {
+				thermapp_usb_cfg_write(dev, &thermapp_initial_cfg.word[0x0d], sizeof (uint16_t) * 0x0d, sizeof (uint16_t));
+			}
+			thermapp_usb_cfg_write(dev, &thermapp_initial_cfg.word[0x10], sizeof (uint16_t) * 0x10, sizeof (uint16_t) * 0x09);
+			thermapp_usb_cfg_write(dev, &thermapp_initial_cfg.word[0x1c], sizeof (uint16_t) * 0x1c, sizeof (uint16_t) * 0x04);
 		}
-		thermapp_usb_cfg_write(dev, &thermapp_initial_cfg.word[0x10], sizeof (uint16_t) * 0x10, sizeof (uint16_t) * 0x09);
-		thermapp_usb_cfg_write(dev, &thermapp_initial_cfg.word[0x1c], sizeof (uint16_t) * 0x1c, sizeof (uint16_t) * 0x04);
 	}
 	cal->cur_set = set;
+	thermapp_trace_span(switch_names[set], trace_start);
 	return 1;
 }
 
@@ -607,9 +937,21 @@ thermapp_cal_close(struct thermapp_cal *cal)
 	if (!cal)
 		return;
 
-	for (size_t set = 0; set < CAL_SETS; ++set)
-		for (size_t id = 0; id < CAL_FILES; ++id)
-			free(cal->raw_buf[set][id]);
+	if (cal->loader) {
+		// Wait for and discard a pending load.
+		thermapp_cal_close(thermapp_cal_join(cal, 1));
+		return;
+	}
+
+	if (cal->cache_map) {
+		// All raw_buf entries point into the cache mapping.
+		munmap(cal->cache_map, cal->cache_len);
+	} else {
+		for (size_t set = 0; set < CAL_SETS; ++set)
+			for (size_t id = 0; id < CAL_FILES; ++id)
+				free(cal->raw_buf[set][id]);
+	}
 	free(cal->path_buf);
+	thermapp_arena_close(cal->auto_arena);
 	free(cal);
 }
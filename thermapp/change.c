@@ -0,0 +1,136 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Change detection, for static scenes.
+//
+// The NUC output is divided into CHANGE_TILE x CHANGE_TILE tiles (smaller at
+// the right and bottom edges).  A tile has changed if any of its pixels
+// differs from the reference by more than the threshold; the reference then
+// takes that tile's pixels.  Comparing against the last accepted values
+// rather than the previous frame means a slow drift is caught once it adds
+// up to the threshold, instead of never.  The first frame after
+// thermapp_change_start changes every tile.
+//
+// The pipeline re-quantizes and re-renders only the changed tiles, and
+// skips a frame's processing entirely when none changed and the LUT has
+// settled.  See pipeline.c.
+
+struct thermapp_change {
+	float threshold; // 0.01 C units, as the NUC output
+	size_t w, h;
+	size_t tiles_x, tiles_y;
+	int primed;
+	float *ref;
+};
+
+// threshold in degrees C.
+struct thermapp_change *
+thermapp_change_open(double threshold)
+{
+	struct thermapp_change *change = calloc(1, sizeof *change);
+	if (!change) {
+		perror("calloc");
+		return NULL;
+	}
+	change->threshold = threshold * 100.0;
+	return change;
+}
+
+// For a w x h image.  The next frame changes every tile.
+int
+thermapp_change_start(struct thermapp_change *change, size_t w, size_t h)
+{
+	change->w = w;
+	change->h = h;
+	change->tiles_x = (w + CHANGE_TILE - 1) / CHANGE_TILE;
+	change->tiles_y = (h + CHANGE_TILE - 1) / CHANGE_TILE;
+	change->primed = 0;
+
+	free(change->ref);
+	change->ref = malloc(w * h * sizeof *change->ref);
+	if (!change->ref) {
+		perror("malloc");
+		return 0;
+	}
+	return 1;
+}
+
+// Whether any of the n pixels differ by more than the threshold.
+static int
+differs(const float *a, const float *b, size_t n, float threshold)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128 t = _mm_set1_ps(threshold);
+	__m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 over = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4) {
+		__m128 d = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&a[i]), _mm_loadu_ps(&b[i])), abs_mask);
+		over = _mm_or_ps(over, _mm_cmpgt_ps(d, t));
+	}
+	if (_mm_movemask_ps(over)) {
+		return 1;
+	}
+#endif
+	for (; i < n; ++i) {
+		float d = a[i] - b[i];
+		if (d > threshold || d < -threshold) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Compares temp, the NUC output, with the reference, tile by tile.
+void
+thermapp_change_detect(struct thermapp_change *change, const float *temp, struct thermapp_change_result *result)
+{
+	size_t w = change->w;
+	result->tiles_x = change->tiles_x;
+	result->tiles_y = change->tiles_y;
+	result->tiles = change->tiles_x * change->tiles_y;
+	result->changed = 0;
+	result->repaint = 0;
+	result->unchanged = 0;
+
+	uint8_t *tile = result->tile;
+	for (size_t y = 0; y < change->h; y += CHANGE_TILE) {
+		size_t th = change->h - y < CHANGE_TILE ? change->h - y : CHANGE_TILE;
+		for (size_t x = 0; x < w; x += CHANGE_TILE) {
+			size_t tw = w - x < CHANGE_TILE ? w - x : CHANGE_TILE;
+			size_t i = y * w + x;
+			int changed = !change->primed;
+			for (size_t j = 0; !changed && j < th; ++j) {
+				changed = differs(&temp[i + j * w], &change->ref[i + j * w], tw, change->threshold);
+			}
+			if (changed) {
+				for (size_t j = 0; j < th; ++j) {
+					memcpy(&change->ref[i + j * w], &temp[i + j * w], tw * sizeof *temp);
+				}
+				result->changed++;
+			}
+			*tile++ = changed;
+		}
+	}
+	change->primed = 1;
+}
+
+void
+thermapp_change_close(struct thermapp_change *change)
+{
+	if (!change)
+		return;
+
+	free(change->ref);
+	free(change);
+}
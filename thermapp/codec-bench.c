@@ -0,0 +1,244 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Codec benchmark.
+//
+// Encodes and decodes a set of frames with both the SIMD and the scalar code,
+// checks that every frame survives the round trip, and reports the
+// compression ratio and throughput (in MB/s of raw frame data, and in frames
+// per second).  Frames are synthetic (a smooth scene with fixed pattern and
+// temporal noise, 12-bit like the 384x288 cameras) unless recordings made
+// with -r are given.
+
+#include "thermapp.h"
+
+#include <unistd.h>
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Deterministic, so runs are comparable.
+static uint32_t rng_state = 12345;
+
+static double
+rng_gauss(void)
+{
+	double u = 0.0;
+	for (int i = 0; i < 12; ++i) {
+		rng_state = rng_state * 1664525 + 1013904223;
+		u += (rng_state >> 8) / (double)(1 << 24);
+	}
+	return u - 6.0;
+}
+
+static size_t
+synthetic(union thermapp_frame *frames, size_t count, size_t w, size_t h)
+{
+	float *fpn = malloc(w * h * sizeof *fpn);
+	if (!fpn) {
+		perror("malloc");
+		return 0;
+	}
+	for (size_t i = 0; i < w * h; ++i) {
+		fpn[i] = 12.0 * rng_gauss();
+	}
+
+	for (size_t f = 0; f < count; ++f) {
+		union thermapp_frame *frame = &frames[f];
+		memset(frame->bytes, 0, HEADER_SIZE);
+		frame->header.data_w = w;
+		frame->header.data_h = h;
+		frame->header.data_offset = HEADER_SIZE;
+		frame->header.frame_num_lo = f;
+
+		uint16_t *px = (uint16_t *)&frame->bytes[HEADER_SIZE];
+		for (size_t y = 0; y < h; ++y) {
+			for (size_t x = 0; x < w; ++x) {
+				double dx = x - (w / 2.0 + 20.0 * sin(f / 10.0));
+				double dy = y - h / 2.0;
+				double scene = 1800.0 + 0.5 * y + 900.0 * exp(-(dx * dx + dy * dy) / (2.0 * 40.0 * 40.0));
+				double v = scene + fpn[y * w + x] + 3.0 * rng_gauss();
+				px[y * w + x] = v < 0 ? 0 : v > 4095 ? 4095 : (uint16_t)v;
+			}
+		}
+	}
+	free(fpn);
+	return count;
+}
+
+static size_t
+load_rec(const char *path, union thermapp_frame *frames, size_t count)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return 0;
+	}
+
+	unsigned char *buf = malloc(thermapp_codec_bound(FRAME_PIXELS_MAX));
+	if (!buf) {
+		perror("malloc");
+		fclose(f);
+		return 0;
+	}
+
+	size_t n = 0;
+	struct thermapp_rec_header hdr;
+	while (n < count && fread(&hdr, sizeof hdr, 1, f) == 1) {
+		if (hdr.len > thermapp_codec_bound(FRAME_PIXELS_MAX)
+		 || fread(buf, 1, hdr.len, f) != hdr.len) {
+			fprintf(stderr, "%s: %s\n", path, "Truncated record");
+			break;
+		}
+		if (hdr.magic == REC_MAGIC_FRAME && hdr.len <= sizeof frames[n]) {
+			memcpy(frames[n].bytes, buf, hdr.len);
+			n += 1;
+		} else if (hdr.magic == REC_MAGIC_CODEC && thermapp_codec_decode(buf, hdr.len, &frames[n])) {
+			n += 1;
+		} else {
+			fprintf(stderr, "%s: %s\n", path, "Bad record");
+			break;
+		}
+	}
+	free(buf);
+	fclose(f);
+	return n;
+}
+
+static int
+run(const char *name, const union thermapp_frame *frames, size_t count, int scalar)
+{
+	size_t bound = thermapp_codec_bound(FRAME_PIXELS_MAX);
+	unsigned char *enc = malloc(count * bound);
+	size_t *enc_len = malloc(count * sizeof *enc_len);
+	union thermapp_frame *dec = malloc(sizeof *dec);
+	if (!enc || !enc_len || !dec) {
+		perror("malloc");
+		free(enc);
+		free(enc_len);
+		free(dec);
+		return -1;
+	}
+
+	thermapp_codec_force_scalar(scalar);
+
+	// Repeat until at least 0.5 s so short inputs still give stable numbers.
+	size_t raw_bytes = 0, enc_bytes = 0, frames_done = 0, passes = 0;
+	uint64_t enc_ns = 0, dec_ns = 0;
+	int bad = 0;
+	do {
+		uint64_t t0 = now_ns();
+		for (size_t i = 0; i < count; ++i) {
+			enc_len[i] = thermapp_codec_encode(&frames[i], &enc[i * bound], bound);
+		}
+		uint64_t t1 = now_ns();
+		for (size_t i = 0; i < count; ++i) {
+			size_t len = thermapp_codec_decode(&enc[i * bound], enc_len[i], dec);
+			size_t raw = HEADER_SIZE + 2 * frames[i].header.data_w * frames[i].header.data_h;
+			if (passes == 0 && (len != raw || memcmp(dec->bytes, frames[i].bytes, raw) != 0)) {
+				bad += 1;
+			}
+			if (passes == 0) {
+				raw_bytes += raw;
+				enc_bytes += enc_len[i];
+			}
+		}
+		uint64_t t2 = now_ns();
+		enc_ns += t1 - t0;
+		dec_ns += t2 - t1;
+		frames_done += count;
+		passes += 1;
+	} while (enc_ns + dec_ns < 500000000);
+
+	double mb = raw_bytes * (double)passes / 1e6;
+	printf("%-24s %-6s %6zu  %5.2f  %9.1f  %8.0f  %9.1f  %8.0f  %s\n",
+	       name, scalar ? "scalar" : "simd", count,
+	       enc_bytes ? (double)raw_bytes / enc_bytes : 0.0,
+	       mb / (enc_ns / 1e9), frames_done / (enc_ns / 1e9),
+	       mb / (dec_ns / 1e9), frames_done / (dec_ns / 1e9),
+	       bad ? "MISMATCH" : "ok");
+
+	free(enc);
+	free(enc_len);
+	free(dec);
+	return bad ? -1 : 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t count = 100;
+	size_t w = 640, h = 480;
+	int opt;
+	while ((opt = getopt(argc, argv, "hn:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%zux%zu", &w, &h) != 2
+			 || w < FRAME_WIDTH_MIN || w > FRAME_WIDTH_MAX
+			 || h < FRAME_HEIGHT_MIN || h > FRAME_HEIGHT_MAX) {
+				fprintf(stderr, "bad size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			printf("Usage: %s [options] [recording.rec...]\n", argv[0]);
+			printf("  -h            Show this help message and exit\n");
+			printf("  -n frames     Number of frames to use [default: 100]\n");
+			printf("  -s WxH        Synthetic frame size [default: 640x480]\n");
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (!count) {
+		return EXIT_FAILURE;
+	}
+
+	union thermapp_frame *frames = malloc(count * sizeof *frames);
+	if (!frames) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+	printf("%-24s %-6s %6s  %5s  %9s  %8s  %9s  %8s\n",
+	       "input", "code", "frames", "ratio", "enc MB/s", "enc fps", "dec MB/s", "dec fps");
+	if (optind == argc) {
+		char name[32];
+		snprintf(name, sizeof name, "synthetic %zux%zu", w, h);
+		size_t n = synthetic(frames, count, w, h);
+		if (run(name, frames, n, 0) < 0 || run(name, frames, n, 1) < 0) {
+			ret = EXIT_FAILURE;
+		}
+	}
+	for (int i = optind; i < argc; ++i) {
+		size_t n = load_rec(argv[i], frames, count);
+		if (!n) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		const char *name = strrchr(argv[i], '/');
+		name = name ? name + 1 : argv[i];
+		if (run(name, frames, n, 0) < 0 || run(name, frames, n, 1) < 0) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	free(frames);
+	return ret;
+}
@@ -0,0 +1,272 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Lossless codec for raw frames.
+//
+// The frame header (HEADER_SIZE bytes) is kept verbatim, so the geometry
+// needed for decoding comes from it.  Each pixel is predicted from the pixel
+// above it (the pixel to the left in the first row), and the difference
+// (mod 2^16) is zigzag-mapped so that small negative and positive residuals
+// both become small unsigned values.
+//
+// Residuals are coded in blocks of CODEC_BLOCK pixels (the last block is
+// padded with zeros).  Each block is one byte giving the bit width b of its
+// largest residual, then b bit planes from the most significant down, each
+// plane being CODEC_BLOCK bits (pixel 0 in bit 0) stored little-endian.  A
+// block of b-bit residuals therefore takes exactly 1 + 2b bytes.
+//
+// Every frame is coded on its own, so any frame in a recording can be decoded
+// without the ones before it.  Bit planes map directly onto SSE2: the top bit
+// of 16 lanes is collected with packs + movemask, and spread back out with a
+// compare against per-lane bit masks.  Other targets use the scalar code,
+// which produces the same stream.
+
+#define CODEC_BLOCK 16
+
+static int codec_scalar;
+
+void
+thermapp_codec_force_scalar(int scalar)
+{
+	codec_scalar = scalar;
+}
+
+size_t
+thermapp_codec_bound(size_t pixels)
+{
+	size_t blocks = (pixels + CODEC_BLOCK - 1) / CODEC_BLOCK;
+	return HEADER_SIZE + blocks * (1 + 2 * CODEC_BLOCK);
+}
+
+static unsigned
+bit_width(unsigned v)
+{
+	return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static uint16_t
+zigzag(uint16_t d)
+{
+	return (uint16_t)(d << 1) ^ (uint16_t)-(d >> 15);
+}
+
+static uint16_t
+unzigzag(uint16_t z)
+{
+	return (z >> 1) ^ (uint16_t)-(z & 1);
+}
+
+static uint16_t
+predict(const uint16_t *px, size_t w, size_t i)
+{
+	return i >= w ? px[i - w] : i ? px[i - 1] : 0;
+}
+
+// Any block that isn't entirely below the first row, or is the partial last block.
+static size_t
+encode_block_scalar(const uint16_t *px, size_t w, size_t n, size_t i, unsigned char *out)
+{
+	uint16_t zz[CODEC_BLOCK];
+	unsigned all = 0;
+	for (size_t j = 0; j < CODEC_BLOCK; ++j) {
+		zz[j] = i + j < n ? zigzag(px[i + j] - predict(px, w, i + j)) : 0;
+		all |= zz[j];
+	}
+
+	unsigned b = bit_width(all);
+	*out++ = b;
+	for (unsigned k = b; k--; ) {
+		unsigned mask = 0;
+		for (size_t j = 0; j < CODEC_BLOCK; ++j) {
+			mask |= (zz[j] >> k & 1) << j;
+		}
+		*out++ = mask;
+		*out++ = mask >> 8;
+	}
+	return 1 + 2 * b;
+}
+
+static size_t
+decode_block_scalar(const unsigned char *in, size_t avail, uint16_t *px, size_t w, size_t n, size_t i)
+{
+	unsigned b = avail ? in[0] : 0;
+	if (!avail || b > 16 || 1 + 2 * b > avail) {
+		return 0;
+	}
+
+	uint16_t zz[CODEC_BLOCK] = { 0 };
+	const unsigned char *plane = in + 1;
+	for (unsigned k = b; k--; plane += 2) {
+		unsigned mask = plane[0] | plane[1] << 8;
+		for (size_t j = 0; j < CODEC_BLOCK; ++j) {
+			zz[j] = zz[j] << 1 | (mask >> j & 1);
+		}
+	}
+
+	for (size_t j = 0; j < CODEC_BLOCK && i + j < n; ++j) {
+		px[i + j] = unzigzag(zz[j]) + predict(px, w, i + j);
+	}
+	return 1 + 2 * b;
+}
+
+#ifdef __SSE2__
+static size_t
+encode_block_sse2(const uint16_t *px, size_t w, size_t i, unsigned char *out)
+{
+	__m128i d0 = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)&px[i]),
+	                           _mm_loadu_si128((const __m128i *)&px[i - w]));
+	__m128i d1 = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)&px[i + 8]),
+	                           _mm_loadu_si128((const __m128i *)&px[i + 8 - w]));
+	__m128i z0 = _mm_xor_si128(_mm_add_epi16(d0, d0), _mm_srai_epi16(d0, 15));
+	__m128i z1 = _mm_xor_si128(_mm_add_epi16(d1, d1), _mm_srai_epi16(d1, 15));
+
+	__m128i all = _mm_or_si128(z0, z1);
+	all = _mm_or_si128(all, _mm_srli_si128(all, 8));
+	all = _mm_or_si128(all, _mm_srli_si128(all, 4));
+	all = _mm_or_si128(all, _mm_srli_si128(all, 2));
+	unsigned b = bit_width(_mm_cvtsi128_si32(all) & 0xffff);
+
+	*out++ = b;
+	if (!b) {
+		return 1;
+	}
+
+	// Move bit b-1 to the sign bit, then peel off one plane per iteration.
+	__m128i shift = _mm_cvtsi32_si128(16 - b);
+	z0 = _mm_sll_epi16(z0, shift);
+	z1 = _mm_sll_epi16(z1, shift);
+	for (unsigned k = b; k--; ) {
+		unsigned mask = _mm_movemask_epi8(_mm_packs_epi16(z0, z1));
+		*out++ = mask;
+		*out++ = mask >> 8;
+		z0 = _mm_add_epi16(z0, z0);
+		z1 = _mm_add_epi16(z1, z1);
+	}
+	return 1 + 2 * b;
+}
+
+static size_t
+decode_block_sse2(const unsigned char *in, size_t avail, uint16_t *px, size_t w, size_t i)
+{
+	unsigned b = avail ? in[0] : 0;
+	if (!avail || b > 16 || 1 + 2 * b > avail) {
+		return 0;
+	}
+
+	const __m128i sel0 = _mm_setr_epi16(0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080);
+	const __m128i sel1 = _mm_setr_epi16(0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, (short)0x8000);
+	__m128i z0 = _mm_setzero_si128();
+	__m128i z1 = _mm_setzero_si128();
+	const unsigned char *plane = in + 1;
+	for (unsigned k = b; k--; plane += 2) {
+		__m128i mask = _mm_set1_epi16(plane[0] | plane[1] << 8);
+		__m128i bit0 = _mm_srli_epi16(_mm_cmpeq_epi16(_mm_and_si128(mask, sel0), sel0), 15);
+		__m128i bit1 = _mm_srli_epi16(_mm_cmpeq_epi16(_mm_and_si128(mask, sel1), sel1), 15);
+		z0 = _mm_or_si128(_mm_add_epi16(z0, z0), bit0);
+		z1 = _mm_or_si128(_mm_add_epi16(z1, z1), bit1);
+	}
+
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i d0 = _mm_xor_si128(_mm_srli_epi16(z0, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(z0, one)));
+	__m128i d1 = _mm_xor_si128(_mm_srli_epi16(z1, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(z1, one)));
+	d0 = _mm_add_epi16(d0, _mm_loadu_si128((const __m128i *)&px[i - w]));
+	d1 = _mm_add_epi16(d1, _mm_loadu_si128((const __m128i *)&px[i + 8 - w]));
+	_mm_storeu_si128((__m128i *)&px[i], d0);
+	_mm_storeu_si128((__m128i *)&px[i + 8], d1);
+	return 1 + 2 * b;
+}
+#endif
+
+// Returns the number of bytes written to out, or 0 if out_len is too small
+// or the frame does not look like a frame.
+size_t
+thermapp_codec_encode(const union thermapp_frame *frame, unsigned char *out, size_t out_len)
+{
+	size_t w = frame->header.data_w;
+	size_t h = frame->header.data_h;
+	size_t n = w * h;
+	if (frame->header.data_offset != HEADER_SIZE
+	 || w < FRAME_WIDTH_MIN || w > FRAME_WIDTH_MAX
+	 || h < FRAME_HEIGHT_MIN || h > FRAME_HEIGHT_MAX
+	 || out_len < thermapp_codec_bound(n)) {
+		return 0;
+	}
+
+	const uint16_t *px = (const uint16_t *)&frame->bytes[HEADER_SIZE];
+	unsigned char *p = out;
+	memcpy(p, frame->bytes, HEADER_SIZE);
+	p += HEADER_SIZE;
+
+	size_t i = 0;
+#ifdef __SSE2__
+	if (!codec_scalar) {
+		for (; i < w; i += CODEC_BLOCK) {
+			p += encode_block_scalar(px, w, n, i, p);
+		}
+		for (; i + CODEC_BLOCK <= n; i += CODEC_BLOCK) {
+			p += encode_block_sse2(px, w, i, p);
+		}
+	}
+#endif
+	for (; i < n; i += CODEC_BLOCK) {
+		p += encode_block_scalar(px, w, n, i, p);
+	}
+	return p - out;
+}
+
+// Returns the length of the decoded frame (as returned by
+// thermapp_usb_frame_read), or 0 if the data is corrupt.
+size_t
+thermapp_codec_decode(const unsigned char *in, size_t in_len, union thermapp_frame *frame)
+{
+	if (in_len < HEADER_SIZE) {
+		return 0;
+	}
+	memcpy(frame->bytes, in, HEADER_SIZE);
+
+	size_t w = frame->header.data_w;
+	size_t h = frame->header.data_h;
+	size_t n = w * h;
+	if (frame->header.data_offset != HEADER_SIZE
+	 || w < FRAME_WIDTH_MIN || w > FRAME_WIDTH_MAX
+	 || h < FRAME_HEIGHT_MIN || h > FRAME_HEIGHT_MAX) {
+		return 0;
+	}
+
+	uint16_t *px = (uint16_t *)&frame->bytes[HEADER_SIZE];
+	const unsigned char *p = in + HEADER_SIZE;
+	const unsigned char *end = in + in_len;
+
+	size_t i = 0, used;
+#ifdef __SSE2__
+	if (!codec_scalar) {
+		for (; i < w; i += CODEC_BLOCK, p += used) {
+			if (!(used = decode_block_scalar(p, end - p, px, w, n, i))) {
+				return 0;
+			}
+		}
+		for (; i + CODEC_BLOCK <= n; i += CODEC_BLOCK, p += used) {
+			if (!(used = decode_block_sse2(p, end - p, px, w, i))) {
+				return 0;
+			}
+		}
+	}
+#endif
+	for (; i < n; i += CODEC_BLOCK, p += used) {
+		if (!(used = decode_block_scalar(p, end - p, px, w, n, i))) {
+			return 0;
+		}
+	}
+	if (p != end) {
+		return 0;
+	}
+	return HEADER_SIZE + 2 * n;
+}
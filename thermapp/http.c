@@ -0,0 +1,675 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE // accept4
+
+#include "thermapp.h"
+
+#include <linux/sockios.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// MJPEG over HTTP.
+//
+// One thread runs an epoll loop over the listening socket, the clients, and
+// an eventfd the capture thread uses to hand over frames.  Hand-over is the
+// same single-slot mailbox as thermapp_scene: if the server thread is still
+// busy with the last frame, the new one is dropped, and nothing at all is
+// copied while nobody is watching.
+//
+// Each frame is encoded once into a reference counted buffer that every
+// client sends from.  A client that is still sending an earlier frame when a
+// new one arrives skips the new one, so a slow client sees a lower frame rate
+// instead of a growing delay, and never holds more than one frame.  The same
+// goes for a client whose socket still has more than a frame's worth of data
+// in flight: the kernel would otherwise buffer a second or more of video.
+//
+//   /              a page showing the stream
+//   /stream.mjpg   multipart/x-mixed-replace stream
+//   /snapshot.jpg  the next frame, as a single JPEG
+
+#define HTTP_CLIENTS_MAX 16
+#define HTTP_REQUEST_MAX 1024
+#define HTTP_BOUNDARY    "thermappframe"
+
+#define EV_LISTEN HTTP_CLIENTS_MAX
+#define EV_WAKE   (HTTP_CLIENTS_MAX + 1)
+
+struct http_buf {
+	unsigned refs;
+	size_t len;
+	unsigned char data[];
+};
+
+struct http_client {
+	int fd;           // -1 if unused
+	int viewer;       // wants frames (streaming, or waiting for a snapshot)
+	int streaming;
+	int close_after;
+
+	char req[HTTP_REQUEST_MAX];
+	size_t req_len;
+	int req_done;
+
+	// Pending output: head, then buf (if any), then tail.
+	char head[512];
+	size_t head_len;
+	struct http_buf *buf;
+	const char *tail;
+	size_t tail_len;
+	size_t sent;
+
+	unsigned long frames_sent;
+	unsigned long frames_dropped;
+};
+
+struct thermapp_http {
+	pthread_t thread;
+	int listen_fd;
+	int epoll_fd;
+	int wake_fd;
+	atomic_int stop;
+	atomic_int busy;    // mailbox owned by the server thread
+	atomic_int viewers;
+
+	size_t img_w;
+	size_t img_h;
+	uint32_t *input;    // mailbox, img_w * img_h
+	struct thermapp_jpeg *jpeg;
+	struct http_buf *latest;
+
+	struct http_client clients[HTTP_CLIENTS_MAX];
+
+	// Statistics.
+	unsigned long frames_dropped; // written by the capture thread only
+	unsigned long frames_encoded;
+	unsigned long bytes_encoded;
+	uint64_t encode_ns;
+	unsigned long clients_total;
+	unsigned long clients_refused;
+	unsigned long parts_sent;
+	unsigned long parts_dropped;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+buf_release(struct http_buf *buf)
+{
+	if (buf && !--buf->refs) {
+		free(buf);
+	}
+}
+
+static void
+client_close(struct thermapp_http *http, struct http_client *c)
+{
+	if (c->viewer) {
+		atomic_fetch_sub_explicit(&http->viewers, 1, memory_order_relaxed);
+	}
+	http->parts_sent += c->frames_sent;
+	http->parts_dropped += c->frames_dropped;
+	buf_release(c->buf);
+	close(c->fd);
+	memset(c, 0, sizeof *c);
+	c->fd = -1;
+}
+
+static void
+client_viewer(struct thermapp_http *http, struct http_client *c, int viewer)
+{
+	if (c->viewer != viewer) {
+		c->viewer = viewer;
+		atomic_fetch_add_explicit(&http->viewers, viewer ? 1 : -1, memory_order_relaxed);
+	}
+}
+
+static int
+client_pending(const struct http_client *c)
+{
+	return c->sent < c->head_len + (c->buf ? c->buf->len : 0) + c->tail_len;
+}
+
+// Bytes written to the socket but not yet acknowledged by the client.
+static size_t
+client_in_flight(const struct http_client *c)
+{
+	int n;
+	return ioctl(c->fd, SIOCOUTQ, &n) == 0 && n > 0 ? (size_t)n : 0;
+}
+
+// Sends as much of the pending output as the socket takes.
+// Returns -1 if the client was closed.
+static int
+client_flush(struct thermapp_http *http, struct http_client *c)
+{
+	while (client_pending(c)) {
+		struct iovec iov[3];
+		int n = 0;
+		size_t off = c->sent;
+		size_t buf_len = c->buf ? c->buf->len : 0;
+		if (off < c->head_len) {
+			iov[n++] = (struct iovec){ c->head + off, c->head_len - off };
+			off = 0;
+		} else {
+			off -= c->head_len;
+		}
+		if (off < buf_len) {
+			iov[n++] = (struct iovec){ c->buf->data + off, buf_len - off };
+			off = 0;
+		} else {
+			off -= buf_len;
+		}
+		if (off < c->tail_len) {
+			iov[n++] = (struct iovec){ (char *)c->tail + off, c->tail_len - off };
+		}
+
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+		ssize_t ret = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0; // resumed on EPOLLOUT
+			}
+			client_close(http, c);
+			return -1;
+		}
+		c->sent += ret;
+	}
+
+	if (c->buf) {
+		c->frames_sent += 1;
+	}
+	buf_release(c->buf);
+	c->buf = NULL;
+	c->head_len = c->tail_len = c->sent = 0;
+	if (c->close_after) {
+		client_close(http, c);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+client_send(struct thermapp_http *http, struct http_client *c,
+            const char *head, struct http_buf *buf, const char *tail, int close_after)
+{
+	c->head_len = snprintf(c->head, sizeof c->head, "%s", head);
+	c->buf = buf;
+	if (buf) {
+		buf->refs += 1;
+	}
+	c->tail = tail ? tail : "";
+	c->tail_len = strlen(c->tail);
+	c->sent = 0;
+	c->close_after = close_after;
+	return client_flush(http, c);
+}
+
+static int
+client_error(struct thermapp_http *http, struct http_client *c, const char *status)
+{
+	char head[256];
+	snprintf(head, sizeof head,
+	         "HTTP/1.0 %s\r\n"
+	         "Server: thermapp\r\n"
+	         "Connection: close\r\n"
+	         "Content-Type: text/plain\r\n"
+	         "\r\n"
+	         "%s\r\n", status, status);
+	return client_send(http, c, head, NULL, NULL, 1);
+}
+
+static int
+client_snapshot(struct thermapp_http *http, struct http_client *c)
+{
+	char head[256];
+	snprintf(head, sizeof head,
+	         "HTTP/1.0 200 OK\r\n"
+	         "Server: thermapp\r\n"
+	         "Connection: close\r\n"
+	         "Cache-Control: no-cache, no-store\r\n"
+	         "Content-Type: image/jpeg\r\n"
+	         "Content-Length: %zu\r\n"
+	         "\r\n", http->latest->len);
+	client_viewer(http, c, 0);
+	return client_send(http, c, head, http->latest, NULL, 1);
+}
+
+static int
+client_request(struct thermapp_http *http, struct http_client *c)
+{
+	char method[8], path[256];
+	if (sscanf(c->req, "%7s %255s HTTP/", method, path) != 2) {
+		return client_error(http, c, "400 Bad Request");
+	}
+	if (strcmp(method, "GET") != 0) {
+		return client_error(http, c, "405 Method Not Allowed");
+	}
+	char *query = strchr(path, '?');
+	if (query) {
+		*query = '\0';
+	}
+
+	if (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
+		static const char page[] =
+			"<!DOCTYPE html>\n"
+			"<html><head><title>thermapp</title></head>\n"
+			"<body style=\"margin:0;background:#000\">"
+			"<img src=\"/stream.mjpg\" style=\"width:100%;height:100vh;object-fit:contain\">"
+			"</body></html>\n";
+		char head[512];
+		snprintf(head, sizeof head,
+		         "HTTP/1.0 200 OK\r\n"
+		         "Server: thermapp\r\n"
+		         "Connection: close\r\n"
+		         "Content-Type: text/html\r\n"
+		         "Content-Length: %zu\r\n"
+		         "\r\n"
+		         "%s", sizeof page - 1, page);
+		return client_send(http, c, head, NULL, NULL, 1);
+	} else if (strcmp(path, "/stream.mjpg") == 0 || strcmp(path, "/stream") == 0) {
+		c->streaming = 1;
+		client_viewer(http, c, 1);
+		return client_send(http, c,
+		                   "HTTP/1.0 200 OK\r\n"
+		                   "Server: thermapp\r\n"
+		                   "Connection: close\r\n"
+		                   "Cache-Control: no-cache, no-store\r\n"
+		                   "Pragma: no-cache\r\n"
+		                   "Content-Type: multipart/x-mixed-replace; boundary=" HTTP_BOUNDARY "\r\n"
+		                   "\r\n", NULL, NULL, 0);
+	} else if (strcmp(path, "/snapshot.jpg") == 0) {
+		// Always a fresh frame, so wait for the next one.
+		client_viewer(http, c, 1);
+		return 0;
+	} else {
+		return client_error(http, c, "404 Not Found");
+	}
+}
+
+static void
+client_readable(struct thermapp_http *http, struct http_client *c)
+{
+	for (;;) {
+		char discard[256];
+		char *p = c->req_done ? discard : c->req + c->req_len;
+		size_t len = c->req_done ? sizeof discard : sizeof c->req - 1 - c->req_len;
+		if (!len) {
+			client_error(http, c, "431 Request Header Fields Too Large");
+			return;
+		}
+		ssize_t ret = recv(c->fd, p, len, 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				client_close(http, c);
+			}
+			return;
+		}
+		if (ret == 0) {
+			client_close(http, c);
+			return;
+		}
+		if (c->req_done) {
+			continue;
+		}
+		c->req_len += ret;
+		c->req[c->req_len] = '\0';
+		if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n")) {
+			c->req_done = 1;
+			if (client_request(http, c) < 0) {
+				return;
+			}
+		}
+	}
+}
+
+static void
+accept_clients(struct thermapp_http *http)
+{
+	for (;;) {
+		int fd = accept4(http->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept");
+			}
+			return;
+		}
+
+		struct http_client *c = NULL;
+		for (size_t i = 0; i < HTTP_CLIENTS_MAX; ++i) {
+			if (http->clients[i].fd < 0) {
+				c = &http->clients[i];
+				break;
+			}
+		}
+		if (!c) {
+			http->clients_refused += 1;
+			close(fd);
+			continue;
+		}
+
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+			.data.u32 = c - http->clients,
+		};
+		if (epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		http->clients_total += 1;
+	}
+}
+
+static void
+new_frame(struct thermapp_http *http)
+{
+	uint64_t t0 = now_ns();
+	const unsigned char *jpeg;
+	size_t len = thermapp_jpeg_encode(http->jpeg, http->input, &jpeg);
+	struct http_buf *buf = malloc(sizeof *buf + len);
+	if (buf) {
+		buf->refs = 1;
+		buf->len = len;
+		memcpy(buf->data, jpeg, len);
+	} else {
+		perror("malloc");
+	}
+	uint64_t t1 = now_ns();
+	http->encode_ns += t1 - t0;
+	thermapp_trace_span_at("jpeg encode", t0, t1);
+	http->frames_encoded += 1;
+	http->bytes_encoded += len;
+
+	// The mailbox is free once the frame is encoded.
+	atomic_store_explicit(&http->busy, 0, memory_order_release);
+	if (!buf) {
+		return;
+	}
+	buf_release(http->latest);
+	http->latest = buf;
+
+	char head[128];
+	snprintf(head, sizeof head,
+	         "--" HTTP_BOUNDARY "\r\n"
+	         "Content-Type: image/jpeg\r\n"
+	         "Content-Length: %zu\r\n"
+	         "\r\n", len);
+	for (size_t i = 0; i < HTTP_CLIENTS_MAX; ++i) {
+		struct http_client *c = &http->clients[i];
+		if (c->fd < 0 || !c->viewer) {
+			continue;
+		}
+		if (client_pending(c) || client_in_flight(c) > len) {
+			c->frames_dropped += 1;
+		} else if (c->streaming) {
+			client_send(http, c, head, buf, "\r\n", 0);
+		} else {
+			client_snapshot(http, c);
+		}
+	}
+}
+
+static void *
+server(void *arg)
+{
+	struct thermapp_http *http = arg;
+	struct epoll_event events[HTTP_CLIENTS_MAX + 2];
+	thermapp_trace_thread("http");
+
+	while (!atomic_load_explicit(&http->stop, memory_order_acquire)) {
+		int n = epoll_wait(http->epoll_fd, events, HTTP_CLIENTS_MAX + 2, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+		for (int i = 0; i < n; ++i) {
+			uint32_t id = events[i].data.u32;
+			if (id == EV_LISTEN) {
+				accept_clients(http);
+			} else if (id == EV_WAKE) {
+				uint64_t count;
+				if (read(http->wake_fd, &count, sizeof count) < 0 && errno != EAGAIN) {
+					perror("read");
+				}
+				if (atomic_load_explicit(&http->busy, memory_order_acquire)) {
+					new_frame(http);
+				}
+			} else {
+				struct http_client *c = &http->clients[id];
+				if (c->fd < 0) {
+					continue;
+				}
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					client_close(http, c);
+					continue;
+				}
+				if (events[i].events & EPOLLOUT && client_flush(http, c) < 0) {
+					continue;
+				}
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+					client_readable(http, c);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+static int
+listen_on(const char *addr)
+{
+	// [host:]port, host may be a [bracketed] IPv6 address.
+	char host[256];
+	const char *port = strrchr(addr, ':');
+	if (port) {
+		size_t len = port - addr;
+		if (len >= sizeof host) {
+			len = sizeof host - 1;
+		}
+		memcpy(host, addr, len);
+		host[len] = '\0';
+		port += 1;
+		if (host[0] == '[' && len >= 2 && host[len - 1] == ']') {
+			host[len - 1] = '\0';
+			memmove(host, host + 1, len - 1);
+		}
+	} else {
+		host[0] = '\0';
+		port = addr;
+	}
+
+	struct addrinfo hints = {
+		.ai_flags = AI_PASSIVE,
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res;
+	int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", addr, gai_strerror(err));
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, HTTP_CLIENTS_MAX) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		perror(addr);
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+struct thermapp_http *
+thermapp_http_open(const char *addr, size_t img_w, size_t img_h, int quality)
+{
+	struct thermapp_http *http = calloc(1, sizeof *http);
+	if (!http) {
+		perror("calloc");
+		return NULL;
+	}
+	http->listen_fd = http->epoll_fd = http->wake_fd = -1;
+	for (size_t i = 0; i < HTTP_CLIENTS_MAX; ++i) {
+		http->clients[i].fd = -1;
+	}
+	http->img_w = img_w;
+	http->img_h = img_h;
+	atomic_init(&http->stop, 0);
+	atomic_init(&http->busy, 0);
+	atomic_init(&http->viewers, 0);
+
+	http->input = malloc(img_w * img_h * sizeof *http->input);
+	if (!http->input) {
+		perror("malloc");
+		goto err;
+	}
+	http->jpeg = thermapp_jpeg_open(img_w, img_h, quality);
+	if (!http->jpeg) {
+		goto err;
+	}
+
+	http->listen_fd = listen_on(addr);
+	if (http->listen_fd < 0) {
+		goto err;
+	}
+	http->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (http->wake_fd < 0) {
+		perror("eventfd");
+		goto err;
+	}
+	http->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (http->epoll_fd < 0) {
+		perror("epoll_create1");
+		goto err;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_LISTEN };
+	if (epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, http->listen_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		goto err;
+	}
+	ev.data.u32 = EV_WAKE;
+	if (epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, http->wake_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		goto err;
+	}
+
+	int ret = pthread_create(&http->thread, NULL, server, http);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+		goto err;
+	}
+	printf("Serving MJPEG on %s\n", addr);
+	return http;
+
+err:
+	if (http->epoll_fd >= 0)
+		close(http->epoll_fd);
+	if (http->wake_fd >= 0)
+		close(http->wake_fd);
+	if (http->listen_fd >= 0)
+		close(http->listen_fd);
+	if (http->jpeg)
+		thermapp_jpeg_close(http->jpeg);
+	free(http->input);
+	free(http);
+	return NULL;
+}
+
+// Called from the capture thread with the rendered frame.  Never blocks.
+void
+thermapp_http_frame(struct thermapp_http *http, const uint32_t *img)
+{
+	if (!atomic_load_explicit(&http->viewers, memory_order_relaxed)) {
+		return;
+	}
+	if (atomic_load_explicit(&http->busy, memory_order_acquire)) {
+		http->frames_dropped += 1;
+		return;
+	}
+
+	memcpy(http->input, img, http->img_w * http->img_h * sizeof *http->input);
+	atomic_store_explicit(&http->busy, 1, memory_order_release);
+	uint64_t one = 1;
+	if (write(http->wake_fd, &one, sizeof one) < 0) {
+		perror("write");
+	}
+}
+
+void
+thermapp_http_close(struct thermapp_http *http)
+{
+	if (!http)
+		return;
+
+	atomic_store_explicit(&http->stop, 1, memory_order_release);
+	uint64_t one = 1;
+	if (write(http->wake_fd, &one, sizeof one) < 0) {
+		perror("write");
+	}
+	pthread_join(http->thread, NULL);
+
+	for (size_t i = 0; i < HTTP_CLIENTS_MAX; ++i) {
+		if (http->clients[i].fd >= 0) {
+			client_close(http, &http->clients[i]);
+		}
+	}
+	buf_release(http->latest);
+
+	printf("HTTP: %lu clients (%lu refused), %lu frames encoded (%.3f ms avg, %.1f kB avg), %lu dropped while busy, %lu sent, %lu skipped by slow clients\n",
+	       http->clients_total, http->clients_refused,
+	       http->frames_encoded,
+	       http->frames_encoded ? http->encode_ns / 1e6 / http->frames_encoded : 0.0,
+	       http->frames_encoded ? http->bytes_encoded / 1e3 / http->frames_encoded : 0.0,
+	       http->frames_dropped, http->parts_sent, http->parts_dropped);
+
+	close(http->epoll_fd);
+	close(http->wake_fd);
+	close(http->listen_fd);
+	thermapp_jpeg_close(http->jpeg);
+	free(http->input);
+	free(http);
+}
@@ -0,0 +1,583 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Image processing benchmark.
+//
+// Times each img.c kernel, and the whole per-frame sequence as main.c runs
+// it in enhanced mode, on synthetic frames and synthetic calibration sets for
+// each camera resolution and calibration set.  Inputs are deterministic, so
+// runs are comparable.  Each kernel is run on a fresh copy of its input until
+// at least -m seconds have passed, and the median call is reported as
+// ns/pixel and frames/s.
+//
+// Results are written as JSON, one result per line.  With -c, the results
+// are also compared against a saved run and the exit status is nonzero if any
+// kernel got slower by more than -t percent.
+
+#include "thermapp.h"
+
+#include <unistd.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_FRAMES 4
+
+static const struct {
+	size_t w, h;         // image
+	size_t fpa_w, fpa_h; // as reported by the camera
+} sizes[] = {
+	{ 384, 288, 384, 288 },
+	{ 512, 308, 384, 288 }, // special case, see sync() in usb.c
+	{ 640, 480, 640, 480 },
+};
+
+static const struct {
+	const char *name;
+	enum thermapp_cal_set set;
+} sets[] = {
+	{ "NV",  CAL_SET_NV  },
+	{ "LO",  CAL_SET_LO  },
+	{ "MED", CAL_SET_MED },
+	{ "HI",  CAL_SET_HI  },
+};
+
+enum kernel {
+	K_VGSK,
+	K_NUC,
+	K_BPR,
+	K_MINMAX,
+	K_QUANTIZE,
+	K_HPF,
+	K_LUT,
+	K_PALETTE,
+	K_FRAME,
+	KERNELS,
+};
+
+static const char *const kernel_names[KERNELS] = {
+	[K_VGSK]     = "vgsk",
+	[K_NUC]      = "nuc",
+	[K_BPR]      = "bpr",
+	[K_MINMAX]   = "minmax",
+	[K_QUANTIZE] = "quantize",
+	[K_HPF]      = "hpf",
+	[K_LUT]      = "lut",
+	[K_PALETTE]  = "palette",
+	[K_FRAME]    = "frame",
+};
+
+struct result {
+	char size[16];
+	char set[8];
+	char kernel[16];
+	double ns_per_pixel;
+	double fps;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Deterministic, so runs are comparable.
+static uint32_t rng_state;
+
+static float
+rng_uniform(void)
+{
+	rng_state = rng_state * 1664525 + 1013904223;
+	return (rng_state >> 8) / (float)(1 << 24);
+}
+
+static float
+rng_gauss(void)
+{
+	float u = 0.0f;
+	for (int i = 0; i < 12; ++i) {
+		u += rng_uniform();
+	}
+	return u - 6.0f;
+}
+
+// Per-pixel coefficients: mean + sd * noise.
+static float *
+coeffs(size_t n, float mean, float sd)
+{
+	float *p = malloc(n * sizeof *p);
+	if (!p) {
+		perror("malloc");
+		return NULL;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		p[i] = mean + sd * rng_gauss();
+	}
+	return p;
+}
+
+static void
+free_cal(struct thermapp_cal *cal)
+{
+	free((float *)cal->nuc_good);
+	free((float *)cal->nuc_offset);
+	free((float *)cal->nuc_px);
+	free((float *)cal->nuc_px2);
+	free((float *)cal->nuc_px3);
+	free((float *)cal->nuc_px4);
+	free((float *)cal->nuc_tfpa);
+	free((float *)cal->nuc_tfpa2);
+	free((float *)cal->nuc_tfpa_px);
+	free((float *)cal->nuc_tfpa2_px2);
+	free((float *)cal->nuc_vgsk);
+	free((float *)cal->nuc_vgsk2);
+	free((float *)cal->nuc_vgsk_px);
+	free((float *)cal->transient_offset);
+	free((float *)cal->transient_delta);
+	free(cal);
+}
+
+static struct thermapp_cal *
+synthetic_cal(size_t w, size_t h, enum thermapp_cal_set set)
+{
+	struct thermapp_cal *cal = calloc(1, sizeof *cal);
+	if (!cal) {
+		perror("calloc");
+		return NULL;
+	}
+	rng_state = 1000 + set;
+
+	cal->img_w = cal->nuc_w = w;
+	cal->img_h = cal->nuc_h = h;
+	cal->cur_set = set;
+	cal->vgsk_min = 1000;
+	cal->vgsk_max = 2000;
+	cal->histogram_peak_target = 0.45;
+
+	size_t n = w * h;
+	float *good = coeffs(n, 0.0f, 0.0f);
+	if (good) {
+		// About 0.1% bad pixels, none in the first position.
+		for (size_t i = 0; i < n; ++i) {
+			good[i] = i == 0 || rng_uniform() >= 0.001f;
+		}
+	}
+	cal->nuc_good = good;
+
+	// Sized so that the output is roughly 0.01 C units around room temperature.
+	if (set == CAL_SET_NV) {
+		cal->nuc_offset  = coeffs(n, 0.0f, 50.0f);
+		cal->nuc_px      = coeffs(n, 1.0f, 0.02f);
+		cal->nuc_px2     = coeffs(n, 0.0f, 1e-6f);
+		cal->nuc_tfpa    = coeffs(n, 0.0f, 1e-3f);
+		cal->nuc_tfpa2   = coeffs(n, 0.0f, 1e-8f);
+		cal->nuc_tfpa_px = coeffs(n, 0.0f, 1e-7f);
+		cal->nuc_vgsk    = coeffs(n, 0.0f, 1e-3f);
+		cal->nuc_vgsk2   = coeffs(n, 0.0f, 1e-8f);
+		cal->nuc_vgsk_px = coeffs(n, 0.0f, 1e-7f);
+		if (!cal->nuc_offset || !cal->nuc_px || !cal->nuc_px2 || !cal->nuc_tfpa || !cal->nuc_tfpa2
+		 || !cal->nuc_tfpa_px || !cal->nuc_vgsk || !cal->nuc_vgsk2 || !cal->nuc_vgsk_px) {
+			free_cal(cal);
+			return NULL;
+		}
+	} else {
+		static float dist_param[CAL_SETS][5];
+		float *dist = dist_param[set];
+		dist[0] = 1.0f;
+		dist[1] = 0.0f;
+		dist[2] = 0.9f + 0.05f * set;
+		dist[3] = 300.0f;
+		dist[4] = 3000.0f;
+		cal->dist_param = dist;
+
+		cal->nuc_offset       = coeffs(n, 500.0f, 50.0f);
+		cal->nuc_px           = coeffs(n, 1.0f, 0.02f);
+		cal->nuc_px2          = coeffs(n, 0.0f, 1e-6f);
+		cal->nuc_px3          = coeffs(n, 0.0f, 1e-10f);
+		cal->nuc_px4          = coeffs(n, 0.0f, 1e-14f);
+		cal->nuc_tfpa         = coeffs(n, 0.0f, 1e-3f);
+		cal->nuc_tfpa2        = coeffs(n, 0.0f, 1e-8f);
+		cal->nuc_tfpa_px      = coeffs(n, 0.0f, 1e-7f);
+		cal->nuc_tfpa2_px2    = coeffs(n, 0.0f, 1e-12f);
+		cal->transient_offset = coeffs(n, 0.0f, 1.0f);
+		cal->transient_delta  = coeffs(n, 0.0f, 1.0f);
+		if (!cal->nuc_offset || !cal->nuc_px || !cal->nuc_px2 || !cal->nuc_px3 || !cal->nuc_px4
+		 || !cal->nuc_tfpa || !cal->nuc_tfpa2 || !cal->nuc_tfpa_px || !cal->nuc_tfpa2_px2
+		 || !cal->transient_offset || !cal->transient_delta) {
+			free_cal(cal);
+			return NULL;
+		}
+	}
+	return cal;
+}
+
+// A warm blob drifting over a gradient, with fixed pattern and temporal noise.
+static void
+synthetic_frames(union thermapp_frame *frames, const struct thermapp_cal *cal, size_t fpa_w, size_t fpa_h)
+{
+	size_t w = cal->img_w, h = cal->img_h;
+	rng_state = 12345;
+	for (size_t f = 0; f < BENCH_FRAMES; ++f) {
+		union thermapp_frame *frame = &frames[f];
+		memset(frame->bytes, 0, HEADER_SIZE);
+		frame->header.fpa_w = fpa_w;
+		frame->header.fpa_h = fpa_h;
+		frame->header.data_w = w;
+		frame->header.data_h = h;
+		frame->header.data_offset = HEADER_SIZE;
+		frame->header.frame_num_lo = f;
+		frame->header.temp_fpa_diode = 8000 + f;
+		frame->header.VoutC = 1524;
+
+		uint16_t *px = (uint16_t *)&frame->bytes[HEADER_SIZE];
+		for (size_t y = 0; y < h; ++y) {
+			for (size_t x = 0; x < w; ++x) {
+				float dx = x - (w / 2.0f + 20.0f * sinf(f / 2.0f));
+				float dy = y - h / 2.0f;
+				float v = 1800.0f + 0.5f * y + 900.0f * expf(-(dx * dx + dy * dy) / (2.0f * 40.0f * 40.0f));
+				v += 3.0f * rng_gauss();
+				px[y * w + x] = v < 0 ? 0 : v > 4095 ? 4095 : (uint16_t)v;
+			}
+		}
+	}
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+struct state {
+	const struct thermapp_cal *cal;
+	const union thermapp_frame *frames;
+	uint32_t palette[UINT8_MAX+1];
+	uint8_t lut[UINT16_MAX+1];
+
+	// Per-frame inputs to each kernel, from one pass of the full sequence.
+	float *nuc[BENCH_FRAMES];
+	uint16_t *quantized[BENCH_FRAMES];
+	uint16_t *filtered[BENCH_FRAMES];
+
+	// Scratch, reset before each timed call.
+	float *uniform;
+	uint16_t *scratch;
+	uint32_t *rgb;
+	struct thermapp_img_scratch img_scratch;
+};
+
+// The full per-frame sequence, as in main.c (enhanced mode).
+static void
+frame_run(struct state *st, const union thermapp_frame *frame, float *uniform, uint16_t *quantized)
+{
+	const struct thermapp_cal *cal = st->cal;
+	size_t i_min, i_max;
+	double t_min, t_max;
+	thermapp_img_vgsk(cal, frame);
+	thermapp_img_nuc(cal, frame, uniform, 0, 0.0f);
+	thermapp_img_bpr(cal, uniform);
+	thermapp_img_minmax(cal, uniform, NULL, NULL, &i_min, &i_max, &t_min, &t_max, 20.0, 0.95);
+	thermapp_img_quantize(cal, uniform, quantized);
+	thermapp_img_hpf(cal, quantized, 1.25f, &st->img_scratch);
+	thermapp_img_lut(cal, quantized, st->lut, 0.0f, 0.0f, &st->img_scratch);
+	thermapp_img_palette(cal, quantized, st->lut, st->palette, st->rgb, 0, 0);
+}
+
+static void
+kernel_run(struct state *st, enum kernel k, size_t f)
+{
+	const struct thermapp_cal *cal = st->cal;
+	size_t i_min, i_max;
+	double t_min, t_max;
+
+	switch (k) {
+	case K_VGSK:
+		thermapp_img_vgsk(cal, &st->frames[f]);
+		break;
+	case K_NUC:
+		thermapp_img_nuc(cal, &st->frames[f], st->uniform, 0, 0.0f);
+		break;
+	case K_BPR:
+		thermapp_img_bpr(cal, st->uniform);
+		break;
+	case K_MINMAX:
+		thermapp_img_minmax(cal, st->nuc[f], NULL, NULL, &i_min, &i_max, &t_min, &t_max, 20.0, 0.95);
+		break;
+	case K_QUANTIZE:
+		thermapp_img_quantize(cal, st->nuc[f], st->scratch);
+		break;
+	case K_HPF:
+		thermapp_img_hpf(cal, st->scratch, 1.25f, &st->img_scratch);
+		break;
+	case K_LUT:
+		thermapp_img_lut(cal, st->filtered[f], st->lut, 0.0f, 0.0f, &st->img_scratch);
+		break;
+	case K_PALETTE:
+		thermapp_img_palette(cal, st->filtered[f], st->lut, st->palette, st->rgb, 0, 0);
+		break;
+	case K_FRAME:
+		frame_run(st, &st->frames[f], st->uniform, st->scratch);
+		break;
+	default:
+		break;
+	}
+}
+
+// Untimed: give in-place kernels a fresh copy of their input.
+static void
+kernel_prepare(struct state *st, enum kernel k, size_t f)
+{
+	size_t px = st->cal->img_w * st->cal->img_h;
+	if (k == K_BPR) {
+		memcpy(st->uniform, st->nuc[f], px * sizeof *st->uniform);
+	} else if (k == K_HPF) {
+		memcpy(st->scratch, st->quantized[f], px * sizeof *st->scratch);
+	}
+}
+
+static int
+bench(struct state *st, enum kernel k, double min_seconds, double *ns_per_call)
+{
+	size_t cap = 1024, n = 0;
+	uint64_t *t = malloc(cap * sizeof *t);
+	if (!t) {
+		perror("malloc");
+		return 0;
+	}
+
+	// Warm up caches and the LUT state.
+	for (size_t f = 0; f < BENCH_FRAMES; ++f) {
+		kernel_prepare(st, k, f);
+		kernel_run(st, k, f);
+	}
+
+	uint64_t total = 0;
+	while (total < min_seconds * 1e9 || n < 16) {
+		size_t f = n % BENCH_FRAMES;
+		kernel_prepare(st, k, f);
+		uint64_t t0 = now_ns();
+		kernel_run(st, k, f);
+		uint64_t t1 = now_ns();
+		if (n == cap) {
+			uint64_t *p = realloc(t, 2 * cap * sizeof *t);
+			if (!p) {
+				perror("realloc");
+				free(t);
+				return 0;
+			}
+			t = p;
+			cap *= 2;
+		}
+		t[n++] = t1 - t0;
+		total += t1 - t0;
+	}
+
+	qsort(t, n, sizeof *t, cmp_u64);
+	*ns_per_call = t[n / 2];
+	free(t);
+	return 1;
+}
+
+static int
+run_config(size_t si, size_t ci, double min_seconds, struct result *results, size_t *nresults)
+{
+	size_t w = sizes[si].w, h = sizes[si].h, px = w * h;
+	struct thermapp_cal *cal = synthetic_cal(w, h, sets[ci].set);
+	struct state *st = calloc(1, sizeof *st);
+	union thermapp_frame *frames = malloc(BENCH_FRAMES * sizeof *frames);
+	int ok = cal && st && frames;
+	if (!ok) {
+		perror("malloc");
+		goto out;
+	}
+
+	for (size_t f = 0; ok && f < BENCH_FRAMES; ++f) {
+		st->nuc[f] = malloc(px * sizeof *st->nuc[f]);
+		st->quantized[f] = malloc(px * sizeof *st->quantized[f]);
+		st->filtered[f] = malloc(px * sizeof *st->filtered[f]);
+		ok = st->nuc[f] && st->quantized[f] && st->filtered[f];
+	}
+	st->uniform = malloc(px * sizeof *st->uniform);
+	st->scratch = malloc(px * sizeof *st->scratch);
+	st->rgb = malloc(px * sizeof *st->rgb);
+	if (!ok || !st->uniform || !st->scratch || !st->rgb) {
+		perror("malloc");
+		ok = 0;
+		goto out;
+	}
+
+	for (int i = 0; i <= UINT8_MAX; ++i) {
+		st->palette[i] = i << 16 | i << 8 | i;
+	}
+	st->cal = cal;
+	st->frames = frames;
+	synthetic_frames(frames, cal, sizes[si].fpa_w, sizes[si].fpa_h);
+
+	// Inputs for the kernels that don't start from the raw frame.
+	for (size_t f = 0; f < BENCH_FRAMES; ++f) {
+		thermapp_img_nuc(cal, &frames[f], st->nuc[f], 0, 0.0f);
+		thermapp_img_bpr(cal, st->nuc[f]);
+		thermapp_img_quantize(cal, st->nuc[f], st->quantized[f]);
+		memcpy(st->filtered[f], st->quantized[f], px * sizeof *st->filtered[f]);
+		thermapp_img_hpf(cal, st->filtered[f], 1.25f, &st->img_scratch);
+	}
+
+	for (enum kernel k = 0; k < KERNELS; ++k) {
+		double ns;
+		if (!bench(st, k, min_seconds, &ns)) {
+			ok = 0;
+			break;
+		}
+		struct result *r = &results[(*nresults)++];
+		snprintf(r->size, sizeof r->size, "%zux%zu", w, h);
+		snprintf(r->set, sizeof r->set, "%s", sets[ci].name);
+		snprintf(r->kernel, sizeof r->kernel, "%s", kernel_names[k]);
+		r->ns_per_pixel = ns / px;
+		r->fps = 1e9 / ns;
+		fprintf(stderr, "%-8s %-4s %-9s %8.3f ns/px %10.1f fps\n",
+		        r->size, r->set, r->kernel, r->ns_per_pixel, r->fps);
+	}
+
+out:
+	if (st) {
+		for (size_t f = 0; f < BENCH_FRAMES; ++f) {
+			free(st->nuc[f]);
+			free(st->quantized[f]);
+			free(st->filtered[f]);
+		}
+		free(st->uniform);
+		free(st->scratch);
+		free(st->rgb);
+		free(st);
+	}
+	free(frames);
+	if (cal) {
+		free_cal(cal);
+	}
+	return ok;
+}
+
+// Reads back the results written by main() below, one per line.
+static size_t
+load_baseline(const char *path, struct result *results, size_t max)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return 0;
+	}
+	size_t n = 0;
+	char line[256];
+	while (n < max && fgets(line, sizeof line, f)) {
+		struct result *r = &results[n];
+		if (sscanf(line, " {\"size\": \"%15[^\"]\", \"set\": \"%7[^\"]\", \"kernel\": \"%15[^\"]\", \"ns_per_pixel\": %lf, \"fps\": %lf",
+		           r->size, r->set, r->kernel, &r->ns_per_pixel, &r->fps) == 5) {
+			n += 1;
+		}
+	}
+	fclose(f);
+	if (!n) {
+		fprintf(stderr, "%s: %s\n", path, "No results");
+	}
+	return n;
+}
+
+static int
+compare(const struct result *base, size_t nbase, const struct result *cur, size_t ncur, double threshold)
+{
+	int regressions = 0;
+	fprintf(stderr, "\n%-8s %-4s %-9s %10s %10s %8s\n", "size", "set", "kernel", "base ns/px", "ns/px", "change");
+	for (size_t i = 0; i < ncur; ++i) {
+		const struct result *c = &cur[i];
+		for (size_t j = 0; j < nbase; ++j) {
+			const struct result *b = &base[j];
+			if (strcmp(b->size, c->size) || strcmp(b->set, c->set) || strcmp(b->kernel, c->kernel)) {
+				continue;
+			}
+			double change = 100.0 * (c->ns_per_pixel - b->ns_per_pixel) / b->ns_per_pixel;
+			int slower = change > threshold;
+			regressions += slower;
+			fprintf(stderr, "%-8s %-4s %-9s %10.3f %10.3f %+7.1f%%%s\n",
+			        c->size, c->set, c->kernel, b->ns_per_pixel, c->ns_per_pixel, change,
+			        slower ? "  SLOWER" : change < -threshold ? "  faster" : "");
+			break;
+		}
+	}
+	fprintf(stderr, "%d regressions over %.1f%%\n", regressions, threshold);
+	return regressions;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *baseline = NULL;
+	double threshold = 10.0;
+	double min_seconds = 0.2;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:hm:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			baseline = optarg;
+			break;
+		case 'm':
+			min_seconds = strtod(optarg, NULL);
+			break;
+		case 't':
+			threshold = strtod(optarg, NULL);
+			break;
+		case 'h':
+			printf("Usage: %s [options] > results.json\n", argv[0]);
+			printf("  -c file       Compare against results saved from an earlier run\n");
+			printf("  -h            Show this help message and exit\n");
+			printf("  -m seconds    Minimum time per kernel [default: 0.2]\n");
+			printf("  -t percent    With -c, slowdown that counts as a regression [default: 10]\n");
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	size_t max = sizeof sizes / sizeof *sizes * sizeof sets / sizeof *sets * KERNELS;
+	struct result *results = calloc(max, sizeof *results);
+	struct result *base = calloc(max, sizeof *base);
+	if (!results || !base) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	size_t nbase = 0;
+	if (baseline && !(nbase = load_baseline(baseline, base, max))) {
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+	size_t n = 0;
+	for (size_t si = 0; si < sizeof sizes / sizeof *sizes; ++si) {
+		for (size_t ci = 0; ci < sizeof sets / sizeof *sets; ++ci) {
+			if (!run_config(si, ci, min_seconds, results, &n)) {
+				ret = EXIT_FAILURE;
+			}
+		}
+	}
+
+	printf("{\"results\": [\n");
+	for (size_t i = 0; i < n; ++i) {
+		const struct result *r = &results[i];
+		printf("  {\"size\": \"%s\", \"set\": \"%s\", \"kernel\": \"%s\", \"ns_per_pixel\": %.4f, \"fps\": %.1f}%s\n",
+		       r->size, r->set, r->kernel, r->ns_per_pixel, r->fps, i + 1 < n ? "," : "");
+	}
+	printf("]}\n");
+
+	if (baseline && compare(base, nbase, results, n, threshold)) {
+		ret = EXIT_FAILURE;
+	}
+
+	free(results);
+	free(base);
+	return ret;
+}
@@ -0,0 +1,920 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Differential fuzzer for the img.c kernels.
+//
+// Each case builds a random calibration (geometry, calibration set, NUC
+// tables, bad pixel map) and a random sequence of frames (pixels, FPA
+// temperature, VoutC), then runs every variant in the table below and the
+// frozen reference (ref.c) on them and compares the results stage by stage.
+// Every stage gets the reference output of the previous stage as its input,
+// so a difference is reported where it starts rather than where it ends up.
+// The LUT is the exception: its exponential moving average carries over from
+// frame to frame, so each variant keeps its own LUT for the whole sequence.
+//
+// Each case also runs a few checks of code that has no reference copy
+// but must agree exactly with a simpler version of itself:
+//
+//   tiled   thermapp_img_quantize_rect and _palette_rect over random subsets
+//           of CHANGE_TILE tiles, into images held over the sequence as the
+//           pipeline holds them, against the reference for the whole frame,
+//           in all four flips; and the histogram they keep up to date
+//           against one rebuilt from scratch, with the occupancy flag and
+//           the LUT target it lets the pipeline skip
+//   scale   scale.c with SSE2 against the same file built without it, for
+//           every filter and factor, at the case's size or a tiny or odd one
+//   alarm   the single-pass blob labeller in alarm.c against a flood fill
+//
+// Cases are numbered; a failure prints the case number, which reproduces it
+// with -s number -n 1.  Building with -DFUZZ_LIBFUZZER and clang's
+// -fsanitize=fuzzer turns this into a libFuzzer target instead, with the
+// input bytes choosing the case.
+
+#include "thermapp.h"
+#include "ref.h"
+
+#include <unistd.h>
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_SEQUENCE_MAX 6 // frames per case
+
+// Per-stage tolerances.  Floating point results may differ in rounding
+// (e.g. contracted multiply-adds, reordered sums); integer results by one
+// step of rounding, or two for the LUT after its state has carried over.
+#define TOL_NUC_REL  1e-4f
+#define TOL_NUC_ABS  1e-2f // 0.0001 C
+#define TOL_TEMP     1e-3 // C
+#define TOL_QUANTIZE 1
+#define TOL_HPF      1
+#define TOL_LUT      2
+
+struct variant {
+	const char *name;
+	int (*vgsk)(const struct thermapp_cal *, const union thermapp_frame *);
+	void (*nuc)(const struct thermapp_cal *, const union thermapp_frame *, float *, int, float);
+	void (*bpr)(const struct thermapp_cal *, float *);
+	void (*minmax)(const struct thermapp_cal *, const float *, float *, float *, size_t *, size_t *, double *, double *, double, double);
+	void (*quantize)(const struct thermapp_cal *, const float *, uint16_t *);
+	void (*hpf)(const struct thermapp_cal *, uint16_t *, float, struct thermapp_img_scratch *);
+	void (*lut)(const struct thermapp_cal *, const uint16_t *, uint8_t *, float, float, struct thermapp_img_scratch *);
+	void (*palette)(const struct thermapp_cal *, const uint16_t *, const uint8_t *, const uint32_t *, uint32_t *, int, int);
+	void (*y16)(const struct thermapp_cal *, const uint16_t *, uint16_t *, int, int);
+};
+
+// Add optimized implementations here as they are written.
+static const struct variant variants[] = {
+	{
+		"img",
+		thermapp_img_vgsk,
+		thermapp_img_nuc,
+		thermapp_img_bpr,
+		thermapp_img_minmax,
+		thermapp_img_quantize,
+		thermapp_img_hpf,
+		thermapp_img_lut,
+		thermapp_img_palette,
+		thermapp_img_y16,
+	},
+};
+#define VARIANTS (sizeof variants / sizeof *variants)
+
+// The frozen kernels keep their working space on the stack.
+static void
+ref_hpf(const struct thermapp_cal *cal, uint16_t *io, float enhanced_ratio, struct thermapp_img_scratch *scratch)
+{
+	thermapp_ref_img_hpf(cal, io, enhanced_ratio);
+}
+
+static void
+ref_lut(const struct thermapp_cal *cal, const uint16_t *in, uint8_t *lut, float ignore_ratio, float max_gain, struct thermapp_img_scratch *scratch)
+{
+	thermapp_ref_img_lut(cal, in, lut, ignore_ratio, max_gain);
+}
+
+static const struct variant reference = {
+	"ref",
+	thermapp_ref_img_vgsk,
+	thermapp_ref_img_nuc,
+	thermapp_ref_img_bpr,
+	thermapp_ref_img_minmax,
+	thermapp_ref_img_quantize,
+	ref_hpf,
+	ref_lut,
+	thermapp_ref_img_palette,
+	thermapp_ref_img_y16,
+};
+
+// xorshift64*, seeded per case.
+static uint64_t rng_state;
+
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+// Uniform in [lo, hi].
+static uint32_t
+rng_range(uint32_t lo, uint32_t hi)
+{
+	return lo + rng() % (hi - lo + 1);
+}
+
+static float
+rng_float(float lo, float hi)
+{
+	return lo + (hi - lo) * (rng() >> 8) / (float)(1 << 24);
+}
+
+struct fuzz_case {
+	struct thermapp_cal *cal;
+	float dist_param[5];
+	float *tables[16];
+	size_t tables_used;
+	union thermapp_frame *frames;
+	size_t frames_len;
+	int transient_enabled;
+	float temp_delta;
+	float enhanced_ratio;
+	float ignore_ratio;
+	float max_gain;
+	int fliph, flipv;
+	uint32_t palette[UINT8_MAX+1];
+};
+
+static float *
+table(struct fuzz_case *fc, float mean, float sd)
+{
+	size_t n = fc->cal->nuc_w * fc->cal->nuc_h;
+	float *t = malloc(n * sizeof *t);
+	if (!t) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	// Mostly smooth, with occasional outliers.
+	for (size_t i = 0; i < n; ++i) {
+		t[i] = mean + sd * rng_float(-1.0f, 1.0f);
+		if (!(rng() & 1023)) {
+			t[i] *= 10.0f;
+		}
+	}
+	fc->tables[fc->tables_used++] = t;
+	return t;
+}
+
+static void
+make_case(struct fuzz_case *fc, uint64_t seed)
+{
+	rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+	memset(fc, 0, sizeof *fc);
+
+	struct thermapp_cal *cal = calloc(1, sizeof *cal);
+	if (!cal) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	fc->cal = cal;
+
+	// Geometry: usually a real camera size, sometimes anything sync() accepts.
+	static const size_t real[][2] = { { 384, 288 }, { 512, 308 }, { 640, 480 } };
+	if (rng() & 1) {
+		size_t i = rng_range(0, 2);
+		cal->img_w = real[i][0];
+		cal->img_h = real[i][1];
+	} else {
+		cal->img_w = rng_range(FRAME_WIDTH_MIN, FRAME_WIDTH_MAX);
+		cal->img_h = rng_range(FRAME_HEIGHT_MIN, FRAME_HEIGHT_MAX);
+	}
+	cal->nuc_w = rng_range(cal->img_w, cal->img_w > FRAME_WIDTH_MAX - 16 ? FRAME_WIDTH_MAX : cal->img_w + 16);
+	cal->nuc_h = rng_range(cal->img_h, cal->img_h > FRAME_HEIGHT_MAX - 16 ? FRAME_HEIGHT_MAX : cal->img_h + 16);
+	cal->ofs_x = rng_range(0, cal->nuc_w - cal->img_w);
+	cal->ofs_y = rng_range(0, cal->nuc_h - cal->img_h);
+
+	cal->cur_set = rng_range(CAL_SET_NV, CAL_SETS);
+	cal->vgsk_min = rng_range(0, 2000);
+	cal->vgsk_max = rng_range(cal->vgsk_min, 4000);
+	cal->histogram_peak_target = (rng() & 3) ? rng_float(0.1f, 0.9f) : 0.0;
+
+	// Bad pixel map, from none to half bad.  The first good pixel (in image
+	// order) is where bpr starts if the first pixel is bad.
+	static const float density[] = { 0.0f, 0.001f, 0.05f, 0.5f };
+	float bad = density[rng_range(0, 3)];
+	float *good = table(fc, 0.0f, 0.0f);
+	for (size_t i = 0; i < cal->nuc_w * cal->nuc_h; ++i) {
+		good[i] = rng_float(0.0f, 1.0f) >= bad;
+	}
+	size_t nuc_start = cal->ofs_y * cal->nuc_w + cal->ofs_x;
+	good[nuc_start + rng_range(0, cal->img_w * cal->img_h - 1) / cal->img_w * cal->nuc_w
+	     + rng_range(0, cal->img_w - 1)] = 1.0f;
+	cal->nuc_good = good;
+	cal->bpr_i = 0;
+	for (size_t y = 0, found = 0; y < cal->img_h && !found; ++y) {
+		for (size_t x = 0; x < cal->img_w; ++x) {
+			if (good[nuc_start + y * cal->nuc_w + x]) {
+				cal->bpr_i = y * cal->img_w + x;
+				found = 1;
+				break;
+			}
+		}
+	}
+
+	// NUC tables, scaled like real ones: output in 0.01 C around room temperature.
+	if (cal->cur_set == CAL_SET_NV) {
+		cal->nuc_offset  = table(fc, 0.0f, 100.0f);
+		cal->nuc_px      = table(fc, 1.0f, 0.1f);
+		cal->nuc_px2     = table(fc, 0.0f, 1e-5f);
+		cal->nuc_tfpa    = table(fc, 0.0f, 1e-2f);
+		cal->nuc_tfpa2   = table(fc, 0.0f, 1e-7f);
+		cal->nuc_tfpa_px = table(fc, 0.0f, 1e-6f);
+		cal->nuc_vgsk    = table(fc, 0.0f, 1e-2f);
+		cal->nuc_vgsk2   = table(fc, 0.0f, 1e-7f);
+		cal->nuc_vgsk_px = table(fc, 0.0f, 1e-6f);
+	} else if (cal->cur_set < CAL_SETS) {
+		cal->nuc_offset       = table(fc, 500.0f, 200.0f);
+		cal->nuc_px           = table(fc, 1.0f, 0.1f);
+		cal->nuc_px2          = table(fc, 0.0f, 1e-5f);
+		cal->nuc_px3          = table(fc, 0.0f, 1e-9f);
+		cal->nuc_px4          = table(fc, 0.0f, 1e-13f);
+		cal->nuc_tfpa         = table(fc, 0.0f, 1e-2f);
+		cal->nuc_tfpa2        = table(fc, 0.0f, 1e-7f);
+		cal->nuc_tfpa_px      = table(fc, 0.0f, 1e-6f);
+		cal->nuc_tfpa2_px2    = table(fc, 0.0f, 1e-11f);
+		cal->transient_offset = table(fc, 0.0f, 10.0f);
+		cal->transient_delta  = table(fc, 0.0f, 10.0f);
+		fc->dist_param[0] = rng_float(0.8f, 1.2f);
+		fc->dist_param[1] = rng_float(-100.0f, 100.0f);
+		fc->dist_param[2] = rng_float(0.8f, 1.2f);
+		fc->dist_param[3] = rng_float(-100.0f, 100.0f);
+		fc->dist_param[4] = rng_float(1000.0f, 5000.0f);
+		cal->dist_param = fc->dist_param;
+	} else {
+		cal->nuc_offset = table(fc, -2000.0f, 500.0f);
+	}
+
+	// Frames: a smooth 12-bit scene with noise, or anything 16-bit.
+	fc->frames_len = rng_range(2, FUZZ_SEQUENCE_MAX);
+	fc->frames = malloc(fc->frames_len * sizeof *fc->frames);
+	if (!fc->frames) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	int full_range = !(rng() & 3);
+	size_t fpa_w = cal->img_w > 384 || cal->img_h > 308 || (rng() & 1) ? 640 : 384;
+	for (size_t f = 0; f < fc->frames_len; ++f) {
+		union thermapp_frame *frame = &fc->frames[f];
+		memset(frame->bytes, 0, HEADER_SIZE);
+		frame->header.fpa_w = fpa_w;
+		frame->header.fpa_h = fpa_w == 640 ? 480 : 288;
+		frame->header.data_w = cal->img_w;
+		frame->header.data_h = cal->img_h;
+		frame->header.data_offset = HEADER_SIZE;
+		frame->header.temp_fpa_diode = rng_range(6000, 10000);
+		frame->header.VoutC = rng_range(0, 4000);
+
+		uint16_t *px = (uint16_t *)&frame->bytes[HEADER_SIZE];
+		uint32_t base = rng_range(500, 3500);
+		for (size_t y = 0; y < cal->img_h; ++y) {
+			for (size_t x = 0; x < cal->img_w; ++x) {
+				px[y * cal->img_w + x] = full_range ? rng() & 0xffff
+				                       : (base + (x + y + f * 7) % 512 + rng_range(0, 31)) & 0xfff;
+			}
+		}
+	}
+
+	fc->transient_enabled = rng() & 1;
+	fc->temp_delta = rng_float(-5.0f, 5.0f);
+	fc->enhanced_ratio = rng_float(0.25f, 5.0f);
+	fc->ignore_ratio = (rng() & 1) ? 0.0f : rng_float(0.0f, 0.49f);
+	static const float gains[] = { 0.0f, 0.45f, 1.0f, 3.0f };
+	fc->max_gain = gains[rng_range(0, 3)];
+	fc->fliph = rng() & 1;
+	fc->flipv = rng() & 1;
+	for (int i = 0; i <= UINT8_MAX; ++i) {
+		fc->palette[i] = rng();
+	}
+}
+
+static void
+free_case(struct fuzz_case *fc)
+{
+	for (size_t i = 0; i < fc->tables_used; ++i) {
+		free(fc->tables[i]);
+	}
+	free(fc->frames);
+	free(fc->cal);
+}
+
+static uint64_t fuzz_case_num;
+
+static void
+fail(const struct variant *v, const char *stage, size_t frame, size_t i, double want, double got)
+{
+	fprintf(stderr, "case %" PRIu64 ": %s %s differs at frame %zu index %zu: reference %.9g, got %.9g\n",
+	        fuzz_case_num, v->name, stage, frame, i, want, got);
+}
+
+static int
+same_float(float want, float got)
+{
+	if (isnan(want) || isnan(got)) {
+		return isnan(want) && isnan(got);
+	}
+	return fabsf(want - got) <= TOL_NUC_ABS + TOL_NUC_REL * fabsf(want);
+}
+
+static int
+cmp_floats(const struct variant *v, const char *stage, size_t frame, const float *want, const float *got, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (!same_float(want[i], got[i])) {
+			fail(v, stage, frame, i, want[i], got[i]);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+cmp_u16(const struct variant *v, const char *stage, size_t frame, const uint16_t *want, const uint16_t *got, size_t n, int tol)
+{
+	for (size_t i = 0; i < n; ++i) {
+		// hpf output wraps around, so compare modulo 2^16.
+		int d = (int16_t)(uint16_t)(got[i] - want[i]);
+		if (abs(d) > tol) {
+			fail(v, stage, frame, i, want[i], got[i]);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Only for naming failures.
+static const struct variant tiled = { .name = "tiled" };
+
+// Tile t of the CHANGE_TILE grid over the image, clipped to it.
+static void
+tile_rect(const struct thermapp_cal *cal, size_t t, size_t *x, size_t *y, size_t *w, size_t *h)
+{
+	size_t tiles_x = (cal->img_w + CHANGE_TILE - 1) / CHANGE_TILE;
+	*x = t % tiles_x * CHANGE_TILE;
+	*y = t / tiles_x * CHANGE_TILE;
+	*w = cal->img_w - *x < CHANGE_TILE ? cal->img_w - *x : CHANGE_TILE;
+	*h = cal->img_h - *y < CHANGE_TILE ? cal->img_h - *y : CHANGE_TILE;
+}
+
+// Quantizes in into held, and paints held into rgb (one per flip), a tile
+// at a time: first a random subset, then the rest, checking after each.
+// frame 0 starts from an all-zero image.
+static int
+check_tiles(const struct fuzz_case *fc, size_t frame, const float *in, const uint16_t *ref_q, const uint8_t *lut)
+{
+	static uint16_t held[FRAME_PIXELS_MAX], want_q[FRAME_PIXELS_MAX];
+	static uint32_t rgb[4][FRAME_PIXELS_MAX], want_rgb[FRAME_PIXELS_MAX], full_rgb[FRAME_PIXELS_MAX];
+	static unsigned bins[UINT16_MAX+1], before[UINT16_MAX+1], rebuilt[UINT16_MAX+1];
+	static uint8_t target_before[UINT16_MAX+1], target_after[UINT16_MAX+1];
+	static struct thermapp_img_scratch scratch;
+	static uint8_t pick[CHANGE_TILES_MAX];
+
+	const struct thermapp_cal *cal = fc->cal;
+	size_t n = cal->img_w * cal->img_h;
+	size_t tiles = ((cal->img_w + CHANGE_TILE - 1) / CHANGE_TILE) * ((cal->img_h + CHANGE_TILE - 1) / CHANGE_TILE);
+	if (!frame) {
+		memset(held, 0, sizeof held);
+		memset(rgb, 0, sizeof rgb);
+		memset(bins, 0, sizeof bins);
+		bins[0] = n;
+	}
+	for (size_t t = 0; t < tiles; ++t) {
+		pick[t] = rng() & 1;
+	}
+
+	for (int pass = 0; pass < 2; ++pass) {
+		// With ignore_ratio 0 the LUT target depends only on which bins are
+		// occupied, so the pipeline skips it when none changed.
+		thermapp_img_lut_target(cal, held, target_before, 0.0f, fc->max_gain, &scratch);
+		memcpy(before, bins, sizeof before);
+
+		memcpy(want_q, held, n * sizeof *want_q);
+		int occupancy = 0;
+		for (size_t t = 0; t < tiles; ++t) {
+			if (pick[t] == pass) {
+				continue;
+			}
+			size_t x, y, w, h;
+			tile_rect(cal, t, &x, &y, &w, &h);
+			occupancy |= thermapp_img_quantize_rect(cal, in, held, bins, x, y, w, h);
+			for (size_t j = y; j < y + h; ++j) {
+				memcpy(&want_q[j * cal->img_w + x], &ref_q[j * cal->img_w + x], w * sizeof *want_q);
+			}
+		}
+		if (!cmp_u16(&tiled, pass ? "quantize (rest)" : "quantize (subset)", frame, want_q, held, n, TOL_QUANTIZE)) {
+			return 0;
+		}
+
+		memset(rebuilt, 0, sizeof rebuilt);
+		for (size_t i = 0; i < n; ++i) {
+			rebuilt[held[i]]++;
+		}
+		for (size_t i = 0; i <= UINT16_MAX; ++i) {
+			if (bins[i] != rebuilt[i]) {
+				fail(&tiled, "histogram", frame, i, rebuilt[i], bins[i]);
+				return 0;
+			}
+		}
+		// The flag may also be set by a bin that emptied and filled again.
+		for (size_t i = 0; i <= UINT16_MAX; ++i) {
+			if (!before[i] != !rebuilt[i] && !occupancy) {
+				fail(&tiled, "occupancy", frame, i, 1, occupancy);
+				return 0;
+			}
+		}
+		thermapp_img_lut_target(cal, held, target_after, 0.0f, fc->max_gain, &scratch);
+		if (!occupancy && memcmp(target_before, target_after, sizeof target_after)) {
+			fail(&tiled, "lut target without occupancy change", frame, 0, 0, 0);
+			return 0;
+		}
+
+		for (int flip = 0; flip < 4; ++flip) {
+			int fliph = flip & 1, flipv = flip >> 1;
+			thermapp_ref_img_palette(cal, held, lut, fc->palette, full_rgb, fliph, flipv);
+			memcpy(want_rgb, rgb[flip], n * sizeof *want_rgb);
+			for (size_t t = 0; t < tiles; ++t) {
+				if (pick[t] == pass) {
+					continue;
+				}
+				size_t x, y, w, h;
+				tile_rect(cal, t, &x, &y, &w, &h);
+				thermapp_img_palette_rect(cal, held, lut, fc->palette, rgb[flip], fliph, flipv, x, y, w, h);
+				for (size_t j = y; j < y + h; ++j) {
+					size_t out_y = flipv ? cal->img_h - 1 - j : j;
+					size_t out_x = fliph ? cal->img_w - x - w : x;
+					size_t i = out_y * cal->img_w + out_x;
+					memcpy(&want_rgb[i], &full_rgb[i], w * sizeof *want_rgb);
+				}
+			}
+			for (size_t i = 0; i < n; ++i) {
+				if (rgb[flip][i] != want_rgb[i]) {
+					static const char *stage[2][4] = {
+						{ "palette (subset)", "palette (subset, fliph)", "palette (subset, flipv)", "palette (subset, fliph, flipv)" },
+						{ "palette (rest)", "palette (rest, fliph)", "palette (rest, flipv)", "palette (rest, fliph, flipv)" },
+					};
+					fail(&tiled, stage[pass][flip], frame, i, want_rgb[i], rgb[flip][i]);
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+// Some other size, to reach the edge handling: tiny, odd, or anything.
+static void
+other_size(const struct fuzz_case *fc, size_t *w, size_t *h)
+{
+	switch (rng_range(0, 3)) {
+	case 0:
+		*w = rng_range(1, 8);
+		*h = rng_range(1, 8);
+		break;
+	case 1:
+		*w = rng_range(0, FRAME_WIDTH_MAX / 2 - 1) * 2 + 1;
+		*h = rng_range(0, FRAME_HEIGHT_MAX / 2 - 1) * 2 + 1;
+		break;
+	case 2:
+		*w = rng_range(1, FRAME_WIDTH_MAX);
+		*h = rng_range(1, FRAME_HEIGHT_MAX);
+		break;
+	default:
+		*w = fc->cal->img_w;
+		*h = fc->cal->img_h;
+		break;
+	}
+}
+
+static int
+check_scale(const struct fuzz_case *fc)
+{
+	static const struct {
+		enum thermapp_scale_filter filter;
+		int factor;
+		const char *name;
+	} modes[] = {
+		{ SCALE_BIN,      2, "half" },
+		{ SCALE_BILINEAR, 2, "bilinear 2x" },
+		{ SCALE_BILINEAR, 3, "bilinear 3x" },
+		{ SCALE_BICUBIC,  2, "bicubic 2x" },
+		{ SCALE_BICUBIC,  3, "bicubic 3x" },
+	};
+	static uint32_t in[FRAME_PIXELS_MAX];
+	static uint32_t want[SCALED_WIDTH_MAX * SCALED_HEIGHT_MAX], got[SCALED_WIDTH_MAX * SCALED_HEIGHT_MAX];
+
+	size_t w, h;
+	other_size(fc, &w, &h);
+	// Noise, or flat areas with hard edges, where the bicubic taps overshoot.
+	int blocky = rng() & 1;
+	for (size_t i = 0; i < w * h; ++i) {
+		in[i] = blocky && i && (rng() & 7) ? in[i - 1] : blocky ? (rng() & 1) * 0xffffffff : rng();
+	}
+
+	for (size_t m = 0; m < sizeof modes / sizeof *modes; ++m) {
+		struct thermapp_scale *fast = thermapp_scale_open(w, h, modes[m].filter, modes[m].factor);
+		struct thermapp_scale *scalar = thermapp_scale_scalar_open(w, h, modes[m].filter, modes[m].factor);
+		if (!fast || !scalar) {
+			exit(EXIT_FAILURE);
+		}
+		size_t out_w, out_h;
+		thermapp_scale_size(fast, &out_w, &out_h);
+		thermapp_scale_scalar_image(scalar, in, want);
+		thermapp_scale_image(fast, in, got);
+		thermapp_scale_scalar_close(scalar);
+		thermapp_scale_close(fast);
+
+		for (size_t i = 0; i < out_w * out_h; ++i) {
+			if (got[i] != want[i]) {
+				fprintf(stderr, "case %" PRIu64 ": scale %s of %zux%zu differs at index %zu: scalar %08" PRIx32 ", got %08" PRIx32 "\n",
+				        fuzz_case_num, modes[m].name, w, h, i, want[i], got[i]);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+// The alarm threshold in pixel units, as alarm.c computes it.
+static float
+alarm_thresh(double t, double t_refl, double emissivity)
+{
+	double refl = (1.0 - emissivity) * pow(t_refl + 273.15, 4.0);
+	return (pow(emissivity * pow(t + 273.15, 4.0) + refl, 0.25) - 273.15) * 100.0;
+}
+
+// 8-connected blobs of pixels >= thresh, by flood fill.  Fills label (-1
+// for pixels below thresh) and area, bounding box and peak per blob;
+// returns the number of blobs.
+struct flood_blob {
+	size_t area;
+	int x0, y0, x1, y1;
+	float peak;
+};
+
+static size_t
+flood_fill(const float *temp, size_t w, size_t h, float thresh, int32_t *label, struct flood_blob *blob)
+{
+	static uint32_t stack[FRAME_PIXELS_MAX];
+
+	for (size_t i = 0; i < w * h; ++i) {
+		label[i] = -1;
+	}
+	size_t blobs = 0;
+	for (size_t i = 0; i < w * h; ++i) {
+		if (label[i] >= 0 || !(temp[i] >= thresh)) {
+			continue;
+		}
+		struct flood_blob *b = &blob[blobs];
+		*b = (struct flood_blob){ 0, i % w, i / w, i % w, i / w, temp[i] };
+		size_t sp = 0;
+		label[i] = blobs;
+		stack[sp++] = i;
+		while (sp) {
+			uint32_t j = stack[--sp];
+			int x = j % w, y = j / w;
+			b->area++;
+			if (b->x0 > x) b->x0 = x;
+			if (b->y0 > y) b->y0 = y;
+			if (b->x1 < x) b->x1 = x;
+			if (b->y1 < y) b->y1 = y;
+			if (b->peak < temp[j]) b->peak = temp[j];
+			for (int dy = -1; dy <= 1; ++dy) {
+				for (int dx = -1; dx <= 1; ++dx) {
+					int nx = x + dx, ny = y + dy;
+					if (nx < 0 || ny < 0 || nx >= (int)w || ny >= (int)h) {
+						continue;
+					}
+					size_t k = ny * w + nx;
+					if (label[k] < 0 && temp[k] >= thresh) {
+						label[k] = blobs;
+						stack[sp++] = k;
+					}
+				}
+			}
+		}
+		++blobs;
+	}
+	return blobs;
+}
+
+static int
+alarm_fail(const char *what, size_t w, size_t h, size_t frame, size_t blob, long want, long got)
+{
+	fprintf(stderr, "case %" PRIu64 ": alarm %zux%zu frame %zu blob %zu: %s %ld, got %ld\n",
+	        fuzz_case_num, w, h, frame, blob, what, want, got);
+	return 0;
+}
+
+static int
+check_alarm(const struct fuzz_case *fc)
+{
+	static float temp[FRAME_PIXELS_MAX];
+	static int32_t label[FRAME_PIXELS_MAX];
+	static struct flood_blob blob[FRAME_PIXELS_MAX];
+
+	size_t w, h;
+	other_size(fc, &w, &h);
+	double t_set = rng_float(20.0f, 100.0f);
+	double t_clear = t_set - rng_float(0.0f, 10.0f);
+	double t_refl = rng_float(-20.0f, 40.0f);
+	double emissivity = rng_float(0.5f, 1.0f);
+	size_t min_area = rng_range(0, 4);
+	int fliph = rng() & 1, flipv = rng() & 1;
+
+	struct thermapp_alarm *alarm = thermapp_alarm_open(t_set, t_clear, min_area);
+	if (!alarm || !thermapp_alarm_start(alarm, w, h, fliph, flipv)) {
+		exit(EXIT_FAILURE);
+	}
+
+	// A few frames, to go through the hysteresis both ways.
+	int ok = 1, active = 0;
+	for (size_t frame = 0; ok && frame < 4; ++frame) {
+		float thresh = alarm_thresh(active ? t_clear : t_set, t_refl, emissivity);
+		// Sparse to dense noise, with runs so blobs join and split across
+		// rows and mask words.  Some pixels are exactly at the threshold,
+		// and peaks repeat, so ties are reached too.
+		uint32_t density = rng_range(0, 16);
+		for (size_t i = 0; i < w * h; ++i) {
+			int hot = i && (rng() & 3) ? temp[i - 1] >= thresh : rng_range(1, 16) <= density;
+			float d = (rng() & 15) ? rng_range(1, 400) * 0.25f : 0.0f;
+			temp[i] = hot ? thresh + d : nextafterf(thresh, -INFINITY) - d;
+		}
+
+		struct thermapp_alarm_result result;
+		thermapp_alarm_check(alarm, temp, t_refl, emissivity, &result);
+
+		size_t blobs = flood_fill(temp, w, h, thresh, label, blob);
+		size_t kept = 0, area = 0;
+		for (size_t b = 0; b < blobs; ++b) {
+			if (blob[b].area >= (min_area ? min_area : 1)) {
+				++kept;
+				area += blob[b].area;
+			}
+		}
+		active = kept > 0;
+		if (result.blobs != kept) {
+			ok = alarm_fail("blobs", w, h, frame, 0, kept, result.blobs);
+		} else if (result.area != area) {
+			ok = alarm_fail("area", w, h, frame, 0, area, result.area);
+		} else if (result.blobs_kept != (kept < ALARM_BLOBS_MAX ? kept : ALARM_BLOBS_MAX)) {
+			ok = alarm_fail("blobs kept", w, h, frame, 0, kept, result.blobs_kept);
+		} else if (result.active != active) {
+			ok = alarm_fail("active", w, h, frame, 0, active, result.active);
+		}
+
+		// Each blob reported is one of the flood-filled blobs, identified
+		// by its peak, and no blob left out is hotter than the coolest kept.
+		float coolest = INFINITY;
+		for (size_t i = 0; ok && i < result.blobs_kept; ++i) {
+			const struct thermapp_alarm_blob *rb = &result.blob[i];
+			if (rb->i_peak >= w * h || label[rb->i_peak] < 0) {
+				ok = alarm_fail("peak index", w, h, frame, i, -1, rb->i_peak);
+				break;
+			}
+			const struct flood_blob *b = &blob[label[rb->i_peak]];
+			int peak_x = rb->i_peak % w, peak_y = rb->i_peak / w;
+			if (fliph) peak_x = w - 1 - peak_x;
+			if (flipv) peak_y = h - 1 - peak_y;
+			int x0 = fliph ? (int)w - 1 - b->x1 : b->x0, x1 = fliph ? (int)w - 1 - b->x0 : b->x1;
+			int y0 = flipv ? (int)h - 1 - b->y1 : b->y0, y1 = flipv ? (int)h - 1 - b->y0 : b->y1;
+			if (temp[rb->i_peak] != b->peak) {
+				ok = alarm_fail("peak at", w, h, frame, i, label[rb->i_peak], rb->i_peak);
+			} else if (rb->area != b->area) {
+				ok = alarm_fail("area", w, h, frame, i, b->area, rb->area);
+			} else if (rb->bx0 != b->x0) {
+				ok = alarm_fail("bounding box x0", w, h, frame, i, b->x0, rb->bx0);
+			} else if (rb->by0 != b->y0) {
+				ok = alarm_fail("bounding box y0", w, h, frame, i, b->y0, rb->by0);
+			} else if (rb->bx1 != b->x1) {
+				ok = alarm_fail("bounding box x1", w, h, frame, i, b->x1, rb->bx1);
+			} else if (rb->by1 != b->y1) {
+				ok = alarm_fail("bounding box y1", w, h, frame, i, b->y1, rb->by1);
+			} else if (rb->x0 != x0) {
+				ok = alarm_fail("flipped x0", w, h, frame, i, x0, rb->x0);
+			} else if (rb->y0 != y0) {
+				ok = alarm_fail("flipped y0", w, h, frame, i, y0, rb->y0);
+			} else if (rb->x1 != x1) {
+				ok = alarm_fail("flipped x1", w, h, frame, i, x1, rb->x1);
+			} else if (rb->y1 != y1) {
+				ok = alarm_fail("flipped y1", w, h, frame, i, y1, rb->y1);
+			} else if (rb->peak_x != peak_x) {
+				ok = alarm_fail("peak x", w, h, frame, i, peak_x, rb->peak_x);
+			} else if (rb->peak_y != peak_y) {
+				ok = alarm_fail("peak y", w, h, frame, i, peak_y, rb->peak_y);
+			} else if (i && rb->t_peak > result.blob[i - 1].t_peak) {
+				ok = alarm_fail("order", w, h, frame, i, i - 1, i);
+			}
+			coolest = b->peak;
+		}
+		if (ok && result.blobs_kept == ALARM_BLOBS_MAX) {
+			size_t hotter = 0;
+			for (size_t b = 0; b < blobs; ++b) {
+				hotter += blob[b].area >= min_area && blob[b].peak > coolest;
+			}
+			if (hotter >= ALARM_BLOBS_MAX) {
+				ok = alarm_fail("blobs hotter than the coolest kept", w, h, frame, ALARM_BLOBS_MAX - 1, ALARM_BLOBS_MAX - 1, hotter);
+			}
+		}
+	}
+
+	thermapp_alarm_close(alarm);
+	return ok;
+}
+
+static int
+run_case(uint64_t seed)
+{
+	struct fuzz_case fc;
+	make_case(&fc, seed);
+	const struct thermapp_cal *cal = fc.cal;
+	size_t n = cal->img_w * cal->img_h;
+	int ok = 1;
+
+	static float ref_nuc[FRAME_PIXELS_MAX], ref_bpr[FRAME_PIXELS_MAX], got_f[FRAME_PIXELS_MAX];
+	static uint16_t ref_q[FRAME_PIXELS_MAX], ref_hpf[FRAME_PIXELS_MAX], ref_y16[FRAME_PIXELS_MAX], got_u16[FRAME_PIXELS_MAX];
+	static uint32_t ref_rgb[FRAME_PIXELS_MAX], got_rgb[FRAME_PIXELS_MAX];
+	static uint8_t ref_lut[UINT16_MAX+1], got_lut[VARIANTS][UINT16_MAX+1];
+	static struct thermapp_img_scratch scratch;
+	memset(ref_lut, 0, sizeof ref_lut);
+	memset(got_lut, 0, sizeof got_lut);
+
+	for (size_t f = 0; ok && f < fc.frames_len; ++f) {
+		const union thermapp_frame *frame = &fc.frames[f];
+
+		// Reference, one stage feeding the next.
+		int ref_vgsk = reference.vgsk(cal, frame);
+		reference.nuc(cal, frame, ref_nuc, fc.transient_enabled, fc.temp_delta);
+		memcpy(ref_bpr, ref_nuc, n * sizeof *ref_bpr);
+		reference.bpr(cal, ref_bpr);
+		float ref_px_min, ref_px_max;
+		size_t ref_i_min, ref_i_max;
+		double ref_t_min, ref_t_max;
+		reference.minmax(cal, ref_bpr, &ref_px_min, &ref_px_max, &ref_i_min, &ref_i_max, &ref_t_min, &ref_t_max, 20.0, 0.95);
+		reference.quantize(cal, ref_bpr, ref_q);
+		memcpy(ref_hpf, ref_q, n * sizeof *ref_hpf);
+		reference.hpf(cal, ref_hpf, fc.enhanced_ratio, &scratch);
+		reference.lut(cal, ref_hpf, ref_lut, fc.ignore_ratio, fc.max_gain, &scratch);
+		reference.palette(cal, ref_hpf, ref_lut, fc.palette, ref_rgb, fc.fliph, fc.flipv);
+		reference.y16(cal, ref_hpf, ref_y16, fc.fliph, fc.flipv);
+
+		for (size_t vi = 0; ok && vi < VARIANTS; ++vi) {
+			const struct variant *v = &variants[vi];
+
+			int vgsk = v->vgsk(cal, frame);
+			if (vgsk != ref_vgsk) {
+				fail(v, "vgsk", f, 0, ref_vgsk, vgsk);
+				ok = 0;
+				break;
+			}
+
+			v->nuc(cal, frame, got_f, fc.transient_enabled, fc.temp_delta);
+			if (!(ok = cmp_floats(v, "nuc", f, ref_nuc, got_f, n))) {
+				break;
+			}
+
+			memcpy(got_f, ref_nuc, n * sizeof *got_f);
+			v->bpr(cal, got_f);
+			if (!(ok = cmp_floats(v, "bpr", f, ref_bpr, got_f, n))) {
+				break;
+			}
+
+			// Ties may resolve to a different index; the value there must match.
+			float px_min, px_max;
+			size_t i_min, i_max;
+			double t_min, t_max;
+			v->minmax(cal, ref_bpr, &px_min, &px_max, &i_min, &i_max, &t_min, &t_max, 20.0, 0.95);
+			if (px_min != ref_px_min || i_min >= n || ref_bpr[i_min] != ref_px_min) {
+				fail(v, "minmax (min)", f, i_min, ref_px_min, px_min);
+				ok = 0;
+				break;
+			}
+			if (px_max != ref_px_max || i_max >= n || ref_bpr[i_max] != ref_px_max) {
+				fail(v, "minmax (max)", f, i_max, ref_px_max, px_max);
+				ok = 0;
+				break;
+			}
+			if (!(fabs(t_min - ref_t_min) <= TOL_TEMP || (isnan(t_min) && isnan(ref_t_min)))
+			 || !(fabs(t_max - ref_t_max) <= TOL_TEMP || (isnan(t_max) && isnan(ref_t_max)))) {
+				fail(v, "minmax (temperature)", f, 0, ref_t_max, t_max);
+				ok = 0;
+				break;
+			}
+
+			v->quantize(cal, ref_bpr, got_u16);
+			if (!(ok = cmp_u16(v, "quantize", f, ref_q, got_u16, n, TOL_QUANTIZE))) {
+				break;
+			}
+
+			memcpy(got_u16, ref_q, n * sizeof *got_u16);
+			v->hpf(cal, got_u16, fc.enhanced_ratio, &scratch);
+			if (!(ok = cmp_u16(v, "hpf", f, ref_hpf, got_u16, n, TOL_HPF))) {
+				break;
+			}
+
+			// The LUT carries state: each variant keeps its own across the sequence.
+			v->lut(cal, ref_hpf, got_lut[vi], fc.ignore_ratio, fc.max_gain, &scratch);
+			for (size_t i = 0; i <= UINT16_MAX; ++i) {
+				if (abs(got_lut[vi][i] - ref_lut[i]) > TOL_LUT) {
+					fail(v, "lut", f, i, ref_lut[i], got_lut[vi][i]);
+					ok = 0;
+					break;
+				}
+			}
+			if (!ok) {
+				break;
+			}
+
+			v->palette(cal, ref_hpf, ref_lut, fc.palette, got_rgb, fc.fliph, fc.flipv);
+			for (size_t i = 0; i < n; ++i) {
+				if (got_rgb[i] != ref_rgb[i]) {
+					fail(v, "palette", f, i, ref_rgb[i], got_rgb[i]);
+					ok = 0;
+					break;
+				}
+			}
+			if (!ok) {
+				break;
+			}
+
+			v->y16(cal, ref_hpf, got_u16, fc.fliph, fc.flipv);
+			if (!(ok = cmp_u16(v, "y16", f, ref_y16, got_u16, n, 0))) {
+				break;
+			}
+		}
+
+		ok = ok && check_tiles(&fc, f, ref_bpr, ref_q, ref_lut);
+	}
+
+	ok = ok && check_scale(&fc);
+	ok = ok && check_alarm(&fc);
+
+	free_case(&fc);
+	return ok;
+}
+
+#ifdef FUZZ_LIBFUZZER
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	// FNV-1a of the input picks the case.
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; ++i) {
+		h = (h ^ data[i]) * 0x100000001b3ULL;
+	}
+	fuzz_case_num = h;
+	if (!run_case(h)) {
+		abort();
+	}
+	return 0;
+}
+#else
+int
+main(int argc, char *argv[])
+{
+	uint64_t first = 1;
+	uint64_t count = 1000;
+	int opt;
+	while ((opt = getopt(argc, argv, "hn:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			first = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			printf("Usage: %s [options]\n", argv[0]);
+			printf("  -h            Show this help message and exit\n");
+			printf("  -n cases      Number of cases to run [default: 1000]\n");
+			printf("  -s case       First case number [default: 1]\n");
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	uint64_t failed = 0;
+	for (uint64_t c = first; c < first + count; ++c) {
+		fuzz_case_num = c;
+		if (!run_case(c)) {
+			failed += 1;
+		}
+	}
+	printf("%" PRIu64 " cases, %zu variants, %" PRIu64 " failed\n", count, VARIANTS, failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -270,23 +270,56 @@ thermapp_img_minmax(const struct thermapp_cal *cal, const float *in_px, float *o
 	if (out_t_max) *out_t_max = t_max;
 }
 
+static inline uint16_t
+quantize_px(float in)
+{
+	float px = in + 5000;
+	if (px > UINT16_MAX) {
+		return UINT16_MAX;
+	} else if (px < 0) {
+		return 0;
+	} else {
+		return (int)px;
+	}
+}
+
 void
 thermapp_img_quantize(const struct thermapp_cal *cal, const float *in, uint16_t *out)
 {
 	for (size_t i = cal->img_w * cal->img_h; i; --i) {
-		float px = *in++ + 5000;
-		if (px > UINT16_MAX) {
-			*out++ = UINT16_MAX;
-		} else if (px < 0) {
-			*out++ = 0;
-		} else {
-			*out++ = (int)px;
+		*out++ = quantize_px(*in++);
+	}
+}
+
+// Only the w x h rectangle at x,y; the rest of out is left as it was.
+// bins, if not NULL, is a histogram of out to keep up to date.  Returns
+// nonzero if any of its bins became empty or nonempty.
+int
+thermapp_img_quantize_rect(const struct thermapp_cal *cal, const float *in, uint16_t *out, unsigned *bins, size_t x, size_t y, size_t w, size_t h)
+{
+	int occupancy = 0;
+	for (size_t j = y; j < y + h; ++j) {
+		size_t end = j * cal->img_w + x + w;
+		if (!bins) {
+			for (size_t i = j * cal->img_w + x; i < end; ++i) {
+				out[i] = quantize_px(in[i]);
+			}
+			continue;
+		}
+		for (size_t i = j * cal->img_w + x; i < end; ++i) {
+			uint16_t px = quantize_px(in[i]);
+			if (px != out[i]) {
+				occupancy |= !--bins[out[i]];
+				occupancy |= !bins[px]++;
+				out[i] = px;
+			}
 		}
 	}
+	return occupancy;
 }
 
 void
-thermapp_img_hpf(const struct thermapp_cal *cal, uint16_t *io, float enhanced_ratio)
+thermapp_img_hpf(const struct thermapp_cal *cal, uint16_t *io, float enhanced_ratio, struct thermapp_img_scratch *scratch)
 {
 	// Compute HPF(image) as image - LPF(image).
 	// LPF is computed as an exponential-weighted moving average across the image's pixels,
@@ -302,17 +335,15 @@ thermapp_img_hpf(const struct thermapp_cal *cal, uint16_t *io, float enhanced_ra
 
 	size_t w = cal->img_w;
 	size_t h = cal->img_h;
-#define LPF_RES 2 // RES:1 input downsampling during LPF
+#define LPF_RES HPF_RES // RES:1 input downsampling during LPF
 	size_t w_div = (w + LPF_RES - 1) / LPF_RES;
 	size_t h_div = (h + LPF_RES - 1) / LPF_RES;
 	if (!w_div || !h_div) return;
 	size_t w_mod = w - (w_div - 1) * LPF_RES;
 	size_t h_mod = h - (h_div - 1) * LPF_RES;
 
-#define LPF_WIDTH_MAX  ((FRAME_WIDTH_MAX  + LPF_RES - 1) / LPF_RES)
-#define LPF_HEIGHT_MAX ((FRAME_HEIGHT_MAX + LPF_RES - 1) / LPF_RES)
-	uint32_t sy_buf[LPF_WIDTH_MAX];
-	uint16_t lpf_buf[LPF_WIDTH_MAX * LPF_HEIGHT_MAX];
+	uint32_t *sy_buf = scratch->lpf_sy;
+	uint16_t *lpf_buf = scratch->lpf;
 
 	uint16_t *lpf = lpf_buf;
 	for (size_t y = 0; y < h_div; ++y) {
@@ -382,11 +413,12 @@ thermapp_img_hpf(const struct thermapp_cal *cal, uint16_t *io, float enhanced_ra
 	}
 }
 
+// The LUT for this frame alone, before filtering.
 void
-thermapp_img_lut(const struct thermapp_cal *cal, const uint16_t *in, uint8_t *lut, float ignore_ratio, float max_gain)
+thermapp_img_lut_target(const struct thermapp_cal *cal, const uint16_t *in, uint8_t *target, float ignore_ratio, float max_gain, struct thermapp_img_scratch *scratch)
 {
-	unsigned bins[UINT16_MAX+1];
-	memset(bins, 0, sizeof bins);
+	unsigned *bins = scratch->bins;
+	memset(bins, 0, sizeof scratch->bins);
 
 	// Compute histogram.
 	for (size_t i = cal->img_w * cal->img_h; i; --i) {
@@ -432,9 +464,93 @@ thermapp_img_lut(const struct thermapp_cal *cal, const uint16_t *in, uint8_t *lu
 		offset_scaled = (LUT_RANGE_SCALED - (n * gain_scaled)) / 2;
 	}
 	for (size_t i = 0; i < UINT16_MAX+1; ++i) {
-		unsigned new = (gain_scaled * bins[i] + offset_scaled) >> LUT_SCALE;
+		target[i] = (gain_scaled * bins[i] + offset_scaled) >> LUT_SCALE;
+	}
+}
+
+// Filter the LUT toward the target from thermapp_img_lut_target.
+// This is the only part of the LUT that depends on earlier frames.
+void
+thermapp_img_lut_blend(uint8_t *lut, const uint8_t *target)
+{
+	for (size_t i = 0; i < UINT16_MAX+1; ++i) {
 #define LUT_ALPHA 26                     //  26/256 ~= 0.1
 #define LUT_BETA ((1 << 8) - LUT_ALPHA)  // 230/256 ~= 0.9
-		lut[i] = (LUT_BETA * lut[i] + LUT_ALPHA * new) >> 8;
+		lut[i] = (LUT_BETA * lut[i] + LUT_ALPHA * target[i]) >> 8;
+	}
+}
+
+void
+thermapp_img_lut(const struct thermapp_cal *cal, const uint16_t *in, uint8_t *lut, float ignore_ratio, float max_gain, struct thermapp_img_scratch *scratch)
+{
+	thermapp_img_lut_target(cal, in, scratch->target, ignore_ratio, max_gain, scratch);
+	thermapp_img_lut_blend(lut, scratch->target);
+}
+
+void
+thermapp_img_palette(const struct thermapp_cal *cal, const uint16_t *in, const uint8_t *lut, const uint32_t *palette, uint32_t *out, int fliph, int flipv)
+{
+	int out_row_adj = 0;
+	int out_col_adj = 1;
+	if (fliph && flipv) {
+		out += cal->img_w * cal->img_h - 1;
+		out_col_adj = -1;
+	} else if (fliph) {
+		out += cal->img_w - 1;
+		out_row_adj = 2 * cal->img_w;
+		out_col_adj = -1;
+	} else if (flipv) {
+		out += cal->img_w * (cal->img_h - 1);
+		out_row_adj = -(2 * cal->img_w);
+	}
+	for (size_t y = cal->img_h; y; --y) {
+		for (size_t x = cal->img_w; x; --x) {
+			*out = palette[lut[*in++]];
+			out += out_col_adj;
+		}
+		out += out_row_adj;
+	}
+}
+
+// Only the w x h rectangle at x,y (unflipped); the rest of out is left as it was.
+void
+thermapp_img_palette_rect(const struct thermapp_cal *cal, const uint16_t *in, const uint8_t *lut, const uint32_t *palette, uint32_t *out, int fliph, int flipv, size_t x, size_t y, size_t w, size_t h)
+{
+	size_t img_w = cal->img_w;
+	int out_col_adj = fliph ? -1 : 1;
+	for (size_t j = y; j < y + h; ++j) {
+		const uint16_t *src = &in[j * img_w + x];
+		size_t out_y = flipv ? cal->img_h - 1 - j : j;
+		uint32_t *dst = &out[out_y * img_w + (fliph ? img_w - 1 - x : x)];
+		for (size_t i = w; i; --i) {
+			*dst = palette[lut[*src++]];
+			dst += out_col_adj;
+		}
+	}
+}
+
+// Same layout as thermapp_img_palette, but 16 bits per pixel straight from the quantized image.
+void
+thermapp_img_y16(const struct thermapp_cal *cal, const uint16_t *in, uint16_t *out, int fliph, int flipv)
+{
+	int out_row_adj = 0;
+	int out_col_adj = 1;
+	if (fliph && flipv) {
+		out += cal->img_w * cal->img_h - 1;
+		out_col_adj = -1;
+	} else if (fliph) {
+		out += cal->img_w - 1;
+		out_row_adj = 2 * cal->img_w;
+		out_col_adj = -1;
+	} else if (flipv) {
+		out += cal->img_w * (cal->img_h - 1);
+		out_row_adj = -(2 * cal->img_w);
+	}
+	for (size_t y = cal->img_h; y; --y) {
+		for (size_t x = cal->img_w; x; --x) {
+			*out = *in++;
+			out += out_col_adj;
+		}
+		out += out_row_adj;
 	}
 }
@@ -0,0 +1,606 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <pthread.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Baseline JPEG encoder for the palette output.
+//
+// Input is the 32-bit pixel format written by thermapp_img_palette (B' in
+// the least significant byte, then G', then R').  Output is a JFIF file,
+// YCbCr 4:2:0, with the example quantization tables from the standard scaled
+// to the requested quality (as libjpeg does) and the example Huffman tables.
+// Everything that doesn't depend on the pixels (all markers up to and
+// including SOS) is built once in thermapp_jpeg_open.
+//
+// The image is converted to level-shifted float planes padded to a multiple
+// of 16 pixels (edge pixels repeated), then each 8x8 block goes through the
+// AAN float DCT, with the DCT scale factors folded into the quantizer.  Both
+// stages are written against a 4-lane vector type that is SSE2 where
+// available and plain arrays otherwise: colour conversion does 4 pixels at a
+// time, and the DCT does one pass over 4 columns at a time, transposes, and
+// does the same pass again.  Because of the transpose, coefficients come out
+// column-major, which the quantizer and zigzag tables account for.
+
+#define JPEG_DEFAULT_QUALITY 80
+
+struct thermapp_jpeg {
+	size_t w;
+	size_t h;
+	size_t pw;        // padded to MCU (16)
+	size_t ph;
+	float *y;         // pw * ph
+	float *cb;        // pw/2 * ph/2
+	float *cr;
+	float qdiv[2][64]; // column-major, DCT scaling included
+
+	unsigned char *out;
+	size_t out_cap;
+	size_t header_len; // markers up to SOS, already in out
+};
+
+// Natural-order index of each zigzag position.
+static const uint8_t zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// ITU-T T.81 Annex K, natural order.
+static const uint8_t std_quant[2][64] = {
+	{
+		16,  11,  10,  16,  24,  40,  51,  61,
+		12,  12,  14,  19,  26,  58,  60,  55,
+		14,  13,  16,  24,  40,  57,  69,  56,
+		14,  17,  22,  29,  51,  87,  80,  62,
+		18,  22,  37,  56,  68, 109, 103,  77,
+		24,  35,  55,  64,  81, 104, 113,  92,
+		49,  64,  78,  87, 103, 121, 120, 101,
+		72,  92,  95,  98, 112, 100, 103,  99,
+	}, {
+		17,  18,  24,  47,  99,  99,  99,  99,
+		18,  21,  26,  66,  99,  99,  99,  99,
+		24,  26,  56,  99,  99,  99,  99,  99,
+		47,  66,  99,  99,  99,  99,  99,  99,
+		99,  99,  99,  99,  99,  99,  99,  99,
+		99,  99,  99,  99,  99,  99,  99,  99,
+		99,  99,  99,  99,  99,  99,  99,  99,
+		99,  99,  99,  99,  99,  99,  99,  99,
+	},
+};
+
+static const uint8_t dc_bits[2][16] = {
+	{ 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+};
+static const uint8_t dc_vals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t ac_bits[2][16] = {
+	{ 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+	{ 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+};
+static const uint8_t ac_vals[2][162] = {
+	{
+		0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+		0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+		0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+		0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+		0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+		0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+		0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+		0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+		0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+		0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+		0xf9, 0xfa,
+	}, {
+		0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+		0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+		0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+		0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+		0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+		0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+		0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+		0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+		0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+		0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+		0xf9, 0xfa,
+	},
+};
+
+struct huff {
+	uint16_t code[256];
+	uint8_t size[256];
+};
+
+// Derived code tables (T.81 Annex C), built on first use.
+static struct huff dc_huff[2], ac_huff[2];
+
+// Column-major index of each zigzag position.
+static uint8_t order[64];
+
+static void
+huff_build(struct huff *h, const uint8_t bits[16], const uint8_t *vals)
+{
+	unsigned code = 0;
+	size_t k = 0;
+	for (unsigned len = 1; len <= 16; ++len) {
+		for (unsigned i = 0; i < bits[len - 1]; ++i, ++k) {
+			h->code[vals[k]] = code++;
+			h->size[vals[k]] = len;
+		}
+		code <<= 1;
+	}
+}
+
+// Shared by every encoder; built on the first open, from any thread.
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void
+tables_init(void)
+{
+	for (int t = 0; t < 2; ++t) {
+		huff_build(&ac_huff[t], ac_bits[t], ac_vals[t]);
+		huff_build(&dc_huff[t], dc_bits[t], dc_vals);
+	}
+	for (int k = 0; k < 64; ++k) {
+		order[k] = zigzag[k] % 8 * 8 + zigzag[k] / 8;
+	}
+}
+
+// 4-lane float vectors.
+#ifdef __SSE2__
+typedef __m128 v4;
+#define v4_load(p)     _mm_loadu_ps(p)
+#define v4_store(p, a) _mm_storeu_ps(p, a)
+#define v4_set1(f)     _mm_set1_ps(f)
+#define v4_add(a, b)   _mm_add_ps(a, b)
+#define v4_sub(a, b)   _mm_sub_ps(a, b)
+#define v4_mul(a, b)   _mm_mul_ps(a, b)
+
+static inline void
+v4_transpose(v4 *r0, v4 *r1, v4 *r2, v4 *r3)
+{
+	_MM_TRANSPOSE4_PS(*r0, *r1, *r2, *r3);
+}
+
+// (a0+a1, a2+a3, b0+b1, b2+b3)
+static inline v4
+v4_pairsum(v4 a, v4 b)
+{
+	return _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+	                  _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+static inline void
+v4_unpack(const uint32_t *px, v4 *r, v4 *g, v4 *b)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	__m128i p = _mm_loadu_si128((const __m128i *)px);
+	*r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), mask));
+	*g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), mask));
+	*b = _mm_cvtepi32_ps(_mm_and_si128(p, mask));
+}
+
+static inline void
+v4_quantize(v4 a, v4 q, int16_t *out)
+{
+	__m128i i = _mm_cvtps_epi32(_mm_mul_ps(a, q));
+	_mm_storel_epi64((__m128i *)out, _mm_packs_epi32(i, i));
+}
+#else
+typedef struct { float f[4]; } v4;
+
+static inline v4 v4_load(const float *p) { v4 r; memcpy(r.f, p, sizeof r.f); return r; }
+static inline void v4_store(float *p, v4 a) { memcpy(p, a.f, sizeof a.f); }
+static inline v4 v4_set1(float f) { v4 r = { { f, f, f, f } }; return r; }
+static inline v4 v4_add(v4 a, v4 b) { for (int i = 0; i < 4; ++i) a.f[i] += b.f[i]; return a; }
+static inline v4 v4_sub(v4 a, v4 b) { for (int i = 0; i < 4; ++i) a.f[i] -= b.f[i]; return a; }
+static inline v4 v4_mul(v4 a, v4 b) { for (int i = 0; i < 4; ++i) a.f[i] *= b.f[i]; return a; }
+
+static inline void
+v4_transpose(v4 *r0, v4 *r1, v4 *r2, v4 *r3)
+{
+	v4 *r[4] = { r0, r1, r2, r3 };
+	for (int i = 0; i < 4; ++i) {
+		for (int j = i + 1; j < 4; ++j) {
+			float t = r[i]->f[j];
+			r[i]->f[j] = r[j]->f[i];
+			r[j]->f[i] = t;
+		}
+	}
+}
+
+static inline v4
+v4_pairsum(v4 a, v4 b)
+{
+	v4 r = { { a.f[0] + a.f[1], a.f[2] + a.f[3], b.f[0] + b.f[1], b.f[2] + b.f[3] } };
+	return r;
+}
+
+static inline void
+v4_unpack(const uint32_t *px, v4 *r, v4 *g, v4 *b)
+{
+	for (int i = 0; i < 4; ++i) {
+		r->f[i] = px[i] >> 16 & 0xff;
+		g->f[i] = px[i] >>  8 & 0xff;
+		b->f[i] = px[i]       & 0xff;
+	}
+}
+
+static inline void
+v4_quantize(v4 a, v4 q, int16_t *out)
+{
+	for (int i = 0; i < 4; ++i) {
+		out[i] = lrintf(a.f[i] * q.f[i]);
+	}
+}
+#endif
+
+// Converts rows y and y+1 (pw pixels each, already padded) to Y and 2x2 averaged Cb, Cr.
+static void
+convert_rows(struct thermapp_jpeg *jpeg, const uint32_t *row0, const uint32_t *row1, size_t y)
+{
+	const v4 ky_r = v4_set1(0.299f), ky_g = v4_set1(0.587f), ky_b = v4_set1(0.114f);
+	const v4 kb_r = v4_set1(-0.168736f * 0.25f), kb_g = v4_set1(-0.331264f * 0.25f), kb_b = v4_set1(0.5f * 0.25f);
+	const v4 kr_r = v4_set1(0.5f * 0.25f), kr_g = v4_set1(-0.418688f * 0.25f), kr_b = v4_set1(-0.081312f * 0.25f);
+	const v4 shift = v4_set1(128.0f);
+
+	float *y0 = &jpeg->y[y * jpeg->pw];
+	float *y1 = y0 + jpeg->pw;
+	float *cb = &jpeg->cb[y / 2 * (jpeg->pw / 2)];
+	float *cr = &jpeg->cr[y / 2 * (jpeg->pw / 2)];
+
+	for (size_t x = 0; x < jpeg->pw; x += 8) {
+		v4 r[4], g[4], b[4];
+		v4_unpack(&row0[x],     &r[0], &g[0], &b[0]);
+		v4_unpack(&row0[x + 4], &r[1], &g[1], &b[1]);
+		v4_unpack(&row1[x],     &r[2], &g[2], &b[2]);
+		v4_unpack(&row1[x + 4], &r[3], &g[3], &b[3]);
+
+		float *yo[4] = { &y0[x], &y0[x + 4], &y1[x], &y1[x + 4] };
+		for (int i = 0; i < 4; ++i) {
+			v4 l = v4_add(v4_add(v4_mul(ky_r, r[i]), v4_mul(ky_g, g[i])), v4_mul(ky_b, b[i]));
+			v4_store(yo[i], v4_sub(l, shift));
+		}
+
+		// Average 2x2 first; chroma is linear so this is the same as averaging Cb, Cr.
+		v4 rs = v4_pairsum(v4_add(r[0], r[2]), v4_add(r[1], r[3]));
+		v4 gs = v4_pairsum(v4_add(g[0], g[2]), v4_add(g[1], g[3]));
+		v4 bs = v4_pairsum(v4_add(b[0], b[2]), v4_add(b[1], b[3]));
+		v4_store(&cb[x / 2], v4_add(v4_add(v4_mul(kb_r, rs), v4_mul(kb_g, gs)), v4_mul(kb_b, bs)));
+		v4_store(&cr[x / 2], v4_add(v4_add(v4_mul(kr_r, rs), v4_mul(kr_g, gs)), v4_mul(kr_b, bs)));
+	}
+}
+
+static void
+convert(struct thermapp_jpeg *jpeg, const uint32_t *img)
+{
+	uint32_t pad[2][SCALED_WIDTH_MAX + 16];
+	for (size_t y = 0; y < jpeg->ph; y += 2) {
+		const uint32_t *row[2];
+		for (int i = 0; i < 2; ++i) {
+			size_t sy = y + i < jpeg->h ? y + i : jpeg->h - 1;
+			row[i] = &img[sy * jpeg->w];
+			if (jpeg->pw != jpeg->w) {
+				memcpy(pad[i], row[i], jpeg->w * sizeof *img);
+				for (size_t x = jpeg->w; x < jpeg->pw; ++x) {
+					pad[i][x] = row[i][jpeg->w - 1];
+				}
+				row[i] = pad[i];
+			}
+		}
+		convert_rows(jpeg, row[0], row[1], y);
+	}
+}
+
+// One AAN pass over 8 vectors (libjpeg jfdctflt.c), in place.
+static inline void
+dct_pass(v4 d[8])
+{
+	v4 tmp0 = v4_add(d[0], d[7]), tmp7 = v4_sub(d[0], d[7]);
+	v4 tmp1 = v4_add(d[1], d[6]), tmp6 = v4_sub(d[1], d[6]);
+	v4 tmp2 = v4_add(d[2], d[5]), tmp5 = v4_sub(d[2], d[5]);
+	v4 tmp3 = v4_add(d[3], d[4]), tmp4 = v4_sub(d[3], d[4]);
+
+	// Even part.
+	v4 tmp10 = v4_add(tmp0, tmp3), tmp13 = v4_sub(tmp0, tmp3);
+	v4 tmp11 = v4_add(tmp1, tmp2), tmp12 = v4_sub(tmp1, tmp2);
+	d[0] = v4_add(tmp10, tmp11);
+	d[4] = v4_sub(tmp10, tmp11);
+	v4 z1 = v4_mul(v4_add(tmp12, tmp13), v4_set1(0.707106781f));
+	d[2] = v4_add(tmp13, z1);
+	d[6] = v4_sub(tmp13, z1);
+
+	// Odd part.
+	tmp10 = v4_add(tmp4, tmp5);
+	tmp11 = v4_add(tmp5, tmp6);
+	tmp12 = v4_add(tmp6, tmp7);
+	v4 z5 = v4_mul(v4_sub(tmp10, tmp12), v4_set1(0.382683433f));
+	v4 z2 = v4_add(v4_mul(tmp10, v4_set1(0.541196100f)), z5);
+	v4 z4 = v4_add(v4_mul(tmp12, v4_set1(1.306562965f)), z5);
+	v4 z3 = v4_mul(tmp11, v4_set1(0.707106781f));
+	v4 z11 = v4_add(tmp7, z3), z13 = v4_sub(tmp7, z3);
+	d[5] = v4_add(z13, z2);
+	d[3] = v4_sub(z13, z2);
+	d[1] = v4_add(z11, z4);
+	d[7] = v4_sub(z11, z4);
+}
+
+// Forward DCT and quantization of the 8x8 block at p; out is column-major.
+static void
+fdct_quantize(const float *p, size_t stride, const float qdiv[64], int16_t out[64])
+{
+	// l/r: left and right 4 columns, one vector per row.
+	v4 l[8], r[8];
+	for (int i = 0; i < 8; ++i) {
+		l[i] = v4_load(&p[i * stride]);
+		r[i] = v4_load(&p[i * stride + 4]);
+	}
+	dct_pass(l);
+	dct_pass(r);
+
+	// Transpose: rows of the result are the columns of the block.
+	v4_transpose(&l[0], &l[1], &l[2], &l[3]);
+	v4_transpose(&l[4], &l[5], &l[6], &l[7]);
+	v4_transpose(&r[0], &r[1], &r[2], &r[3]);
+	v4_transpose(&r[4], &r[5], &r[6], &r[7]);
+	v4 c[8] = { l[0], l[1], l[2], l[3], r[0], r[1], r[2], r[3] };
+	v4 d[8] = { l[4], l[5], l[6], l[7], r[4], r[5], r[6], r[7] };
+	dct_pass(c);
+	dct_pass(d);
+
+	for (int i = 0; i < 8; ++i) {
+		v4_quantize(c[i], v4_load(&qdiv[i * 8]),     &out[i * 8]);
+		v4_quantize(d[i], v4_load(&qdiv[i * 8 + 4]), &out[i * 8 + 4]);
+	}
+}
+
+struct bitwriter {
+	unsigned char *p;
+	uint64_t acc;
+	unsigned n;
+};
+
+static inline void
+put_bits(struct bitwriter *bw, unsigned code, unsigned size)
+{
+	bw->acc = bw->acc << size | code;
+	bw->n += size;
+	while (bw->n >= 8) {
+		bw->n -= 8;
+		unsigned char byte = bw->acc >> bw->n;
+		*bw->p++ = byte;
+		if (byte == 0xff) {
+			*bw->p++ = 0;
+		}
+	}
+}
+
+static inline unsigned
+magnitude(int v, unsigned *bits)
+{
+	unsigned a = v < 0 ? -v : v;
+	unsigned size = a ? 32 - __builtin_clz(a) : 0;
+	*bits = (v < 0 ? v - 1 : v) & ((1u << size) - 1);
+	return size;
+}
+
+static void
+encode_block(struct bitwriter *bw, const int16_t coef[64], int *dc_pred, int t)
+{
+	unsigned bits, size;
+	size = magnitude(coef[0] - *dc_pred, &bits);
+	*dc_pred = coef[0];
+	put_bits(bw, dc_huff[t].code[size], dc_huff[t].size[size]);
+	put_bits(bw, bits, size);
+
+	unsigned run = 0;
+	for (int k = 1; k < 64; ++k) {
+		int v = coef[order[k]];
+		if (!v) {
+			run += 1;
+			continue;
+		}
+		for (; run >= 16; run -= 16) {
+			put_bits(bw, ac_huff[t].code[0xf0], ac_huff[t].size[0xf0]);
+		}
+		size = magnitude(v, &bits);
+		unsigned sym = run << 4 | size;
+		put_bits(bw, ac_huff[t].code[sym], ac_huff[t].size[sym]);
+		put_bits(bw, bits, size);
+		run = 0;
+	}
+	if (run) {
+		put_bits(bw, ac_huff[t].code[0x00], ac_huff[t].size[0x00]);
+	}
+}
+
+static unsigned char *
+put_marker(unsigned char *p, unsigned marker, size_t len)
+{
+	*p++ = 0xff;
+	*p++ = marker;
+	*p++ = (len + 2) >> 8;
+	*p++ = (len + 2);
+	return p;
+}
+
+static size_t
+write_header(struct thermapp_jpeg *jpeg, const uint8_t quant[2][64])
+{
+	unsigned char *p = jpeg->out;
+	*p++ = 0xff;
+	*p++ = 0xd8; // SOI
+
+	static const unsigned char jfif[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+	p = put_marker(p, 0xe0, sizeof jfif); // APP0
+	memcpy(p, jfif, sizeof jfif);
+	p += sizeof jfif;
+
+	p = put_marker(p, 0xdb, 2 * 65); // DQT
+	for (int t = 0; t < 2; ++t) {
+		*p++ = t;
+		for (int k = 0; k < 64; ++k) {
+			*p++ = quant[t][zigzag[k]];
+		}
+	}
+
+	p = put_marker(p, 0xc0, 6 + 3 * 3); // SOF0
+	*p++ = 8;
+	*p++ = jpeg->h >> 8;
+	*p++ = jpeg->h;
+	*p++ = jpeg->w >> 8;
+	*p++ = jpeg->w;
+	*p++ = 3;
+	static const unsigned char comps[3][3] = { { 1, 0x22, 0 }, { 2, 0x11, 1 }, { 3, 0x11, 1 } };
+	memcpy(p, comps, sizeof comps);
+	p += sizeof comps;
+
+	p = put_marker(p, 0xc4, 2 * (17 + 12) + 2 * (17 + 162)); // DHT
+	for (int t = 0; t < 2; ++t) {
+		*p++ = 0x00 | t;
+		memcpy(p, dc_bits[t], 16);
+		p += 16;
+		memcpy(p, dc_vals, 12);
+		p += 12;
+		*p++ = 0x10 | t;
+		memcpy(p, ac_bits[t], 16);
+		p += 16;
+		memcpy(p, ac_vals[t], 162);
+		p += 162;
+	}
+
+	p = put_marker(p, 0xda, 1 + 3 * 2 + 3); // SOS
+	*p++ = 3;
+	static const unsigned char scan[] = { 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+	memcpy(p, scan, sizeof scan);
+	p += sizeof scan;
+
+	return p - jpeg->out;
+}
+
+struct thermapp_jpeg *
+thermapp_jpeg_open(size_t w, size_t h, int quality)
+{
+	if (w < 1 || w > SCALED_WIDTH_MAX || h < 1 || h > SCALED_HEIGHT_MAX) {
+		fprintf(stderr, "jpeg: bad size %zux%zu\n", w, h);
+		return NULL;
+	}
+	if (quality <= 0) {
+		quality = JPEG_DEFAULT_QUALITY;
+	} else if (quality > 100) {
+		quality = 100;
+	}
+
+	struct thermapp_jpeg *jpeg = calloc(1, sizeof *jpeg);
+	if (!jpeg) {
+		perror("calloc");
+		return NULL;
+	}
+	jpeg->w = w;
+	jpeg->h = h;
+	jpeg->pw = (w + 15) & ~(size_t)15;
+	jpeg->ph = (h + 15) & ~(size_t)15;
+
+	// Worst case per 8x8 block is well under 512 bytes, even with every byte stuffed.
+	size_t blocks = jpeg->pw * jpeg->ph / 64 * 3 / 2;
+	jpeg->out_cap = 1024 + blocks * 512;
+	jpeg->out = malloc(jpeg->out_cap);
+	jpeg->y = malloc(jpeg->pw * jpeg->ph * sizeof *jpeg->y);
+	jpeg->cb = malloc(jpeg->pw * jpeg->ph / 4 * sizeof *jpeg->cb);
+	jpeg->cr = malloc(jpeg->pw * jpeg->ph / 4 * sizeof *jpeg->cr);
+	if (!jpeg->out || !jpeg->y || !jpeg->cb || !jpeg->cr) {
+		perror("malloc");
+		thermapp_jpeg_close(jpeg);
+		return NULL;
+	}
+
+	// Quality scaling as in libjpeg's jpeg_quality_scaling.
+	int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+	uint8_t quant[2][64];
+	static const float aan[8] = {
+		1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+		1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+	};
+	for (int t = 0; t < 2; ++t) {
+		for (int i = 0; i < 64; ++i) {
+			int q = (std_quant[t][i] * scale + 50) / 100;
+			quant[t][i] = q < 1 ? 1 : q > 255 ? 255 : q;
+			int row = i / 8, col = i % 8;
+			jpeg->qdiv[t][col * 8 + row] = 1.0f / (quant[t][i] * aan[row] * aan[col] * 8.0f);
+		}
+	}
+
+	pthread_once(&tables_once, tables_init);
+	jpeg->header_len = write_header(jpeg, quant);
+	return jpeg;
+}
+
+// Returns the length of the JPEG in *out (valid until the next call).
+size_t
+thermapp_jpeg_encode(struct thermapp_jpeg *jpeg, const uint32_t *img, const unsigned char **out)
+{
+	convert(jpeg, img);
+
+	struct bitwriter bw = { jpeg->out + jpeg->header_len, 0, 0 };
+	int pred[3] = { 0, 0, 0 };
+	int16_t coef[64];
+	size_t pw = jpeg->pw, cw = jpeg->pw / 2;
+	for (size_t my = 0; my < jpeg->ph; my += 16) {
+		for (size_t mx = 0; mx < pw; mx += 16) {
+			const float *yb = &jpeg->y[my * pw + mx];
+			fdct_quantize(yb,              pw, jpeg->qdiv[0], coef);
+			encode_block(&bw, coef, &pred[0], 0);
+			fdct_quantize(yb + 8,          pw, jpeg->qdiv[0], coef);
+			encode_block(&bw, coef, &pred[0], 0);
+			fdct_quantize(yb + 8 * pw,     pw, jpeg->qdiv[0], coef);
+			encode_block(&bw, coef, &pred[0], 0);
+			fdct_quantize(yb + 8 * pw + 8, pw, jpeg->qdiv[0], coef);
+			encode_block(&bw, coef, &pred[0], 0);
+
+			size_t c = my / 2 * cw + mx / 2;
+			fdct_quantize(&jpeg->cb[c], cw, jpeg->qdiv[1], coef);
+			encode_block(&bw, coef, &pred[1], 1);
+			fdct_quantize(&jpeg->cr[c], cw, jpeg->qdiv[1], coef);
+			encode_block(&bw, coef, &pred[2], 1);
+		}
+	}
+
+	// Pad the last byte with 1 bits, then EOI.
+	if (bw.n) {
+		put_bits(&bw, (1u << (8 - bw.n)) - 1, 8 - bw.n);
+	}
+	*bw.p++ = 0xff;
+	*bw.p++ = 0xd9;
+
+	*out = jpeg->out;
+	return bw.p - jpeg->out;
+}
+
+void
+thermapp_jpeg_close(struct thermapp_jpeg *jpeg)
+{
+	if (!jpeg)
+		return;
+
+	free(jpeg->out);
+	free(jpeg->y);
+	free(jpeg->cb);
+	free(jpeg->cr);
+	free(jpeg);
+}
@@ -0,0 +1,396 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Console output off the capture path.
+//
+// Events (libusb errors, discarded transfers, calibration progress) are
+// small binary records pushed into a bounded lock-free ring; any thread may
+// push, and a push never blocks or makes a system call.  If the ring is full
+// the event is counted and dropped.  The ring is the usual sequence-numbered one: each
+// slot's seq says whether it is free for the producer claiming position pos
+// (seq == pos) or holds data for the consumer (seq == pos + 1).
+//
+// The status line only ever needs its latest value, so it is a single slot
+// behind a seqlock instead of ring traffic: the capture thread overwrites it
+// every frame and the logger samples it.
+//
+// The logger thread wakes LOG_POLL times per second at most, formats the
+// events, and redraws the status line at the requested rate.  Each event
+// type is printed at most LOG_BURST times per second; the rest are counted
+// and summarized, except calibration progress, which like the status line
+// overwrites itself.  Without a running logger, events are printed
+// immediately, one thread at a time.
+
+#define LOG_RING   256 // power of 2
+#define LOG_POLL   20  // Hz
+#define LOG_BURST  5   // per event type per second
+#define LOG_ARGS   5
+
+struct log_record {
+	atomic_ulong seq;
+	enum thermapp_log_event event;
+	const char *what;
+	long arg[LOG_ARGS];
+};
+
+static struct {
+	pthread_t thread;
+	sem_t wake;
+	atomic_int running;
+	atomic_int stop;
+	double status_period;
+
+	struct log_record ring[LOG_RING];
+	atomic_ulong tail;  // producers
+	unsigned long head; // logger thread
+	atomic_ulong dropped;
+
+	atomic_uint status_seq;
+	struct thermapp_status status;
+
+	// Logger thread only.
+	int status_shown;
+	struct timespec burst_start[LOG_EVENTS];
+	unsigned burst[LOG_EVENTS];
+	unsigned long suppressed[LOG_EVENTS];
+
+	// Logger thread while running, otherwise under direct_lock.
+	int progress_shown;
+} logger;
+
+// Printing without the logger, and starting it.
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+elapsed(struct timespec end, struct timespec start)
+{
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void
+format_event(enum thermapp_log_event event, const char *what, const long *arg)
+{
+	switch (event) {
+	case LOG_USB_ERROR:
+		fprintf(stderr, "%s: %s\n", what, libusb_strerror((int)arg[0]));
+		break;
+	case LOG_USB_PARTIAL:
+		fprintf(stderr, "discarding partial transfer of size %ld\n", arg[0]);
+		break;
+	case LOG_CAL_READY:
+		printf("Factory calibration from %s ready after %.3f s\n", what, arg[0] / 1e3);
+		break;
+	case LOG_CAL_UNAVAILABLE:
+		printf("Factory calibration unavailable in %s after %.3f s\n", what, arg[0] / 1e3);
+		break;
+	case LOG_AUTOCAL_START:
+		printf("Calibrating... cover the lens!\n");
+		break;
+	case LOG_AUTOCAL_PROGRESS:
+		printf("\rCaptured calibration frame %ld/%d. Keep lens covered.", arg[0], AUTOCAL_FRAMES);
+		fflush(stdout);
+		break;
+	case LOG_AUTOCAL_DONE:
+		printf("Calibration finished\n");
+		break;
+	case LOG_BAD_PIXEL:
+		printf("Bad pixel (%ld,%ld)\n", arg[0], arg[1]);
+		break;
+	case LOG_RECAL_START:
+		printf("Recalibrating... keep lens covered.\n");
+		break;
+	case LOG_FIRST_FRAME:
+		printf("First frame after %.3f s\n", arg[0] / 1e3);
+		break;
+	case LOG_REC_TRIGGERED:
+		printf("Recording triggered\n");
+		break;
+	case LOG_ALARM:
+		printf("Alarm: %ld hot spot(s), hottest %.1f C at (%ld, %ld), %ld pixels\n",
+		       arg[0], arg[1] / 10.0, arg[2], arg[3], arg[4]);
+		break;
+	case LOG_ALARM_CLEARED:
+		printf("Alarm cleared\n");
+		break;
+	default:
+		break;
+	}
+}
+
+// Finish the status line so a message gets a line of its own.
+static void
+status_break(void)
+{
+	if (logger.status_shown) {
+		logger.status_shown = 0;
+		logger.progress_shown = 0;
+		printf("\n");
+		fflush(stdout);
+	}
+}
+
+static void
+print_suppressed(enum thermapp_log_event event)
+{
+	if (logger.suppressed[event]) {
+		status_break();
+		fprintf(stderr, "(%lu similar messages suppressed)\n", logger.suppressed[event]);
+	}
+}
+
+static void
+print_event(const struct log_record *rec, struct timespec now)
+{
+	enum thermapp_log_event event = rec->event;
+	if (event == LOG_AUTOCAL_PROGRESS) {
+		// Overwrites the last progress, but not the status line.
+		if (!logger.progress_shown) {
+			status_break();
+		}
+		format_event(event, rec->what, rec->arg);
+		logger.status_shown = 1;
+		logger.progress_shown = 1;
+		return;
+	}
+	if (elapsed(now, logger.burst_start[event]) >= 1.0) {
+		print_suppressed(event);
+		logger.burst_start[event] = now;
+		logger.burst[event] = 0;
+		logger.suppressed[event] = 0;
+	}
+	if (logger.burst[event] >= LOG_BURST) {
+		logger.suppressed[event] += 1;
+		return;
+	}
+	logger.burst[event] += 1;
+
+	status_break();
+	format_event(event, rec->what, rec->arg);
+}
+
+static int
+drain(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	int n = 0;
+	for (;;) {
+		struct log_record *rec = &logger.ring[logger.head & (LOG_RING - 1)];
+		if (atomic_load_explicit(&rec->seq, memory_order_acquire) != logger.head + 1) {
+			break;
+		}
+		print_event(rec, now);
+		atomic_store_explicit(&rec->seq, logger.head + LOG_RING, memory_order_release);
+		logger.head += 1;
+		n += 1;
+	}
+	return n;
+}
+
+static int
+status_read(struct thermapp_status *status)
+{
+	for (int tries = 0; tries < 100; ++tries) {
+		unsigned s1 = atomic_load_explicit(&logger.status_seq, memory_order_acquire);
+		if (s1 & 1) {
+			continue;
+		}
+		memcpy(status, &logger.status, sizeof *status);
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&logger.status_seq, memory_order_relaxed) == s1) {
+			return s1 != 0;
+		}
+	}
+	return 0;
+}
+
+static void
+status_print(void)
+{
+	struct thermapp_status s;
+	if (!status_read(&s)) {
+		return;
+	}
+	printf("\rFrame #%" PRIu32 ":  FPA: %f C  Thermistor: %f C  Range: [%f:%f] @ (%d,%d):(%d,%d)  Latency: %.1f/%.1f/%.1f ms",
+	       s.frame_num, s.temp_fpa, s.temp_therm, s.t_min, s.t_max,
+	       s.min_x, s.min_y, s.max_x, s.max_y, s.latency_p50, s.latency_p99, s.latency_max);
+	fflush(stdout);
+	logger.status_shown = 1;
+	logger.progress_shown = 0;
+}
+
+static void *
+worker(void *arg)
+{
+	struct timespec last_status = { 0 };
+
+	while (!atomic_load_explicit(&logger.stop, memory_order_acquire)) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 1000000000 / LOG_POLL;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (sem_timedwait(&logger.wake, &deadline) < 0 && errno == EINTR) {
+		}
+
+		drain();
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (logger.status_period > 0.0 && elapsed(now, last_status) >= logger.status_period) {
+			last_status = now;
+			status_print();
+		}
+	}
+
+	// Flush whatever is left, and leave the final status on screen.
+	drain();
+	for (int i = 0; i < LOG_EVENTS; ++i) {
+		print_suppressed(i);
+	}
+	if (logger.status_period > 0.0) {
+		status_print();
+	}
+	return NULL;
+}
+
+// status_rate: status line updates per second, 0 for none.
+int
+thermapp_log_open(double status_rate)
+{
+	for (size_t i = 0; i < LOG_RING; ++i) {
+		atomic_init(&logger.ring[i].seq, i);
+	}
+	atomic_init(&logger.tail, 0);
+	atomic_init(&logger.dropped, 0);
+	atomic_init(&logger.status_seq, 0);
+	atomic_init(&logger.stop, 0);
+	logger.head = 0;
+	logger.status_period = status_rate > 0.0 ? 1.0 / status_rate : 0.0;
+
+	if (sem_init(&logger.wake, 0, 0) < 0) {
+		perror("sem_init");
+		return 0;
+	}
+	// Any direct print finishes before the logger thread takes over.
+	pthread_mutex_lock(&direct_lock);
+	int ret = pthread_create(&logger.thread, NULL, worker, NULL);
+	if (!ret) {
+		atomic_store_explicit(&logger.running, 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&direct_lock);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+		sem_destroy(&logger.wake);
+		return 0;
+	}
+	return 1;
+}
+
+// Without a running logger, print the event now.  Returns 0 if the logger
+// has started meanwhile, for the caller to queue the event instead.
+static int
+print_direct(enum thermapp_log_event event, const char *what, const long *arg)
+{
+	pthread_mutex_lock(&direct_lock);
+	int direct = !atomic_load_explicit(&logger.running, memory_order_relaxed);
+	if (direct) {
+		if (event != LOG_AUTOCAL_PROGRESS && logger.progress_shown) {
+			logger.progress_shown = 0;
+			printf("\n");
+		}
+		format_event(event, what, arg);
+		logger.progress_shown = event == LOG_AUTOCAL_PROGRESS;
+	}
+	pthread_mutex_unlock(&direct_lock);
+	return direct;
+}
+
+// what: a string literal, or one that outlives the logger (only the pointer
+// is kept); args: n of them (at most LOG_ARGS), depending on the event.
+void
+thermapp_log_args(enum thermapp_log_event event, const char *what, const long *args, size_t n)
+{
+	long arg[LOG_ARGS] = { 0 };
+	memcpy(arg, args, (n < LOG_ARGS ? n : LOG_ARGS) * sizeof *arg);
+
+	if (!atomic_load_explicit(&logger.running, memory_order_acquire)
+	    && print_direct(event, what, arg)) {
+		return;
+	}
+
+	unsigned long pos = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+	struct log_record *rec;
+	for (;;) {
+		rec = &logger.ring[pos & (LOG_RING - 1)];
+		long diff = (long)(atomic_load_explicit(&rec->seq, memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&logger.tail, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// Full.  Never wait for the logger.
+			atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+		}
+	}
+	rec->event = event;
+	rec->what = what;
+	memcpy(rec->arg, arg, sizeof rec->arg);
+	atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+}
+
+// For events with a single argument.
+void
+thermapp_log(enum thermapp_log_event event, const char *what, long arg)
+{
+	thermapp_log_args(event, what, &arg, 1);
+}
+
+// Single writer: the capture thread.
+void
+thermapp_log_status(const struct thermapp_status *status)
+{
+	unsigned seq = atomic_load_explicit(&logger.status_seq, memory_order_relaxed);
+	atomic_store_explicit(&logger.status_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&logger.status, status, sizeof *status);
+	atomic_store_explicit(&logger.status_seq, seq + 2, memory_order_release);
+}
+
+void
+thermapp_log_close(void)
+{
+	if (!atomic_load_explicit(&logger.running, memory_order_acquire))
+		return;
+
+	atomic_store_explicit(&logger.stop, 1, memory_order_release);
+	sem_post(&logger.wake);
+	pthread_join(logger.thread, NULL);
+	sem_destroy(&logger.wake);
+	atomic_store_explicit(&logger.running, 0, memory_order_release);
+
+	unsigned long dropped = atomic_load_explicit(&logger.dropped, memory_order_relaxed);
+	if (dropped) {
+		fprintf(stderr, "\n%lu log messages dropped\n", dropped);
+	}
+}
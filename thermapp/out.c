@@ -0,0 +1,467 @@
+// SPDX-FileCopyrightText: 2019-2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE // vmsplice, F_SETPIPE_SZ
+
+#include "thermapp.h"
+
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Video output.
+//
+// Streaming I/O (V4L2_MEMORY_MMAP): the caller renders directly into a
+// driver buffer obtained from thermapp_out_buffer, and thermapp_out_commit
+// queues it.  Buffers are only dequeued once all of them have been queued,
+// so up to OUT_BUFFERS frames are in flight.  No copies are made by us or
+// the kernel on the way to the driver.
+//
+// Read/write I/O: the caller renders into a private buffer which is then
+// passed to write(), costing one copy into the kernel.  This is used when
+// the device does not support streaming, when requested, or when the output
+// is not a character device at all (a regular file or a pipe), which is
+// useful for testing without v4l2loopback.
+//
+// Pipe I/O (the output is a pipe, e.g. "-" for stdout piped to ffmpeg): the
+// caller renders into a page-aligned buffer, and its pages are handed to the
+// pipe with vmsplice(SPLICE_F_GIFT) instead of being copied.  Gifted pages
+// belong to the kernel from then on: the reader may splice or tee them
+// onward and keep them long after the pipe has drained, so they are never
+// written again.  Instead the buffer is mapped afresh over the same address
+// after each frame, which costs a page fault per page of the next frame but
+// no copy.  A full pipe blocks vmsplice as it would write(); the pipe is
+// grown to hold OUT_PIPE_FRAMES frames where allowed, so a reader that keeps
+// up never waits.
+
+#define OUT_BUFFERS 4
+#define OUT_PIPE_FRAMES 2
+
+struct thermapp_out {
+	int fd;
+	int is_v4l2;
+	int is_pipe;
+	int streaming;
+	int stream_on;
+	size_t size;
+
+	uint8_t *write_buf;
+
+	struct {
+		void *start;
+		size_t len;
+	} buf[OUT_BUFFERS];
+	unsigned bufs;
+	unsigned queued;  // buffers queued at least once (priming), up to bufs
+	int cur;          // buffer being rendered into, or -1
+
+	// Pipe I/O: buf[0] is an anonymous mapping, replaced after each frame.
+	size_t pipe_len;         // size rounded up to a page
+
+	// Statistics
+	unsigned long frames;
+	unsigned long copies;
+	unsigned long syscalls;  // in the output path
+	uint64_t latency;  // time spent in output calls for the current frame
+	uint64_t latency_sum;
+	uint64_t latency_max;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct thermapp_out *
+thermapp_out_open(const char *path, int streaming)
+{
+	struct thermapp_out *out = calloc(1, sizeof *out);
+	if (!out) {
+		perror("calloc");
+		return NULL;
+	}
+	out->fd = -1;
+	out->cur = -1;
+
+	struct stat st;
+	if (strcmp(path, "-") == 0) {
+		out->fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+	} else if (stat(path, &st) == 0 && S_ISCHR(st.st_mode)) {
+		out->is_v4l2 = 1;
+		out->fd = open(path, O_RDWR);
+	} else {
+		out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (out->fd < 0) {
+		perror("open");
+		goto err;
+	}
+
+	if (!out->is_v4l2) {
+		out->is_pipe = streaming && fstat(out->fd, &st) == 0 && S_ISFIFO(st.st_mode);
+		return out;
+	}
+
+	struct v4l2_capability cap;
+	if (ioctl(out->fd, VIDIOC_QUERYCAP, &cap) < 0) {
+		perror("VIDIOC_QUERYCAP");
+		goto err;
+	}
+
+	uint32_t caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps : cap.capabilities;
+	if (!(caps & V4L2_CAP_VIDEO_OUTPUT)) {
+		fprintf(stderr, "%s is not a video output device\n", path);
+		goto err;
+	}
+
+	out->streaming = streaming && caps & V4L2_CAP_STREAMING;
+	if (!out->streaming && !(caps & V4L2_CAP_READWRITE)) {
+		fprintf(stderr, "%s does not support write i/o\n", path);
+		goto err;
+	}
+
+	return out;
+
+err:
+	thermapp_out_close(out);
+	return NULL;
+}
+
+static size_t
+format_size(struct v4l2_format *vid_format)
+{
+	switch (vid_format->fmt.pix.pixelformat) {
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+		vid_format->fmt.pix.bytesperline = vid_format->fmt.pix.width; /* ??? */
+		vid_format->fmt.pix.sizeimage = vid_format->fmt.pix.bytesperline * vid_format->fmt.pix.height;
+		vid_format->fmt.pix.sizeimage += 2 * ((vid_format->fmt.pix.width + 1) / 2) * ((vid_format->fmt.pix.height + 1) / 2);
+		break;
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+		vid_format->fmt.pix.bytesperline = 4 * ((vid_format->fmt.pix.width + 1) / 2);
+		vid_format->fmt.pix.sizeimage = vid_format->fmt.pix.bytesperline * vid_format->fmt.pix.height;
+		break;
+	case V4L2_PIX_FMT_GREY:
+		vid_format->fmt.pix.bytesperline = vid_format->fmt.pix.width;
+		vid_format->fmt.pix.sizeimage = vid_format->fmt.pix.bytesperline * vid_format->fmt.pix.height;
+		break;
+	case V4L2_PIX_FMT_Y10:
+	case V4L2_PIX_FMT_Y12:
+	case V4L2_PIX_FMT_Y14:
+	case V4L2_PIX_FMT_Y16:
+	case V4L2_PIX_FMT_Y16_BE:
+		vid_format->fmt.pix.bytesperline = 2 * vid_format->fmt.pix.width;
+		vid_format->fmt.pix.sizeimage = vid_format->fmt.pix.bytesperline * vid_format->fmt.pix.height;
+		break;
+	case V4L2_PIX_FMT_XBGR32:
+	case V4L2_PIX_FMT_XRGB32:
+		vid_format->fmt.pix.bytesperline = 4 * vid_format->fmt.pix.width;
+		vid_format->fmt.pix.sizeimage = vid_format->fmt.pix.bytesperline * vid_format->fmt.pix.height;
+		break;
+	default:
+		fprintf(stderr, "unable to guess correct settings for format '%c%c%c%c'\n",
+		        vid_format->fmt.pix.pixelformat       & 0xff,
+		        vid_format->fmt.pix.pixelformat >>  8 & 0xff,
+		        vid_format->fmt.pix.pixelformat >> 16 & 0xff,
+		        vid_format->fmt.pix.pixelformat >> 24 & 0xff);
+		return 0;
+	}
+	return vid_format->fmt.pix.sizeimage;
+}
+
+static int
+request_buffers(struct thermapp_out *out)
+{
+	struct v4l2_requestbuffers req;
+	memset(&req, 0, sizeof req);
+	req.count = OUT_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(out->fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("VIDIOC_REQBUFS");
+		return 0;
+	}
+	if (req.count < 2) {
+		fprintf(stderr, "%s: %s\n", "VIDIOC_REQBUFS", "Insufficient buffers");
+		return 0;
+	}
+	if (req.count > OUT_BUFFERS) {
+		req.count = OUT_BUFFERS;
+	}
+
+	for (out->bufs = 0; out->bufs < req.count; ++out->bufs) {
+		struct v4l2_buffer buf;
+		memset(&buf, 0, sizeof buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = out->bufs;
+		if (ioctl(out->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+			perror("VIDIOC_QUERYBUF");
+			return 0;
+		}
+		if (buf.length < out->size) {
+			fprintf(stderr, "%s: %s\n", "VIDIOC_QUERYBUF", "Buffer too small");
+			return 0;
+		}
+		void *start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, buf.m.offset);
+		if (start == MAP_FAILED) {
+			perror("mmap");
+			return 0;
+		}
+		out->buf[out->bufs].start = start;
+		out->buf[out->bufs].len = buf.length;
+	}
+	return 1;
+}
+
+static int
+pipe_buffers(struct thermapp_out *out)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	out->pipe_len = (out->size + page - 1) / page * page;
+
+	// Room for a few frames, so vmsplice doesn't wait on the reader.
+	// Not fatal: above /proc/sys/fs/pipe-max-size, unprivileged users get EPERM.
+	int cur = fcntl(out->fd, F_GETPIPE_SZ);
+	size_t want = OUT_PIPE_FRAMES * out->pipe_len;
+	if (cur >= 0 && (size_t)cur < want && fcntl(out->fd, F_SETPIPE_SZ, (int)want) < 0) {
+		fprintf(stderr, "%s: %s, pipe holds %d bytes\n", "F_SETPIPE_SZ", strerror(errno), cur);
+	}
+
+	void *start = mmap(NULL, out->pipe_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (start == MAP_FAILED) {
+		perror("mmap");
+		return 0;
+	}
+	out->buf[0].start = start;
+	out->buf[0].len = out->pipe_len;
+	out->bufs = 1;
+	return 1;
+}
+
+static void
+release_buffers(struct thermapp_out *out)
+{
+	for (unsigned i = 0; i < out->bufs; ++i) {
+		munmap(out->buf[i].start, out->buf[i].len);
+	}
+	out->bufs = 0;
+}
+
+size_t
+thermapp_out_format(struct thermapp_out *out, uint32_t format, size_t width, size_t height)
+{
+	struct v4l2_format vid_format;
+
+	memset(&vid_format, 0, sizeof vid_format);
+	vid_format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+	if (out->is_v4l2 && ioctl(out->fd, VIDIOC_G_FMT, &vid_format)) {
+		perror("VIDIOC_G_FMT");
+		return 0;
+	}
+
+	vid_format.fmt.pix.width = width;
+	vid_format.fmt.pix.height = height;
+	vid_format.fmt.pix.pixelformat = format;
+	vid_format.fmt.pix.field = V4L2_FIELD_NONE;
+	vid_format.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+
+	out->size = format_size(&vid_format);
+	if (!out->size) {
+		return 0;
+	}
+
+	if (out->is_v4l2 && ioctl(out->fd, VIDIOC_S_FMT, &vid_format)) {
+		perror("VIDIOC_S_FMT");
+		return 0;
+	}
+
+	if (out->streaming && !request_buffers(out)) {
+		// Fall back to write(), if the device allows it.
+		release_buffers(out);
+		out->streaming = 0;
+		fprintf(stderr, "Streaming i/o unavailable, using write()\n");
+	}
+
+	if (out->is_pipe && !pipe_buffers(out)) {
+		release_buffers(out);
+		out->is_pipe = 0;
+		fprintf(stderr, "vmsplice unavailable, using write()\n");
+	}
+
+	// Also the fallback for pipe i/o.
+	if (!out->streaming) {
+		free(out->write_buf);
+		out->write_buf = malloc(out->size);
+		if (!out->write_buf) {
+			perror("malloc");
+			return 0;
+		}
+	}
+
+	return out->size;
+}
+
+void *
+thermapp_out_buffer(struct thermapp_out *out)
+{
+	if (out->is_pipe) {
+		out->cur = 0;
+		return out->buf[0].start;
+	}
+
+	if (!out->streaming) {
+		return out->write_buf;
+	}
+
+	if (out->cur >= 0) {
+		return out->buf[out->cur].start;
+	}
+
+	if (out->queued < out->bufs) {
+		// Still priming the queue: use each buffer once before dequeuing any.
+		out->cur = out->queued;
+		return out->buf[out->cur].start;
+	}
+
+	uint64_t start = now_ns();
+	struct v4l2_buffer buf;
+	memset(&buf, 0, sizeof buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.memory = V4L2_MEMORY_MMAP;
+	while (out->syscalls += 1, ioctl(out->fd, VIDIOC_DQBUF, &buf) < 0) {
+		if (errno != EINTR) {
+			perror("VIDIOC_DQBUF");
+			return NULL;
+		}
+	}
+	out->latency += now_ns() - start;
+	out->cur = buf.index;
+	return out->buf[out->cur].start;
+}
+
+int
+thermapp_out_commit(struct thermapp_out *out, const struct timespec *timestamp)
+{
+	uint64_t start = now_ns();
+	int ok = 1;
+
+	if (out->is_pipe) {
+		struct iovec iov = { out->buf[0].start, out->size };
+		while (iov.iov_len) {
+			out->syscalls += 1;
+			ssize_t ret = vmsplice(out->fd, &iov, 1, SPLICE_F_GIFT);
+			if (ret < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("vmsplice");
+				ok = 0;
+				break;
+			}
+			iov.iov_base = (uint8_t *)iov.iov_base + ret;
+			iov.iov_len -= ret;
+		}
+		out->cur = -1;
+
+		// The gifted pages stay with the pipe; render the next frame into new ones.
+		out->syscalls += 1;
+		if (mmap(out->buf[0].start, out->pipe_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+			perror("mmap");
+			out->is_pipe = 0;
+			fprintf(stderr, "vmsplice unavailable, using write()\n");
+		}
+	} else if (!out->streaming) {
+		out->syscalls += 1;
+		if (write(out->fd, out->write_buf, out->size) < 0) {
+			perror("write");
+			ok = 0;
+		}
+		out->copies += 1;
+	} else if (out->cur >= 0) {
+		struct v4l2_buffer buf;
+		memset(&buf, 0, sizeof buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = out->cur;
+		buf.bytesused = out->size;
+		buf.field = V4L2_FIELD_NONE;
+		if (timestamp) {
+			buf.flags |= V4L2_BUF_FLAG_TIMESTAMP_COPY;
+			buf.timestamp.tv_sec  = timestamp->tv_sec;
+			buf.timestamp.tv_usec = timestamp->tv_nsec / 1000;
+		}
+		out->syscalls += 1;
+		if (ioctl(out->fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("VIDIOC_QBUF");
+			ok = 0;
+		} else if (out->queued < out->bufs) {
+			out->queued += 1;
+		}
+		out->cur = -1;
+
+		if (ok && !out->stream_on) {
+			enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+			out->syscalls += 1;
+			if (ioctl(out->fd, VIDIOC_STREAMON, &type) < 0) {
+				perror("VIDIOC_STREAMON");
+				ok = 0;
+			} else {
+				out->stream_on = 1;
+			}
+		}
+	}
+
+	out->latency += now_ns() - start;
+	out->latency_sum += out->latency;
+	if (out->latency_max < out->latency) {
+		out->latency_max = out->latency;
+	}
+	out->latency = 0;
+	out->frames += 1;
+	return ok;
+}
+
+void
+thermapp_out_close(struct thermapp_out *out)
+{
+	if (!out)
+		return;
+
+	if (out->frames) {
+		const char *mode = out->is_pipe ? "vmsplice" : out->streaming ? "mmap streaming" : "write()";
+		printf("Output: %lu frames, %s, %.2f copies/frame, %.2f syscalls/frame, %.3f ms avg / %.3f ms max in output calls\n",
+		       out->frames, mode,
+		       (double)out->copies / out->frames, (double)out->syscalls / out->frames,
+		       out->latency_sum / 1e6 / out->frames, out->latency_max / 1e6);
+	}
+
+	if (out->stream_on) {
+		enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		ioctl(out->fd, VIDIOC_STREAMOFF, &type);
+	}
+	release_buffers(out);
+	free(out->write_buf);
+	if (out->fd >= 0)
+		close(out->fd);
+	free(out);
+}
@@ -0,0 +1,1073 @@
+// SPDX-FileCopyrightText: 2019-2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <pthread.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The camera and the image processing, without any outputs (libthermapp).
+//
+// A pipeline owns the USB device, the calibration and everything carried
+// from frame to frame: filtered temperatures, transient correction,
+// automatic calibration, calibration set switching, vgsk control, background
+// refinement and the LUT.  The caller drives it from one thread:
+//
+//   thermapp_pipeline_wait      until the next event; on PIPELINE_FRAME
+//   thermapp_pipeline_process   NUC through LUT, into the caller's buffer or ours
+//   thermapp_pipeline_render    palette (or Y16), into the caller's buffer or ours
+//
+// so that results can go straight into output buffers (a driver buffer, a
+// shared memory slot) with no copies.  thermapp_pipeline_next does all three
+// with our buffers, for callers that just want pointers.  Frame data stays
+// valid until the next call to thermapp_pipeline_wait or _next.
+//
+// Pipelined (config.pipelined), the same calls overlap three frames:
+//
+//   capture thread   USB, sequential state, NUC, BPR, min/max, ROIs, alarm, change
+//   enhance thread   quantize, HPF, LUT
+//   caller           render and outputs
+//
+// connected by queues of SLOTS preallocated frame slots that cycle back to
+// the capture thread once the caller is done with them.  The sequential
+// state stays on one thread each: temperatures, calibration and vgsk control
+// on capture, the LUT on enhance, which sees frames in order and hands each
+// one a copy of the LUT it was rendered with.  If all slots are in use the
+// capture thread still keeps the sequential state up to date but drops the
+// frame.  Throughput is bounded by the slowest group rather than the sum, at
+// the cost of the time a frame waits in the queues.
+//
+// When processing falls behind, config.backpressure decides which frames are
+// worth finishing.  Each stage group (NUC, enhance, render and outputs)
+// checks a frame before starting on it: BACKPRESSURE_QUEUE takes every
+// frame, BACKPRESSURE_LATEST skips one if a newer frame is already waiting
+// in its queue, and BACKPRESSURE_DEADLINE skips one that arrived more than
+// config.deadline ago.  The sequential state in capture() is kept up to date
+// with every frame regardless, and a frame that sets or clears the alarm is
+// never skipped once it has been checked.  Serially there is only the
+// deadline check before NUC: the USB buffer holds one frame, and a newer
+// one overwrites it (counted as an overrun).  Drops are counted by reason,
+// see thermapp_pipeline_dropped.
+//
+// With change detection (config.change), only the tiles of the NUC output
+// that changed are quantized, into an image held from frame to frame, and
+// only the tiles changed since the last render are rendered, into p->rgb,
+// unless the LUT moved (or HPF is on) and everything needs rendering.  When
+// nothing changed and the LUT has settled, quantize, HPF and LUT are
+// skipped and the frame is marked unchanged, for callers that want to skip
+// their outputs too.  The palette image is then always rendered into p->rgb
+// first and copied to the caller's buffer.
+
+// Stage timing, if enabled in the config.  See main.c.  Each thread has its own mark.
+#ifndef NO_STAGE_STATS
+#define STAGE_START(mark) \
+	do { if (p->stage_timing) clock_gettime(CLOCK_MONOTONIC, (mark)); } while (0)
+#define STAGE(s, mark) \
+	do { if (p->stage_timing) thermapp_stats_mark(p->stats, (s), (mark)); } while (0)
+#else
+#define STAGE_START(mark) do { } while (0)
+#define STAGE(s, mark) do { } while (0)
+#endif
+
+#define SLOTS 4 // one per thread, and one to absorb jitter
+
+struct slot {
+	enum thermapp_pipeline_event ev;
+	struct thermapp_pipeline_frame f;
+	union thermapp_frame *frame;
+	float *temp;
+	uint16_t *quantized;
+	uint8_t *lut;
+	struct thermapp_roi_result roi[ROI_MAX];
+	struct thermapp_alarm_result alarm;
+	struct thermapp_change_result change;
+	int dropped; // by the enhance thread, for the caller to pass back
+};
+
+struct thermapp_pipeline {
+	struct thermapp_usb_dev *dev;
+	struct thermapp_cal *cal;
+	struct thermapp_scene *scene;
+
+	// Config.
+	char *caldir;
+	char *autocal_dir;
+	double autocal_max_temp_delta;
+	double autocal_max_age;
+	int scene_nuc;
+	enum thermapp_video_mode video_mode;
+	float enhanced_ratio;
+	int fliph, flipv;
+	const uint32_t *palette;
+	double t_refl;
+	double emissivity;
+	struct thermapp_stats *stats;
+	int stage_timing;
+	struct thermapp_rois *rois;
+	struct thermapp_alarm *alarm;
+	struct thermapp_change *change;
+
+	// Sequential state.
+	int resume_req;
+	int ident_frame;
+	int cal_pending;
+	int autocal_tried;          // saved autocal tables looked for while cal_pending,
+	int autocal_reused;         // and loaded
+	int autocal_frame;
+	atomic_int recal_req;
+	struct thermapp_temp temp;
+	uint16_t vgsk;
+	struct timespec start_time;
+	struct timespec stage_ts;   // capture (or only) thread
+	struct timespec enhance_ts; // enhance thread
+	struct timespec output_ts;  // caller, when pipelined
+
+	// Pipelined.
+	int pipelined;
+	enum thermapp_backpressure backpressure;
+	uint64_t deadline;                // ns
+	struct thermapp_arena *slot_arena;
+	pthread_t capture_thread;
+	pthread_t enhance_thread;
+	int capture_started, enhance_started;
+	struct thermapp_queue *free_q;    // caller, capture -> capture
+	struct thermapp_queue *nuc_q;     // capture -> enhance
+	struct thermapp_queue *done_q;    // enhance -> caller
+	struct slot slot[SLOTS];
+	struct slot *capture_slot;        // capture thread's, or NULL if dropping
+	struct slot *stash[SLOTS];        // capture thread's, free
+	size_t stashed;
+	union thermapp_frame *spare_frame;  // for dropped frames
+	struct thermapp_pipeline_frame spare;
+	struct slot *output_slot;         // caller's
+	enum thermapp_pipeline_event end; // capture thread's last event
+	int ended;                        // caller has seen it
+	atomic_int stop;
+	atomic_ulong dropped[DROPS];
+	unsigned long overruns;           // capture thread's: dev->frames_overrun, counted so far
+
+	uint32_t palette_buf[UINT8_MAX+1];
+
+	// Working buffers, from the arena.
+	struct thermapp_arena *arena;
+	uint8_t *palette_index;
+	union thermapp_frame *frame;
+	float *temp_buf;
+	uint16_t *quantized;
+	uint32_t *rgb;
+	struct thermapp_img_scratch *scratch;
+	struct thermapp_roi_result roi[ROI_MAX];
+	struct thermapp_alarm_result alarm_result;
+	struct thermapp_change_result change_result;
+
+	// Change detection.  See enhance and thermapp_pipeline_render.
+	uint16_t *held;              // enhance thread's: quantized, before HPF, of the tiles as last changed
+	uint8_t *lut_prev;           // enhance thread's
+	unsigned *bins;              // enhance thread's: histogram of held
+	const uint16_t *last_quantized; // enhance thread's last output
+	int lut_settled;             // enhance thread's: the last frame didn't change the LUT
+	uint8_t dirty[CHANGE_TILES_MAX]; // caller's: tiles of rgb to render
+	int repaint;                 // caller's: all of them
+	uint8_t carried[CHANGE_TILES_MAX]; // enhance thread's: changed tiles of frames it dropped
+	int carrying;
+};
+
+static const char *const drop_names[DROPS] = {
+	[DROP_OVERRUN]    = "overrun",
+	[DROP_BUSY]       = "busy",
+	[DROP_SUPERSEDED] = "superseded",
+	[DROP_LATE]       = "late",
+};
+
+#define SLOT_SIZE ( \
+	ARENA_LEN(sizeof (union thermapp_frame)) + \
+	ARENA_LEN(FRAME_PIXELS_MAX * sizeof (float)) + \
+	ARENA_LEN(FRAME_PIXELS_MAX * sizeof (uint16_t)) + \
+	ARENA_LEN((UINT16_MAX+1) * sizeof (uint8_t)))
+#define ARENA_SIZE ( \
+	ARENA_LEN((UINT16_MAX+1) * sizeof (uint8_t)) + \
+	ARENA_LEN(sizeof (union thermapp_frame)) + \
+	ARENA_LEN(FRAME_PIXELS_MAX * sizeof (float)) + \
+	ARENA_LEN(FRAME_PIXELS_MAX * sizeof (uint16_t)) + \
+	ARENA_LEN(FRAME_PIXELS_MAX * sizeof (uint32_t)) + \
+	ARENA_LEN(sizeof (struct thermapp_img_scratch)) + \
+	ARENA_LEN(FRAME_PIXELS_MAX * sizeof (uint16_t)) + \
+	ARENA_LEN((UINT16_MAX+1) * sizeof (uint8_t)) + \
+	ARENA_LEN((UINT16_MAX+1) * sizeof (unsigned)))
+
+static uint64_t
+timespec_ns(struct timespec ts)
+{
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static float
+timespec_delta(struct timespec end, struct timespec start)
+{
+	struct timespec delta;
+	delta.tv_nsec = end.tv_nsec - start.tv_nsec;
+	delta.tv_sec  = end.tv_sec  - start.tv_sec;
+	return (float)delta.tv_sec + (float)delta.tv_nsec / 1e9f;
+}
+
+// Defaults, the same as thermapp's.
+void
+thermapp_pipeline_config_init(struct thermapp_pipeline_config *config)
+{
+	memset(config, 0, sizeof *config);
+	config->autocal_max_temp_delta = 2.0;
+	config->video_mode = VIDEO_MODE_THERMOGRAPHY;
+	config->enhanced_ratio = 1.25f;
+	config->fliph = 1;
+	config->t_refl = 20.0;
+	config->emissivity = 0.95;
+}
+
+static char *
+strdup_opt(const char *s, int *ok)
+{
+	char *copy = NULL;
+	if (s && !(copy = strdup(s))) {
+		perror("strdup");
+		*ok = 0;
+	}
+	return copy;
+}
+
+// The calibration the current frame was processed with, from PIPELINE_STARTED
+// until the next call to thermapp_pipeline_wait or _next.  Pipelined, p->cal
+// belongs to the capture thread, so it comes from the caller's slot instead:
+// the placeholder it may point to is only freed once every slot is back.
+const struct thermapp_cal *
+thermapp_pipeline_cal(const struct thermapp_pipeline *p)
+{
+	if (p->pipelined) {
+		return p->output_slot ? p->output_slot->f.cal : NULL;
+	}
+	return p->cal;
+}
+
+// Redo the background refinement from the next frames (with -b, while the lens is covered).
+void
+thermapp_pipeline_recalibrate(struct thermapp_pipeline *p)
+{
+	atomic_store_explicit(&p->recal_req, 1, memory_order_relaxed);
+}
+
+static void
+frame_info(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f, struct timespec ts)
+{
+	memset(f, 0, sizeof *f);
+	f->raw = p->frame;
+	f->ts = ts;
+	f->frame_num = p->frame->header.frame_num_lo
+	             | p->frame->header.frame_num_hi << 16;
+	f->temp_fpa = p->temp.cur_fpa;
+	f->temp_therm = p->temp.cur_therm;
+	f->cal = p->cal;
+	if (p->cal) {
+		f->w = p->cal->img_w;
+		f->h = p->cal->img_h;
+	}
+}
+
+static void
+drop(struct thermapp_pipeline *p, enum thermapp_drop reason)
+{
+	atomic_fetch_add_explicit(&p->dropped[reason], 1, memory_order_relaxed);
+}
+
+// With BACKPRESSURE_DEADLINE, whether f arrived longer ago than the deadline.
+static int
+late(const struct thermapp_pipeline *p, const struct thermapp_pipeline_frame *f)
+{
+	if (p->backpressure != BACKPRESSURE_DEADLINE) {
+		return 0;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_ns(now) - timespec_ns(f->ts) > p->deadline;
+}
+
+// Pipelined, whether to drop slot rather than start the next stage group on
+// it; q is the queue it came from, with any newer slots behind it.  Counted.
+static int
+skip(struct thermapp_pipeline *p, struct thermapp_queue *q, const struct slot *slot)
+{
+	if (slot->ev != PIPELINE_FRAME || (slot->f.alarm && slot->f.alarm->changed)) {
+		return 0;
+	}
+	if (p->backpressure == BACKPRESSURE_LATEST) {
+		const struct slot *next = thermapp_queue_peek(q);
+		if (next && next->ev == PIPELINE_FRAME) {
+			drop(p, DROP_SUPERSEDED);
+			return 1;
+		}
+	} else if (late(p, &slot->f)) {
+		drop(p, DROP_LATE);
+		return 1;
+	}
+	return 0;
+}
+
+// Pipelined, wait until every slot is back, i.e. nothing is using the calibration.
+// The capture thread is the free queue's consumer, not a producer, so it keeps them.
+static void
+drain(struct thermapp_pipeline *p)
+{
+	while (p->stashed < SLOTS - !!p->capture_slot) {
+		p->stash[p->stashed++] = thermapp_queue_pop(p->free_q);
+	}
+}
+
+// Handle USB events until the next frame, into p->frame.  Everything that
+// has to happen for every frame, in order, happens here.
+static enum thermapp_pipeline_event
+capture(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f)
+{
+	struct thermapp_usb_dev *dev = p->dev;
+	union thermapp_frame *frame = p->frame;
+
+	while (thermapp_usb_transfers_pending(dev)
+	    && !atomic_load_explicit(&p->stop, memory_order_relaxed)) {
+		thermapp_usb_handle_events(dev);
+
+		struct timespec frame_ts;
+		if (!thermapp_usb_frame_read(dev, frame, sizeof *frame, &frame_ts)) {
+			if (p->resume_req) {
+				p->resume_req -= 1;
+
+				uint16_t mode = 2;
+				thermapp_usb_cfg_write(dev, &mode, offsetof(union thermapp_cfg, modes), sizeof mode);
+				thermapp_usb_cfg_write(dev, NULL, 0, 0);
+			}
+			continue;
+		}
+		STAGE(STAGE_USB_WAIT, &p->stage_ts);
+
+		if (dev->frames_overrun != p->overruns) {
+			atomic_fetch_add_explicit(&p->dropped[DROP_OVERRUN], dev->frames_overrun - p->overruns, memory_order_relaxed);
+			p->overruns = dev->frames_overrun;
+		}
+
+		if (p->ident_frame) {
+			p->ident_frame -= 1;
+
+			// Suspend, ideally until there is demand for the video.
+			// The camera holds the last 512-byte packet of the current frame until
+			// the following resume.  Note that this matches the start-up behavior
+			// where the first frame is preceded with 512 bytes of 0xff i.e. the
+			// last packet of the (nonexistent) frame before the first one.
+			uint16_t mode = 1;
+			thermapp_usb_cfg_write(dev, &mode, offsetof(union thermapp_cfg, modes), sizeof mode);
+			thermapp_usb_cfg_write(dev, NULL, 0, 0);
+
+			// Factory calibration files are read in the background.
+			// Until they're ready, frames are processed with the (offset-only)
+			// autocal set if a saved automatic calibration can be reused, and
+			// are raw only otherwise: there is nothing to correct them with.
+			p->cal = thermapp_cal_open_async(p->caldir, &frame->header);
+			if (!p->cal) {
+				return PIPELINE_ERROR;
+			}
+			p->cal_pending = 1;
+			if (thermapp_cal_loading(p->cal) && p->autocal_dir) {
+				p->autocal_tried = 1;
+				p->autocal_reused = thermapp_cache_autocal_load(p->cal, p->autocal_dir, &frame->header, p->autocal_max_temp_delta, p->autocal_max_age);
+				if (p->autocal_reused) {
+					thermapp_cal_bpr_init(p->cal);
+				}
+			}
+
+			if (p->rois && !thermapp_rois_compile(p->rois, p->cal->img_w, p->cal->img_h, p->fliph, p->flipv)) {
+				return PIPELINE_ERROR;
+			}
+			if (p->alarm && !thermapp_alarm_start(p->alarm, p->cal->img_w, p->cal->img_h, p->fliph, p->flipv)) {
+				return PIPELINE_ERROR;
+			}
+			if (p->change && !thermapp_change_start(p->change, p->cal->img_w, p->cal->img_h)) {
+				return PIPELINE_ERROR;
+			}
+
+			// TODO: Cannot detect video demand.  Resume now, calibration is read in the background.
+			p->resume_req = 3;
+
+			// Discard 1st frame, it usually has the header repeated twice
+			// and the data shifted into the pad by a corresponding amount.
+			// The caller sets up its outputs now that the size is known.
+			frame_info(p, f, frame_ts);
+			return PIPELINE_STARTED;
+		}
+
+		struct thermapp_cal *cal = p->cal;
+		if (p->cal_pending) {
+			if (p->pipelined && thermapp_cal_loaded(cal)) {
+				// The placeholder is freed by the swap, and every slot
+				// (including the caller's, see thermapp_pipeline_cal) may point to it.
+				drain(p);
+			}
+			cal = p->cal = thermapp_cal_join(cal, 0);
+			if (!thermapp_cal_loading(cal)) {
+				p->cal_pending = 0;
+
+				if (p->caldir) {
+					struct timespec now;
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					thermapp_log(thermapp_cal_present(cal) ? LOG_CAL_READY : LOG_CAL_UNAVAILABLE,
+					             p->caldir, timespec_delta(now, p->start_time) * 1e3);
+				}
+
+				// Restart temp sensor measurements.
+				thermapp_temp_reset(&p->temp, cal, timespec_ns(frame_ts));
+
+				// Use factory cal, saved autocal, and/or restart autocal.
+				// Autocal tables reused while loading came along with the swap.
+				if (thermapp_cal_present(cal)) {
+					thermapp_cal_bpr_init(cal);
+				} else if (p->autocal_reused
+				        || (!p->autocal_tried && p->autocal_dir
+				         && thermapp_cache_autocal_load(cal, p->autocal_dir, &frame->header, p->autocal_max_temp_delta, p->autocal_max_age))) {
+					thermapp_cal_bpr_init(cal);
+					if (p->scene_nuc && !p->scene) {
+						p->scene = thermapp_scene_open(cal);
+					}
+				} else {
+					p->autocal_frame = AUTOCAL_FRAMES;
+					thermapp_log(LOG_AUTOCAL_START, NULL, 0);
+				}
+			}
+		}
+
+		thermapp_temp_update(&p->temp, cal, &frame->header, timespec_ns(frame_ts));
+
+		// All autocal and image processing below expects the image size to match that of the ident frame.
+		if (frame->header.data_w != cal->img_w
+		 || frame->header.data_h != cal->img_h) {
+			continue;
+		}
+
+		frame_info(p, f, frame_ts);
+
+		if (p->cal_pending && !p->autocal_reused) {
+			return PIPELINE_RAW;
+		}
+
+		if (p->autocal_frame) {
+			p->autocal_frame -= 1;
+			thermapp_log(LOG_AUTOCAL_PROGRESS, NULL, AUTOCAL_FRAMES - p->autocal_frame);
+
+			thermapp_cal_autocal_add(cal, frame);
+
+			// Skip image processing until autocal data is ready to use.
+			if (p->autocal_frame) {
+				return PIPELINE_RAW;
+			}
+			thermapp_log(LOG_AUTOCAL_DONE, NULL, 0);
+			thermapp_cal_autocal_finish(cal);
+
+			if (p->autocal_dir) {
+				thermapp_cache_autocal_save(cal, p->autocal_dir, &frame->header);
+			}
+
+			if (p->scene_nuc && !p->scene) {
+				p->scene = thermapp_scene_open(cal);
+			}
+		}
+
+		if (thermapp_cal_select(cal, dev, p->video_mode, p->temp.therm)
+		// XXX: Don't update vgsk/VoutC on every frame, else it will go bistable
+		// since we begin seeing the effects of the vgsk/VoutC write immediately.
+		// Instead wait the about-two-frame delay for the previous write to
+		// complete (i.e. until the incoming header matches the outgoing header).
+		//
+		// Example:  We receive frame 1, calculate a delta to apply to vgsk/VoutC
+		// from the pixel data (which steps toward the target vgsk/VoutC value),
+		// and send that new value.  The delta begins to take effect while frame 2
+		// is being captured; later scanlines have increasingly larger or smaller
+		// values to match the gain change.  However the header for frame 2 does
+		// not contain the updated vgsk/VoutC value, it still reports the original
+		// value.  Next we receive frame 2, calculate a new delta from the original
+		// vgsk/VoutC (smaller than what was calculated from frame 1 because of the
+		// gain taking effect, which is a retreat from the target value), and send
+		// it.  The process repeats, with frame 3 reporting the vgsk/VoutC computed
+		// from frame 1 but with its pixel values retreating because of frame 2,
+		// resulting in a larger step than desired toward the target value.
+		 || p->vgsk == frame->header.VoutC) {
+			// If for some reason switching to the autocal set, don't adjust
+			// vgsk/VoutC since that cal is only valid at a particular value.
+			if (cal->cur_set < CAL_SETS) {
+				p->vgsk = thermapp_img_vgsk(cal, frame);
+				thermapp_usb_cfg_write(dev, &p->vgsk, offsetof(union thermapp_cfg, VoutC), sizeof p->vgsk);
+			} else {
+				p->vgsk = thermapp_initial_cfg.VoutC;
+			}
+		}
+
+		// XXX: Sometimes vgsk/VoutC in the response never updates to match the
+		// most recent request.  Unclear if that request is queued, or if it took
+		// effect and the response header was never updated.  May be timing related.
+		// Send the request on every received frame until it updates.
+		// See also resume_req, may need a 2nd/3rd write to resume after suspend.
+		thermapp_usb_cfg_write(dev, NULL, 0, 0);
+
+		// Background refinement applies to the autocal set only.
+		// Never blocks: the frame is dropped if the estimator is busy,
+		// and the newest complete offset table (if any) is swapped in.
+		if (p->scene && cal->cur_set == CAL_SETS) {
+			if (atomic_exchange_explicit(&p->recal_req, 0, memory_order_relaxed)) {
+				thermapp_scene_covered(p->scene, AUTOCAL_FRAMES);
+				thermapp_log(LOG_RECAL_START, NULL, 0);
+			}
+			thermapp_scene_submit(p->scene, frame);
+			cal->nuc_offset = thermapp_scene_offset(p->scene);
+		}
+
+		return PIPELINE_FRAME;
+	}
+	return PIPELINE_STOPPED;
+}
+
+// NUC through change detection, on the capture (or only) thread.
+static void
+nuc(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f, float *temp, struct thermapp_roi_result *roi, struct thermapp_alarm_result *alarm, struct thermapp_change_result *change)
+{
+	const struct thermapp_cal *cal = p->cal;
+
+	STAGE_START(&p->stage_ts);
+	thermapp_img_nuc(cal, p->frame, temp, !!p->temp.transient_steps, p->temp.delta);
+	STAGE(STAGE_NUC, &p->stage_ts);
+	thermapp_img_bpr(cal, temp);
+	STAGE(STAGE_BPR, &p->stage_ts);
+	thermapp_img_minmax(cal, temp, NULL, NULL, &f->i_min, &f->i_max, &f->t_min, &f->t_max, p->t_refl, p->emissivity);
+	STAGE(STAGE_MINMAX, &p->stage_ts);
+
+	div_t xy_min = div(f->i_min, cal->img_w);
+	div_t xy_max = div(f->i_max, cal->img_w);
+	if (p->fliph) {
+		xy_min.rem = cal->img_w - 1 - xy_min.rem;
+		xy_max.rem = cal->img_w - 1 - xy_max.rem;
+	}
+	if (p->flipv) {
+		xy_min.quot = cal->img_h - 1 - xy_min.quot;
+		xy_max.quot = cal->img_h - 1 - xy_max.quot;
+	}
+	f->min_x = xy_min.rem;
+	f->min_y = xy_min.quot;
+	f->max_x = xy_max.rem;
+	f->max_y = xy_max.quot;
+	f->temp = temp;
+
+	if (p->rois) {
+		thermapp_rois_measure(p->rois, temp, p->t_refl, p->emissivity, roi);
+		STAGE(STAGE_ROI, &p->stage_ts);
+		f->roi = roi;
+	}
+	if (p->alarm) {
+		thermapp_alarm_check(p->alarm, temp, p->t_refl, p->emissivity, alarm);
+		STAGE(STAGE_ALARM, &p->stage_ts);
+		f->alarm = alarm;
+	}
+	if (p->change) {
+		thermapp_change_detect(p->change, temp, change);
+		STAGE(STAGE_CHANGE, &p->stage_ts);
+		f->change = change;
+	}
+}
+
+// Quantize only the changed tiles into p->held, which then stands in for the
+// whole image.  Returns 0 if the LUT would come out the same as the last one:
+// it had stopped moving, and (with ignore_ratio 0, see
+// thermapp_img_lut_target) depends only on which values occur, which haven't
+// changed.  HPF output depends on every pixel, so the LUT then always runs.
+// Nothing is done if no tiles changed, and the frame is marked unchanged.
+static int
+quantize_changed(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f, uint16_t *quantized, struct thermapp_change_result *change)
+{
+	const struct thermapp_cal *cal = f->cal;
+	int enhanced = p->video_mode == VIDEO_MODE_ENHANCED;
+
+	if (!change->changed && p->lut_settled) {
+		change->unchanged = 1;
+		if (quantized != p->last_quantized) {
+			memcpy(quantized, p->last_quantized, f->w * f->h * sizeof *quantized);
+		}
+		return 0;
+	}
+
+	int occupancy = 0;
+	if (change->changed == change->tiles) {
+		// Every tile, as on the first frame: start over.
+		thermapp_img_quantize(cal, f->temp, p->held);
+		memset(p->bins, 0, (UINT16_MAX+1) * sizeof *p->bins);
+		for (size_t i = 0; i < f->w * f->h; ++i) {
+			p->bins[p->held[i]]++;
+		}
+		occupancy = 1;
+	} else {
+		const uint8_t *tile = change->tile;
+		for (size_t y = 0; y < f->h; y += CHANGE_TILE) {
+			size_t th = f->h - y < CHANGE_TILE ? f->h - y : CHANGE_TILE;
+			for (size_t x = 0; x < f->w; x += CHANGE_TILE) {
+				size_t tw = f->w - x < CHANGE_TILE ? f->w - x : CHANGE_TILE;
+				if (*tile++) {
+					occupancy |= thermapp_img_quantize_rect(cal, f->temp, p->held, p->bins, x, y, tw, th);
+				}
+			}
+		}
+	}
+	memcpy(quantized, p->held, f->w * f->h * sizeof *quantized);
+	return enhanced || occupancy || !p->lut_settled;
+}
+
+// Change detection has moved past the changed tiles of a frame the enhance
+// thread dropped; they go with the next frame it enhances.
+static void
+carry_tiles(struct thermapp_pipeline *p, const struct thermapp_change_result *change)
+{
+	for (size_t i = 0; i < change->tiles; ++i) {
+		p->carried[i] |= change->tile[i];
+	}
+	p->carrying = 1;
+}
+
+static void
+add_carried(struct thermapp_pipeline *p, struct thermapp_change_result *change)
+{
+	change->changed = 0;
+	for (size_t i = 0; i < change->tiles; ++i) {
+		change->tile[i] |= p->carried[i];
+		change->changed += change->tile[i];
+	}
+	memset(p->carried, 0, change->tiles * sizeof *p->carried);
+	p->carrying = 0;
+}
+
+// Quantize through LUT, in frame order, on the enhance (or only) thread.
+// The running LUT is p->palette_index; lut gets a copy if it's elsewhere.
+static void
+enhance(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f, uint16_t *quantized, uint8_t *lut, struct thermapp_change_result *change, struct timespec *mark)
+{
+	const struct thermapp_cal *cal = f->cal;
+
+	int lut_needed = 1;
+	if (p->change) {
+		if (p->carrying) {
+			add_carried(p, change);
+		}
+		lut_needed = quantize_changed(p, f, quantized, change);
+	} else {
+		thermapp_img_quantize(cal, f->temp, quantized);
+	}
+	STAGE(STAGE_QUANTIZE, mark);
+	if (p->video_mode == VIDEO_MODE_ENHANCED && lut_needed) {
+		thermapp_img_hpf(cal, quantized, p->enhanced_ratio, p->scratch);
+		STAGE(STAGE_HPF, mark);
+	}
+	if (!p->change) {
+		thermapp_img_lut(cal, quantized, p->palette_index, 0.0f, 0.0f, p->scratch);
+	} else if (lut_needed) {
+		memcpy(p->lut_prev, p->palette_index, (UINT16_MAX+1) * sizeof *p->lut_prev);
+		thermapp_img_lut(cal, quantized, p->palette_index, 0.0f, 0.0f, p->scratch);
+		p->lut_settled = !memcmp(p->lut_prev, p->palette_index, (UINT16_MAX+1) * sizeof *p->lut_prev);
+		change->repaint = !p->lut_settled || p->video_mode == VIDEO_MODE_ENHANCED;
+	}
+	if (p->change && !change->unchanged) {
+		p->last_quantized = quantized;
+	}
+	if (lut != p->palette_index) {
+		memcpy(lut, p->palette_index, (UINT16_MAX+1) * sizeof *lut);
+	}
+	STAGE(STAGE_LUT, mark);
+	f->quantized = quantized;
+	f->lut = lut;
+}
+
+static void *
+capture_run(void *arg)
+{
+	struct thermapp_pipeline *p = arg;
+	thermapp_trace_thread("capture");
+
+	enum thermapp_pipeline_event ev;
+	do {
+		// Without a free slot, keep up with the camera and drop the frame.
+		// The ident frame can't be dropped, but it's first: every slot is free.
+		struct slot *slot = p->stashed ? p->stash[--p->stashed]
+		                  : p->ident_frame ? thermapp_queue_pop(p->free_q)
+		                  : thermapp_queue_try_pop(p->free_q);
+		p->capture_slot = slot;
+		p->frame = slot ? slot->frame : p->spare_frame;
+
+		ev = capture(p, slot ? &slot->f : &p->spare);
+		if (!slot) {
+			if (ev == PIPELINE_FRAME || ev == PIPELINE_RAW) {
+				drop(p, DROP_BUSY);
+			}
+			continue;
+		}
+		if (ev == PIPELINE_FRAME) {
+			if (late(p, &slot->f)) {
+				// Keep the slot for the next frame.
+				drop(p, DROP_LATE);
+				p->stash[p->stashed++] = slot;
+				p->capture_slot = NULL;
+				continue;
+			}
+			nuc(p, &slot->f, slot->temp, slot->roi, &slot->alarm, &slot->change);
+		}
+		if (ev > PIPELINE_STOPPED) {
+			slot->ev = ev;
+			slot->dropped = 0;
+			p->capture_slot = NULL;
+			thermapp_queue_push(p->nuc_q, slot);
+		}
+	} while (ev > PIPELINE_STOPPED);
+
+	p->end = ev;
+	thermapp_queue_push(p->nuc_q, NULL);
+	return NULL;
+}
+
+static void *
+enhance_run(void *arg)
+{
+	struct thermapp_pipeline *p = arg;
+	thermapp_trace_thread("enhance");
+
+	struct slot *slot;
+	while ((slot = thermapp_queue_pop(p->nuc_q))) {
+		if (skip(p, p->nuc_q, slot)) {
+			slot->dropped = 1;
+			if (p->change) {
+				carry_tiles(p, &slot->change);
+			}
+		} else if (slot->ev == PIPELINE_FRAME) {
+			STAGE_START(&p->enhance_ts);
+			enhance(p, &slot->f, slot->quantized, slot->lut, &slot->change, &p->enhance_ts);
+		}
+		thermapp_queue_push(p->done_q, slot);
+	}
+	thermapp_queue_push(p->done_q, NULL);
+	return NULL;
+}
+
+// Opens the camera and starts streaming.
+struct thermapp_pipeline *
+thermapp_pipeline_open(const struct thermapp_pipeline_config *config)
+{
+	struct thermapp_pipeline *p = calloc(1, sizeof *p);
+	if (!p) {
+		perror("calloc");
+		return NULL;
+	}
+
+	int ok = 1;
+	p->caldir = strdup_opt(config->caldir, &ok);
+	p->autocal_dir = strdup_opt(config->autocal_dir, &ok);
+	if (!ok) {
+		goto err;
+	}
+	p->autocal_max_temp_delta = config->autocal_max_temp_delta;
+	p->autocal_max_age = config->autocal_max_age;
+	p->scene_nuc = config->scene_nuc;
+	p->video_mode = config->video_mode;
+	p->enhanced_ratio = config->enhanced_ratio;
+	p->fliph = config->fliph;
+	p->flipv = config->flipv;
+	p->palette = config->palette ? config->palette : thermapp_palette(NULL, p->palette_buf);
+	p->t_refl = config->t_refl;
+	p->emissivity = config->emissivity;
+	p->stats = config->stats;
+	p->stage_timing = config->stage_timing;
+	p->pipelined = config->pipelined;
+	p->backpressure = config->backpressure;
+	p->deadline = config->deadline * 1e9;
+	p->rois = config->rois;
+	p->alarm = config->alarm;
+	p->change = config->change;
+
+	p->resume_req = 2;
+	p->ident_frame = 1;
+	p->vgsk = thermapp_initial_cfg.VoutC;
+
+	p->arena = thermapp_arena_open(ARENA_SIZE);
+	if (!p->arena) {
+		goto err;
+	}
+	p->palette_index = thermapp_arena_alloc(p->arena, (UINT16_MAX+1) * sizeof *p->palette_index);
+	p->frame = thermapp_arena_alloc(p->arena, sizeof *p->frame);
+	p->temp_buf = thermapp_arena_alloc(p->arena, FRAME_PIXELS_MAX * sizeof *p->temp_buf);
+	p->quantized = thermapp_arena_alloc(p->arena, FRAME_PIXELS_MAX * sizeof *p->quantized);
+	p->rgb = thermapp_arena_alloc(p->arena, FRAME_PIXELS_MAX * sizeof *p->rgb);
+	p->scratch = thermapp_arena_alloc(p->arena, sizeof *p->scratch);
+	p->held = thermapp_arena_alloc(p->arena, FRAME_PIXELS_MAX * sizeof *p->held);
+	p->lut_prev = thermapp_arena_alloc(p->arena, (UINT16_MAX+1) * sizeof *p->lut_prev);
+	p->bins = thermapp_arena_alloc(p->arena, (UINT16_MAX+1) * sizeof *p->bins);
+	p->spare_frame = p->frame;
+
+	atomic_init(&p->recal_req, 0);
+	atomic_init(&p->stop, 0);
+	for (int i = 0; i < DROPS; ++i) {
+		atomic_init(&p->dropped[i], 0);
+	}
+	if (p->stats) {
+		thermapp_stats_drops(p->stats, p->dropped);
+	}
+	if (p->pipelined) {
+		p->slot_arena = thermapp_arena_open(SLOTS * SLOT_SIZE);
+		p->free_q = thermapp_queue_open(SLOTS);
+		p->nuc_q = thermapp_queue_open(SLOTS + 1);
+		p->done_q = thermapp_queue_open(SLOTS + 1);
+		if (!p->slot_arena || !p->free_q || !p->nuc_q || !p->done_q) {
+			goto err;
+		}
+		for (size_t i = 0; i < SLOTS; ++i) {
+			struct slot *slot = &p->slot[i];
+			slot->frame = thermapp_arena_alloc(p->slot_arena, sizeof *slot->frame);
+			slot->temp = thermapp_arena_alloc(p->slot_arena, FRAME_PIXELS_MAX * sizeof *slot->temp);
+			slot->quantized = thermapp_arena_alloc(p->slot_arena, FRAME_PIXELS_MAX * sizeof *slot->quantized);
+			slot->lut = thermapp_arena_alloc(p->slot_arena, (UINT16_MAX+1) * sizeof *slot->lut);
+			thermapp_queue_push(p->free_q, slot);
+		}
+	}
+
+	p->dev = thermapp_usb_open();
+	if (!p->dev) {
+		goto err;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &p->start_time);
+	p->stage_ts = p->start_time;
+	thermapp_usb_start(p->dev);
+
+	if (p->pipelined) {
+		int ret = pthread_create(&p->enhance_thread, NULL, enhance_run, p);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+			goto err;
+		}
+		p->enhance_started = 1;
+		ret = pthread_create(&p->capture_thread, NULL, capture_run, p);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+			goto err;
+		}
+		p->capture_started = 1;
+	}
+	return p;
+
+err:
+	thermapp_pipeline_close(p);
+	return NULL;
+}
+
+// What p->rgb is missing after a frame's processing, whether or not the
+// frame is rendered.
+static void
+mark_dirty(struct thermapp_pipeline *p, const struct thermapp_change_result *change)
+{
+	if (change && !change->unchanged) {
+		if (change->repaint) {
+			p->repaint = 1;
+		} else {
+			for (size_t i = 0; i < change->tiles; ++i) {
+				p->dirty[i] |= change->tile[i];
+			}
+		}
+	}
+}
+
+// The next event.  On PIPELINE_FRAME, call thermapp_pipeline_process.
+enum thermapp_pipeline_event
+thermapp_pipeline_wait(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f)
+{
+	if (!p->pipelined) {
+		enum thermapp_pipeline_event ev;
+		while ((ev = capture(p, f)) == PIPELINE_FRAME && late(p, f)) {
+			drop(p, DROP_LATE);
+		}
+		return ev;
+	}
+
+	if (p->output_slot) {
+		thermapp_queue_push(p->free_q, p->output_slot);
+		p->output_slot = NULL;
+	}
+	if (p->ended) {
+		return p->end;
+	}
+	for (;;) {
+		struct slot *slot = thermapp_queue_pop(p->done_q);
+		if (!slot) {
+			// Both threads are done; end was written before the handoff.
+			p->ended = 1;
+			return p->end;
+		}
+		if (!slot->dropped && !skip(p, p->done_q, slot)) {
+			p->output_slot = slot;
+			*f = slot->f;
+			STAGE_START(&p->output_ts);
+			return slot->ev;
+		}
+		if (!slot->dropped) {
+			// Enhanced, so the held image has its tiles; rgb doesn't.
+			mark_dirty(p, slot->f.change);
+		}
+		thermapp_queue_push(p->free_q, slot);
+	}
+}
+
+// NUC through LUT.  temp: where the NUC output goes (img_w * img_h, in 0.01 C),
+// or NULL for our own buffer.  Pipelined, this was already done; temp gets a copy.
+void
+thermapp_pipeline_process(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f, float *temp)
+{
+	if (p->pipelined) {
+		if (temp) {
+			memcpy(temp, f->temp, f->w * f->h * sizeof *temp);
+			f->temp = temp;
+		}
+	} else {
+		nuc(p, f, temp ? temp : p->temp_buf, p->roi, &p->alarm_result, &p->change_result);
+		enhance(p, f, p->quantized, p->palette_index, &p->change_result, &p->stage_ts);
+	}
+
+	mark_dirty(p, f->change);
+}
+
+// With change detection, only the tiles that changed since the last render.
+static void
+render_changed(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f)
+{
+	if (p->repaint) {
+		thermapp_img_palette(f->cal, f->quantized, f->lut, p->palette, p->rgb, p->fliph, p->flipv);
+		memset(p->dirty, 0, sizeof p->dirty);
+		p->repaint = 0;
+		return;
+	}
+	uint8_t *dirty = p->dirty;
+	for (size_t y = 0; y < f->h; y += CHANGE_TILE) {
+		size_t th = f->h - y < CHANGE_TILE ? f->h - y : CHANGE_TILE;
+		for (size_t x = 0; x < f->w; x += CHANGE_TILE) {
+			size_t tw = f->w - x < CHANGE_TILE ? f->w - x : CHANGE_TILE;
+			if (*dirty) {
+				thermapp_img_palette_rect(f->cal, f->quantized, f->lut, p->palette, p->rgb, p->fliph, p->flipv, x, y, tw, th);
+				*dirty = 0;
+			}
+			++dirty;
+		}
+	}
+}
+
+// Palette image, flipped for display, into rgb (img_w * img_h) or NULL for our own buffer.
+void
+thermapp_pipeline_render(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f, uint32_t *rgb)
+{
+	if (!rgb) {
+		rgb = p->rgb;
+	}
+	if (p->change) {
+		// p->rgb holds the image as of the last render.
+		render_changed(p, f);
+		if (rgb != p->rgb) {
+			memcpy(rgb, p->rgb, f->w * f->h * sizeof *rgb);
+		}
+	} else {
+		thermapp_img_palette(f->cal, f->quantized, f->lut, p->palette, rgb, p->fliph, p->flipv);
+	}
+	f->rgb = rgb;
+}
+
+// 16-bit image, flipped for display, into y16 (img_w * img_h).
+void
+thermapp_pipeline_render_y16(struct thermapp_pipeline *p, const struct thermapp_pipeline_frame *f, uint16_t *y16)
+{
+	thermapp_img_y16(f->cal, f->quantized, y16, p->fliph, p->flipv);
+}
+
+// The next processed and rendered frame, or PIPELINE_STOPPED or PIPELINE_ERROR.
+enum thermapp_pipeline_event
+thermapp_pipeline_next(struct thermapp_pipeline *p, struct thermapp_pipeline_frame *f)
+{
+	for (;;) {
+		enum thermapp_pipeline_event ev = thermapp_pipeline_wait(p, f);
+		if (ev == PIPELINE_FRAME) {
+			thermapp_pipeline_process(p, f, NULL);
+			thermapp_pipeline_render(p, f, NULL);
+			thermapp_pipeline_stage(p, STAGE_PALETTE);
+			return ev;
+		}
+		if (ev == PIPELINE_STOPPED || ev == PIPELINE_ERROR) {
+			return ev;
+		}
+	}
+}
+
+// Stage timing from the last mark to now, for the caller's own stages.
+void
+thermapp_pipeline_stage(struct thermapp_pipeline *p, enum thermapp_stage stage)
+{
+	STAGE(stage, p->pipelined ? &p->output_ts : &p->stage_ts);
+}
+
+// Frames dropped so far for the given reason.
+unsigned long
+thermapp_pipeline_dropped(struct thermapp_pipeline *p, enum thermapp_drop reason)
+{
+	return atomic_load_explicit(&p->dropped[reason], memory_order_relaxed);
+}
+
+const char *
+thermapp_drop_name(enum thermapp_drop reason)
+{
+	return drop_names[reason];
+}
+
+void
+thermapp_pipeline_close(struct thermapp_pipeline *p)
+{
+	if (!p)
+		return;
+
+	if (p->capture_started) {
+		atomic_store_explicit(&p->stop, 1, memory_order_relaxed);
+		// Keep the slots moving until the capture thread sees it (at the next USB event).
+		if (p->output_slot) {
+			thermapp_queue_push(p->free_q, p->output_slot);
+			p->output_slot = NULL;
+		}
+		while (!p->ended) {
+			struct slot *slot = thermapp_queue_pop(p->done_q);
+			if (slot) {
+				thermapp_queue_push(p->free_q, slot);
+			} else {
+				p->ended = 1;
+			}
+		}
+		pthread_join(p->capture_thread, NULL);
+	} else if (p->enhance_started) {
+		thermapp_queue_push(p->nuc_q, NULL);
+	}
+	if (p->enhance_started)
+		pthread_join(p->enhance_thread, NULL);
+	thermapp_queue_close(p->done_q);
+	thermapp_queue_close(p->nuc_q);
+	thermapp_queue_close(p->free_q);
+	thermapp_arena_close(p->slot_arena);
+
+	if (p->scene)
+		thermapp_scene_close(p->scene);
+	if (p->cal)
+		thermapp_cal_close(p->cal);
+	if (p->dev)
+		thermapp_usb_close(p->dev);
+	thermapp_arena_close(p->arena);
+	free(p->autocal_dir);
+	free(p->caldir);
+	free(p);
+}
@@ -0,0 +1,114 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <semaphore.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Single-producer, single-consumer queue of pointers.
+//
+// The ring itself is lock-free: the producer owns head, the consumer owns
+// tail, and each publishes its index with release.  The semaphore counts
+// items only so that an empty queue can be slept on; posting it costs one
+// atomic add when nobody is waiting.  There's no "full": queues are sized
+// for every item that can exist (e.g. a fixed pool of frame slots), so a
+// push never waits.
+
+struct thermapp_queue {
+	size_t mask;
+	atomic_size_t head; // next to push
+	atomic_size_t tail; // next to pop
+	sem_t items;
+	void *ring[];
+};
+
+// cap: the most items ever in the queue at once.
+struct thermapp_queue *
+thermapp_queue_open(size_t cap)
+{
+	size_t len = 1;
+	while (len < cap) {
+		len *= 2;
+	}
+
+	struct thermapp_queue *q = calloc(1, sizeof *q + len * sizeof *q->ring);
+	if (!q) {
+		perror("calloc");
+		return NULL;
+	}
+	q->mask = len - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	if (sem_init(&q->items, 0, 0) < 0) {
+		perror("sem_init");
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+void
+thermapp_queue_push(struct thermapp_queue *q, void *item)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	q->ring[head & q->mask] = item;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	sem_post(&q->items);
+}
+
+static void *
+take(struct thermapp_queue *q)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	// The semaphore says an item is there; this makes its contents visible.
+	while (atomic_load_explicit(&q->head, memory_order_acquire) == tail)
+		;
+	void *item = q->ring[tail & q->mask];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return item;
+}
+
+// Waits for an item.
+void *
+thermapp_queue_pop(struct thermapp_queue *q)
+{
+	while (sem_wait(&q->items) < 0 && errno == EINTR)
+		;
+	return take(q);
+}
+
+// Never waits; NULL when empty.
+void *
+thermapp_queue_try_pop(struct thermapp_queue *q)
+{
+	if (sem_trywait(&q->items) < 0) {
+		return NULL;
+	}
+	return take(q);
+}
+
+// The item the next pop would return, left in the queue; NULL when empty.
+// Consumer only.
+void *
+thermapp_queue_peek(struct thermapp_queue *q)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (atomic_load_explicit(&q->head, memory_order_acquire) == tail) {
+		return NULL;
+	}
+	return q->ring[tail & q->mask];
+}
+
+void
+thermapp_queue_close(struct thermapp_queue *q)
+{
+	if (!q)
+		return;
+
+	sem_destroy(&q->items);
+	free(q);
+}
@@ -0,0 +1,433 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Pre-trigger recorder ("dashcam" mode).
+//
+// Every raw frame is appended to a byte ring of fixed size, allocated and
+// touched once when the recorder is opened.  Nothing is written to disk until
+// thermapp_rec_trigger; then a background thread writes out the frames from
+// the last pre seconds, and keeps writing new frames until post seconds after
+// the (latest) trigger.
+//
+// The capture thread never waits for the writer.  Positions in the ring are
+// 64-bit byte counts that only increase.  Before overwriting old records, the
+// capture thread advances "oldest" past them.  The writer copies each record
+// out of the ring, then checks that oldest has not moved past it (seqlock
+// style).  If the disk is too slow and the writer falls a whole ring behind,
+// it skips ahead to oldest and counts an overrun.
+//
+// Records are 8-byte aligned in the ring, and never wrap: if a record does
+// not fit before the end, the rest is marked as padding.  In the output file,
+// records are packed one after another, each a struct thermapp_rec_header
+// followed by len bytes of the frame as received (header and pixels), or of
+// the frame as coded by thermapp_codec_encode.
+//
+// With compression, frames are coded by the capture thread as they go into
+// the ring.  The ring is still sized for uncompressed frames, so it holds
+// more than pre seconds; the extra is not written out.
+
+#define REC_MAGIC_PAD   0x50416854 // "ThAP", ring only: skip to the end
+
+#define REC_FPS 25 // for sizing the ring; the camera is slower than this
+
+struct thermapp_rec {
+	pthread_t thread;
+	sem_t wake;
+	atomic_int stop;
+
+	char *dir;
+	uint64_t pre_ns;
+	uint64_t post_ns;
+
+	unsigned char *ring;
+	size_t cap;
+	atomic_uint_least64_t head;   // end of the newest record
+	atomic_uint_least64_t oldest; // start of the oldest intact record
+	atomic_uint_least64_t trigger; // time of the latest trigger, 0 = never
+	atomic_int active;            // writer wants to hear about every frame
+
+	// Writer private.
+	unsigned char *bounce;
+	size_t bounce_len;
+	int compress;
+	int fd;
+
+	// Statistics.
+	unsigned long frames;          // written by the capture thread only
+	unsigned long frames_rejected; // written by the capture thread only
+	uint64_t bytes_in;             // written by the capture thread only
+	uint64_t bytes_stored;         // written by the capture thread only
+	atomic_ulong events;
+	atomic_ulong frames_written;
+	atomic_ulong overruns;
+	atomic_ulong write_errors;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+align8(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+// Position of the next record at or after pos, skipping the unusable tail of the ring.
+static uint64_t
+skip_tail(const struct thermapp_rec *rec, uint64_t pos)
+{
+	size_t off = pos % rec->cap;
+	if (rec->cap - off < sizeof (struct thermapp_rec_header)) {
+		pos += rec->cap - off;
+	}
+	return pos;
+}
+
+static int
+open_event(struct thermapp_rec *rec)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	struct tm tm;
+	localtime_r(&ts.tv_sec, &tm);
+
+	char stamp[32];
+	strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", &tm);
+	size_t len = strlen(rec->dir) + sizeof "/thermapp-" + strlen(stamp) + sizeof ".000.rec";
+	char *path = malloc(len);
+	if (!path) {
+		perror("malloc");
+		return -1;
+	}
+	snprintf(path, len, "%s/thermapp-%s.%03ld.rec", rec->dir, stamp, ts.tv_nsec / 1000000);
+
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (rec->fd < 0) {
+		perror(path);
+	}
+	free(path);
+	return rec->fd;
+}
+
+static void
+close_event(struct thermapp_rec *rec)
+{
+	if (rec->fd >= 0) {
+		close(rec->fd);
+		rec->fd = -1;
+	}
+	atomic_store_explicit(&rec->active, 0, memory_order_relaxed);
+}
+
+// Copy the record at *pos into the bounce buffer.  Returns 1 and advances *pos,
+// or 0 if there is nothing new, with *pos moved past padding or to oldest after
+// an overrun.
+static int
+fetch(struct thermapp_rec *rec, uint64_t *pos, struct thermapp_rec_header *hdr)
+{
+	for (;;) {
+		uint64_t head = atomic_load_explicit(&rec->head, memory_order_acquire);
+		uint64_t p = skip_tail(rec, *pos);
+		if (p >= head) {
+			return 0;
+		}
+
+		size_t off = p % rec->cap;
+		memcpy(hdr, &rec->ring[off], sizeof *hdr);
+		size_t len = sizeof *hdr + hdr->len;
+		int ok = hdr->magic == REC_MAGIC_PAD
+		      || ((hdr->magic == REC_MAGIC_FRAME || hdr->magic == REC_MAGIC_CODEC)
+		          && len <= rec->bounce_len && off + len <= rec->cap);
+		if (ok && hdr->magic != REC_MAGIC_PAD) {
+			memcpy(rec->bounce, &rec->ring[off], len);
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+		uint64_t oldest = atomic_load_explicit(&rec->oldest, memory_order_relaxed);
+		if (oldest > p) {
+			// Overwritten while (or before) copying.
+			atomic_fetch_add_explicit(&rec->overruns, 1, memory_order_relaxed);
+			*pos = oldest;
+			continue;
+		}
+		if (!ok) {
+			// Lost track of record boundaries; resynchronize at the newest frame.
+			atomic_fetch_add_explicit(&rec->overruns, 1, memory_order_relaxed);
+			*pos = head;
+			return 0;
+		}
+
+		if (hdr->magic == REC_MAGIC_PAD) {
+			*pos = p + (rec->cap - off);
+			continue;
+		}
+
+		*pos = p + align8(len);
+		return 1;
+	}
+}
+
+static void *
+writer(void *arg)
+{
+	struct thermapp_rec *rec = arg;
+	uint64_t last_trigger = 0;
+	uint64_t end = 0;
+	uint64_t pos = 0;
+	thermapp_trace_thread("rec");
+
+	for (;;) {
+		while (sem_wait(&rec->wake) < 0 && errno == EINTR)
+			;
+		int stop = atomic_load_explicit(&rec->stop, memory_order_acquire);
+
+		uint64_t trigger = atomic_load_explicit(&rec->trigger, memory_order_relaxed);
+		if (trigger != last_trigger) {
+			last_trigger = trigger;
+			end = trigger + rec->post_ns;
+			if (rec->fd < 0 && open_event(rec) >= 0) {
+				atomic_fetch_add_explicit(&rec->events, 1, memory_order_relaxed);
+				atomic_store_explicit(&rec->active, 1, memory_order_relaxed);
+
+				// Start at the first frame within the pre-trigger window.
+				pos = atomic_load_explicit(&rec->oldest, memory_order_acquire);
+				struct thermapp_rec_header hdr;
+				uint64_t start = trigger > rec->pre_ns ? trigger - rec->pre_ns : 0;
+				uint64_t p = pos;
+				while (fetch(rec, &p, &hdr) && hdr.timestamp < start) {
+					pos = p;
+				}
+			}
+		}
+
+		struct thermapp_rec_header hdr;
+		while (rec->fd >= 0 && fetch(rec, &pos, &hdr)) {
+			if (hdr.timestamp > end) {
+				close_event(rec);
+				break;
+			}
+			uint64_t trace_start = thermapp_trace_now();
+			ssize_t n = write(rec->fd, rec->bounce, sizeof hdr + hdr.len);
+			thermapp_trace_span("rec write", trace_start);
+			if (n != (ssize_t)(sizeof hdr + hdr.len)) {
+				if (n < 0) {
+					perror("write");
+				}
+				atomic_fetch_add_explicit(&rec->write_errors, 1, memory_order_relaxed);
+				close_event(rec);
+				break;
+			}
+			atomic_fetch_add_explicit(&rec->frames_written, 1, memory_order_relaxed);
+		}
+
+		if (stop) {
+			close_event(rec);
+			break;
+		}
+	}
+	return NULL;
+}
+
+struct thermapp_rec *
+thermapp_rec_open(const char *dir, double pre_seconds, double post_seconds, size_t frame_len, int compress)
+{
+	struct thermapp_rec *rec = calloc(1, sizeof *rec);
+	if (!rec) {
+		perror("calloc");
+		return NULL;
+	}
+	rec->fd = -1;
+	rec->ring = MAP_FAILED;
+	rec->pre_ns  = pre_seconds  * 1e9;
+	rec->post_ns = post_seconds * 1e9;
+
+	rec->dir = strdup(dir);
+	if (!rec->dir) {
+		perror("strdup");
+		goto err;
+	}
+
+	rec->compress = compress;
+	rec->bounce_len = sizeof (struct thermapp_rec_header) + frame_len;
+	if (compress) {
+		size_t bound = thermapp_codec_bound((frame_len - HEADER_SIZE) / 2);
+		if (bound > frame_len) {
+			rec->bounce_len = sizeof (struct thermapp_rec_header) + bound;
+		}
+	}
+
+	// Room for pre_seconds of frames at the nominal rate, plus one frame
+	// lost to padding at the end of the ring and one being written.  Each
+	// frame reserves align8(bounce_len), the most it can take compressed.
+	size_t frames = pre_seconds * REC_FPS + 2;
+	rec->cap = align8(rec->bounce_len) * frames;
+
+	// Touch everything now so memory use doesn't grow later.
+	rec->ring = mmap(NULL, rec->cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (rec->ring == MAP_FAILED) {
+		perror("mmap");
+		goto err;
+	}
+	rec->bounce = malloc(rec->bounce_len);
+	if (!rec->bounce) {
+		perror("malloc");
+		goto err;
+	}
+	memset(rec->bounce, 0, rec->bounce_len);
+
+	atomic_init(&rec->stop, 0);
+	atomic_init(&rec->head, 0);
+	atomic_init(&rec->oldest, 0);
+	atomic_init(&rec->trigger, 0);
+	atomic_init(&rec->active, 0);
+	atomic_init(&rec->events, 0);
+	atomic_init(&rec->frames_written, 0);
+	atomic_init(&rec->overruns, 0);
+	atomic_init(&rec->write_errors, 0);
+
+	if (sem_init(&rec->wake, 0, 0) < 0) {
+		perror("sem_init");
+		goto err;
+	}
+	int ret = pthread_create(&rec->thread, NULL, writer, rec);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+		sem_destroy(&rec->wake);
+		goto err;
+	}
+
+	printf("Recorder: %.1f MB for %g s before and %g s after each trigger\n",
+	       rec->cap / 1e6, pre_seconds, post_seconds);
+	return rec;
+
+err:
+	free(rec->bounce);
+	if (rec->ring != MAP_FAILED)
+		munmap(rec->ring, rec->cap);
+	free(rec->dir);
+	free(rec);
+	return NULL;
+}
+
+void
+thermapp_rec_frame(struct thermapp_rec *rec, const union thermapp_frame *frame, size_t len, uint64_t timestamp)
+{
+	rec->frames += 1;
+	struct thermapp_rec_header hdr = {
+		.magic = REC_MAGIC_FRAME,
+		.len = len,
+		.timestamp = timestamp,
+	};
+	if (sizeof hdr + len > rec->bounce_len) {
+		rec->frames_rejected += 1;
+		return;
+	}
+
+	// Reserve room for the worst case, the unused part is given back below.
+	size_t max_len = rec->compress ? rec->bounce_len - sizeof hdr : len;
+	size_t need = align8(sizeof hdr + max_len);
+
+	uint64_t pos = atomic_load_explicit(&rec->head, memory_order_relaxed);
+	uint64_t oldest = atomic_load_explicit(&rec->oldest, memory_order_relaxed);
+	size_t off = pos % rec->cap;
+	size_t pad = 0;
+	if (off + need > rec->cap) {
+		pad = rec->cap - off;
+	}
+
+	// Retire the records about to be overwritten, before touching them.
+	while (oldest + rec->cap < pos + pad + need) {
+		oldest = skip_tail(rec, oldest);
+		if (oldest + rec->cap >= pos + pad + need) {
+			break;
+		}
+		const struct thermapp_rec_header *old = (const struct thermapp_rec_header *)&rec->ring[oldest % rec->cap];
+		if (old->magic == REC_MAGIC_PAD) {
+			oldest += rec->cap - oldest % rec->cap;
+		} else {
+			oldest += align8(sizeof *old + old->len);
+		}
+	}
+	atomic_store_explicit(&rec->oldest, oldest, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	if (pad) {
+		if (pad >= sizeof hdr) {
+			struct thermapp_rec_header pad_hdr = { .magic = REC_MAGIC_PAD, .len = pad - sizeof hdr };
+			memcpy(&rec->ring[off], &pad_hdr, sizeof pad_hdr);
+		}
+		pos += pad;
+		off = 0;
+	}
+	size_t coded = rec->compress ? thermapp_codec_encode(frame, &rec->ring[off + sizeof hdr], max_len) : 0;
+	if (coded) {
+		hdr.magic = REC_MAGIC_CODEC;
+		hdr.len = coded;
+	} else {
+		memcpy(&rec->ring[off + sizeof hdr], frame->bytes, len);
+	}
+	memcpy(&rec->ring[off], &hdr, sizeof hdr);
+	rec->bytes_in += len;
+	rec->bytes_stored += hdr.len;
+	atomic_store_explicit(&rec->head, pos + align8(sizeof hdr + hdr.len), memory_order_release);
+
+	if (atomic_load_explicit(&rec->active, memory_order_relaxed)) {
+		sem_post(&rec->wake);
+	}
+}
+
+void
+thermapp_rec_trigger(struct thermapp_rec *rec)
+{
+	atomic_store_explicit(&rec->trigger, now_ns(), memory_order_relaxed);
+	sem_post(&rec->wake);
+}
+
+void
+thermapp_rec_close(struct thermapp_rec *rec)
+{
+	if (!rec)
+		return;
+
+	atomic_store_explicit(&rec->stop, 1, memory_order_release);
+	sem_post(&rec->wake);
+	pthread_join(rec->thread, NULL);
+	sem_destroy(&rec->wake);
+
+	printf("Recorder: %lu frames, %lu events, %lu frames written, %lu overruns, %lu write errors",
+	       rec->frames, atomic_load(&rec->events), atomic_load(&rec->frames_written),
+	       atomic_load(&rec->overruns), atomic_load(&rec->write_errors));
+	if (rec->compress && rec->bytes_stored) {
+		printf(", compression %.2f:1", (double)rec->bytes_in / rec->bytes_stored);
+	}
+	if (rec->frames_rejected) {
+		printf(", %lu frames too large", rec->frames_rejected);
+	}
+	printf("\n");
+
+	free(rec->bounce);
+	munmap(rec->ring, rec->cap);
+	free(rec->dir);
+	free(rec);
+}
@@ -0,0 +1,28 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef THERMAPP_REF_H
+#define THERMAPP_REF_H
+
+// Test-only entry points, for thermapp-img-fuzz.  Not installed.
+
+#include "thermapp.h"
+
+// Frozen reference copies of the thermapp_img_* kernels, for testing optimized versions (ref.c).
+int thermapp_ref_img_vgsk(const struct thermapp_cal *, const union thermapp_frame *);
+void thermapp_ref_img_nuc(const struct thermapp_cal *, const union thermapp_frame *, float *, int, float);
+void thermapp_ref_img_bpr(const struct thermapp_cal *, float *);
+void thermapp_ref_img_minmax(const struct thermapp_cal *, const float *, float *, float *, size_t *, size_t *, double *, double *, double, double);
+void thermapp_ref_img_quantize(const struct thermapp_cal *, const float *, uint16_t *);
+void thermapp_ref_img_hpf(const struct thermapp_cal *, uint16_t *, float);
+void thermapp_ref_img_lut(const struct thermapp_cal *, const uint16_t *, uint8_t *, float, float);
+void thermapp_ref_img_palette(const struct thermapp_cal *, const uint16_t *, const uint8_t *, const uint32_t *, uint32_t *, int, int);
+void thermapp_ref_img_y16(const struct thermapp_cal *, const uint16_t *, uint16_t *, int, int);
+
+// The thermapp_scale_* functions without SSE2 (scale-scalar.o).
+struct thermapp_scale *thermapp_scale_scalar_open(size_t, size_t, enum thermapp_scale_filter, int);
+void thermapp_scale_scalar_size(const struct thermapp_scale *, size_t *, size_t *);
+void thermapp_scale_scalar_image(struct thermapp_scale *, const uint32_t *, uint32_t *);
+void thermapp_scale_scalar_close(struct thermapp_scale *);
+
+#endif
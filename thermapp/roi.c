@@ -0,0 +1,427 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Regions of interest, measured in one pass over the NUC output.
+//
+// A ROI file has one region per line: a name, then two or more points x,y in
+// the displayed (flipped) image, e.g.
+//
+//   door   10,20 60,120
+//   pipe   100,40 180,40 200,90 120,90
+//
+// Two points are the opposite corners of a rectangle, both included.  More
+// are a polygon, filled with the even-odd rule: a pixel is in it if its
+// center is inside, or on a left or top edge.  Blank lines and lines
+// starting with # are ignored.
+//
+// thermapp_rois_compile turns the regions into a list of segments, runs of
+// pixels within one row covered by the same set of regions, in memory order.
+// Measuring converts each pixel that is in any region to a temperature once,
+// gathers min/max/sums for each segment, then folds the segment into every
+// region covering it, so the cost per pixel doesn't depend on how many
+// regions there are or how much they overlap.
+
+struct seg {
+	uint32_t start; // pixel index
+	uint32_t len;
+	uint64_t mask;  // regions covering it, bit i for region i
+};
+
+struct roi {
+	char name[ROI_NAME_MAX + 1];
+	size_t first; // into xy
+	size_t points;
+};
+
+// A run of one region's pixels in a row.
+struct span {
+	int x0, x1;   // inclusive
+	unsigned roi;
+};
+
+struct thermapp_rois {
+	struct roi roi[ROI_MAX];
+	size_t count;
+	int (*xy)[2];
+	size_t points;
+
+	size_t w, h;
+	int fliph, flipv;
+	struct seg *seg;
+	size_t segs;
+};
+
+static int
+add_point(struct thermapp_rois *rois, int x, int y, size_t *cap)
+{
+	if (rois->points == *cap) {
+		size_t new_cap = *cap ? 2 * *cap : 64;
+		void *xy = realloc(rois->xy, new_cap * sizeof *rois->xy);
+		if (!xy) {
+			perror("realloc");
+			return 0;
+		}
+		rois->xy = xy;
+		*cap = new_cap;
+	}
+	rois->xy[rois->points][0] = x;
+	rois->xy[rois->points][1] = y;
+	rois->points++;
+	return 1;
+}
+
+// Reads the regions.  They're laid out over an image by thermapp_rois_compile.
+struct thermapp_rois *
+thermapp_rois_open(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	struct thermapp_rois *rois = calloc(1, sizeof *rois);
+	if (!rois) {
+		perror("calloc");
+		fclose(f);
+		return NULL;
+	}
+
+	size_t cap = 0;
+	char line[4096];
+	for (int line_num = 1; fgets(line, sizeof line, f); ++line_num) {
+		char *s = line + strspn(line, " \t\r\n");
+		if (!*s || *s == '#') {
+			continue;
+		}
+		size_t name_len = strcspn(s, " \t\r\n");
+		if (name_len > ROI_NAME_MAX) {
+			fprintf(stderr, "%s:%d: name longer than %d characters\n", path, line_num, ROI_NAME_MAX);
+			goto err;
+		}
+		if (rois->count == ROI_MAX) {
+			fprintf(stderr, "%s:%d: more than %d regions\n", path, line_num, ROI_MAX);
+			goto err;
+		}
+		struct roi *roi = &rois->roi[rois->count];
+		memcpy(roi->name, s, name_len);
+		roi->name[name_len] = '\0';
+		roi->first = rois->points;
+		s += name_len;
+
+		int x, y, n;
+		while (sscanf(s, " %d ,%d%n", &x, &y, &n) == 2) {
+			if (!add_point(rois, x, y, &cap)) {
+				goto err;
+			}
+			s += n;
+		}
+		s += strspn(s, " \t\r\n");
+		roi->points = rois->points - roi->first;
+		if (*s || roi->points < 2) {
+			fprintf(stderr, "%s:%d: expected a name and at least two points x,y\n", path, line_num);
+			goto err;
+		}
+		rois->count++;
+	}
+	if (ferror(f)) {
+		perror(path);
+		goto err;
+	}
+	fclose(f);
+	return rois;
+
+err:
+	fclose(f);
+	thermapp_rois_close(rois);
+	return NULL;
+}
+
+size_t
+thermapp_rois_count(const struct thermapp_rois *rois)
+{
+	return rois->count;
+}
+
+const char *
+thermapp_rois_name(const struct thermapp_rois *rois, size_t i)
+{
+	return rois->roi[i].name;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+cmp_int(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+// Appends the spans of region i on display row y, clipped to the image.
+static size_t
+row_spans(const struct thermapp_rois *rois, unsigned i, int y, struct span *out, double *cross)
+{
+	const struct roi *roi = &rois->roi[i];
+	const int (*xy)[2] = (const int (*)[2])rois->xy + roi->first;
+	int w = rois->w;
+	size_t n = 0;
+
+	if (roi->points == 2) {
+		int x0 = xy[0][0] < xy[1][0] ? xy[0][0] : xy[1][0];
+		int x1 = xy[0][0] < xy[1][0] ? xy[1][0] : xy[0][0];
+		int y0 = xy[0][1] < xy[1][1] ? xy[0][1] : xy[1][1];
+		int y1 = xy[0][1] < xy[1][1] ? xy[1][1] : xy[0][1];
+		if (y >= y0 && y <= y1) {
+			out[n++] = (struct span){ x0, x1, i };
+		}
+	} else {
+		// Where each edge crosses the row, counting an edge's lower end but not its upper.
+		size_t crossings = 0;
+		for (size_t k = 0; k < roi->points; ++k) {
+			const int *a = xy[k];
+			const int *b = xy[(k + 1) % roi->points];
+			if ((a[1] <= y) != (b[1] <= y)) {
+				cross[crossings++] = a[0] + (double)(y - a[1]) * (b[0] - a[0]) / (b[1] - a[1]);
+			}
+		}
+		qsort(cross, crossings, sizeof *cross, cmp_double);
+		// Pixel x is inside if an odd number of crossings lie to its right.
+		for (size_t k = 0; k + 1 < crossings; k += 2) {
+			int x0 = ceil(cross[k]);
+			int x1 = (int)ceil(cross[k + 1]) - 1;
+			if (x0 <= x1) {
+				out[n++] = (struct span){ x0, x1, i };
+			}
+		}
+	}
+
+	size_t kept = 0;
+	for (size_t k = 0; k < n; ++k) {
+		if (out[k].x0 < 0)
+			out[k].x0 = 0;
+		if (out[k].x1 > w - 1)
+			out[k].x1 = w - 1;
+		if (out[k].x0 <= out[k].x1)
+			out[kept++] = out[k];
+	}
+	return kept;
+}
+
+// Lays the regions out over a w x h image, displayed with the given flips.
+// Fails if a region has no pixels in the image.
+int
+thermapp_rois_compile(struct thermapp_rois *rois, size_t w, size_t h, int fliph, int flipv)
+{
+	rois->w = w;
+	rois->h = h;
+	rois->fliph = fliph;
+	rois->flipv = flipv;
+	free(rois->seg);
+	rois->seg = NULL;
+	rois->segs = 0;
+
+	// Each region contributes at most one span per pair of its edges.
+	size_t max_spans = 0;
+	for (size_t i = 0; i < rois->count; ++i) {
+		max_spans += rois->roi[i].points / 2 + 1;
+	}
+	struct span *span = malloc(max_spans * sizeof *span);
+	double *cross = malloc((rois->points + 1) * sizeof *cross);
+	int *edge = malloc(2 * max_spans * sizeof *edge);
+	size_t *pixels = calloc(rois->count + 1, sizeof *pixels);
+	size_t cap = 0;
+	int ok = 0;
+	if (!span || !cross || !edge || !pixels) {
+		perror("malloc");
+		goto done;
+	}
+
+	for (size_t row = 0; row < h; ++row) {
+		int y = flipv ? h - 1 - row : row;
+		size_t spans = 0;
+		for (unsigned i = 0; i < rois->count; ++i) {
+			spans += row_spans(rois, i, y, span + spans, cross);
+		}
+		if (!spans) {
+			continue;
+		}
+
+		// In buffer order, then cut at every span boundary.
+		size_t edges = 0;
+		for (size_t k = 0; k < spans; ++k) {
+			if (fliph) {
+				int x0 = w - 1 - span[k].x1;
+				span[k].x1 = w - 1 - span[k].x0;
+				span[k].x0 = x0;
+			}
+			edge[edges++] = span[k].x0;
+			edge[edges++] = span[k].x1 + 1;
+		}
+		qsort(edge, edges, sizeof *edge, cmp_int);
+
+		for (size_t e = 0; e + 1 < edges; ++e) {
+			int x0 = edge[e], x1 = edge[e + 1];
+			if (x0 == x1) {
+				continue;
+			}
+			uint64_t mask = 0;
+			for (size_t k = 0; k < spans; ++k) {
+				if (span[k].x0 <= x0 && x0 <= span[k].x1) {
+					mask |= (uint64_t)1 << span[k].roi;
+				}
+			}
+			if (!mask) {
+				continue;
+			}
+			for (uint64_t m = mask; m; m &= m - 1) {
+				pixels[__builtin_ctzll(m)] += x1 - x0;
+			}
+
+			uint32_t start = row * w + x0;
+			struct seg *last = rois->segs ? &rois->seg[rois->segs - 1] : NULL;
+			if (last && last->mask == mask && last->start + last->len == start) {
+				last->len += x1 - x0;
+				continue;
+			}
+			if (rois->segs == cap) {
+				size_t new_cap = cap ? 2 * cap : 256;
+				struct seg *seg = realloc(rois->seg, new_cap * sizeof *seg);
+				if (!seg) {
+					perror("realloc");
+					goto done;
+				}
+				rois->seg = seg;
+				cap = new_cap;
+			}
+			rois->seg[rois->segs++] = (struct seg){ start, x1 - x0, mask };
+		}
+	}
+
+	ok = 1;
+	for (size_t i = 0; i < rois->count; ++i) {
+		if (!pixels[i]) {
+			fprintf(stderr, "ROI %s is outside the %zux%zu image\n", rois->roi[i].name, w, h);
+			ok = 0;
+		}
+	}
+
+done:
+	free(pixels);
+	free(edge);
+	free(cross);
+	free(span);
+	return ok;
+}
+
+struct roi_acc {
+	double sum, sum2;
+	float px_min, px_max;
+	size_t i_min, i_max;
+	size_t n;
+};
+
+// One result per region, in file order.  temp is the NUC output (0.01 C units,
+// before emissivity, in buffer order); temperatures are corrected as in
+// thermapp_img_minmax.
+void
+thermapp_rois_measure(const struct thermapp_rois *rois, const float *temp, double t_refl, double emissivity, struct thermapp_roi_result *results)
+{
+	struct roi_acc acc[ROI_MAX];
+	for (size_t i = 0; i < rois->count; ++i) {
+		acc[i] = (struct roi_acc){ .px_min = INFINITY, .px_max = -INFINITY };
+	}
+
+	// t = ((x^4 - R*r^4)/E)^0.25, see thermapp_img_minmax.  It's monotonic, so
+	// min/max are found on the NUC output and only the sums need every pixel
+	// converted; single precision is good to a few mK here.
+	double refl = (1.0 - emissivity) * pow(t_refl + 273.15, 4.0);
+	float refl_f = refl;
+	float inv_e = 1.0 / emissivity;
+
+	for (size_t s = 0; s < rois->segs; ++s) {
+		const struct seg *seg = &rois->seg[s];
+		const float *px = temp + seg->start;
+		float px_min = px[0], px_max = px[0];
+		uint32_t k_min = 0, k_max = 0;
+		double sum = 0.0, sum2 = 0.0;
+		for (uint32_t k = 0; k < seg->len; ++k) {
+			float x = px[k] * 0.01f + 273.15f;
+			float x2 = x * x;
+			float t = sqrtf(sqrtf((x2 * x2 - refl_f) * inv_e)) - 273.15f;
+			sum += t;
+			sum2 += (double)t * t;
+			if (px_min > px[k]) {
+				px_min = px[k];
+				k_min = k;
+			}
+			if (px_max < px[k]) {
+				px_max = px[k];
+				k_max = k;
+			}
+		}
+
+		for (uint64_t m = seg->mask; m; m &= m - 1) {
+			struct roi_acc *a = &acc[__builtin_ctzll(m)];
+			a->sum += sum;
+			a->sum2 += sum2;
+			a->n += seg->len;
+			if (a->px_min > px_min) {
+				a->px_min = px_min;
+				a->i_min = seg->start + k_min;
+			}
+			if (a->px_max < px_max) {
+				a->px_max = px_max;
+				a->i_max = seg->start + k_max;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < rois->count; ++i) {
+		const struct roi_acc *a = &acc[i];
+		struct thermapp_roi_result *r = &results[i];
+		double mean = a->sum / a->n;
+		double var = a->sum2 / a->n - mean * mean;
+		r->t_min = pow((pow(a->px_min / 100.0 + 273.15, 4.0) - refl) / emissivity, 0.25) - 273.15;
+		r->t_max = pow((pow(a->px_max / 100.0 + 273.15, 4.0) - refl) / emissivity, 0.25) - 273.15;
+		r->t_mean = mean;
+		r->t_stddev = var > 0.0 ? sqrt(var) : 0.0;
+		r->pixels = a->n;
+		r->i_min = a->i_min;
+		r->i_max = a->i_max;
+		r->min_x = a->i_min % rois->w;
+		r->min_y = a->i_min / rois->w;
+		r->max_x = a->i_max % rois->w;
+		r->max_y = a->i_max / rois->w;
+		if (rois->fliph) {
+			r->min_x = rois->w - 1 - r->min_x;
+			r->max_x = rois->w - 1 - r->max_x;
+		}
+		if (rois->flipv) {
+			r->min_y = rois->h - 1 - r->min_y;
+			r->max_y = rois->h - 1 - r->max_y;
+		}
+	}
+}
+
+void
+thermapp_rois_close(struct thermapp_rois *rois)
+{
+	if (!rois)
+		return;
+
+	free(rois->seg);
+	free(rois->xy);
+	free(rois);
+}
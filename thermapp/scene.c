@@ -0,0 +1,361 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Background refinement of the autocal offset table.
+//
+// The capture thread hands over at most one frame at a time through a
+// single-slot mailbox; if the worker is still busy, the frame is dropped
+// rather than waiting.  The worker keeps its own running estimate and
+// publishes snapshots of it through a triple buffer, so the capture thread
+// can always pick up the most recent complete table without locking and the
+// worker never writes to a table the capture thread may be reading.
+//
+// Two estimators:
+// * Scene-based (default): for each good pixel, the difference between its
+//   corrected value and the mean of its 4 neighbors is assumed to be fixed
+//   pattern noise, and a small fraction of it is removed from the offset.
+//   Only frames with enough temporal change are used, and large differences
+//   (real edges in the scene) are ignored, so a static scene is not burned in.
+// * Lens covered: the operator asserts that the lens is covered; the next
+//   frames are averaged and replace the estimate outright, like autocal.
+
+#define SCENE_MOTION_MIN  4.0f // mean |frame - previous frame| to use a frame
+#define SCENE_EDGE_MAX   64.0f // ignore differences to neighbors larger than this
+#define SCENE_RATE     (1.0f / 128.0f)
+
+#define TRIPLE_FRESH 4 // flag in middle: not yet picked up by the reader
+
+struct thermapp_scene {
+	pthread_t thread;
+	sem_t wake;
+	atomic_int busy;  // mailbox owned by worker
+	atomic_int stop;
+	atomic_int covered_req;
+
+	// Copied geometry and good pixel mask, so the worker never touches the cal.
+	size_t img_w;
+	size_t img_h;
+	size_t nuc_w;
+	size_t nuc_px;
+	size_t nuc_start;
+	float *nuc_good;    // nuc_w * nuc_h
+
+	uint16_t *input;    // mailbox, img_w * img_h
+	uint16_t *previous; // img_w * img_h
+	float *estimate;    // nuc_w * nuc_h, worker private
+	float *sum;         // img_w * img_h, covered accumulation
+	int covered_frames;
+	int covered_total;
+	int have_previous;
+
+	float *table[3];    // nuc_w * nuc_h each
+	int front;          // reader
+	int back;           // writer
+	atomic_int middle;
+
+	// Statistics, written by the worker only.
+	struct timespec cpu;
+	atomic_ulong frames_used;
+	atomic_ulong frames_static;
+	atomic_ulong frames_covered;
+	unsigned long frames_dropped; // written by the capture thread only
+	atomic_ulong published;
+};
+
+static void
+publish(struct thermapp_scene *scene)
+{
+	memcpy(scene->table[scene->back], scene->estimate, scene->nuc_px * sizeof (float));
+	scene->back = atomic_exchange_explicit(&scene->middle, scene->back | TRIPLE_FRESH, memory_order_acq_rel) & ~TRIPLE_FRESH;
+	atomic_fetch_add_explicit(&scene->published, 1, memory_order_relaxed);
+}
+
+static void
+estimate_covered(struct thermapp_scene *scene)
+{
+	size_t w = scene->img_w;
+	size_t h = scene->img_h;
+	const uint16_t *in = scene->input;
+
+	for (size_t i = 0; i < w * h; ++i) {
+		scene->sum[i] += in[i];
+	}
+	atomic_fetch_add_explicit(&scene->frames_covered, 1, memory_order_relaxed);
+	if (--scene->covered_frames) {
+		return;
+	}
+
+	// Same as autocal: offset is the negated mean of the covered frames.
+	for (size_t y = 0; y < h; ++y) {
+		float *est = &scene->estimate[scene->nuc_start + y * scene->nuc_w];
+		const float *sum = &scene->sum[y * w];
+		for (size_t x = 0; x < w; ++x) {
+			est[x] = sum[x] / -(float)scene->covered_total;
+		}
+	}
+	publish(scene);
+}
+
+static void
+estimate_scene(struct thermapp_scene *scene)
+{
+	size_t w = scene->img_w;
+	size_t h = scene->img_h;
+	const uint16_t *in = scene->input;
+
+	// Gate on camera/scene motion.
+	float motion = 0.0f;
+	if (scene->have_previous) {
+		for (size_t i = 0; i < w * h; ++i) {
+			motion += fabsf((float)in[i] - (float)scene->previous[i]);
+		}
+		motion /= (float)(w * h);
+	}
+	memcpy(scene->previous, in, w * h * sizeof *in);
+	scene->have_previous = 1;
+	if (motion < SCENE_MOTION_MIN) {
+		atomic_fetch_add_explicit(&scene->frames_static, 1, memory_order_relaxed);
+		return;
+	}
+
+	// Interior pixels only; corrected value = raw + offset.
+	double adjust = 0.0;
+	size_t adjusted = 0;
+	for (size_t y = 1; y + 1 < h; ++y) {
+		const uint16_t *row = &in[y * w];
+		float *est = &scene->estimate[scene->nuc_start + y * scene->nuc_w];
+		const float *good = &scene->nuc_good[scene->nuc_start + y * scene->nuc_w];
+		size_t nw = scene->nuc_w;
+		for (size_t x = 1; x + 1 < w; ++x) {
+			if (!good[x] || !good[x - 1] || !good[x + 1] || !good[x - nw] || !good[x + nw]) {
+				continue;
+			}
+			float c = row[x] + est[x];
+			float m = (row[x - 1] + est[x - 1]
+			         + row[x + 1] + est[x + 1]
+			         + row[x - w] + est[x - nw]
+			         + row[x + w] + est[x + nw]) * 0.25f;
+			float e = c - m;
+			if (fabsf(e) < SCENE_EDGE_MAX) {
+				float d = SCENE_RATE * e;
+				est[x] -= d;
+				adjust += d;
+				adjusted += 1;
+			}
+		}
+	}
+
+	// Hold the mean offset constant; only the pattern should change, not the level.
+	if (adjusted) {
+		float mean = (float)(adjust / (double)(w * h));
+		for (size_t y = 0; y < h; ++y) {
+			float *est = &scene->estimate[scene->nuc_start + y * scene->nuc_w];
+			for (size_t x = 0; x < w; ++x) {
+				est[x] += mean;
+			}
+		}
+	}
+	atomic_fetch_add_explicit(&scene->frames_used, 1, memory_order_relaxed);
+	publish(scene);
+}
+
+static void
+timespec_add_delta(struct timespec *acc, struct timespec end, struct timespec start)
+{
+	acc->tv_sec  += end.tv_sec  - start.tv_sec;
+	acc->tv_nsec += end.tv_nsec - start.tv_nsec;
+	while (acc->tv_nsec >= 1000000000) {
+		acc->tv_nsec -= 1000000000;
+		acc->tv_sec  += 1;
+	}
+	while (acc->tv_nsec < 0) {
+		acc->tv_nsec += 1000000000;
+		acc->tv_sec  -= 1;
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	struct thermapp_scene *scene = arg;
+	thermapp_trace_thread("scene");
+
+	for (;;) {
+		while (sem_wait(&scene->wake) < 0 && errno == EINTR)
+			;
+		if (atomic_load_explicit(&scene->stop, memory_order_acquire)) {
+			break;
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		uint64_t trace_start = thermapp_trace_now();
+
+		int covered = atomic_exchange_explicit(&scene->covered_req, 0, memory_order_relaxed);
+		if (covered > 0) {
+			scene->covered_frames = scene->covered_total = covered;
+			memset(scene->sum, 0, scene->img_w * scene->img_h * sizeof *scene->sum);
+		}
+		if (scene->covered_frames) {
+			estimate_covered(scene);
+		} else {
+			estimate_scene(scene);
+		}
+
+		thermapp_trace_span("scene estimate", trace_start);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+		timespec_add_delta(&scene->cpu, end, start);
+
+		atomic_store_explicit(&scene->busy, 0, memory_order_release);
+	}
+	return NULL;
+}
+
+struct thermapp_scene *
+thermapp_scene_open(const struct thermapp_cal *cal)
+{
+	struct thermapp_scene *scene = calloc(1, sizeof *scene);
+	if (!scene) {
+		perror("calloc");
+		return NULL;
+	}
+
+	size_t img_px = cal->img_w * cal->img_h;
+	size_t nuc_px = cal->nuc_w * cal->nuc_h;
+	scene->img_w = cal->img_w;
+	scene->img_h = cal->img_h;
+	scene->nuc_w = cal->nuc_w;
+	scene->nuc_px = nuc_px;
+	scene->nuc_start = cal->ofs_y * cal->nuc_w + cal->ofs_x;
+
+	scene->input    = malloc(img_px * sizeof *scene->input);
+	scene->previous = malloc(img_px * sizeof *scene->previous);
+	scene->sum      = malloc(img_px * sizeof *scene->sum);
+	scene->estimate = malloc(nuc_px * sizeof *scene->estimate);
+	scene->nuc_good = malloc(nuc_px * sizeof *scene->nuc_good);
+	for (size_t i = 0; i < 3; ++i) {
+		scene->table[i] = malloc(nuc_px * sizeof *scene->table[i]);
+	}
+	if (!scene->input || !scene->previous || !scene->sum || !scene->estimate || !scene->nuc_good
+	 || !scene->table[0] || !scene->table[1] || !scene->table[2]) {
+		perror("malloc");
+		goto err;
+	}
+
+	memcpy(scene->nuc_good, cal->nuc_good, nuc_px * sizeof *scene->nuc_good);
+
+	// Start from the current autocal offsets.
+	memcpy(scene->estimate, cal->auto_offset, nuc_px * sizeof *scene->estimate);
+	for (size_t i = 0; i < 3; ++i) {
+		memcpy(scene->table[i], cal->auto_offset, nuc_px * sizeof *scene->table[i]);
+	}
+	scene->front = 0;
+	atomic_init(&scene->middle, 1);
+	scene->back = 2;
+
+	atomic_init(&scene->busy, 0);
+	atomic_init(&scene->stop, 0);
+	atomic_init(&scene->covered_req, 0);
+	atomic_init(&scene->frames_used, 0);
+	atomic_init(&scene->frames_static, 0);
+	atomic_init(&scene->frames_covered, 0);
+	atomic_init(&scene->published, 0);
+
+	if (sem_init(&scene->wake, 0, 0) < 0) {
+		perror("sem_init");
+		goto err;
+	}
+	int ret = pthread_create(&scene->thread, NULL, worker, scene);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+		sem_destroy(&scene->wake);
+		goto err;
+	}
+	return scene;
+
+err:
+	for (size_t i = 0; i < 3; ++i) {
+		free(scene->table[i]);
+	}
+	free(scene->nuc_good);
+	free(scene->estimate);
+	free(scene->sum);
+	free(scene->previous);
+	free(scene->input);
+	free(scene);
+	return NULL;
+}
+
+void
+thermapp_scene_submit(struct thermapp_scene *scene, const union thermapp_frame *frame)
+{
+	// Never wait for the worker; drop the frame if it's still busy with the last one.
+	if (atomic_load_explicit(&scene->busy, memory_order_acquire)) {
+		scene->frames_dropped += 1;
+		return;
+	}
+
+	const uint16_t *pixels = (const uint16_t *)&frame->bytes[frame->header.data_offset];
+	memcpy(scene->input, pixels, scene->img_w * scene->img_h * sizeof *scene->input);
+	atomic_store_explicit(&scene->busy, 1, memory_order_relaxed);
+	sem_post(&scene->wake);
+}
+
+void
+thermapp_scene_covered(struct thermapp_scene *scene, int frames)
+{
+	atomic_store_explicit(&scene->covered_req, frames, memory_order_relaxed);
+}
+
+const float *
+thermapp_scene_offset(struct thermapp_scene *scene)
+{
+	if (atomic_load_explicit(&scene->middle, memory_order_relaxed) & TRIPLE_FRESH) {
+		scene->front = atomic_exchange_explicit(&scene->middle, scene->front, memory_order_acq_rel) & ~TRIPLE_FRESH;
+	}
+	return scene->table[scene->front];
+}
+
+void
+thermapp_scene_close(struct thermapp_scene *scene)
+{
+	if (!scene)
+		return;
+
+	atomic_store_explicit(&scene->stop, 1, memory_order_release);
+	sem_post(&scene->wake);
+	pthread_join(scene->thread, NULL);
+	sem_destroy(&scene->wake);
+
+	unsigned long used = atomic_load(&scene->frames_used);
+	unsigned long still = atomic_load(&scene->frames_static);
+	unsigned long covered = atomic_load(&scene->frames_covered);
+	double cpu = scene->cpu.tv_sec + scene->cpu.tv_nsec / 1e9;
+	unsigned long worked = used + still + covered;
+	printf("Scene NUC: %lu frames used, %lu static, %lu covered, %lu dropped, %lu tables published, %.3f ms CPU/frame\n",
+	       used, still, covered, scene->frames_dropped, atomic_load(&scene->published),
+	       worked ? 1e3 * cpu / worked : 0.0);
+
+	for (size_t i = 0; i < 3; ++i) {
+		free(scene->table[i]);
+	}
+	free(scene->nuc_good);
+	free(scene->estimate);
+	free(scene->sum);
+	free(scene->previous);
+	free(scene->input);
+	free(scene);
+}
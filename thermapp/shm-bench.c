@@ -0,0 +1,262 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Shared-memory ring benchmark.
+//
+// A producer publishes synthetic frames (raw, temp and rgb filled in, as
+// thermapp does) as fast as it can, or at a fixed rate, while 1..N reader
+// processes attach by name and read every frame they can.  Reports the
+// producer's publish cost, and per-reader throughput, drops and retries.
+
+#include "shm.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_NAME "/thermapp-bench"
+#define BENCH_FOURCC ('X' | 'R' << 8 | '2' << 16 | '4' << 24)
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static volatile uint32_t sink;
+
+struct reader_result {
+	uint64_t frames;
+	uint64_t dropped;
+	uint64_t retries;
+	uint64_t read_ns;
+	uint64_t bad;
+};
+
+// Runs in a child process, results are passed back through a pipe.
+static void
+reader(int fd, int zero_copy, double seconds)
+{
+	struct reader_result res;
+	memset(&res, 0, sizeof res);
+
+	struct thermapp_shm *shm = thermapp_shm_attach(BENCH_NAME);
+	if (!shm) {
+		exit(EXIT_FAILURE);
+	}
+	const struct thermapp_shm_header *hdr = thermapp_shm_header(shm);
+	size_t pixels = (size_t)hdr->img_w * hdr->img_h;
+	uint16_t *raw = malloc(pixels * sizeof *raw);
+	float *temp = malloc(pixels * sizeof *temp);
+	void *rgb = malloc(hdr->rgb_size);
+	if (!raw || !temp || !rgb) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t index = 0;
+	uint64_t end = now_ns() + (uint64_t)(seconds * 1e9);
+	while (now_ns() < end) {
+		if (!thermapp_shm_wait(shm, index, 100)) {
+			continue;
+		}
+
+		uint64_t t0 = now_ns();
+		struct thermapp_shm_meta meta;
+		uint16_t first, last;
+		if (zero_copy) {
+			// Touch the whole frame in place, the way an analytics consumer would.
+			struct thermapp_shm_frame frame;
+			if (!thermapp_shm_acquire(shm, &index, 0, &frame)) {
+				continue;
+			}
+			uint32_t sum = 0;
+			for (size_t i = 0; i < pixels; ++i) {
+				sum += frame.raw[i];
+			}
+			meta = *frame.meta;
+			first = frame.raw[0];
+			last = frame.raw[pixels - 1];
+			if (!thermapp_shm_release(shm, &frame)) {
+				res.retries += 1;
+				continue;
+			}
+			sink = sum;
+		} else {
+			if (!thermapp_shm_read(shm, &index, 0, &meta, raw, temp, rgb)) {
+				continue;
+			}
+			first = raw[0];
+			last = raw[pixels - 1];
+		}
+		res.read_ns += now_ns() - t0;
+		res.frames += 1;
+
+		// The producer stamps every pixel with the frame number.
+		if (first != (uint16_t)meta.frame_num || last != (uint16_t)meta.frame_num) {
+			res.bad += 1;
+		}
+	}
+	res.dropped = thermapp_shm_dropped(shm);
+	res.retries += thermapp_shm_retries(shm);
+
+	thermapp_shm_close(shm);
+	if (write(fd, &res, sizeof res) != sizeof res) {
+		perror("write");
+	}
+	exit(EXIT_SUCCESS);
+}
+
+static int
+run(int readers, int zero_copy, double seconds, double fps, uint32_t w, uint32_t h)
+{
+	struct thermapp_shm *shm = thermapp_shm_create(BENCH_NAME, w, h, BENCH_FOURCC, 4, 0, 4);
+	if (!shm) {
+		return -1;
+	}
+
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		thermapp_shm_close(shm);
+		return -1;
+	}
+	fflush(stdout);
+	for (int i = 0; i < readers; ++i) {
+		if (fork() == 0) {
+			close(fds[0]);
+			reader(fds[1], zero_copy, seconds + 0.2);
+		}
+	}
+	close(fds[1]);
+
+	// Give the readers time to attach.
+	struct timespec settle = { 0, 100000000 };
+	nanosleep(&settle, NULL);
+
+	size_t pixels = (size_t)w * h;
+	uint64_t frames = 0, publish_ns = 0, publish_max = 0;
+	uint64_t start = now_ns();
+	uint64_t end = start + (uint64_t)(seconds * 1e9);
+	for (uint64_t now = start; now < end; now = now_ns()) {
+		if (fps > 0.0) {
+			uint64_t due = start + (uint64_t)(frames * 1e9 / fps);
+			if (now < due) {
+				struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		uint64_t t0 = now_ns();
+		struct thermapp_shm_frame frame;
+		thermapp_shm_begin(shm, &frame);
+		uint16_t stamp = frames;
+		for (size_t i = 0; i < pixels; ++i) {
+			frame.raw[i] = stamp;
+		}
+		memset(frame.temp, 0, pixels * sizeof *frame.temp);
+		memset(frame.rgb, stamp, pixels * 4);
+		frame.meta->frame_num = frames;
+		frame.meta->timestamp = t0;
+		thermapp_shm_publish(shm);
+		uint64_t dt = now_ns() - t0;
+		publish_ns += dt;
+		if (publish_max < dt) {
+			publish_max = dt;
+		}
+		frames += 1;
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	struct reader_result total;
+	memset(&total, 0, sizeof total);
+	for (int i = 0; i < readers; ++i) {
+		struct reader_result res;
+		if (read(fds[0], &res, sizeof res) != sizeof res) {
+			fprintf(stderr, "reader failed\n");
+			continue;
+		}
+		total.frames += res.frames;
+		total.dropped += res.dropped;
+		total.retries += res.retries;
+		total.read_ns += res.read_ns;
+		total.bad += res.bad;
+	}
+	while (wait(NULL) > 0)
+		;
+	close(fds[0]);
+	thermapp_shm_close(shm);
+
+	printf("%7d  %9.0f  %11.2f  %11.2f  %9.1f%%  %8" PRIu64 "  %8" PRIu64 "  %10.2f  %4" PRIu64 "\n",
+	       readers,
+	       frames / elapsed,
+	       publish_ns / 1e3 / (frames ? frames : 1),
+	       publish_max / 1e3,
+	       readers ? 100.0 * total.frames / readers / frames : 0.0,
+	       total.dropped,
+	       total.retries,
+	       total.read_ns / 1e3 / (total.frames ? total.frames : 1),
+	       total.bad);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int max_readers = 8;
+	int zero_copy = 0;
+	double seconds = 2.0;
+	double fps = 0.0;
+	uint32_t w = 384, h = 288;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:hn:s:t:z")) != -1) {
+		switch (opt) {
+		case 'f':
+			fps = strtod(optarg, NULL);
+			break;
+		case 'n':
+			max_readers = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%" SCNu32 "x%" SCNu32, &w, &h) != 2) {
+				fprintf(stderr, "bad size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			seconds = strtod(optarg, NULL);
+			break;
+		case 'z':
+			zero_copy = 1;
+			break;
+		case 'h':
+			printf("Usage: %s [options]\n", argv[0]);
+			printf("  -f fps        Publish at a fixed rate [default: as fast as possible]\n");
+			printf("  -h            Show this help message and exit\n");
+			printf("  -n readers    Run with 1..readers readers [default: 8]\n");
+			printf("  -s WxH        Frame size [default: 384x288]\n");
+			printf("  -t seconds    Duration of each run [default: 2]\n");
+			printf("  -z            Read in place instead of copying out\n");
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%" PRIu32 "x%" PRIu32 ", %s reads, %s\n", w, h,
+	       zero_copy ? "zero-copy" : "copying", fps > 0.0 ? "fixed rate" : "unthrottled");
+	printf("readers  frames/s  publish us  publish max  received  dropped   retries   read us   bad\n");
+	for (int readers = 0; readers <= max_readers; ++readers) {
+		if (run(readers, zero_copy, seconds, fps, w, h) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,377 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "shm.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Shared-memory frame ring, see shm.h for the layout.
+//
+// Seqlock protocol, per slot:
+//   producer:  seq = odd (relaxed); release fence; write data;
+//              seq = even (release); head += 1 (release); futex wake
+//   reader:    s1 = seq (acquire); read data; acquire fence;
+//              s2 = seq (relaxed); valid iff s1 == s2 and s1 is even
+//
+// The object is created with mode 0644; readers map it read-only, so they
+// cannot disturb the producer or each other.  The futex word is waited on
+// through the read-only mapping, which the kernel allows for shared futexes.
+
+struct thermapp_shm {
+	struct thermapp_shm_header *hdr;
+	unsigned char *map;
+	size_t len;
+	char *name;      // producer only, to unlink
+	int writing;     // producer only, between begin and publish
+
+	// reader statistics
+	uint64_t dropped;
+	uint64_t retries;
+};
+
+static size_t
+align_up(size_t n)
+{
+	return (n + THERMAPP_SHM_ALIGN - 1) & ~(size_t)(THERMAPP_SHM_ALIGN - 1);
+}
+
+static struct thermapp_shm_meta *
+slot_meta(const struct thermapp_shm *shm, uint64_t index)
+{
+	const struct thermapp_shm_header *hdr = shm->hdr;
+	return (struct thermapp_shm_meta *)(shm->map + hdr->slot_offset + (index - 1) % hdr->slots * hdr->slot_size);
+}
+
+static void
+slot_frame(const struct thermapp_shm *shm, struct thermapp_shm_meta *meta, struct thermapp_shm_frame *frame)
+{
+	const struct thermapp_shm_header *hdr = shm->hdr;
+	unsigned char *slot = (unsigned char *)meta;
+	frame->meta = meta;
+	frame->raw  = (uint16_t *)(slot + hdr->raw_offset);
+	frame->temp = (float *)(slot + hdr->temp_offset);
+	frame->rgb  = slot + hdr->rgb_offset;
+}
+
+struct thermapp_shm *
+thermapp_shm_create(const char *name, uint32_t img_w, uint32_t img_h, uint32_t rgb_format, size_t rgb_bpp, uint32_t flags, uint32_t slots)
+{
+	if (slots < 3) {
+		slots = 3;
+	}
+
+	struct thermapp_shm *shm = calloc(1, sizeof *shm);
+	if (!shm) {
+		perror("calloc");
+		return NULL;
+	}
+	shm->map = MAP_FAILED;
+
+	size_t pixels = (size_t)img_w * img_h;
+	size_t raw_offset  = align_up(sizeof (struct thermapp_shm_meta));
+	size_t temp_offset = align_up(raw_offset + pixels * sizeof (uint16_t));
+	size_t rgb_offset  = align_up(temp_offset + pixels * sizeof (float));
+	size_t slot_size   = align_up(rgb_offset + pixels * rgb_bpp);
+	size_t slot_offset = align_up(sizeof (struct thermapp_shm_header));
+	shm->len = slot_offset + slots * slot_size;
+
+	shm->name = strdup(name);
+	if (!shm->name) {
+		perror("strdup");
+		goto err;
+	}
+
+	// Readers of a previous run keep their mapping of the old object.
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		perror("shm_open");
+		goto err;
+	}
+	if (ftruncate(fd, shm->len) < 0) {
+		perror("ftruncate");
+		close(fd);
+		shm_unlink(name);
+		goto err;
+	}
+	shm->map = mmap(NULL, shm->len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (shm->map == MAP_FAILED) {
+		perror("mmap");
+		shm_unlink(name);
+		goto err;
+	}
+
+	// The object is zero-filled: head = 0, every seq = 0 (even, stable).
+	struct thermapp_shm_header *hdr = shm->hdr = (struct thermapp_shm_header *)shm->map;
+	hdr->version = THERMAPP_SHM_VERSION;
+	hdr->slots = slots;
+	hdr->img_w = img_w;
+	hdr->img_h = img_h;
+	hdr->rgb_format = rgb_format;
+	hdr->flags = flags;
+	hdr->slot_offset = slot_offset;
+	hdr->slot_size = slot_size;
+	hdr->raw_offset = raw_offset;
+	hdr->temp_offset = temp_offset;
+	hdr->rgb_offset = rgb_offset;
+	hdr->rgb_size = pixels * rgb_bpp;
+	hdr->producer_pid = getpid();
+
+	// Magic last: a reader that sees it sees the rest of the header.
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(hdr->magic, THERMAPP_SHM_MAGIC, sizeof hdr->magic);
+
+	return shm;
+
+err:
+	thermapp_shm_close(shm);
+	return NULL;
+}
+
+void
+thermapp_shm_begin(struct thermapp_shm *shm, struct thermapp_shm_frame *frame)
+{
+	uint64_t index = shm->hdr->head + 1;
+	struct thermapp_shm_meta *meta = slot_meta(shm, index);
+
+	if (!shm->writing) {
+		shm->writing = 1;
+		__atomic_store_n(&meta->seq, meta->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		meta->index = index;
+	}
+
+	slot_frame(shm, meta, frame);
+	frame->seq = meta->seq;
+}
+
+void
+thermapp_shm_publish(struct thermapp_shm *shm)
+{
+	if (!shm->writing) {
+		return;
+	}
+	shm->writing = 0;
+
+	struct thermapp_shm_header *hdr = shm->hdr;
+	struct thermapp_shm_meta *meta = slot_meta(shm, hdr->head + 1);
+	__atomic_store_n(&meta->seq, meta->seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->head, hdr->head + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&hdr->wake, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+struct thermapp_shm *
+thermapp_shm_attach(const char *name)
+{
+	struct thermapp_shm *shm = calloc(1, sizeof *shm);
+	if (!shm) {
+		perror("calloc");
+		return NULL;
+	}
+	shm->map = MAP_FAILED;
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		perror("shm_open");
+		goto err;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		goto err;
+	}
+	shm->len = st.st_size;
+	if (shm->len < sizeof (struct thermapp_shm_header)) {
+		fprintf(stderr, "%s: %s\n", name, "Not ready");
+		close(fd);
+		goto err;
+	}
+	shm->map = mmap(NULL, shm->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->map == MAP_FAILED) {
+		perror("mmap");
+		goto err;
+	}
+
+	const struct thermapp_shm_header *hdr = shm->hdr = (struct thermapp_shm_header *)shm->map;
+	if (memcmp(hdr->magic, THERMAPP_SHM_MAGIC, sizeof hdr->magic) != 0) {
+		fprintf(stderr, "%s: %s\n", name, "Not ready");
+		goto err;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (hdr->version != THERMAPP_SHM_VERSION) {
+		fprintf(stderr, "%s: %s\n", name, "Unsupported version");
+		goto err;
+	}
+
+	size_t pixels = (size_t)hdr->img_w * hdr->img_h;
+	if (hdr->slots < 3
+	 || hdr->slot_size % THERMAPP_SHM_ALIGN
+	 || hdr->slot_offset < sizeof (struct thermapp_shm_header)
+	 || hdr->slot_offset % THERMAPP_SHM_ALIGN
+	 || hdr->slot_offset + hdr->slots * hdr->slot_size > shm->len
+	 || hdr->raw_offset < sizeof (struct thermapp_shm_meta)
+	 || hdr->raw_offset + pixels * sizeof (uint16_t) > hdr->slot_size
+	 || hdr->temp_offset + pixels * sizeof (float) > hdr->slot_size
+	 || hdr->rgb_offset + hdr->rgb_size > hdr->slot_size) {
+		fprintf(stderr, "%s: %s\n", name, "Bad layout");
+		goto err;
+	}
+
+	return shm;
+
+err:
+	thermapp_shm_close(shm);
+	return NULL;
+}
+
+const struct thermapp_shm_header *
+thermapp_shm_header(const struct thermapp_shm *shm)
+{
+	return shm->hdr;
+}
+
+int
+thermapp_shm_acquire(struct thermapp_shm *shm, uint64_t *index, int latest, struct thermapp_shm_frame *frame)
+{
+	const struct thermapp_shm_header *hdr = shm->hdr;
+	for (;;) {
+		uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (head <= *index) {
+			return 0;
+		}
+
+		// The slot after head's is being written; skip ahead well before that.
+		uint64_t next = *index + 1;
+		if (!*index || latest) {
+			next = head;
+		} else if (head - next >= hdr->slots - 1) {
+			next = head;
+			shm->dropped += next - *index - 1;
+		}
+
+		struct thermapp_shm_meta *meta = slot_meta(shm, next);
+		uint32_t seq = __atomic_load_n(&meta->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1) && meta->index == next) {
+			slot_frame(shm, meta, frame);
+			frame->seq = seq;
+			*index = next;
+			return 1;
+		}
+
+		// Overwritten since head was read, look again.
+		shm->retries += 1;
+	}
+}
+
+int
+thermapp_shm_release(struct thermapp_shm *shm, const struct thermapp_shm_frame *frame)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&frame->meta->seq, __ATOMIC_RELAXED) == frame->seq;
+}
+
+int
+thermapp_shm_read(struct thermapp_shm *shm, uint64_t *index, int latest, struct thermapp_shm_meta *meta, uint16_t *raw, float *temp, void *rgb)
+{
+	const struct thermapp_shm_header *hdr = shm->hdr;
+	size_t pixels = (size_t)hdr->img_w * hdr->img_h;
+	for (;;) {
+		uint64_t prev = *index;
+		struct thermapp_shm_frame frame;
+		if (!thermapp_shm_acquire(shm, index, latest, &frame)) {
+			return 0;
+		}
+
+		if (meta) memcpy(meta, frame.meta, sizeof *meta);
+		if (raw)  memcpy(raw,  frame.raw,  pixels * sizeof *raw);
+		if (temp) memcpy(temp, frame.temp, pixels * sizeof *temp);
+		if (rgb)  memcpy(rgb,  frame.rgb,  hdr->rgb_size);
+
+		if (thermapp_shm_release(shm, &frame)) {
+			if (meta) meta->seq = frame.seq;
+			return 1;
+		}
+
+		// Torn read.  Try again from the same position; acquire skips
+		// ahead if this reader is now too far behind.
+		*index = prev;
+		shm->retries += 1;
+	}
+}
+
+int
+thermapp_shm_wait(struct thermapp_shm *shm, uint64_t index, int timeout_ms)
+{
+	struct thermapp_shm_header *hdr = shm->hdr;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		uint32_t wake = __atomic_load_n(&hdr->wake, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) > index) {
+			return 1;
+		}
+
+		struct timespec timeout, *ptimeout = NULL;
+		if (timeout_ms >= 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int64_t left = (int64_t)timeout_ms * 1000000
+			             - (now.tv_sec - start.tv_sec) * 1000000000
+			             - (now.tv_nsec - start.tv_nsec);
+			if (left <= 0) {
+				return 0;
+			}
+			timeout.tv_sec  = left / 1000000000;
+			timeout.tv_nsec = left % 1000000000;
+			ptimeout = &timeout;
+		}
+
+		// Returns immediately if wake already changed.
+		if (syscall(SYS_futex, &hdr->wake, FUTEX_WAIT, wake, ptimeout, NULL, 0) < 0
+		 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+			perror("futex");
+			return 0;
+		}
+	}
+}
+
+uint64_t
+thermapp_shm_dropped(const struct thermapp_shm *shm)
+{
+	return shm->dropped;
+}
+
+uint64_t
+thermapp_shm_retries(const struct thermapp_shm *shm)
+{
+	return shm->retries;
+}
+
+void
+thermapp_shm_close(struct thermapp_shm *shm)
+{
+	if (shm->map != MAP_FAILED) {
+		munmap(shm->map, shm->len);
+	}
+	if (shm->name) {
+		shm_unlink(shm->name);
+		free(shm->name);
+	}
+	free(shm);
+}
@@ -0,0 +1,161 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef THERMAPP_SHM_H
+#define THERMAPP_SHM_H
+
+// Shared-memory frame ring.
+//
+// thermapp publishes every processed frame into a POSIX shared memory object
+// (see shm_overview(7)), which any number of other processes may map and read
+// without going through the video device.  Each frame carries:
+//
+//   - the 64-byte frame header as received from the camera
+//   - raw: the 16-bit sensor data, img_w * img_h, in sensor order
+//   - temp: the NUC-corrected image in units of 0.01 C (before emissivity
+//     correction, see t_refl/emissivity), img_w * img_h, in sensor order
+//   - rgb: the rendered image as sent to the video device (flipped as
+//     configured, see flags), img_w * img_h pixels of rgb_format
+//   - metadata: frame number, timestamp, temperatures, min/max positions,
+//     the statistics of each region of interest (thermapp -i), and the
+//     hot-spot alarm state with its hottest blobs (thermapp -k)
+//
+// The ring holds a fixed number of slots.  Each slot is guarded by a sequence
+// counter (seqlock): odd while the producer writes it, even when stable.
+// Readers never take a lock and never block the producer.  A reader that falls
+// more than slots-2 frames behind skips ahead and counts the frames it missed.
+//
+// This header does not depend on libusb or on any other thermapp header, so
+// consumers only need it and libthermapp-shm.a (link with -lrt).
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define THERMAPP_SHM_NAME    "/thermapp"
+#define THERMAPP_SHM_MAGIC   "ThAShm\r\n"
+#define THERMAPP_SHM_VERSION 3
+#define THERMAPP_SHM_ALIGN   64
+#define THERMAPP_SHM_ROIS    64
+#define THERMAPP_SHM_BLOBS   8
+
+// flags
+#define THERMAPP_SHM_FLIPH 0x1 // rgb is mirrored horizontally w.r.t. raw/temp
+#define THERMAPP_SHM_FLIPV 0x2 // rgb is mirrored vertically w.r.t. raw/temp
+
+struct thermapp_shm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;
+	uint32_t img_w;
+	uint32_t img_h;
+	uint32_t rgb_format;  // V4L2 fourcc
+	uint32_t flags;
+	uint64_t slot_offset; // from the start of the object
+	uint64_t slot_size;   // bytes per slot, multiple of THERMAPP_SHM_ALIGN
+	uint64_t raw_offset;  // from the start of each slot
+	uint64_t temp_offset;
+	uint64_t rgb_offset;
+	uint64_t rgb_size;
+
+	// Written by the producer only, read with the functions below.
+	_Alignas(THERMAPP_SHM_ALIGN)
+	uint64_t head;        // number of frames published so far
+	uint32_t wake;        // futex word, incremented on every publish
+	uint32_t producer_pid;
+};
+
+// A region of interest, in the metadata of each frame.
+struct thermapp_shm_roi {
+	char name[32];        // NUL-terminated
+	float t_min;          // C, after emissivity correction
+	float t_max;          // C
+	float t_mean;         // C
+	float t_stddev;       // C
+	uint32_t min_x, min_y; // position of t_min in raw/temp
+	uint32_t max_x, max_y; // position of t_max in raw/temp
+	uint32_t pixels;
+	uint32_t reserved;
+};
+
+// A hot spot, in the metadata of each frame.
+struct thermapp_shm_blob {
+	float t_peak;         // C, after emissivity correction
+	uint32_t pixels;
+	uint32_t peak_x, peak_y; // position of t_peak in raw/temp
+	uint32_t x0, y0;      // bounding box in raw/temp, inclusive
+	uint32_t x1, y1;
+};
+
+// Start of each slot.  Frame index i (counting from 1) lives in slot (i-1) % slots.
+struct thermapp_shm_meta {
+	uint32_t seq;         // odd while being written
+	uint32_t frame_num;   // from the camera header
+	uint64_t index;       // position in the ring, see head
+	uint64_t timestamp;   // CLOCK_MONOTONIC, ns, when the frame arrived over USB
+	float temp_fpa;       // C
+	float temp_therm;     // C
+	float t_min;          // C, after emissivity correction
+	float t_max;          // C
+	uint32_t min_x, min_y; // position of t_min in raw/temp
+	uint32_t max_x, max_y; // position of t_max in raw/temp
+	float t_refl;         // C
+	float emissivity;
+	uint16_t header[32];  // union thermapp_cfg
+	uint32_t rois;        // entries of roi in use
+	uint32_t reserved;
+	struct thermapp_shm_roi roi[THERMAPP_SHM_ROIS];
+	uint32_t alarm;       // 1 while the hot-spot alarm is active (thermapp -k)
+	uint32_t alarm_blobs; // total above the threshold
+	uint32_t alarm_pixels; // in all of them
+	uint32_t blobs;       // entries of blob in use, hottest first
+	struct thermapp_shm_blob blob[THERMAPP_SHM_BLOBS];
+};
+
+// A frame as it sits in the ring.
+struct thermapp_shm_frame {
+	struct thermapp_shm_meta *meta;
+	uint16_t *raw;
+	float *temp;
+	void *rgb;
+	uint32_t seq;         // reader only: seq when acquired
+};
+
+struct thermapp_shm;
+
+// Producer.  Creates (replacing any stale object of the same name) and maps
+// the ring.  thermapp_shm_begin returns the slot for the next frame, which may
+// be filled in over any length of time; thermapp_shm_publish makes it visible.
+struct thermapp_shm *thermapp_shm_create(const char *name, uint32_t img_w, uint32_t img_h, uint32_t rgb_format, size_t rgb_bpp, uint32_t flags, uint32_t slots);
+void thermapp_shm_begin(struct thermapp_shm *, struct thermapp_shm_frame *);
+void thermapp_shm_publish(struct thermapp_shm *);
+
+// Reader.
+struct thermapp_shm *thermapp_shm_attach(const char *name);
+const struct thermapp_shm_header *thermapp_shm_header(const struct thermapp_shm *);
+
+// Zero-copy read.  Finds the frame following *index (or the newest frame, if
+// latest is set, or if the next one was already overwritten) and points frame
+// into the ring.  Returns 0 if there is no new frame.  The data may be
+// overwritten at any moment: use it, then call thermapp_shm_release, and
+// discard the results if it returns 0.  On success, *index is updated.
+// Start with *index = 0 to begin at the newest frame.
+int thermapp_shm_acquire(struct thermapp_shm *, uint64_t *index, int latest, struct thermapp_shm_frame *);
+int thermapp_shm_release(struct thermapp_shm *, const struct thermapp_shm_frame *);
+
+// Copying read: as above, but copies the metadata and whichever of raw, temp
+// and rgb are not NULL, retrying until it gets a consistent frame.
+int thermapp_shm_read(struct thermapp_shm *, uint64_t *index, int latest, struct thermapp_shm_meta *, uint16_t *raw, float *temp, void *rgb);
+
+// Sleeps until a frame after index is published, or timeout_ms (-1 = forever).
+// Returns 1 if there is a new frame, 0 on timeout.
+int thermapp_shm_wait(struct thermapp_shm *, uint64_t index, int timeout_ms);
+
+// Frames skipped because this reader fell behind, and reads retried because
+// the producer overwrote the slot during the read.
+uint64_t thermapp_shm_dropped(const struct thermapp_shm *);
+uint64_t thermapp_shm_retries(const struct thermapp_shm *);
+
+// Unmaps; the producer also removes the name.
+void thermapp_shm_close(struct thermapp_shm *);
+
+#endif /* THERMAPP_SHM_H */
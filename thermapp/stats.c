@@ -0,0 +1,521 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Log-scale histograms of durations.
+//
+// Values (ns) below 2^HIST_SUB_BITS have a bucket each; above that, every
+// power of two is split into 2^HIST_SUB_BITS linear buckets, so a bucket is
+// never wider than 1/8 of its value and quantiles are good to 12.5%.  The
+// whole uint64_t range fits in HIST_BUCKETS.  There is one writer per
+// histogram, which updates with relaxed loads and stores (no locked
+// instructions); readers on other threads may see a snapshot that is a few
+// values behind, but never a torn counter.
+
+static unsigned
+bucket(uint64_t v)
+{
+	if (v < (1 << HIST_SUB_BITS)) {
+		return v;
+	}
+	unsigned e = 63 - __builtin_clzll(v);
+	unsigned m = v >> (e - HIST_SUB_BITS) & ((1 << HIST_SUB_BITS) - 1);
+	return (e - HIST_SUB_BITS + 1) << HIST_SUB_BITS | m;
+}
+
+// Largest value that lands in bucket i.
+static uint64_t
+bucket_max(unsigned i)
+{
+	if (i < (1 << HIST_SUB_BITS)) {
+		return i;
+	}
+	unsigned e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t m = (1 << HIST_SUB_BITS) | (i & ((1 << HIST_SUB_BITS) - 1));
+	uint64_t lo = m << (e - HIST_SUB_BITS);
+	return lo + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+static void
+inc(atomic_uint_least64_t *p, uint64_t v)
+{
+	atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+void
+thermapp_hist_add(struct thermapp_hist *hist, uint64_t v)
+{
+	inc(&hist->bucket[bucket(v)], 1);
+	inc(&hist->count, 1);
+	inc(&hist->sum, v);
+	if (atomic_load_explicit(&hist->max, memory_order_relaxed) < v) {
+		atomic_store_explicit(&hist->max, v, memory_order_relaxed);
+	}
+}
+
+void
+thermapp_hist_reset(struct thermapp_hist *hist)
+{
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		atomic_store_explicit(&hist->bucket[i], 0, memory_order_relaxed);
+	}
+	atomic_store_explicit(&hist->count, 0, memory_order_relaxed);
+	atomic_store_explicit(&hist->sum, 0, memory_order_relaxed);
+	atomic_store_explicit(&hist->max, 0, memory_order_relaxed);
+}
+
+// Upper bound of the bucket holding quantile q (0..1), no more than the max.
+uint64_t
+thermapp_hist_quantile(const struct thermapp_hist *hist, double q)
+{
+	uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+	uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+	if (!count) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(q * count);
+	if (rank >= count) {
+		rank = count - 1;
+	}
+
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		seen += atomic_load_explicit(&hist->bucket[i], memory_order_relaxed);
+		if (seen > rank) {
+			uint64_t v = bucket_max(i);
+			return v < max ? v : max;
+		}
+	}
+	return max;
+}
+
+// Per-stage timing of the frame loop, exported in the Prometheus text format.
+//
+// The stage histograms have several writers: pipelined, the capture thread
+// (USB wait through change detection), the enhance thread (quantize, HPF,
+// LUT) and the caller (palette, output), and the caller may charge any stage
+// through thermapp_pipeline_stage.  So unlike thermapp_hist_add, the updates
+// here are atomic read-modify-writes; there are only a dozen per frame.
+//
+// A background thread takes snapshots every STATS_INTERVAL seconds, or when
+// asked to, and replaces the export file atomically (write to a temporary
+// file and rename), so a collector such as node_exporter's textfile
+// collector never reads a partial file.  Histogram buckets are exported at powers of two
+// between STATS_LE_MIN and STATS_LE_MAX ns, which are bucket boundaries.
+
+#define STATS_INTERVAL 10 // seconds
+#define STATS_LE_MIN   10 // 2^10 ns, about 1 us
+#define STATS_LE_MAX   32 // 2^32 ns, about 4 s
+#define STATS_SCALES    8
+
+static const char *const stage_names[STAGES] = {
+	[STAGE_USB_WAIT] = "usb_wait",
+	[STAGE_NUC]      = "nuc",
+	[STAGE_BPR]      = "bpr",
+	[STAGE_MINMAX]   = "minmax",
+	[STAGE_ROI]      = "roi",
+	[STAGE_ALARM]    = "alarm",
+	[STAGE_CHANGE]   = "change",
+	[STAGE_QUANTIZE] = "quantize",
+	[STAGE_HPF]      = "hpf",
+	[STAGE_LUT]      = "lut",
+	[STAGE_PALETTE]  = "palette",
+	[STAGE_OUTPUT]   = "output",
+};
+
+struct thermapp_stats {
+	pthread_t thread;
+	sem_t wake;
+	atomic_int stop;
+
+	char *path;
+	char *tmp_path;
+	const struct thermapp_hist *latency;
+	struct thermapp_hist stage[STAGES];
+
+	// The caller's, added while running.
+	struct {
+		char labels[64];
+		const struct thermapp_hist *hist;
+	} scale[STATS_SCALES];
+	atomic_size_t scales;
+
+	// Change detection, counted while running.
+	atomic_int change_seen;
+	atomic_uint_least64_t change_tiles_changed;
+	atomic_uint_least64_t change_tiles_skipped;
+	atomic_uint_least64_t change_processed;
+	atomic_uint_least64_t change_unchanged;
+	atomic_uint_least64_t change_unsent;
+
+	// The pipeline's drop counters, DROPS of them.
+	_Atomic(const atomic_ulong *) drops;
+
+	// Latest frame's, exported as gauges.
+	pthread_mutex_t frame_lock;
+	const struct thermapp_rois *rois;
+	struct thermapp_roi_result roi[ROI_MAX];
+	size_t roi_count;
+	int alarm_set;
+	struct thermapp_alarm_result alarm;
+	uint64_t alarm_triggers;
+};
+
+// Counts below each exported bound, from one pass over a snapshot of the buckets.
+static void
+hist_write(FILE *f, const char *name, const char *labels, const struct thermapp_hist *hist)
+{
+	uint64_t count = 0;
+	unsigned i = 0;
+	for (unsigned e = STATS_LE_MIN; e <= STATS_LE_MAX; ++e) {
+		for (; i < bucket((uint64_t)1 << e); ++i) {
+			count += atomic_load_explicit(&hist->bucket[i], memory_order_relaxed);
+		}
+		fprintf(f, "%s_bucket{%s%sle=\"%.9g\"} %" PRIu64 "\n", name, labels, *labels ? "," : "",
+		        (double)((uint64_t)1 << e) / 1e9, count);
+	}
+	for (; i < HIST_BUCKETS; ++i) {
+		count += atomic_load_explicit(&hist->bucket[i], memory_order_relaxed);
+	}
+	// +Inf and _count are taken from the same snapshot, so they always agree.
+	fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, *labels ? "," : "", count);
+	fprintf(f, "%s_sum%s%s%s %.9f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+	        atomic_load_explicit(&hist->sum, memory_order_relaxed) / 1e9);
+	fprintf(f, "%s_count%s%s%s %" PRIu64 "\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", count);
+}
+
+static int
+export(struct thermapp_stats *stats)
+{
+	FILE *f = fopen(stats->tmp_path, "w");
+	if (!f) {
+		perror("fopen");
+		return 0;
+	}
+
+	fprintf(f, "# HELP thermapp_stage_seconds Time spent in each stage of the frame loop.\n");
+	fprintf(f, "# TYPE thermapp_stage_seconds histogram\n");
+	for (int i = 0; i < STAGES; ++i) {
+		char labels[32];
+		snprintf(labels, sizeof labels, "stage=\"%s\"", stage_names[i]);
+		hist_write(f, "thermapp_stage_seconds", labels, &stats->stage[i]);
+	}
+	if (stats->latency) {
+		fprintf(f, "# HELP thermapp_latency_seconds Time from USB completion to output.\n");
+		fprintf(f, "# TYPE thermapp_latency_seconds histogram\n");
+		hist_write(f, "thermapp_latency_seconds", "", stats->latency);
+	}
+	size_t scales = atomic_load_explicit(&stats->scales, memory_order_acquire);
+	if (scales) {
+		fprintf(f, "# HELP thermapp_scale_seconds Time to scale the palette image for each extra output size.\n");
+		fprintf(f, "# TYPE thermapp_scale_seconds histogram\n");
+		for (size_t i = 0; i < scales; ++i) {
+			hist_write(f, "thermapp_scale_seconds", stats->scale[i].labels, stats->scale[i].hist);
+		}
+	}
+
+	if (atomic_load_explicit(&stats->change_seen, memory_order_relaxed)) {
+		uint64_t changed = atomic_load_explicit(&stats->change_tiles_changed, memory_order_relaxed);
+		uint64_t skipped = atomic_load_explicit(&stats->change_tiles_skipped, memory_order_relaxed);
+		fprintf(f, "# HELP thermapp_change_tiles_total Tiles seen by change detection.\n");
+		fprintf(f, "# TYPE thermapp_change_tiles_total counter\n");
+		fprintf(f, "thermapp_change_tiles_total{state=\"changed\"} %" PRIu64 "\n", changed);
+		fprintf(f, "thermapp_change_tiles_total{state=\"skipped\"} %" PRIu64 "\n", skipped);
+		fprintf(f, "# HELP thermapp_change_skipped_ratio Fraction of tiles skipped as unchanged, since the start.\n");
+		fprintf(f, "# TYPE thermapp_change_skipped_ratio gauge\n");
+		fprintf(f, "thermapp_change_skipped_ratio %.4f\n", changed + skipped ? (double)skipped / (changed + skipped) : 0.0);
+		fprintf(f, "# HELP thermapp_change_frames_total Frames seen by change detection.\n");
+		fprintf(f, "# TYPE thermapp_change_frames_total counter\n");
+		fprintf(f, "thermapp_change_frames_total{state=\"processed\"} %" PRIu64 "\n",
+		        atomic_load_explicit(&stats->change_processed, memory_order_relaxed));
+		fprintf(f, "thermapp_change_frames_total{state=\"unchanged\"} %" PRIu64 "\n",
+		        atomic_load_explicit(&stats->change_unchanged, memory_order_relaxed));
+		fprintf(f, "# HELP thermapp_change_unsent_frames_total Unchanged frames not sent to the outputs.\n");
+		fprintf(f, "# TYPE thermapp_change_unsent_frames_total counter\n");
+		fprintf(f, "thermapp_change_unsent_frames_total %" PRIu64 "\n",
+		        atomic_load_explicit(&stats->change_unsent, memory_order_relaxed));
+	}
+	const atomic_ulong *drops = atomic_load_explicit(&stats->drops, memory_order_acquire);
+	if (drops) {
+		fprintf(f, "# HELP thermapp_frames_dropped_total Frames dropped before the outputs, by reason.\n");
+		fprintf(f, "# TYPE thermapp_frames_dropped_total counter\n");
+		for (int i = 0; i < DROPS; ++i) {
+			fprintf(f, "thermapp_frames_dropped_total{reason=\"%s\"} %lu\n",
+			        thermapp_drop_name(i), atomic_load_explicit(&drops[i], memory_order_relaxed));
+		}
+	}
+
+	// Copied out so that the frame loop never waits for the file.
+	struct thermapp_roi_result roi[ROI_MAX];
+	pthread_mutex_lock(&stats->frame_lock);
+	const struct thermapp_rois *rois = stats->rois;
+	size_t roi_count = stats->roi_count;
+	memcpy(roi, stats->roi, roi_count * sizeof *roi);
+	int alarm_set = stats->alarm_set;
+	struct thermapp_alarm_result alarm = stats->alarm;
+	uint64_t alarm_triggers = stats->alarm_triggers;
+	pthread_mutex_unlock(&stats->frame_lock);
+	if (roi_count) {
+		static const char *const roi_stats[] = { "min", "max", "mean", "stddev" };
+		fprintf(f, "# HELP thermapp_roi_celsius Temperature in each region of interest, latest frame.\n");
+		fprintf(f, "# TYPE thermapp_roi_celsius gauge\n");
+		for (size_t i = 0; i < roi_count; ++i) {
+			const float value[] = { roi[i].t_min, roi[i].t_max, roi[i].t_mean, roi[i].t_stddev };
+			for (size_t j = 0; j < sizeof value / sizeof *value; ++j) {
+				fprintf(f, "thermapp_roi_celsius{roi=\"%s\",stat=\"%s\"} %.3f\n",
+				        thermapp_rois_name(rois, i), roi_stats[j], value[j]);
+			}
+		}
+	}
+	if (alarm_set) {
+		fprintf(f, "# HELP thermapp_alarm_active Whether the hot-spot alarm is active, latest frame.\n");
+		fprintf(f, "# TYPE thermapp_alarm_active gauge\n");
+		fprintf(f, "thermapp_alarm_active %d\n", alarm.active);
+		fprintf(f, "# HELP thermapp_alarm_blobs Hot spots above the alarm threshold, latest frame.\n");
+		fprintf(f, "# TYPE thermapp_alarm_blobs gauge\n");
+		fprintf(f, "thermapp_alarm_blobs %zu\n", alarm.blobs);
+		fprintf(f, "# HELP thermapp_alarm_pixels Pixels in all hot spots, latest frame.\n");
+		fprintf(f, "# TYPE thermapp_alarm_pixels gauge\n");
+		fprintf(f, "thermapp_alarm_pixels %zu\n", alarm.area);
+		if (alarm.blobs_kept) {
+			fprintf(f, "# HELP thermapp_alarm_peak_celsius Peak temperature of the hottest hot spot, latest frame.\n");
+			fprintf(f, "# TYPE thermapp_alarm_peak_celsius gauge\n");
+			fprintf(f, "thermapp_alarm_peak_celsius %.3f\n", alarm.blob[0].t_peak);
+		}
+		fprintf(f, "# HELP thermapp_alarm_triggers_total Times the hot-spot alarm became active.\n");
+		fprintf(f, "# TYPE thermapp_alarm_triggers_total counter\n");
+		fprintf(f, "thermapp_alarm_triggers_total %" PRIu64 "\n", alarm_triggers);
+	}
+
+	int ok = !ferror(f);
+	if (fclose(f) == EOF) {
+		perror("fclose");
+		ok = 0;
+	}
+	if (ok && rename(stats->tmp_path, stats->path) < 0) {
+		perror("rename");
+		ok = 0;
+	}
+	if (!ok) {
+		unlink(stats->tmp_path);
+	}
+	return ok;
+}
+
+static void *
+exporter(void *arg)
+{
+	struct thermapp_stats *stats = arg;
+
+	while (!atomic_load_explicit(&stats->stop, memory_order_acquire)) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += STATS_INTERVAL;
+		while (sem_timedwait(&stats->wake, &deadline) < 0 && errno == EINTR) {
+		}
+		export(stats);
+	}
+	return NULL;
+}
+
+struct thermapp_stats *
+thermapp_stats_open(const char *path, const struct thermapp_hist *latency)
+{
+	struct thermapp_stats *stats = calloc(1, sizeof *stats);
+	if (!stats) {
+		perror("calloc");
+		return NULL;
+	}
+	stats->latency = latency;
+	atomic_init(&stats->stop, 0);
+	atomic_init(&stats->scales, 0);
+	atomic_init(&stats->change_seen, 0);
+	atomic_init(&stats->change_tiles_changed, 0);
+	atomic_init(&stats->change_tiles_skipped, 0);
+	atomic_init(&stats->change_processed, 0);
+	atomic_init(&stats->change_unchanged, 0);
+	atomic_init(&stats->change_unsent, 0);
+	atomic_init(&stats->drops, NULL);
+	pthread_mutex_init(&stats->frame_lock, NULL);
+	for (int i = 0; i < STAGES; ++i) {
+		thermapp_hist_reset(&stats->stage[i]);
+	}
+
+	size_t len = strlen(path);
+	stats->path = strdup(path);
+	stats->tmp_path = malloc(len + sizeof ".tmp");
+	if (!stats->path || !stats->tmp_path) {
+		perror("malloc");
+		goto err;
+	}
+	memcpy(stats->tmp_path, path, len);
+	memcpy(stats->tmp_path + len, ".tmp", sizeof ".tmp");
+
+	// Fail early on a bad path rather than in the background.
+	if (!export(stats)) {
+		goto err;
+	}
+
+	if (sem_init(&stats->wake, 0, 0) < 0) {
+		perror("sem_init");
+		goto err;
+	}
+	int ret = pthread_create(&stats->thread, NULL, exporter, stats);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", "pthread_create", strerror(ret));
+		sem_destroy(&stats->wake);
+		goto err;
+	}
+	return stats;
+
+err:
+	pthread_mutex_destroy(&stats->frame_lock);
+	free(stats->tmp_path);
+	free(stats->path);
+	free(stats);
+	return NULL;
+}
+
+const char *
+thermapp_stage_name(enum thermapp_stage stage)
+{
+	return stage_names[stage];
+}
+
+// thermapp_hist_add for any number of writers.
+static void
+hist_add_shared(struct thermapp_hist *hist, uint64_t v)
+{
+	atomic_fetch_add_explicit(&hist->bucket[bucket(v)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum, v, memory_order_relaxed);
+	uint_least64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+	while (max < v && !atomic_compare_exchange_weak_explicit(&hist->max, &max, v,
+	                                                         memory_order_relaxed, memory_order_relaxed)) {
+	}
+}
+
+// Any thread.
+void
+thermapp_stats_add(struct thermapp_stats *stats, enum thermapp_stage stage, uint64_t ns)
+{
+	hist_add_shared(&stats->stage[stage], ns);
+}
+
+// Charge the time since *mark to stage (stats may be NULL, for the trace only), and move the mark to now.
+void
+thermapp_stats_mark(struct thermapp_stats *stats, enum thermapp_stage stage, struct timespec *mark)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t start = (uint64_t)mark->tv_sec * 1000000000 + mark->tv_nsec;
+	uint64_t end = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	if (stats) {
+		thermapp_stats_add(stats, stage, end - start);
+	}
+	thermapp_trace_span_at(thermapp_stage_name(stage), start, end);
+	*mark = now;
+}
+
+// Export hist, which the caller keeps adding to, as the cost of producing a w x h image.
+// Only the frame loop's thread may call this.
+void
+thermapp_stats_scale(struct thermapp_stats *stats, size_t w, size_t h, const char *filter, const struct thermapp_hist *hist)
+{
+	size_t i = atomic_load_explicit(&stats->scales, memory_order_relaxed);
+	if (i == STATS_SCALES) {
+		return;
+	}
+	snprintf(stats->scale[i].labels, sizeof stats->scale[i].labels, "size=\"%zux%zu\",filter=\"%s\"", w, h, filter);
+	stats->scale[i].hist = hist;
+	atomic_store_explicit(&stats->scales, i + 1, memory_order_release);
+}
+
+// Results of thermapp_rois_measure for the next export.  rois must outlive stats.
+void
+thermapp_stats_rois(struct thermapp_stats *stats, const struct thermapp_rois *rois, const struct thermapp_roi_result *results)
+{
+	pthread_mutex_lock(&stats->frame_lock);
+	stats->rois = rois;
+	stats->roi_count = thermapp_rois_count(rois);
+	memcpy(stats->roi, results, stats->roi_count * sizeof *results);
+	pthread_mutex_unlock(&stats->frame_lock);
+}
+
+// Result of thermapp_alarm_check for the next export.
+void
+thermapp_stats_alarm(struct thermapp_stats *stats, const struct thermapp_alarm_result *result)
+{
+	pthread_mutex_lock(&stats->frame_lock);
+	stats->alarm_set = 1;
+	stats->alarm = *result;
+	stats->alarm_triggers += result->changed && result->active;
+	pthread_mutex_unlock(&stats->frame_lock);
+}
+
+// One frame's change detection, and whether the frame was sent to the outputs.
+// Only the frame loop's thread may call this.
+void
+thermapp_stats_change(struct thermapp_stats *stats, const struct thermapp_change_result *result, int sent)
+{
+	atomic_store_explicit(&stats->change_seen, 1, memory_order_relaxed);
+	inc(&stats->change_tiles_changed, result->changed);
+	inc(&stats->change_tiles_skipped, result->tiles - result->changed);
+	inc(result->unchanged ? &stats->change_unchanged : &stats->change_processed, 1);
+	inc(&stats->change_unsent, !sent);
+}
+
+// Export the pipeline's drop counters (see thermapp_pipeline_dropped), which
+// must outlive stats.
+void
+thermapp_stats_drops(struct thermapp_stats *stats, const atomic_ulong *drops)
+{
+	atomic_store_explicit(&stats->drops, drops, memory_order_release);
+}
+
+// Export now, e.g. from a signal.  Never blocks.
+void
+thermapp_stats_export(struct thermapp_stats *stats)
+{
+	sem_post(&stats->wake);
+}
+
+void
+thermapp_stats_close(struct thermapp_stats *stats)
+{
+	if (!stats)
+		return;
+
+	// The exporter writes a final snapshot on its way out.
+	atomic_store_explicit(&stats->stop, 1, memory_order_release);
+	sem_post(&stats->wake);
+	pthread_join(stats->thread, NULL);
+	sem_destroy(&stats->wake);
+
+	printf("Stage times (p50/p99 ms):");
+	for (int i = 0; i < STAGES; ++i) {
+		if (atomic_load_explicit(&stats->stage[i].count, memory_order_relaxed)) {
+			printf(" %s %.3f/%.3f", stage_names[i],
+			       thermapp_hist_quantile(&stats->stage[i], 0.50) / 1e6,
+			       thermapp_hist_quantile(&stats->stage[i], 0.99) / 1e6);
+		}
+	}
+	printf("\n");
+
+	pthread_mutex_destroy(&stats->frame_lock);
+	free(stats->tmp_path);
+	free(stats->path);
+	free(stats);
+}
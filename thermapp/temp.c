@@ -0,0 +1,78 @@
+// SPDX-FileCopyrightText: 2019-2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <math.h>
+
+// Sensor temperatures, filtered, and the transient correction state.
+//
+// Everything here depends on the sequence of frame headers and their arrival
+// times only, never on pixel data, so a recording can be replayed through it
+// ahead of the image processing and give the same results as the live loop.
+
+static double
+seconds(uint64_t end, uint64_t start)
+{
+	return (double)(int64_t)(end - start) / 1e9;
+}
+
+// Restart measurements, e.g. once the calibration is loaded.  now: frame time, ns.
+void
+thermapp_temp_reset(struct thermapp_temp *temp, const struct thermapp_cal *cal, uint64_t now)
+{
+	temp->transient_start = now;
+	temp->transient_step_start = now;
+	temp->transient_steps = cal->transient_steps_max;
+	temp->settle_frames = 11;
+	temp->old_delta = NAN;
+	temp->old_deriv_delta = NAN;
+}
+
+void
+thermapp_temp_update(struct thermapp_temp *temp, const struct thermapp_cal *cal, const union thermapp_cfg *header, uint64_t now)
+{
+	double raw_temp = header->temp_fpa_diode;
+	double cur_fpa = cal->coeffs_fpa_diode[1];
+	cur_fpa = fma(cur_fpa, raw_temp, cal->coeffs_fpa_diode[0]);
+	raw_temp = header->temp_thermistor;
+	double cur_therm = cal->coeffs_thermistor[5];
+	cur_therm = fma(cur_therm, raw_temp, cal->coeffs_thermistor[4]);
+	cur_therm = fma(cur_therm, raw_temp, cal->coeffs_thermistor[3]);
+	cur_therm = fma(cur_therm, raw_temp, cal->coeffs_thermistor[2]);
+	cur_therm = fma(cur_therm, raw_temp, cal->coeffs_thermistor[1]);
+	cur_therm = fma(cur_therm, raw_temp, cal->coeffs_thermistor[0]);
+	temp->cur_fpa = cur_fpa;
+	temp->cur_therm = cur_therm;
+	if (temp->settle_frames) {
+		temp->settle_frames -= 1;
+		temp->fpa   = cur_fpa;
+		temp->therm = cur_therm;
+	} else {
+		temp->fpa   = cal->beta_fpa_diode  * temp->fpa   + (1.0 - cal->beta_fpa_diode)  * cur_fpa;
+		temp->therm = cal->beta_thermistor * temp->therm + (1.0 - cal->beta_thermistor) * cur_therm;
+	}
+
+	temp->delta = temp->therm - temp->fpa;
+	if (temp->transient_steps) {
+		if (seconds(now, temp->transient_step_start) > cal->transient_step_time) {
+			temp->transient_step_start = now;
+			if (seconds(now, temp->transient_start) >= cal->transient_oper_time
+			 || fabs(temp->delta) > cal->temp_delta_max) {
+				temp->transient_steps = 0;
+			} else if (!isnan(temp->old_delta)) {
+				double deriv_delta = temp->delta - temp->old_delta;
+				if (!isnan(temp->old_deriv_delta)) {
+					deriv_delta = cal->beta_deriv_temp_delta * temp->old_deriv_delta + (1.0 - cal->beta_deriv_temp_delta) * deriv_delta;
+					if (fabs(deriv_delta) < cal->deriv_temp_delta_min) {
+						temp->transient_steps -= 1;
+					} else {
+						temp->transient_steps = cal->transient_steps_max;
+					}
+				}
+				temp->old_deriv_delta = deriv_delta;
+			}
+			temp->old_delta = temp->delta;
+		}
+	}
+}
@@ -6,7 +6,9 @@
 #define THERMAPP_H
 
 #include <libusb.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <time.h>
 
 #define VENDOR  0x1772
 #define PRODUCT 0x0002
@@ -95,8 +97,12 @@ struct thermapp_usb_dev {
 	size_t cfg_fill_sz;
 	size_t frame_in_sz;
 	size_t frame_done_sz;
+	struct timespec frame_done_ts; // CLOCK_MONOTONIC, when frame_done was completed
+	unsigned long frames_overrun;  // completed over an unread frame_done
 };
 
+struct thermapp_cal_loader;
+
 struct thermapp_cal {
 	uint32_t serial_num;
 	uint16_t hardware_ver;
@@ -180,34 +186,404 @@ struct thermapp_cal {
 	size_t raw_len[CAL_SETS][CAL_FILES];
 	uint32_t valid[CAL_SETS];
 
-	// storage for auto-generated calibration
-	float auto_good[FRAME_PIXELS_MAX];
-	float auto_offset[FRAME_PIXELS_MAX];
+	// compiled calibration cache, if raw_buf was loaded from it
+	unsigned char *cache_map;
+	size_t cache_len;
+
+	// pending thermapp_cal_open_async
+	struct thermapp_cal_loader *loader;
+	int quiet; // loading in the background: no progress messages
+
+	// storage for auto-generated calibration, FRAME_PIXELS_MAX each
+	struct thermapp_arena *auto_arena;
+	float *auto_good;
+	float *auto_offset;
 };
 
 
 extern const union thermapp_cfg thermapp_initial_cfg;
 
+// Preallocated, aligned, prefaulted working buffers (arena.c).
+#define ARENA_ALIGN 64
+#define ARENA_LEN(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+enum thermapp_arena_pages {
+	ARENA_PAGES_SMALL,
+	ARENA_PAGES_THP,     // transparent huge pages, if the kernel allows (default)
+	ARENA_PAGES_HUGETLB, // reserved huge pages, else as ARENA_PAGES_THP
+};
+struct thermapp_arena;
+void thermapp_arena_pages(enum thermapp_arena_pages);
+struct thermapp_arena *thermapp_arena_open(size_t);
+void *thermapp_arena_alloc(struct thermapp_arena *, size_t);
+void thermapp_arena_close(struct thermapp_arena *);
+
 struct thermapp_usb_dev *thermapp_usb_open(void);
 void thermapp_usb_start(struct thermapp_usb_dev *);
 int thermapp_usb_transfers_pending(struct thermapp_usb_dev *);
 void thermapp_usb_handle_events(struct thermapp_usb_dev *);
-size_t thermapp_usb_frame_read(struct thermapp_usb_dev *, void *, size_t);
+size_t thermapp_usb_frame_read(struct thermapp_usb_dev *, void *, size_t, struct timespec *);
 size_t thermapp_usb_cfg_write(struct thermapp_usb_dev *, const void *, size_t, size_t);
 void thermapp_usb_close(struct thermapp_usb_dev *);
 
+enum thermapp_log_event {
+	LOG_USB_ERROR,    // what: libusb function, arg: libusb error code
+	LOG_USB_PARTIAL,  // arg: length of the discarded transfer
+	LOG_CAL_READY,    // what: calibration directory, arg: ms since start
+	LOG_CAL_UNAVAILABLE, // what: calibration directory, arg: ms since start
+	LOG_AUTOCAL_START,
+	LOG_AUTOCAL_PROGRESS, // arg: frames captured, of AUTOCAL_FRAMES
+	LOG_AUTOCAL_DONE,
+	LOG_BAD_PIXEL,    // args: x, y
+	LOG_RECAL_START,
+	LOG_FIRST_FRAME,  // arg: ms since start
+	LOG_REC_TRIGGERED,
+	LOG_ALARM,        // args: hot spots, hottest in 0.1 C, its x, y, pixels
+	LOG_ALARM_CLEARED,
+	LOG_EVENTS,
+};
+
+// Latest values for the console status line.
+struct thermapp_status {
+	uint32_t frame_num;
+	float temp_fpa;
+	float temp_therm;
+	float t_min;
+	float t_max;
+	int min_x, min_y;
+	int max_x, max_y;
+	float latency_p50; // ms, over the last window
+	float latency_p99;
+	float latency_max;
+};
+
+int thermapp_log_open(double);
+void thermapp_log(enum thermapp_log_event, const char *, long);
+void thermapp_log_args(enum thermapp_log_event, const char *, const long *, size_t);
+void thermapp_log_status(const struct thermapp_status *);
+void thermapp_log_close(void);
+
 struct thermapp_cal *thermapp_cal_open(const char *, const union thermapp_cfg *);
+struct thermapp_cal *thermapp_cal_open_async(const char *, const union thermapp_cfg *);
+int thermapp_cal_loading(const struct thermapp_cal *);
+int thermapp_cal_loaded(const struct thermapp_cal *);
+struct thermapp_cal *thermapp_cal_join(struct thermapp_cal *, int);
 int thermapp_cal_present(const struct thermapp_cal *);
 void thermapp_cal_bpr_init(struct thermapp_cal *);
 int thermapp_cal_select(struct thermapp_cal *, struct thermapp_usb_dev *, enum thermapp_video_mode, float);
 void thermapp_cal_close(struct thermapp_cal *);
 
+// Automatic calibration, averaged over this many frames of the covered lens.
+#define AUTOCAL_FRAMES 50
+void thermapp_cal_autocal_add(struct thermapp_cal *, const union thermapp_frame *);
+void thermapp_cal_autocal_finish(struct thermapp_cal *);
+
+struct thermapp_temp {
+	double cur_fpa;   // celsius, this frame
+	double cur_therm; // celsius, this frame
+	double fpa;       // celsius, filtered
+	double therm;     // celsius, filtered
+	double delta;     // therm - fpa
+	int settle_frames;
+	int transient_steps; // nonzero while the transient correction applies
+	uint64_t transient_start;
+	uint64_t transient_step_start;
+	double old_delta;
+	double old_deriv_delta;
+};
+
+void thermapp_temp_reset(struct thermapp_temp *, const struct thermapp_cal *, uint64_t);
+void thermapp_temp_update(struct thermapp_temp *, const struct thermapp_cal *, const union thermapp_cfg *, uint64_t);
+
+const uint32_t *thermapp_palette(const char *, uint32_t *);
+
+struct thermapp_scene;
+struct thermapp_scene *thermapp_scene_open(const struct thermapp_cal *);
+void thermapp_scene_submit(struct thermapp_scene *, const union thermapp_frame *);
+void thermapp_scene_covered(struct thermapp_scene *, int);
+const float *thermapp_scene_offset(struct thermapp_scene *);
+void thermapp_scene_close(struct thermapp_scene *);
+
+// Each frame in a file written by thermapp_rec.
+#define REC_MAGIC_FRAME 0x52416854 // "ThAR", frame as received
+#define REC_MAGIC_CODEC 0x5a416854 // "ThAZ", frame coded by thermapp_codec_encode
+struct thermapp_rec_header {
+	uint32_t magic;
+	uint32_t len;        // bytes following this header
+	uint64_t timestamp;  // CLOCK_MONOTONIC, ns, when the frame arrived over USB
+};
+
+struct thermapp_rec;
+struct thermapp_rec *thermapp_rec_open(const char *, double, double, size_t, int);
+void thermapp_rec_frame(struct thermapp_rec *, const union thermapp_frame *, size_t, uint64_t);
+void thermapp_rec_trigger(struct thermapp_rec *);
+void thermapp_rec_close(struct thermapp_rec *);
+
+size_t thermapp_codec_bound(size_t);
+size_t thermapp_codec_encode(const union thermapp_frame *, unsigned char *, size_t);
+size_t thermapp_codec_decode(const unsigned char *, size_t, union thermapp_frame *);
+void thermapp_codec_force_scalar(int);
+
+int thermapp_cache_load(struct thermapp_cal *, const char *, uint32_t *);
+int thermapp_cache_save(const struct thermapp_cal *, const char *, const char *);
+int thermapp_cache_autocal_save(const struct thermapp_cal *, const char *, const union thermapp_cfg *);
+int thermapp_cache_autocal_load(struct thermapp_cal *, const char *, const union thermapp_cfg *, double, double);
+
+// Working space for thermapp_img_hpf and thermapp_img_lut, one per thread.
+#define HPF_RES 2 // input downsampling for the HPF's low-pass filter
+#define HPF_WIDTH_MAX  ((FRAME_WIDTH_MAX  + HPF_RES - 1) / HPF_RES)
+#define HPF_HEIGHT_MAX ((FRAME_HEIGHT_MAX + HPF_RES - 1) / HPF_RES)
+struct thermapp_img_scratch {
+	uint32_t lpf_sy[HPF_WIDTH_MAX];
+	uint16_t lpf[HPF_WIDTH_MAX * HPF_HEIGHT_MAX];
+	unsigned bins[UINT16_MAX+1];
+	uint8_t target[UINT16_MAX+1];
+};
+
 int thermapp_img_vgsk(const struct thermapp_cal *, const union thermapp_frame *);
 void thermapp_img_nuc(const struct thermapp_cal *, const union thermapp_frame *, float *, int, float);
 void thermapp_img_bpr(const struct thermapp_cal *, float *);
 void thermapp_img_minmax(const struct thermapp_cal *, const float *, float *, float *, size_t *, size_t *, double *, double *, double, double);
 void thermapp_img_quantize(const struct thermapp_cal *, const float *, uint16_t *);
-void thermapp_img_hpf(const struct thermapp_cal *, uint16_t *, float);
-void thermapp_img_lut(const struct thermapp_cal *, const uint16_t *, uint8_t *, float, float);
+int thermapp_img_quantize_rect(const struct thermapp_cal *, const float *, uint16_t *, unsigned *, size_t, size_t, size_t, size_t);
+void thermapp_img_hpf(const struct thermapp_cal *, uint16_t *, float, struct thermapp_img_scratch *);
+void thermapp_img_lut(const struct thermapp_cal *, const uint16_t *, uint8_t *, float, float, struct thermapp_img_scratch *);
+void thermapp_img_lut_target(const struct thermapp_cal *, const uint16_t *, uint8_t *, float, float, struct thermapp_img_scratch *);
+void thermapp_img_lut_blend(uint8_t *, const uint8_t *);
+void thermapp_img_palette(const struct thermapp_cal *, const uint16_t *, const uint8_t *, const uint32_t *, uint32_t *, int, int);
+void thermapp_img_palette_rect(const struct thermapp_cal *, const uint16_t *, const uint8_t *, const uint32_t *, uint32_t *, int, int, size_t, size_t, size_t, size_t);
+void thermapp_img_y16(const struct thermapp_cal *, const uint16_t *, uint16_t *, int, int);
+
+// Other sizes of the palette image (scale.c).
+#define SCALE_UP_MAX 3
+#define SCALED_WIDTH_MAX  (FRAME_WIDTH_MAX  * SCALE_UP_MAX)
+#define SCALED_HEIGHT_MAX (FRAME_HEIGHT_MAX * SCALE_UP_MAX)
+enum thermapp_scale_filter {
+	SCALE_BIN,      // 2x2 average, half size
+	SCALE_BILINEAR,
+	SCALE_BICUBIC,
+};
+struct thermapp_scale;
+struct thermapp_scale *thermapp_scale_open(size_t, size_t, enum thermapp_scale_filter, int);
+void thermapp_scale_size(const struct thermapp_scale *, size_t *, size_t *);
+void thermapp_scale_image(struct thermapp_scale *, const uint32_t *, uint32_t *);
+void thermapp_scale_close(struct thermapp_scale *);
+
+struct thermapp_out;
+struct thermapp_out *thermapp_out_open(const char *, int);
+size_t thermapp_out_format(struct thermapp_out *, uint32_t, size_t, size_t);
+void *thermapp_out_buffer(struct thermapp_out *);
+int thermapp_out_commit(struct thermapp_out *, const struct timespec *);
+void thermapp_out_close(struct thermapp_out *);
+
+// Log-scale histogram, 8 buckets per power of two, for durations in ns.
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+struct thermapp_hist {
+	atomic_uint_least64_t bucket[HIST_BUCKETS];
+	atomic_uint_least64_t count;
+	atomic_uint_least64_t sum;
+	atomic_uint_least64_t max;
+};
+
+void thermapp_hist_add(struct thermapp_hist *, uint64_t);
+void thermapp_hist_reset(struct thermapp_hist *);
+uint64_t thermapp_hist_quantile(const struct thermapp_hist *, double);
+
+enum thermapp_stage {
+	STAGE_USB_WAIT,
+	STAGE_NUC,
+	STAGE_BPR,
+	STAGE_MINMAX,
+	STAGE_ROI,
+	STAGE_ALARM,
+	STAGE_CHANGE,
+	STAGE_QUANTIZE,
+	STAGE_HPF,
+	STAGE_LUT,
+	STAGE_PALETTE,
+	STAGE_OUTPUT,
+	STAGES,
+};
+
+// Regions of interest (roi.c).
+#define ROI_MAX 64
+#define ROI_NAME_MAX 31
+struct thermapp_roi_result {
+	float t_min, t_max, t_mean, t_stddev; // celsius
+	size_t pixels;
+	size_t i_min, i_max;                 // unflipped pixel index
+	int min_x, min_y, max_x, max_y;      // flipped, as displayed
+};
+
+struct thermapp_rois;
+struct thermapp_rois *thermapp_rois_open(const char *);
+int thermapp_rois_compile(struct thermapp_rois *, size_t, size_t, int, int);
+size_t thermapp_rois_count(const struct thermapp_rois *);
+const char *thermapp_rois_name(const struct thermapp_rois *, size_t);
+void thermapp_rois_measure(const struct thermapp_rois *, const float *, double, double, struct thermapp_roi_result *);
+void thermapp_rois_close(struct thermapp_rois *);
+
+// Hot-spot alarm (alarm.c).
+#define ALARM_BLOBS_MAX 8
+struct thermapp_alarm_blob {
+	size_t area;                         // pixels
+	float t_peak;                        // celsius
+	size_t i_peak;                       // unflipped pixel index
+	int bx0, by0, bx1, by1;              // bounding box, unflipped, inclusive
+	int x0, y0, x1, y1;                  // bounding box, flipped, as displayed
+	int peak_x, peak_y;                  // flipped, as displayed
+};
+struct thermapp_alarm_result {
+	int active;
+	int changed;                         // active differs from the previous frame
+	size_t blobs;                        // at or above the threshold and min_area
+	size_t blobs_kept;                   // hottest first, up to ALARM_BLOBS_MAX
+	size_t area;                         // of all blobs
+	struct thermapp_alarm_blob blob[ALARM_BLOBS_MAX];
+};
+
+struct thermapp_alarm;
+struct thermapp_alarm *thermapp_alarm_open(double, double, size_t);
+int thermapp_alarm_start(struct thermapp_alarm *, size_t, size_t, int, int);
+void thermapp_alarm_check(struct thermapp_alarm *, const float *, double, double, struct thermapp_alarm_result *);
+void thermapp_alarm_close(struct thermapp_alarm *);
+
+// Change detection (change.c).
+#define CHANGE_TILE 16
+#define CHANGE_TILES_MAX (((FRAME_WIDTH_MAX + CHANGE_TILE - 1) / CHANGE_TILE) * ((FRAME_HEIGHT_MAX + CHANGE_TILE - 1) / CHANGE_TILE))
+struct thermapp_change_result {
+	size_t tiles_x, tiles_y;
+	size_t tiles;
+	size_t changed;                      // tiles over the threshold
+	int repaint;                         // every tile was rendered anyway (LUT or HPF output changed)
+	int unchanged;                       // nothing was processed, the image is the previous frame's
+	uint8_t tile[CHANGE_TILES_MAX];      // nonzero if changed, unflipped, row by row
+};
+
+struct thermapp_change;
+struct thermapp_change *thermapp_change_open(double);
+int thermapp_change_start(struct thermapp_change *, size_t, size_t);
+void thermapp_change_detect(struct thermapp_change *, const float *, struct thermapp_change_result *);
+void thermapp_change_close(struct thermapp_change *);
+
+struct thermapp_stats;
+struct thermapp_stats *thermapp_stats_open(const char *, const struct thermapp_hist *);
+void thermapp_stats_add(struct thermapp_stats *, enum thermapp_stage, uint64_t);
+void thermapp_stats_mark(struct thermapp_stats *, enum thermapp_stage, struct timespec *);
+const char *thermapp_stage_name(enum thermapp_stage);
+void thermapp_stats_scale(struct thermapp_stats *, size_t, size_t, const char *, const struct thermapp_hist *);
+void thermapp_stats_rois(struct thermapp_stats *, const struct thermapp_rois *, const struct thermapp_roi_result *);
+void thermapp_stats_alarm(struct thermapp_stats *, const struct thermapp_alarm_result *);
+void thermapp_stats_change(struct thermapp_stats *, const struct thermapp_change_result *, int);
+void thermapp_stats_drops(struct thermapp_stats *, const atomic_ulong *);
+void thermapp_stats_export(struct thermapp_stats *);
+void thermapp_stats_close(struct thermapp_stats *);
+
+int thermapp_trace_open(const char *);
+uint64_t thermapp_trace_now(void);
+void thermapp_trace_span(const char *, uint64_t);
+void thermapp_trace_span_at(const char *, uint64_t, uint64_t);
+void thermapp_trace_instant(const char *);
+void thermapp_trace_thread(const char *);
+void thermapp_trace_close(void);
+
+struct thermapp_jpeg;
+struct thermapp_jpeg *thermapp_jpeg_open(size_t, size_t, int);
+size_t thermapp_jpeg_encode(struct thermapp_jpeg *, const uint32_t *, const unsigned char **);
+void thermapp_jpeg_close(struct thermapp_jpeg *);
+
+struct thermapp_http;
+struct thermapp_http *thermapp_http_open(const char *, size_t, size_t, int);
+void thermapp_http_frame(struct thermapp_http *, const uint32_t *);
+void thermapp_http_close(struct thermapp_http *);
+
+struct thermapp_queue;
+struct thermapp_queue *thermapp_queue_open(size_t);
+void thermapp_queue_push(struct thermapp_queue *, void *);
+void *thermapp_queue_pop(struct thermapp_queue *);
+void *thermapp_queue_try_pop(struct thermapp_queue *);
+void *thermapp_queue_peek(struct thermapp_queue *);
+void thermapp_queue_close(struct thermapp_queue *);
+
+// libthermapp: the camera and the image processing, without any outputs.  See pipeline.c.
+enum thermapp_backpressure {
+	BACKPRESSURE_QUEUE,     // every frame in order, dropped only if no slot is free
+	BACKPRESSURE_LATEST,    // skip a frame if a newer one is already waiting
+	BACKPRESSURE_DEADLINE,  // skip a frame older than config.deadline
+};
+
+enum thermapp_drop {
+	DROP_OVERRUN,     // overwritten in the USB buffer before it was read
+	DROP_BUSY,        // no free slot (pipelined)
+	DROP_SUPERSEDED,  // BACKPRESSURE_LATEST
+	DROP_LATE,        // BACKPRESSURE_DEADLINE
+	DROPS
+};
+
+struct thermapp_pipeline_config {
+	const char *caldir;
+	const char *autocal_dir;           // save/reuse the automatic calibration, or NULL
+	double autocal_max_temp_delta;     // celsius
+	double autocal_max_age;            // seconds, 0 for no limit
+	int scene_nuc;                     // refine the automatic calibration in the background
+	enum thermapp_video_mode video_mode;
+	float enhanced_ratio;
+	int fliph, flipv;                  // for rendering and min/max coordinates
+	const uint32_t *palette;           // thermapp_palette, or NULL for the default
+	double t_refl;                     // celsius
+	double emissivity;
+	struct thermapp_stats *stats;      // stage timings, or NULL
+	int stage_timing;                  // into stats and/or the trace
+	int pipelined;                     // capture/NUC and enhancement on their own threads
+	enum thermapp_backpressure backpressure; // when processing falls behind the camera
+	double deadline;                   // seconds, for BACKPRESSURE_DEADLINE
+	struct thermapp_rois *rois;        // measured on every frame, or NULL; laid out by the pipeline
+	struct thermapp_alarm *alarm;      // checked on every frame, or NULL; started by the pipeline
+	struct thermapp_change *change;    // skip processing unchanged tiles, or NULL; started by the pipeline
+};
+
+enum thermapp_pipeline_event {
+	PIPELINE_ERROR = -1,
+	PIPELINE_STOPPED,  // camera gone
+	PIPELINE_STARTED,  // identified, calibration (size, serial number) available
+	PIPELINE_RAW,      // raw frame only, used for calibration
+	PIPELINE_FRAME,    // ready for thermapp_pipeline_process
+};
+
+struct thermapp_pipeline_frame {
+	const union thermapp_frame *raw;
+	struct timespec ts;                // CLOCK_MONOTONIC, when the frame arrived over USB
+	uint32_t frame_num;
+	size_t w, h;
+	double temp_fpa, temp_therm;       // celsius
+	const struct thermapp_cal *cal;    // processed with
+	// After thermapp_pipeline_process:
+	const float *temp;                 // radiometric, 0.01 C units before emissivity
+	const uint16_t *quantized;
+	const uint8_t *lut;                // quantized value -> palette index
+	size_t i_min, i_max;               // unflipped pixel index
+	int min_x, min_y, max_x, max_y;    // flipped, as displayed
+	double t_min, t_max;               // celsius
+	const struct thermapp_roi_result *roi; // one per config.rois region, or NULL
+	const struct thermapp_alarm_result *alarm; // if config.alarm, or NULL
+	const struct thermapp_change_result *change; // if config.change, or NULL
+	// After thermapp_pipeline_render:
+	const uint32_t *rgb;
+};
+
+struct thermapp_pipeline;
+void thermapp_pipeline_config_init(struct thermapp_pipeline_config *);
+struct thermapp_pipeline *thermapp_pipeline_open(const struct thermapp_pipeline_config *);
+const struct thermapp_cal *thermapp_pipeline_cal(const struct thermapp_pipeline *);
+enum thermapp_pipeline_event thermapp_pipeline_wait(struct thermapp_pipeline *, struct thermapp_pipeline_frame *);
+void thermapp_pipeline_process(struct thermapp_pipeline *, struct thermapp_pipeline_frame *, float *);
+void thermapp_pipeline_render(struct thermapp_pipeline *, struct thermapp_pipeline_frame *, uint32_t *);
+void thermapp_pipeline_render_y16(struct thermapp_pipeline *, const struct thermapp_pipeline_frame *, uint16_t *);
+enum thermapp_pipeline_event thermapp_pipeline_next(struct thermapp_pipeline *, struct thermapp_pipeline_frame *);
+void thermapp_pipeline_recalibrate(struct thermapp_pipeline *);
+void thermapp_pipeline_stage(struct thermapp_pipeline *, enum thermapp_stage);
+unsigned long thermapp_pipeline_dropped(struct thermapp_pipeline *, enum thermapp_drop);
+const char *thermapp_drop_name(enum thermapp_drop);
+void thermapp_pipeline_close(struct thermapp_pipeline *);
 
 #endif /* THERMAPP_H */
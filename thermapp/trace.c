@@ -0,0 +1,230 @@
+// SPDX-FileCopyrightText: 2025 Kyle Guinn <elyk03@gmail.com>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thermapp.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Span tracing, dumped as Chrome trace JSON (chrome://tracing, Perfetto).
+//
+// All buffers are allocated up front by thermapp_trace_open.  The first time
+// a thread records a span it claims one of TRACE_THREADS buffers with an
+// atomic increment, and from then on it is the only writer of that buffer,
+// so recording is a clock read and a few stores: no locks, no allocation.
+// Each buffer is a ring that keeps the most recent TRACE_EVENTS spans.
+// Threads beyond TRACE_THREADS are not traced.
+//
+// The dump in thermapp_trace_close assumes the traced threads are done.
+
+#define TRACE_THREADS 8
+#define TRACE_EVENTS  (1 << 18) // per thread, 24 bytes each
+
+struct trace_event {
+	const char *name; // string literal
+	uint64_t start;   // ns since thermapp_trace_open
+	uint64_t dur;     // ns, or UINT64_MAX for an instant event
+};
+
+struct trace_buf {
+	const char *thread_name;
+	uint64_t count;
+	struct trace_event *events;
+};
+
+static struct {
+	atomic_int enabled;
+	atomic_int threads;
+	char *path;
+	uint64_t epoch;
+	struct trace_buf buf[TRACE_THREADS];
+} trace;
+
+static _Thread_local struct trace_buf *trace_tls;
+static _Thread_local int trace_tls_full;
+
+static uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_buf *
+thread_buf(void)
+{
+	if (!trace_tls && !trace_tls_full) {
+		int i = atomic_fetch_add_explicit(&trace.threads, 1, memory_order_relaxed);
+		if (i < TRACE_THREADS) {
+			trace_tls = &trace.buf[i];
+		} else {
+			trace_tls_full = 1;
+		}
+	}
+	return trace_tls;
+}
+
+static void
+record(const char *name, uint64_t start, uint64_t dur)
+{
+	struct trace_buf *buf = thread_buf();
+	if (!buf) {
+		return;
+	}
+	struct trace_event *ev = &buf->events[buf->count++ & (TRACE_EVENTS - 1)];
+	ev->name = name;
+	ev->start = start - trace.epoch;
+	ev->dur = dur;
+}
+
+int
+thermapp_trace_open(const char *path)
+{
+	trace.path = strdup(path);
+	if (!trace.path) {
+		perror("strdup");
+		return 0;
+	}
+	for (int i = 0; i < TRACE_THREADS; ++i) {
+		trace.buf[i].events = malloc(TRACE_EVENTS * sizeof *trace.buf[i].events);
+		if (!trace.buf[i].events) {
+			perror("malloc");
+			for (; i >= 0; --i) {
+				free(trace.buf[i].events);
+				trace.buf[i].events = NULL;
+			}
+			free(trace.path);
+			trace.path = NULL;
+			return 0;
+		}
+	}
+	trace.epoch = clock_ns();
+	atomic_store_explicit(&trace.enabled, 1, memory_order_release);
+	return 1;
+}
+
+// Start of a span, or 0 if not tracing.
+uint64_t
+thermapp_trace_now(void)
+{
+	if (!atomic_load_explicit(&trace.enabled, memory_order_relaxed)) {
+		return 0;
+	}
+	return clock_ns();
+}
+
+// Record a span from start (from thermapp_trace_now) until now.
+void
+thermapp_trace_span(const char *name, uint64_t start)
+{
+	if (!start) {
+		return;
+	}
+	record(name, start, clock_ns() - start);
+}
+
+// Record a span with both ends already known, e.g. from stage timing.
+void
+thermapp_trace_span_at(const char *name, uint64_t start, uint64_t end)
+{
+	if (!atomic_load_explicit(&trace.enabled, memory_order_relaxed)) {
+		return;
+	}
+	record(name, start, end - start);
+}
+
+void
+thermapp_trace_instant(const char *name)
+{
+	if (!atomic_load_explicit(&trace.enabled, memory_order_relaxed)) {
+		return;
+	}
+	record(name, clock_ns(), UINT64_MAX);
+}
+
+// Label the calling thread in the trace.
+void
+thermapp_trace_thread(const char *name)
+{
+	if (!atomic_load_explicit(&trace.enabled, memory_order_relaxed)) {
+		return;
+	}
+	struct trace_buf *buf = thread_buf();
+	if (buf) {
+		buf->thread_name = name;
+	}
+}
+
+static void
+dump(FILE *f)
+{
+	// Timestamps are in microseconds; 3 decimals keep full ns resolution.
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"thermapp\"}}");
+
+	int threads = atomic_load_explicit(&trace.threads, memory_order_acquire);
+	if (threads > TRACE_THREADS) {
+		threads = TRACE_THREADS;
+	}
+	for (int t = 0; t < threads; ++t) {
+		const struct trace_buf *buf = &trace.buf[t];
+		if (buf->thread_name) {
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			        t + 1, buf->thread_name);
+		}
+
+		uint64_t first = buf->count > TRACE_EVENTS ? buf->count - TRACE_EVENTS : 0;
+		for (uint64_t i = first; i < buf->count; ++i) {
+			const struct trace_event *ev = &buf->events[i & (TRACE_EVENTS - 1)];
+			if (ev->dur == UINT64_MAX) {
+				fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%" PRIu64 ".%03u}",
+				        ev->name, t + 1, ev->start / 1000, (unsigned)(ev->start % 1000));
+			} else {
+				fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u}",
+				        ev->name, t + 1, ev->start / 1000, (unsigned)(ev->start % 1000),
+				        ev->dur / 1000, (unsigned)(ev->dur % 1000));
+			}
+		}
+	}
+	fprintf(f, "\n]}\n");
+}
+
+void
+thermapp_trace_close(void)
+{
+	if (!atomic_load_explicit(&trace.enabled, memory_order_acquire))
+		return;
+	atomic_store_explicit(&trace.enabled, 0, memory_order_release);
+
+	uint64_t events = 0, lost = 0;
+	for (int t = 0; t < TRACE_THREADS; ++t) {
+		events += trace.buf[t].count;
+		if (trace.buf[t].count > TRACE_EVENTS) {
+			lost += trace.buf[t].count - TRACE_EVENTS;
+		}
+	}
+
+	FILE *f = fopen(trace.path, "w");
+	if (!f) {
+		perror("fopen");
+	} else {
+		dump(f);
+		if (fclose(f) == EOF) {
+			perror("fclose");
+		}
+		printf("Trace: %" PRIu64 " events written to %s (%" PRIu64 " oldest overwritten)\n",
+		       events - lost, trace.path, lost);
+	}
+
+	for (int t = 0; t < TRACE_THREADS; ++t) {
+		free(trace.buf[t].events);
+		trace.buf[t].events = NULL;
+	}
+	free(trace.path);
+	trace.path = NULL;
+}
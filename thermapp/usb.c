@@ -106,14 +106,14 @@ cancel_transfers(struct thermapp_usb_dev *dev)
 	if (dev->transfer_in) {
 		int ret = libusb_cancel_transfer(dev->transfer_in);
 		if (ret && ret != LIBUSB_ERROR_NOT_FOUND) {
-			fprintf(stderr, "%s: %s\n", "libusb_cancel_transfer", libusb_strerror(ret));
+			thermapp_log(LOG_USB_ERROR, "libusb_cancel_transfer", ret);
 		}
 	}
 
 	if (dev->transfer_out) {
 		int ret = libusb_cancel_transfer(dev->transfer_out);
 		if (ret && ret != LIBUSB_ERROR_NOT_FOUND) {
-			fprintf(stderr, "%s: %s\n", "libusb_cancel_transfer", libusb_strerror(ret));
+			thermapp_log(LOG_USB_ERROR, "libusb_cancel_transfer", ret);
 		}
 	}
 }
@@ -122,6 +122,7 @@ static void LIBUSB_CALL
 transfer_cb_out(struct libusb_transfer *transfer)
 {
 	struct thermapp_usb_dev *dev = (struct thermapp_usb_dev *)transfer->user_data;
+	uint64_t trace_start = thermapp_trace_now();
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
 		if (dev->cfg_fill_sz) {
@@ -135,7 +136,7 @@ transfer_cb_out(struct libusb_transfer *transfer)
 
 			int ret = libusb_submit_transfer(transfer);
 			if (ret) {
-				fprintf(stderr, "%s: %s\n", "libusb_submit_transfer", libusb_strerror(ret));
+				thermapp_log(LOG_USB_ERROR, "libusb_submit_transfer", ret);
 				transfer->buffer = NULL;
 			}
 		} else {
@@ -145,16 +146,18 @@ transfer_cb_out(struct libusb_transfer *transfer)
 		transfer->buffer = NULL;
 		cancel_transfers(dev);
 	}
+	thermapp_trace_span("transfer_cb_out", trace_start);
 }
 
 static void LIBUSB_CALL
 transfer_cb_in(struct libusb_transfer *transfer)
 {
 	struct thermapp_usb_dev *dev = (struct thermapp_usb_dev *)transfer->user_data;
+	uint64_t trace_start = thermapp_trace_now();
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
 		if (transfer->actual_length % PACKET_SIZE) {
-			fprintf(stderr, "discarding partial transfer of size %u\n", transfer->actual_length);
+			thermapp_log(LOG_USB_PARTIAL, NULL, transfer->actual_length);
 			transfer->buffer = dev->frame_in;
 			transfer->length = BULK_SIZE_MIN;
 		} else if (transfer->actual_length) {
@@ -189,10 +192,16 @@ transfer_cb_in(struct libusb_transfer *transfer)
 				transfer->length = (exp - len + PACKET_SIZE - 1) & ~(PACKET_SIZE - 1);
 			} else {
 				// Frame complete.  Discard any excess.
+				// Nobody read the last one in time; it's gone.
+				if (dev->frame_done_sz) {
+					dev->frames_overrun += 1;
+				}
 				transfer->buffer = dev->frame_done;
 				dev->frame_done = dev->frame_in;
 				dev->frame_in = transfer->buffer;
 				dev->frame_done_sz = exp;
+				clock_gettime(CLOCK_MONOTONIC, &dev->frame_done_ts);
+				thermapp_trace_instant("frame complete");
 
 				// Resync.  The next frame may not be the same size.
 				transfer->length = BULK_SIZE_MIN;
@@ -201,13 +210,14 @@ transfer_cb_in(struct libusb_transfer *transfer)
 
 		int ret = libusb_submit_transfer(transfer);
 		if (ret) {
-			fprintf(stderr, "%s: %s\n", "libusb_submit_transfer", libusb_strerror(ret));
+			thermapp_log(LOG_USB_ERROR, "libusb_submit_transfer", ret);
 			transfer->buffer = NULL;
 		}
 	} else {
 		transfer->buffer = NULL;
 		cancel_transfers(dev);
 	}
+	thermapp_trace_span("transfer_cb_in", trace_start);
 }
 
 struct thermapp_usb_dev *
@@ -347,12 +357,12 @@ thermapp_usb_handle_events(struct thermapp_usb_dev *dev)
 {
 	int ret = libusb_handle_events(dev->ctx);
 	if (ret) {
-		fprintf(stderr, "%s: %s\n", "libusb_handle_events", libusb_strerror(ret));
+		thermapp_log(LOG_USB_ERROR, "libusb_handle_events", ret);
 	}
 }
 
 size_t
-thermapp_usb_frame_read(struct thermapp_usb_dev *dev, void *buf, size_t len)
+thermapp_usb_frame_read(struct thermapp_usb_dev *dev, void *buf, size_t len, struct timespec *ts)
 {
 	if (len > dev->frame_done_sz) {
 		len = dev->frame_done_sz;
@@ -361,6 +371,9 @@ thermapp_usb_frame_read(struct thermapp_usb_dev *dev, void *buf, size_t len)
 
 	if (len) {
 		dev->frame_done_sz = 0;
+		if (ts) {
+			*ts = dev->frame_done_ts;
+		}
 		// TODO: 384x288 cameras apparently provide 12-bit samples, and the app zeros the upper nibble
 		//       of each pixel during the histogram calculation.  If zeroing is necessary, do it here.
 #if __BYTE_ORDER == __LITTLE_ENDIAN